@@ -36,6 +36,8 @@
 #include <string.h>
 #include <stdio.h>
 #include "transfer_control.h"
+#include "pv_durability.h"
+#include "pv_diskio.h"
 
 // FOR BLUETOOTH LOW ENGERY I HAD TO DO 
 // idf.py menuconfig
@@ -179,6 +181,7 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
 static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
 {
     char bda_str[18] = {0};
+    transfer_ctx_t *ctx = NULL;
 
     switch (event) {
     case ESP_SPP_INIT_EVT:
@@ -198,6 +201,12 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
     case ESP_SPP_CLOSE_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_CLOSE_EVT status:%d handle:%"PRIu32" close_by_remote:%d", param->close.status,
                  param->close.handle, param->close.async);
+        if ((ctx = transfer_control_find(param->close.handle)) != NULL) {
+            bt_arbiter_sm_reset(ctx);
+            transfer_control_close(ctx);
+        }
+        pv_durability_session_end();
+        pv_diskio_log_stats();
         break;
     case ESP_SPP_START_EVT:
         if (param->start.status == ESP_SPP_SUCCESS) {
@@ -238,19 +247,28 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
             print_speed();
         }
 #endif
-        bt_arbiter_sm_feedin(param->data_ind.data, param->data_ind.len);
+        if ((ctx = transfer_control_find(param->data_ind.handle)) != NULL) {
+            bt_arbiter_sm_feedin(ctx, param->data_ind.data, param->data_ind.len);
+        }
         break;
     case ESP_SPP_CONG_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT");
+        ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT cong:%d", param->cong.cong);
+        transfer_control_tx_event(transfer_control_find(param->cong.handle), false, false, 0, param->cong.cong);
         break;
     case ESP_SPP_WRITE_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_WRITE_EVT");
+        // One per write, logging each would slow the link down
+        ESP_LOGD(SPP_TAG, "ESP_SPP_WRITE_EVT status:%d len:%d cong:%d", param->write.status, param->write.len,
+                 param->write.cong);
+        transfer_control_tx_event(transfer_control_find(param->write.handle), true,
+                                  param->write.status == ESP_SPP_SUCCESS, (uint32_t)param->write.len, param->write.cong);
         break;
     case ESP_SPP_SRV_OPEN_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_SRV_OPEN_EVT status:%d handle:%"PRIu32", rem_bda:[%s]", param->srv_open.status,
                  param->srv_open.handle, bda2str(param->srv_open.rem_bda, bda_str, sizeof(bda_str)));
         // spp_client_handle = param->srv_open.handle;
-        transfer_control_init(param->srv_open.handle);
+        if (transfer_control_open(param->srv_open.handle) == NULL) {
+            esp_spp_disconnect(param->srv_open.handle);
+        }
         gettimeofday(&time_old, NULL);
         
             // Example: send a welcome message
@@ -373,7 +391,10 @@ void register_bluetooth_callbacks(void)
         return;
     }
 
-    // This Registers Main BTE callbacks. Transfer_Controller is Initilized on Bluetooth Connection Start
+    // Transfer tasks and buffers are created once here, connections only bind to them
+    transfer_control_init();
+
+    // This Registers Main BTE callbacks
     if ((ret = esp_spp_register_callback(esp_spp_cb)) != ESP_OK) {
         ESP_LOGE(SPP_TAG, "%s spp register failed: %s", __func__, esp_err_to_name(ret));
         return;
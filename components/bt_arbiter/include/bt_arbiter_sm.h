@@ -20,7 +20,9 @@
 #include "esp_gatts_api.h"
 #include "esp_gatt_common_api.h"
 #include "pv_logging.h"
+#include "transfer_control.h"
 
 #define TAG "PV_MAIN"
 
-extern void bt_arbiter_sm_feedin(uint8_t* data, uint16_t len);
\ No newline at end of file
+extern void bt_arbiter_sm_feedin(transfer_ctx_t *ctx, uint8_t* data, uint16_t len);
+extern void bt_arbiter_sm_reset(transfer_ctx_t *ctx);
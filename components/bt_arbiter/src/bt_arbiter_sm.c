@@ -46,26 +46,23 @@ const char RX_END_CMD[RX_END_LEN] = "END\n"; //END
 #define RX_ENDM_LEN 5
 const char RX_ENDM_CMD[RX_ENDM_LEN] = "ENDM\n"; //ENDM
 
+#define DEL_BACKUP_LEN 7 //exclude null terminator
+// DEL_BACKUP_CMD (DELBKP) is followed by a packet with the device folder name
+#define STATS_LEN 6 //exclude null terminator
+#define RESTORE_LEN 8 //exclude null terminator
+// RESTORE_CMD is followed by a packet with the phone path of the file
+#define ARBITER_REPLY_WAIT pdMS_TO_TICKS(TRANSFER_TX_REPLY_WAIT_MS) // Replies must not hold up the BT task for a whole restore
+
 #define SPP_TAG "SPP_ACCEPTOR_DEMO"
 #define ACK_LEN 3
 const char ACK[ACK_LEN] = "ACK"; //ACK 
 
 
-typedef enum state {
-    WAIT, 
-    RX_ACTIVEM,
-    RX_ACTIVE, 
-    RX_ERROR_STATE, 
-}BT_ARBITER_STATE;
-
-
 struct spp_data_ind_evt_param cur_data;
 
 
 
 
-BT_ARBITER_STATE cur_state = WAIT;
-
 struct bt_arbiter_sm_cmd_line {
     uint16_t            len;            /*!< The length of data */
     uint8_t             *data;          /*!< The data received */
@@ -83,31 +80,41 @@ bool cmd_compare(char * CMD, uint8_t * DATA, uint16_t len)
     return true;
 }
 
-void set_state(BT_ARBITER_STATE new_state)
+void set_state(transfer_ctx_t *ctx, BT_ARBITER_STATE new_state)
 {
-    cur_state = new_state;
+    ctx->cur_state = new_state;
 }
 
-size_t cur_file_size = 0;
-size_t bytes_sent_so_far = 0;
-
-#define LEFTOVER_MAX_SIZE 4
-uint8_t leftover_buffer[LEFTOVER_MAX_SIZE];
-
-BaseType_t sent = pdTRUE;
+/***************************************************************************
+ * Function:    bt_arbiter_sm_reset
+ * Purpose:     Forget the command or file in progress when the phone
+ *              disconnects, the next connection starts in WAIT
+ * Parameters:  ctx - Connection
+ * Return:     None
+ ***************************************************************************/
+void bt_arbiter_sm_reset(transfer_ctx_t *ctx)
+{
+    set_state(ctx, WAIT);
+    ctx->cur_file_size = 0;
+    ctx->bytes_sent_so_far = 0;
+    memset(ctx->leftover_buffer, 0, sizeof(ctx->leftover_buffer));
+}
 
 /***************************************************************************
  * Function:    bt_arbiter_sm_feedin
  * Purpose:     Manage Communications with the Phone. Tells Transfer Controller
  *              What to recieve and what to send
- * Parameters:  Data in Bluetooth Packet, Amount of Bytes of Data in Bluetooth Packet
+ * Parameters:  Connection the packet came from, Data in Bluetooth Packet,
+ *              Amount of Bytes of Data in Bluetooth Packet
  * Return:     None
  * Note:       Will run on callback whenever data is recieved on bluetooth
  *             Should be the only function processing data from bluetooth
  ***************************************************************************/
-void bt_arbiter_sm_feedin(uint8_t* data, uint16_t len)
+void bt_arbiter_sm_feedin(transfer_ctx_t *ctx, uint8_t* data, uint16_t len)
 {
-    switch(cur_state)
+    BaseType_t sent = pdTRUE;
+
+    switch(ctx->cur_state)
     {
         case WAIT:
             if(len == RX_STARTM_LEN)
@@ -115,73 +122,128 @@ void bt_arbiter_sm_feedin(uint8_t* data, uint16_t len)
                 if(cmd_compare((char *)RX_STARTM_CMD, data, RX_STARTM_LEN))
                 {
                     ESP_LOGI(SPP_TAG, "ARBITER ENTERING RX_ACTIVEM MODE");
-                    set_state(RX_ACTIVEM);
+                    set_state(ctx, RX_ACTIVEM);
 
-                    sent = xRingbufferSend(tx_ringbuf, RX_STARTM_CMD, RX_STARTM_LEN, portMAX_DELAY);
+                    sent = transfer_control_send(ctx, RX_STARTM_CMD, RX_STARTM_LEN, ARBITER_REPLY_WAIT) ? pdTRUE : pdFALSE;
                     if (sent != pdTRUE) {
                         ESP_LOGE(SPP_TAG, "Failed to send chunk to TX ring buffer");
                         break;
                     }
                 }
             }
+            else if(len == DEL_BACKUP_LEN && cmd_compare(DEL_BACKUP_CMD, data, DEL_BACKUP_LEN))
+            {
+                ESP_LOGI(SPP_TAG, "ARBITER ENTERING DEL_ACTIVE MODE");
+                set_state(ctx, DEL_ACTIVE);
+            }
+            else if(len == RESTORE_LEN && cmd_compare(RESTORE_CMD, data, RESTORE_LEN))
+            {
+                ESP_LOGI(SPP_TAG, "ARBITER ENTERING RESTORE_ACTIVE MODE");
+                set_state(ctx, RESTORE_ACTIVE);
+            }
+            else if(len == STATS_LEN && cmd_compare(STATS_CMD, data, STATS_LEN))
+            {
+                if(transfer_control_send_stats(ctx) != ESP_OK)
+                {
+                    transfer_control_send(ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), ARBITER_REPLY_WAIT);
+                }
+            }
             else
             {
                 // not recognized
             }
             break;
+        case DEL_ACTIVE:
+            // Deletion runs in its own task, the result is sent when it finishes
+            if(transfer_control_delete_backup(ctx, data, len) != ESP_OK)
+            {
+                transfer_control_send(ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), ARBITER_REPLY_WAIT);
+            }
+            set_state(ctx, WAIT);
+            break;
+        case RESTORE_ACTIVE:
+            // The file is sent by the restore engine once the backup manager dispatches it
+            if(transfer_control_request_restore(data, len) == ESP_OK)
+            {
+                transfer_control_send(ctx, RESTORE_CMD, RESTORE_LEN, ARBITER_REPLY_WAIT);
+            }
+            else
+            {
+                transfer_control_send(ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), ARBITER_REPLY_WAIT);
+            }
+            set_state(ctx, WAIT);
+            break;
         case RX_ACTIVEM:
             if(len == RX_ENDM_LEN)
             {   
                 if(cmd_compare((char *)RX_ENDM_CMD, data, RX_ENDM_LEN))
                 {
-                    ESP_LOGI(SPP_TAG, "ARBITER ENTERING RX_ACTIVE MODE");
-                    set_state(RX_ACTIVE);
-
-                    // Start tracking bytes sent
-                    bytes_sent_so_far = 0;
+                    if (!ctx->meta_valid)
+                    {
+                        PV_LOGE(TAG, "No metadata for the next file");
+                        set_state(ctx, RX_ERROR_STATE);
+                        transfer_control_send(ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), ARBITER_REPLY_WAIT);
+                        break;
+                    }
 
-                    sent = xRingbufferSend(tx_ringbuf, RX_ENDM_CMD, RX_ENDM_LEN, portMAX_DELAY);
+                    // Only queue the file once the phone was told to send it, or its
+                    // entry would take the bytes of the file sent on the retry
+                    sent = transfer_control_send(ctx, RX_ENDM_CMD, RX_ENDM_LEN, ARBITER_REPLY_WAIT) ? pdTRUE : pdFALSE;
                     if (sent != pdTRUE) {
                         PV_LOGE(TAG, "Failed to send chunk to TX ring buffer\n");
-                        set_state(RX_ERROR_STATE);
+                        ctx->meta_valid = false;
+                        set_state(ctx, RX_ERROR_STATE);
                         break;
                     }
+
+                    // The receiver takes the file once it is done with the ones before it
+                    transfer_control_queue_file(ctx);
+                    ESP_LOGI(SPP_TAG, "ARBITER ENTERING RX_ACTIVE MODE");
+                    set_state(ctx, RX_ACTIVE);
+
+                    // Start tracking bytes sent
+                    ctx->bytes_sent_so_far = 0;
                 }
             }
             else
             {
                 // Assume whole sent packet is a JSON string (might not be true)
-                process_photo_metadata((char *)data, &cur_file_size);
+                if (!process_photo_metadata(ctx, (char *)data, &ctx->cur_file_size))
+                {
+                    PV_LOGE(TAG, "Rejected file metadata");
+                    set_state(ctx, RX_ERROR_STATE);
+                    transfer_control_send(ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), ARBITER_REPLY_WAIT);
+                }
             }
             break;
         case RX_ACTIVE:
-            if(bytes_sent_so_far + len < cur_file_size ){
-                sent = xRingbufferSend(rx_ringbuf, data, len, portMAX_DELAY);
-                bytes_sent_so_far += len;
+            if(ctx->bytes_sent_so_far + len < ctx->cur_file_size ){
+                sent = (pv_spsc_send(&ctx->rx_ring, data, len, portMAX_DELAY) == len) ? pdTRUE : pdFALSE;
+                ctx->bytes_sent_so_far += len;
             }
             else
             {
-                size_t left_over =  bytes_sent_so_far + len - cur_file_size;
-                sent = xRingbufferSend(rx_ringbuf, data, len - left_over, portMAX_DELAY);
-                for(int i = 0; i<left_over; i++)
+                size_t left_over =  ctx->bytes_sent_so_far + len - ctx->cur_file_size;
+                sent = (pv_spsc_send(&ctx->rx_ring, data, len - left_over, portMAX_DELAY) == len - left_over) ? pdTRUE : pdFALSE;
+                for(int i = 0; i<left_over && i<LEFTOVER_MAX_SIZE; i++)
                 {
-                    leftover_buffer[i] = data[len - left_over + i];
+                    ctx->leftover_buffer[i] = data[len - left_over + i];
                 }
-                if(cmd_compare((char *)RX_END_CMD, leftover_buffer, RX_END_LEN))
+                if(cmd_compare((char *)RX_END_CMD, ctx->leftover_buffer, RX_END_LEN))
                 {
                     ESP_LOGI(SPP_TAG, "ARBITER LEAVING RX_ACTIVE MODE");
-                    set_state(WAIT);
-                    sent = xRingbufferSend(tx_ringbuf, RX_END_CMD, RX_END_LEN, portMAX_DELAY);
+                    set_state(ctx, WAIT);
+                    sent = transfer_control_send(ctx, RX_END_CMD, RX_END_LEN, ARBITER_REPLY_WAIT) ? pdTRUE : pdFALSE;
                     if (sent != pdTRUE) {
                         PV_LOGE(TAG, "Failed to send chunk to TX ring buffer\n");
-                        set_state(RX_ERROR_STATE);
+                        set_state(ctx, RX_ERROR_STATE);
                         break;
                     }
                 }
                 else
                 {
                     PV_LOGE(TAG, "ERROR! DID NOT RECIEVE VALID END OF FILE CMD");
-                    set_state(RX_ERROR_STATE);
+                    set_state(ctx, RX_ERROR_STATE);
                 }
 
             }
@@ -191,6 +253,14 @@ void bt_arbiter_sm_feedin(uint8_t* data, uint16_t len)
             }
             break;
         case RX_ERROR_STATE:
+            // A new RXSTARTM lets the phone retry after a rejected file
+            if(len == RX_STARTM_LEN && cmd_compare((char *)RX_STARTM_CMD, data, RX_STARTM_LEN))
+            {
+                ESP_LOGI(SPP_TAG, "ARBITER LEAVING ERROR STATE");
+                set_state(ctx, RX_ACTIVEM);
+                transfer_control_send(ctx, RX_STARTM_CMD, RX_STARTM_LEN, ARBITER_REPLY_WAIT);
+                break;
+            }
             // pass end data to transfer control
             ESP_LOGI(SPP_TAG, "IN ERROR STATE NOT PROCESSED\n");
             break;
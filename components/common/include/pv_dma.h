@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+    Buffers the SD driver can DMA from and to directly.
+
+    sdspi only transfers a buffer in place when it is DMA capable internal
+    RAM and word aligned. Anything else (PSRAM, flash, an odd offset into a
+    struct) is copied through a one sector bounce buffer, one transaction
+    per sector. Every buffer that reaches the card (receive ring, merge and
+    copy buffers, scan and sector buffers) is taken from here instead of the
+    general heap.
+
+    Buffers come from one fixed region of CONFIG_PV_DMA_POOL_KB in blocks of
+    PV_DMA_BLOCK_SIZE, so each one starts on a sector (and cache line)
+    boundary. The region is reserved at link time with
+    CONFIG_PV_STATIC_ALLOC and taken from MALLOC_CAP_DMA heap once else.
+    When it is full, buffers fall back to aligned MALLOC_CAP_DMA heap and
+    are counted, the pool size should cover the steady state.
+
+    pv_dma_capable() is the driver's own test, the diskio shim uses it to
+    count (and batch) the transfers that would still bounce.
+*/
+
+#define PV_DMA_BLOCK_SIZE       512U                            // Sector size, a multiple of the cache line
+#define PV_DMA_POOL_SIZE        ((size_t)CONFIG_PV_DMA_POOL_KB * 1024U)
+#define PV_DMA_POOL_BLOCKS      (PV_DMA_POOL_SIZE / PV_DMA_BLOCK_SIZE)
+#define PV_DMA_DRIVER_ALIGN     4U                              // What sdspi needs to skip its bounce buffer
+
+typedef struct {
+    size_t pool_size;
+    size_t used;                                                // Bytes handed out from the region
+    size_t peak;
+    uint32_t allocs;
+    uint32_t heap_fallbacks;                                    // Served from the heap because the region was full
+    uint32_t failures;                                          // Not served at all
+} pv_dma_stats_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_dma_init(void);
+void *pv_dma_alloc(size_t size);
+void pv_dma_free(void *p);
+bool pv_dma_capable(const void *p);
+void pv_dma_get_stats(pv_dma_stats_t *stats);
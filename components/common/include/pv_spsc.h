@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+/*
+    Lock-free byte queue between exactly one producer task and one consumer
+    task, no spinlock or critical section on either side.
+
+    head and tail are free running byte counters, only the producer writes
+    head and only the consumer writes tail, each on its own cache line. Each
+    side caches the other side's counter and only reads it again when the
+    cached value says the queue is full (or empty).
+
+    Both sides work in batches: the producer fills the space returned by
+    pv_spsc_reserve() and publishes it with one pv_spsc_commit(), the
+    consumer processes the data returned by pv_spsc_peek() in place and
+    frees it with one pv_spsc_release(). pv_spsc_write()/pv_spsc_read() copy
+    across the wrap with a single commit/release.
+
+    On the target pv_spsc_send() and pv_spsc_peek_wait() block on a task
+    notification (index 0) when the queue is full or empty. The other side
+    only notifies when a waiter is registered, so the fast path makes no
+    FreeRTOS call. A task blocking on a pv_spsc_t must not wait on task
+    notifications for anything else.
+*/
+
+#define PV_SPSC_CACHE_LINE      64U
+
+typedef struct {
+    // Producer
+    _Alignas(PV_SPSC_CACHE_LINE) atomic_size_t head;    // Bytes published
+    size_t tail_cache;                                  // Producer's last view of tail
+    // Consumer
+    _Alignas(PV_SPSC_CACHE_LINE) atomic_size_t tail;    // Bytes released
+    size_t head_cache;                                  // Consumer's last view of head
+    // Read only after pv_spsc_init()
+    _Alignas(PV_SPSC_CACHE_LINE) uint8_t *buf;
+    size_t size;                                        // Power of two
+#ifdef ESP_PLATFORM
+    _Atomic(TaskHandle_t) producer_wait;                // Producer blocked on a full queue
+    _Atomic(TaskHandle_t) consumer_wait;                // Consumer blocked on an empty queue
+#endif
+} pv_spsc_t;
+
+/* FUNCTION DEFS */
+bool pv_spsc_init(pv_spsc_t *q, uint8_t *buf, size_t size);
+size_t pv_spsc_used(pv_spsc_t *q);
+
+// Producer
+size_t pv_spsc_reserve(pv_spsc_t *q, uint8_t **p);
+void pv_spsc_commit(pv_spsc_t *q, size_t n);
+size_t pv_spsc_write(pv_spsc_t *q, const void *data, size_t len);
+
+// Consumer
+size_t pv_spsc_peek(pv_spsc_t *q, const uint8_t **p);
+size_t pv_spsc_peek_at(pv_spsc_t *q, size_t offset, const uint8_t **p);
+void pv_spsc_release(pv_spsc_t *q, size_t n);
+size_t pv_spsc_read(pv_spsc_t *q, void *buf, size_t len);
+void pv_spsc_discard(pv_spsc_t *q);
+
+#ifdef ESP_PLATFORM
+size_t pv_spsc_send(pv_spsc_t *q, const void *data, size_t len, TickType_t wait);
+size_t pv_spsc_peek_wait(pv_spsc_t *q, const uint8_t **p, TickType_t wait);
+size_t pv_spsc_peek_wait_at(pv_spsc_t *q, size_t offset, const uint8_t **p, TickType_t wait);
+#endif
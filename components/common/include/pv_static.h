@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "freertos/ringbuf.h"
+
+/*
+    Storage of the long lived RTOS objects and buffers of the transfer path.
+
+    With CONFIG_PV_STATIC_ALLOC every object is created on storage reserved
+    at link time by the matching PV_STATIC_*_DEFINE, so it shows up per
+    component in the memory budget report (mem_budget target) and the heap
+    only serves Bluedroid, cJSON and FatFs. Without it the DEFINEs reserve
+    nothing and the CREATE/GET macros allocate from the heap as before.
+
+    The _N variants reserve count objects for per connection arrays and
+    take the index to create. A static task must never be deleted and
+    created again on the same storage, tasks defined here run forever.
+
+    Usage, at file scope:
+        PV_STATIC_TASK_DEFINE(s_task_mem, STACK_SIZE);
+        PV_STATIC_QUEUE_DEFINE(s_queue_mem, LEN, sizeof(item_t));
+    and in the init function:
+        if (PV_STATIC_TASK_CREATE(s_task_mem, fn, "name", STACK_SIZE, arg, prio, &handle, core) != pdPASS) ...
+        s_queue = PV_STATIC_QUEUE_CREATE(s_queue_mem, LEN, sizeof(item_t));
+*/
+
+#if CONFIG_PV_STATIC_ALLOC
+
+/***************************************************************************
+ * Function:    pv_static_task_create
+ * Purpose:     xTaskCreateStaticPinnedToCore() with the return value and
+ *              handle of xTaskCreatePinnedToCore()
+ * Parameters:  See xTaskCreatePinnedToCore, stack and tcb - The storage
+ * Returns:     pdPASS on success, pdFAIL else
+ ***************************************************************************/
+static inline BaseType_t pv_static_task_create(TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg,
+                                               UBaseType_t prio, TaskHandle_t *handle, BaseType_t core,
+                                               StackType_t *stack, StaticTask_t *tcb) {
+    TaskHandle_t task = xTaskCreateStaticPinnedToCore(fn, name, stack_size, arg, prio, stack, tcb, core);
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return (task != NULL) ? pdPASS : pdFAIL;
+}
+
+#define PV_STATIC_TASK_DEFINE_N(name, stack_size, count)                                                    \
+    static StackType_t name##_stack[(count)][(stack_size)];                                                \
+    static StaticTask_t name##_tcb[(count)]
+#define PV_STATIC_TASK_CREATE_N(name, i, fn, tname, stack_size, arg, prio, handle, core)                    \
+    pv_static_task_create((fn), (tname), (stack_size), (arg), (prio), (handle), (core), name##_stack[(i)], &name##_tcb[(i)])
+
+#define PV_STATIC_QUEUE_DEFINE_N(name, len, item_size, count)                                               \
+    static uint8_t name##_storage[(count)][(len) * (item_size)];                                           \
+    static StaticQueue_t name##_buf[(count)]
+#define PV_STATIC_QUEUE_CREATE_N(name, i, len, item_size)                                                   \
+    xQueueCreateStatic((len), (item_size), name##_storage[(i)], &name##_buf[(i)])
+
+#define PV_STATIC_RINGBUF_DEFINE_N(name, size, count)                                                       \
+    static uint8_t name##_storage[(count)][(size)];                                                        \
+    static StaticRingbuffer_t name##_buf[(count)]
+#define PV_STATIC_RINGBUF_CREATE_N(name, i, size, type)                                                     \
+    xRingbufferCreateStatic((size), (type), name##_storage[(i)], &name##_buf[(i)])
+
+#define PV_STATIC_SEMAPHORE_DEFINE_N(name, count)   static StaticSemaphore_t name##_buf[(count)]
+#define PV_STATIC_MUTEX_CREATE_N(name, i)       xSemaphoreCreateMutexStatic(&name##_buf[(i)])
+#define PV_STATIC_COUNTING_CREATE_N(name, i, max, initial)                                                  \
+    xSemaphoreCreateCountingStatic((max), (initial), &name##_buf[(i)])
+
+#define PV_STATIC_TIMER_DEFINE(name)            static StaticTimer_t name##_buf
+#define PV_STATIC_TIMER_CREATE(name, tname, period, reload, id, cb)                                         \
+    xTimerCreateStatic((tname), (period), (reload), (id), (cb), &name##_buf)
+
+// Buffer of count elements, taken once with GET and given back with PUT
+#define PV_STATIC_POOL_DEFINE(name, type, count)    static type name##_pool[(count)]
+#define PV_STATIC_POOL_GET(name, type, count)       (name##_pool)
+#define PV_STATIC_POOL_PUT(name, p)                 ((void)(p))
+
+#else
+
+#define PV_STATIC_TASK_DEFINE_N(name, stack_size, count)        struct name##_unused
+#define PV_STATIC_TASK_CREATE_N(name, i, fn, tname, stack_size, arg, prio, handle, core)                    \
+    xTaskCreatePinnedToCore((fn), (tname), (stack_size), (arg), (prio), (handle), (core))
+
+#define PV_STATIC_QUEUE_DEFINE_N(name, len, item_size, count)   struct name##_unused
+#define PV_STATIC_QUEUE_CREATE_N(name, i, len, item_size)       xQueueCreate((len), (item_size))
+
+#define PV_STATIC_RINGBUF_DEFINE_N(name, size, count)           struct name##_unused
+#define PV_STATIC_RINGBUF_CREATE_N(name, i, size, type)         xRingbufferCreate((size), (type))
+
+#define PV_STATIC_SEMAPHORE_DEFINE_N(name, count)   struct name##_unused
+#define PV_STATIC_MUTEX_CREATE_N(name, i)       xSemaphoreCreateMutex()
+#define PV_STATIC_COUNTING_CREATE_N(name, i, max, initial)  xSemaphoreCreateCounting((max), (initial))
+
+#define PV_STATIC_TIMER_DEFINE(name)            struct name##_unused
+#define PV_STATIC_TIMER_CREATE(name, tname, period, reload, id, cb)                                         \
+    xTimerCreate((tname), (period), (reload), (id), (cb))
+
+#define PV_STATIC_POOL_DEFINE(name, type, count)    struct name##_unused
+#define PV_STATIC_POOL_GET(name, type, count)       ((type *)calloc((count), sizeof(type)))
+#define PV_STATIC_POOL_PUT(name, p)                 free(p)
+
+#endif
+
+// Single objects
+#define PV_STATIC_TASK_DEFINE(name, stack_size)     PV_STATIC_TASK_DEFINE_N(name, stack_size, 1)
+#define PV_STATIC_TASK_CREATE(name, fn, tname, stack_size, arg, prio, handle, core)                         \
+    PV_STATIC_TASK_CREATE_N(name, 0, fn, tname, stack_size, arg, prio, handle, core)
+#define PV_STATIC_QUEUE_DEFINE(name, len, item_size)    PV_STATIC_QUEUE_DEFINE_N(name, len, item_size, 1)
+#define PV_STATIC_QUEUE_CREATE(name, len, item_size)    PV_STATIC_QUEUE_CREATE_N(name, 0, len, item_size)
+#define PV_STATIC_RINGBUF_DEFINE(name, size)        PV_STATIC_RINGBUF_DEFINE_N(name, size, 1)
+#define PV_STATIC_RINGBUF_CREATE(name, size, type)  PV_STATIC_RINGBUF_CREATE_N(name, 0, size, type)
+#define PV_STATIC_SEMAPHORE_DEFINE(name)        PV_STATIC_SEMAPHORE_DEFINE_N(name, 1)
+#define PV_STATIC_MUTEX_CREATE(name)            PV_STATIC_MUTEX_CREATE_N(name, 0)
+#define PV_STATIC_COUNTING_CREATE(name, max, initial)   PV_STATIC_COUNTING_CREATE_N(name, 0, max, initial)
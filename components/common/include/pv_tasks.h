@@ -0,0 +1,36 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+/*
+    Core and priority of every PhotoVault task, see the "PhotoVault Task
+    Placement" menu. Bluedroid and the BT controller keep their own core
+    and priorities (19 and above), protocol work runs next to them and
+    everything touching the card runs on the other core.
+
+    Task            Core        Priority
+    transmitter     protocol    PV_TASK_PRIO_TRANSMITTER
+    backup_mgr      protocol    PV_TASK_PRIO_TRANSMITTER
+    receiver        storage     PV_TASK_PRIO_RECEIVER
+    restore         storage     PV_TASK_PRIO_RECEIVER
+    pv_aio          storage     PV_TASK_PRIO_AIO
+    pv_pack         storage     PV_TASK_PRIO_BACKGROUND
+    pv_trim         storage     PV_TASK_PRIO_BACKGROUND
+    pv_fs_space     storage     PV_TASK_PRIO_BACKGROUND
+    pv_trace        storage     PV_TASK_PRIO_BACKGROUND
+*/
+
+#if CONFIG_PV_TASK_PINNING
+#define PV_TASK_CORE_PROTOCOL       CONFIG_PV_TASK_CORE_PROTOCOL
+#define PV_TASK_CORE_STORAGE        CONFIG_PV_TASK_CORE_STORAGE
+#else
+#define PV_TASK_CORE_PROTOCOL       tskNO_AFFINITY
+#define PV_TASK_CORE_STORAGE        tskNO_AFFINITY
+#endif
+
+#define PV_TASK_PRIO_TRANSMITTER    CONFIG_PV_TASK_PRIO_TRANSMITTER
+#define PV_TASK_PRIO_RECEIVER       CONFIG_PV_TASK_PRIO_RECEIVER
+#define PV_TASK_PRIO_AIO            CONFIG_PV_TASK_PRIO_AIO
+#define PV_TASK_PRIO_BACKGROUND     CONFIG_PV_TASK_PRIO_BACKGROUND
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+
+#include "pv_logging.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_DMA"
+
+#define DMA_HEAP_CAPS           (MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL)
+
+/* STATIC VARIABLES */
+#if CONFIG_PV_STATIC_ALLOC
+static DMA_ATTR uint8_t s_region_mem[PV_DMA_POOL_SIZE] __attribute__((aligned(PV_DMA_BLOCK_SIZE)));
+#endif
+static uint8_t *s_region = NULL;
+static uint16_t s_run[PV_DMA_POOL_BLOCKS];      // Blocks of the buffer starting at each block, 0 if free
+static bool s_used[PV_DMA_POOL_BLOCKS];
+static pv_dma_stats_t s_stats;
+static portMUX_TYPE s_dma_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/***************************************************************************
+ * Function:    pv_dma_init
+ * Purpose:     Sets up the region. Called by the first pv_dma_alloc() too.
+ * Parameters:  None
+ * Returns:     ESP_OK on success (or if already initialized)
+ *              ESP_ERR_NO_MEM if the region could not be allocated
+ ***************************************************************************/
+esp_err_t pv_dma_init(void) {
+    if (s_region != NULL) {
+        return ESP_OK;
+    }
+
+#if CONFIG_PV_STATIC_ALLOC
+    s_region = s_region_mem;
+#else
+    s_region = heap_caps_aligned_alloc(PV_DMA_BLOCK_SIZE, PV_DMA_POOL_SIZE, DMA_HEAP_CAPS);
+    if (s_region == NULL) {
+        PV_LOGE(TAG, "Failed to allocate %u byte DMA region", (unsigned)PV_DMA_POOL_SIZE);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    s_stats.pool_size = PV_DMA_POOL_SIZE;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_dma_alloc
+ * Purpose:     Returns a DMA capable buffer starting on a block boundary,
+ *              from the region if it has room and from the heap else
+ * Parameters:  size - Bytes needed
+ * Returns:     The buffer, NULL if neither had room
+ ***************************************************************************/
+void *pv_dma_alloc(size_t size) {
+    uint32_t blocks = (size + PV_DMA_BLOCK_SIZE - 1) / PV_DMA_BLOCK_SIZE;
+    uint32_t start = 0;
+    uint32_t len = 0;
+    void *p = NULL;
+
+    if (size == 0 || pv_dma_init() != ESP_OK) {
+        return NULL;
+    }
+
+    portENTER_CRITICAL(&s_dma_lock);
+    // First fit, the region only holds a handful of long lived buffers
+    for (uint32_t i = 0; i < PV_DMA_POOL_BLOCKS && len < blocks; i++) {
+        if (s_used[i]) {
+            len = 0;
+            start = i + 1;
+        }
+        else {
+            len++;
+        }
+    }
+    if (len == blocks) {
+        for (uint32_t i = start; i < start + blocks; i++) {
+            s_used[i] = true;
+        }
+        s_run[start] = (uint16_t)blocks;
+        s_stats.used += blocks * PV_DMA_BLOCK_SIZE;
+        if (s_stats.used > s_stats.peak) {
+            s_stats.peak = s_stats.used;
+        }
+        p = s_region + start * PV_DMA_BLOCK_SIZE;
+    }
+    s_stats.allocs++;
+    portEXIT_CRITICAL(&s_dma_lock);
+
+    if (p != NULL) {
+        return p;
+    }
+
+    p = heap_caps_aligned_alloc(PV_DMA_BLOCK_SIZE, blocks * PV_DMA_BLOCK_SIZE, DMA_HEAP_CAPS);
+    portENTER_CRITICAL(&s_dma_lock);
+    if (p != NULL) {
+        s_stats.heap_fallbacks++;
+    }
+    else {
+        s_stats.failures++;
+    }
+    portEXIT_CRITICAL(&s_dma_lock);
+    PV_LOGW(TAG, "Region full, %u bytes %s", (unsigned)size, (p != NULL) ? "taken from the heap" : "not available");
+    return p;
+}
+
+/***************************************************************************
+ * Function:    pv_dma_free
+ * Purpose:     Gives back a buffer from pv_dma_alloc()
+ * Parameters:  p - The buffer, may be NULL
+ * Returns:     None
+ ***************************************************************************/
+void pv_dma_free(void *p) {
+    uint8_t *b = p;
+
+    if (b == NULL) {
+        return;
+    }
+    if (s_region == NULL || b < s_region || b >= s_region + PV_DMA_POOL_SIZE) {
+        heap_caps_free(p);
+        return;
+    }
+
+    uint32_t start = (uint32_t)(b - s_region) / PV_DMA_BLOCK_SIZE;
+    portENTER_CRITICAL(&s_dma_lock);
+    for (uint32_t i = start; i < start + s_run[start]; i++) {
+        s_used[i] = false;
+    }
+    s_stats.used -= s_run[start] * PV_DMA_BLOCK_SIZE;
+    s_run[start] = 0;
+    portEXIT_CRITICAL(&s_dma_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_dma_capable
+ * Purpose:     Tells whether the SD driver can transfer a buffer in place
+ * Parameters:  p - The buffer
+ * Returns:     true if it is DMA capable and word aligned
+ ***************************************************************************/
+bool pv_dma_capable(const void *p) {
+    return esp_ptr_dma_capable(p) && ((uintptr_t)p % PV_DMA_DRIVER_ALIGN) == 0;
+}
+
+/***************************************************************************
+ * Function:    pv_dma_get_stats
+ * Purpose:     Returns a consistent copy of the counters
+ * Parameters:  stats - Returns the counters
+ * Returns:     None
+ ***************************************************************************/
+void pv_dma_get_stats(pv_dma_stats_t *stats) {
+    portENTER_CRITICAL(&s_dma_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_dma_lock);
+}
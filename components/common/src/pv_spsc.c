@@ -0,0 +1,321 @@
+#include <string.h>
+
+#include "pv_spsc.h"
+
+
+/***************************************************************************
+ * Function:    pv_spsc_init
+ * Purpose:     Sets up an empty queue on buf. Call before either task
+ *              uses it.
+ * Parameters:  q - The queue
+ *              buf - Storage, size bytes
+ *              size - Capacity, a power of two
+ * Returns:     false if size is not a power of two
+ ***************************************************************************/
+bool pv_spsc_init(pv_spsc_t *q, uint8_t *buf, size_t size) {
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return false;
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->tail_cache = 0;
+    q->head_cache = 0;
+    q->buf = buf;
+    q->size = size;
+#ifdef ESP_PLATFORM
+    atomic_init(&q->producer_wait, NULL);
+    atomic_init(&q->consumer_wait, NULL);
+#endif
+    return true;
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_used
+ * Purpose:     Bytes published and not released yet, from either side
+ * Parameters:  q - The queue
+ * Returns:     The byte count
+ ***************************************************************************/
+size_t pv_spsc_used(pv_spsc_t *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    return atomic_load_explicit(&q->head, memory_order_acquire) - tail;
+}
+
+/***************************************************************************
+ * Function:    spsc_space
+ * Purpose:     Contiguous free space starting at byte counter head. Reads
+ *              the consumer's tail only if the cached one is not enough.
+ * Parameters:  q - The queue
+ *              head - Producer position, may be ahead of the published head
+ *              p - Returns where the space starts
+ * Returns:     Bytes of contiguous free space
+ ***************************************************************************/
+static size_t spsc_space(pv_spsc_t *q, size_t head, uint8_t **p) {
+    size_t off = head & (q->size - 1);
+    size_t to_end = q->size - off;
+    size_t space = q->size - (head - q->tail_cache);
+
+    if (space < to_end) {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        space = q->size - (head - q->tail_cache);
+    }
+    *p = q->buf + off;
+    return (space < to_end) ? space : to_end;
+}
+
+/***************************************************************************
+ * Function:    spsc_data
+ * Purpose:     Contiguous data starting at byte counter tail. Reads the
+ *              producer's head only if the cached one is not enough.
+ * Parameters:  q - The queue
+ *              tail - Consumer position, may be ahead of the released tail
+ *              p - Returns where the data starts
+ * Returns:     Bytes of contiguous data
+ ***************************************************************************/
+static size_t spsc_data(pv_spsc_t *q, size_t tail, const uint8_t **p) {
+    size_t off = tail & (q->size - 1);
+    size_t to_end = q->size - off;
+    size_t avail = q->head_cache - tail;
+
+    // More than size means the cached head is behind tail (tail past what was peeked so far)
+    if (avail < to_end || avail > q->size) {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        avail = q->head_cache - tail;
+    }
+    *p = q->buf + off;
+    return (avail < to_end) ? avail : to_end;
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_reserve
+ * Purpose:     Producer: contiguous free space to fill before pv_spsc_commit()
+ * Parameters:  q - The queue
+ *              p - Returns where the space starts
+ * Returns:     Bytes that may be written at p, 0 if the queue is full
+ ***************************************************************************/
+size_t pv_spsc_reserve(pv_spsc_t *q, uint8_t **p) {
+    return spsc_space(q, atomic_load_explicit(&q->head, memory_order_relaxed), p);
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_commit
+ * Purpose:     Producer: publishes n bytes filled after pv_spsc_reserve()
+ *              and wakes the consumer if it is waiting
+ * Parameters:  q - The queue
+ *              n - Bytes to publish
+ * Returns:     None
+ ***************************************************************************/
+void pv_spsc_commit(pv_spsc_t *q, size_t n) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    atomic_store_explicit(&q->head, head + n, memory_order_release);
+#ifdef ESP_PLATFORM
+    // Pairs with the fence in pv_spsc_peek_wait(), one side always sees the other
+    atomic_thread_fence(memory_order_seq_cst);
+    TaskHandle_t waiter = atomic_load_explicit(&q->consumer_wait, memory_order_relaxed);
+    if (waiter != NULL) {
+        xTaskNotifyGive(waiter);
+    }
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_write
+ * Purpose:     Producer: copies as much of data as fits and publishes it
+ *              with one commit
+ * Parameters:  q - The queue
+ *              data, len - Bytes to queue
+ * Returns:     Bytes queued
+ ***************************************************************************/
+size_t pv_spsc_write(pv_spsc_t *q, const void *data, size_t len) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t done = 0;
+    uint8_t *p = NULL;
+
+    // At most two runs, up to the end of the buffer and from its start
+    for (int i = 0; i < 2 && done < len; i++) {
+        size_t n = spsc_space(q, head + done, &p);
+        if (n == 0) {
+            break;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(p, (const uint8_t *)data + done, n);
+        done += n;
+    }
+    if (done > 0) {
+        pv_spsc_commit(q, done);
+    }
+    return done;
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_peek
+ * Purpose:     Consumer: contiguous data to process in place before
+ *              pv_spsc_release()
+ * Parameters:  q - The queue
+ *              p - Returns where the data starts
+ * Returns:     Bytes readable at p, 0 if the queue is empty
+ ***************************************************************************/
+size_t pv_spsc_peek(pv_spsc_t *q, const uint8_t **p) {
+    return pv_spsc_peek_at(q, 0, p);
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_peek_at
+ * Purpose:     Consumer: as pv_spsc_peek(), but skipping offset bytes that
+ *              were peeked and are still in use, so several batches can be
+ *              processed in place before they are released in order
+ * Parameters:  q - The queue
+ *              offset - Bytes after the oldest unreleased one
+ *              p - Returns where the data starts
+ * Returns:     Bytes readable at p, 0 if there is nothing past offset
+ ***************************************************************************/
+size_t pv_spsc_peek_at(pv_spsc_t *q, size_t offset, const uint8_t **p) {
+    if (pv_spsc_used(q) <= offset) {
+        return 0;
+    }
+    return spsc_data(q, atomic_load_explicit(&q->tail, memory_order_relaxed) + offset, p);
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_release
+ * Purpose:     Consumer: frees n bytes after pv_spsc_peek() and wakes the
+ *              producer if it is waiting
+ * Parameters:  q - The queue
+ *              n - Bytes to free
+ * Returns:     None
+ ***************************************************************************/
+void pv_spsc_release(pv_spsc_t *q, size_t n) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+#ifdef ESP_PLATFORM
+    // Pairs with the fence in pv_spsc_send()
+    atomic_thread_fence(memory_order_seq_cst);
+    TaskHandle_t waiter = atomic_load_explicit(&q->producer_wait, memory_order_relaxed);
+    if (waiter != NULL) {
+        xTaskNotifyGive(waiter);
+    }
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_read
+ * Purpose:     Consumer: copies up to len bytes out and frees them with
+ *              one release
+ * Parameters:  q - The queue
+ *              buf, len - Destination
+ * Returns:     Bytes read
+ ***************************************************************************/
+size_t pv_spsc_read(pv_spsc_t *q, void *buf, size_t len) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t done = 0;
+    const uint8_t *p = NULL;
+
+    for (int i = 0; i < 2 && done < len; i++) {
+        size_t n = spsc_data(q, tail + done, &p);
+        if (n == 0) {
+            break;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy((uint8_t *)buf + done, p, n);
+        done += n;
+    }
+    if (done > 0) {
+        pv_spsc_release(q, done);
+    }
+    return done;
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_discard
+ * Purpose:     Consumer: frees everything published so far
+ * Parameters:  q - The queue
+ * Returns:     None
+ ***************************************************************************/
+void pv_spsc_discard(pv_spsc_t *q) {
+    size_t n = pv_spsc_used(q);
+
+    if (n > 0) {
+        pv_spsc_release(q, n);
+    }
+}
+
+#ifdef ESP_PLATFORM
+/***************************************************************************
+ * Function:    pv_spsc_send
+ * Purpose:     Producer: queues all of data, blocking while the queue is full
+ * Parameters:  q - The queue
+ *              data, len - Bytes to queue
+ *              wait - Longest total time to block, portMAX_DELAY for no limit
+ * Returns:     Bytes queued, less than len on timeout
+ ***************************************************************************/
+size_t pv_spsc_send(pv_spsc_t *q, const void *data, size_t len, TickType_t wait) {
+    TickType_t start = xTaskGetTickCount();
+    size_t done = 0;
+
+    while (1) {
+        done += pv_spsc_write(q, (const uint8_t *)data + done, len - done);
+        if (done == len) {
+            break;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (wait != portMAX_DELAY && waited >= wait) {
+            break;
+        }
+        // Register before checking again, a release in between then notifies
+        atomic_store(&q->producer_wait, xTaskGetCurrentTaskHandle());
+        atomic_thread_fence(memory_order_seq_cst);
+        if (pv_spsc_used(q) == q->size) {
+            ulTaskNotifyTake(pdTRUE, (wait == portMAX_DELAY) ? portMAX_DELAY : wait - waited);
+        }
+        atomic_store(&q->producer_wait, NULL);
+    }
+    return done;
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_peek_wait
+ * Purpose:     Consumer: pv_spsc_peek(), blocking while the queue is empty
+ * Parameters:  q - The queue
+ *              p - Returns where the data starts
+ *              wait - Longest time to block, portMAX_DELAY for no limit
+ * Returns:     Bytes readable at p, 0 on timeout
+ ***************************************************************************/
+size_t pv_spsc_peek_wait(pv_spsc_t *q, const uint8_t **p, TickType_t wait) {
+    return pv_spsc_peek_wait_at(q, 0, p, wait);
+}
+
+/***************************************************************************
+ * Function:    pv_spsc_peek_wait_at
+ * Purpose:     Consumer: pv_spsc_peek_at(), blocking while there is nothing
+ *              past offset
+ * Parameters:  q - The queue
+ *              offset - Bytes after the oldest unreleased one
+ *              p - Returns where the data starts
+ *              wait - Longest time to block, portMAX_DELAY for no limit
+ * Returns:     Bytes readable at p, 0 on timeout
+ ***************************************************************************/
+size_t pv_spsc_peek_wait_at(pv_spsc_t *q, size_t offset, const uint8_t **p, TickType_t wait) {
+    TickType_t start = xTaskGetTickCount();
+    size_t n = 0;
+
+    while ((n = pv_spsc_peek_at(q, offset, p)) == 0) {
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (wait != portMAX_DELAY && waited >= wait) {
+            break;
+        }
+        atomic_store(&q->consumer_wait, xTaskGetCurrentTaskHandle());
+        atomic_thread_fence(memory_order_seq_cst);
+        if (pv_spsc_used(q) <= offset) {
+            ulTaskNotifyTake(pdTRUE, (wait == portMAX_DELAY) ? portMAX_DELAY : wait - waited);
+        }
+        atomic_store(&q->consumer_wait, NULL);
+    }
+    return n;
+}
+#endif
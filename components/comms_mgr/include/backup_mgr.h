@@ -0,0 +1,81 @@
+#ifndef BACKUP_MGR_H
+#define BACKUP_MGR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "pv_tasks.h"
+#include "transfer_control.h"
+
+/*
+    Decides which transfer goes next and what happens when one fails.
+
+    Transfers are queued with backup_mgr_enqueue() and kept in a table of
+    BACKUP_MGR_MAX_ENTRIES with their state. Ready transfers wait in a heap
+    ordered by priority (then by age) and up to BACKUP_MGR_IN_FLIGHT of them
+    are handed to the restore engine (restore_engine.h) on tx_cmd_queue at
+    once, so the next file is always queued while the current one is sent.
+    Nothing is dispatched while no phone is connected.
+
+    The manager task sleeps on status_queue: a result, a new transfer or a
+    new connection wakes it, and so does the next retry coming due. A failed
+    transfer is retried after an exponential backoff (BACKUP_MGR_BACKOFF_*,
+    with jitter) from a second heap ordered by due time, and given up on
+    after BACKUP_MGR_MAX_ATTEMPTS. A new connection makes every waiting
+    retry ready at once, most failures are the link going away.
+
+    Receiver results (TRANSFER_TYPE_RX) are only counted, the phone resends
+    what it did not get acknowledged.
+
+    State of an entry:
+
+    BACKUP_PENDING      Ready, waiting for a free slot
+    BACKUP_ACTIVE       On tx_cmd_queue or being sent
+    BACKUP_RETRY_WAIT   Failed, waiting for its backoff
+    BACKUP_DONE         Sent
+    BACKUP_FAILED       Gave up after BACKUP_MGR_MAX_ATTEMPTS
+
+    Finished entries stay in the table for backup_mgr_get_state() until
+    their slot is needed.
+*/
+
+#define BACKUP_MGR_MAX_ENTRIES          32U
+#define BACKUP_MGR_IN_FLIGHT            2U              // Commands on tx_cmd_queue at once, at most TRANSFER_CMD_QUEUE_LEN
+#define BACKUP_MGR_MAX_ATTEMPTS         5U
+#define BACKUP_MGR_BACKOFF_BASE_MS      1000U           // Wait after the first failure, doubled after every further one
+#define BACKUP_MGR_BACKOFF_MAX_MS       60000U
+#define BACKUP_MGR_TASK_STACK_SIZE      3072U
+#define BACKUP_MGR_TASK_PRIORITY        PV_TASK_PRIO_TRANSMITTER
+
+#define BACKUP_PRIO_LOW                 0U
+#define BACKUP_PRIO_NORMAL              1U
+#define BACKUP_PRIO_HIGH                2U              // Restores the user is waiting for
+
+typedef enum {
+    BACKUP_NONE,                                        // Not in the table
+    BACKUP_PENDING,
+    BACKUP_ACTIVE,
+    BACKUP_RETRY_WAIT,
+    BACKUP_DONE,
+    BACKUP_FAILED,
+} backup_state_t;
+
+typedef struct {
+    uint32_t pending;                                   // Entries in each state right now
+    uint32_t active;
+    uint32_t retry_wait;
+    uint32_t done;                                      // Transfers completed since boot
+    uint32_t failed;                                    // Transfers given up on since boot
+    uint32_t retries;                                   // Failed attempts that were rescheduled
+    uint32_t rx_done;                                   // Files the receiver stored
+    uint32_t rx_failed;                                 // Files the receiver could not store
+} backup_mgr_stats_t;
+
+/* FUNCTION DEFS */
+esp_err_t backup_mgr_init(void);
+esp_err_t backup_mgr_enqueue(const char *path, uint8_t transfer_type, uint8_t priority);
+backup_state_t backup_mgr_get_state(const char *path, uint8_t transfer_type);
+void backup_mgr_link_up(void);
+void backup_mgr_get_stats(backup_mgr_stats_t *stats);
+
+#endif
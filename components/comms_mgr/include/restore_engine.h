@@ -0,0 +1,53 @@
+#ifndef RESTORE_ENGINE_H
+#define RESTORE_ENGINE_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "pv_tasks.h"
+#include "transfer_control.h"
+
+/*
+    Streams files from the card back to the phone.
+
+    Files come from tx_cmd_queue (see backup_mgr.h) one after the other, so
+    queueing a whole album keeps the engine busy, and every result goes back
+    on status_queue. Files are named by their phone path, as the phone asks
+    for them (RESTORE_CMD), and found on the card through the storage
+    layout (pv_layout.h) or in the pack store. Each file is sent on the TX
+    ring buffer of the connected phone as
+
+        TX_START_CMD
+        {"path":"...","size":N}\n
+        TX_DATA_CMD "<n>\n" and n bytes of file data, repeated until all
+                                    N bytes are sent (n <= RESTORE_FRAME_MAX)
+        TX_END_CMD                  (TX_FAIL_CMD if the card failed)
+
+    tx_lock is only held for the header, one frame or the end, and replies
+    waiting for it go first, so arbiter replies are never held up by a
+    large file; they arrive between frames. A file only starts while the
+    arbiter is idle. If the card fails part way TX_FAIL_CMD ends the file
+    early and the phone discards it. A file only counts as restored once
+    the transmitter got all of it confirmed without dropping a byte.
+
+    A file the receiver put in the pack store (pv_pack.h) has no file of
+    its own, it is read from the pack whole and sent the same way.
+
+    Data is read through pv_aio into two DMA buffers: while one is copied
+    to the ring the next read is already running. The read size follows the
+    link, it covers RESTORE_READAHEAD_MS of the rate the transmitter got
+    confirmed, between RESTORE_READ_MIN and RESTORE_READ_MAX. No read is
+    started while the link is congested, the ring is full by then anyway
+    and the card is left to the receiver.
+*/
+
+#define RESTORE_READ_MIN            (4U * 1024U)
+#define RESTORE_READ_MAX            (16U * 1024U)       // Size of each of the two read buffers
+#define RESTORE_READAHEAD_MS        250U                // Link time one read should cover
+#define RESTORE_FRAME_MAX           (2U * 1024U)        // File bytes per TX_DATA_CMD frame, tx_lock is held for one
+#define RESTORE_TASK_STACK_SIZE     4096U
+#define RESTORE_TASK_PRIORITY       PV_TASK_PRIO_RECEIVER
+
+/* FUNCTION DEFS */
+esp_err_t restore_engine_init(void);
+
+#endif
@@ -2,8 +2,10 @@
 #define TRANSFER_CONTROL_H
 
 #include <stdint.h>
+#include "sdkconfig.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/ringbuf.h>
 #include "esp_gap_ble_api.h"
 #include "esp_gatts_api.h"
@@ -11,37 +13,193 @@
 #include "cJSON.h"
 #include "pv_fs.h"
 #include "pv_sdc.h"
+#include "pv_aio.h"
+#include "pv_dircache.h"
+#include "pv_layout.h"
+#include "pv_pack.h"
+#include "pv_diskio.h"
+#include "pv_trim.h"
+#include "pv_tasks.h"
+#include "pv_spsc.h"
 
-#define RX_RINGBUF_SIZE 4096
+#define RX_RINGBUF_SIZE 4096            // Smallest receive staging ring, see transfer_control_init()
+#define RX_STAGING_PSRAM_SIZE ((size_t)CONFIG_PV_RX_STAGING_PSRAM_KB * 1024U)
+#define RX_STAGING_INTERNAL_SIZE ((size_t)CONFIG_PV_RX_STAGING_INTERNAL_KB * 1024U)
+#define RX_STAGE_CHUNK_SIZE 8192        // DMA buffer the receiver copies a PSRAM ring out to
+#define RX_WRITES_IN_FLIGHT 2           // Card writes the receiver keeps queued on the storage I/O task
 #define TX_RINGBUF_SIZE 4096
+#define TRANSFER_TX_WRITE_MAX 990       // ESP_SPP_MAX_MTU, bytes handed to Bluedroid per write
+#define TRANSFER_TX_WRITE_TIMEOUT_MS 5000   // Wait for ESP_SPP_WRITE_EVT after which a write is counted as late
+#define TRANSFER_TX_REPLY_WAIT_MS 1000  // Longest an arbiter reply waits for tx_lock, see transfer_control_send()
 #define INITIAL_BUFFER_SIZE 4096
 #define MAX_PATH_SIZE 256
+#define TRANSFER_CMD_QUEUE_LEN 10
+#define TRANSFER_TASK_STACK_SIZE 8192
+#define TRANSFER_RX_TASK_PRIORITY PV_TASK_PRIO_RECEIVER
+#define TRANSFER_TX_TASK_PRIORITY PV_TASK_PRIO_TRANSMITTER
+#define TRANSFER_RESET_POLL_MS 100       // Longest time the receiver takes to notice a disconnect
+#define TRANSFER_MAX_SESSIONS 1          // Connections served at once, each has its own tasks and buffers
+#define TRANSFER_FILES_IN_FLIGHT 4       // Files announced but not fully written yet, per connection
+#define LEFTOVER_MAX_SIZE 4
+#define TRANSFER_DELETE_QUEUE_LEN 2      // Backup deletes waiting for the delete task
+#define TRANSFER_DELETE_TASK_STACK_SIZE 4096
+#define TRANSFER_DELETE_TASK_PRIORITY 3
+#define TRANSFER_DELETE_DRAIN_MS 30000   // Longest a backup delete waits for the receiver to finish the folder's files
 
 #define TRANSFER_TYPE_RX 0
 #define TRANSFER_TYPE_TX 1
+#define TRANSFER_TYPE_WAKE 2            // status_queue only, wakes the backup manager without a result
 
 #define PV_ERR_SEND_FAIL 1
 #define PV_ERR_RECV_FAIL 2
 
 #define FAILURE_PATTERN "69696969"
+#define DEL_BACKUP_CMD "DELBKP\n"
+#define STATS_CMD "STATS\n"            // Answered with the storage I/O counters as one JSON line
+#define RESTORE_CMD "RESTORE\n"        // Followed by a packet with the phone path of a file to send back
+#define TX_START_CMD "TXSTART\n"       // Starts a restored file, see restore_engine.h
+#define TX_DATA_CMD "TXDATA "          // Frame of a restored file: the length, '\n', then that many bytes
+#define TX_END_CMD "END\n"
+#define TX_FAIL_CMD "TXFAIL\n"         // Ends a restored file the card could not read, see restore_engine.h
 
 
 typedef struct
 {
-    char file_path[128];
+    char file_path[MAX_PATH_SIZE];  // Longer paths are refused by backup_mgr_enqueue()
     uint8_t transfer_type; // TRANSFER_TYPE_TX or TRANSFER_TYPE_RX
     uint8_t status;        // PV_ERR_SEND_FAIL, PV_ERR_RECV_FAIL, or 0 on success
 } transfer_cmd_t;
 
+// Phone protocol state, driven by bt_arbiter_sm_feedin()
+typedef enum state {
+    WAIT, 
+    RX_ACTIVEM,
+    RX_ACTIVE, 
+    RX_ERROR_STATE, 
+    DEL_ACTIVE,
+    RESTORE_ACTIVE,
+}BT_ARBITER_STATE;
+
+// A file announced by the phone, passed from the metadata parser to the receiver
+typedef struct
+{
+    char path[MAX_PATH_SIZE];   // Path on the card, or name in the pack store
+    char alt_path[MAX_PATH_SIZE];   // Used instead if a hashed 8.3 path is taken (see pv_layout.h), empty if none
+    uint64_t size;
+    bool packed;                // Goes into the pack store instead of its own file
+} transfer_file_t;
+
+// Transmitter counters of a connection, reported by STATS_CMD
+typedef struct
+{
+    uint32_t writes;                            // esp_spp_write() calls confirmed by ESP_SPP_WRITE_EVT
+    uint64_t bytes;
+    uint32_t cong_waits;                        // Writes held back until the link was no longer congested
+    uint32_t failures;                          // Writes rejected or failed
+    uint32_t timeouts;                          // Writes without ESP_SPP_WRITE_EVT in TRANSFER_TX_WRITE_TIMEOUT_MS
+    uint32_t dropped;                           // Bytes given up on, only when the phone disconnected
+} transfer_tx_stats_t;
+
+/*
+    State of one connection. The arbiter fields are only used from the BT
+    callback, the receiver fields only by that connection's receiver_task.
+    Files are handed between them through file_queue, so the metadata of the
+    next file can be parsed while the receiver still writes the current one.
+
+    The transmitter hands tx_ringbuf bytes to Bluedroid in place, one write
+    at a time: the ring space is only returned once ESP_SPP_WRITE_EVT
+    confirms it, and no write is started while the link is congested
+    (ESP_SPP_CONG_EVT). Replies queued while a write is out are merged into
+    the next one. bluetooth_mgr forwards both events with
+    transfer_control_tx_event(). Bluedroid answers every write with exactly
+    one ESP_SPP_WRITE_EVT, in order, so writes are numbered (tx_write_seq)
+    and the events counted (tx_done_seq): a late event is never taken for
+    the next write. A write is repeated until it goes through, bytes are
+    only given up on when the phone disconnects.
+
+    Everything written to tx_ringbuf goes through tx_lock, so messages from
+    the arbiter, the delete task, STATS_CMD and the restore engine never
+    interleave. The restore engine only holds it for one frame of a file at
+    a time and takes it with transfer_control_tx_lock_bulk(), which leaves
+    it to any reply waiting for it (tx_lock_waiters). Replies sent from the
+    Bluetooth callback only wait TRANSFER_TX_REPLY_WAIT_MS for it: that task
+    also delivers the write events the transmitter is waiting for.
+
+    rx_ring is the staging tier between the two that absorbs card stalls
+    (FAT updates, card garbage collection) before they back up into the
+    Bluetooth stack. With PSRAM it is up to RX_STAGING_PSRAM_SIZE there, and
+    since PSRAM can't be DMAed to the card the receiver copies it out through
+    the rx_stage_buf buffers. Without PSRAM, or if it can't be had, it is
+    RX_STAGING_INTERNAL_SIZE of DMA capable internal RAM written in place.
+    Either way up to RX_WRITES_IN_FLIGHT data writes are queued on the I/O
+    task at once, so the next chunk is staged while the card writes the
+    last one; the receiver only waits when all of them are in flight.
+*/
+typedef struct
+{
+    uint32_t bt_handle;
+    volatile bool connected;                    // A phone is connected, bt_handle is valid
+    volatile bool reset_pending;                // Set on disconnect, cleared by receiver_task
+    pv_spsc_t rx_ring;                          // will be written to by the Bluetooth interface, read by receiver_task
+    bool rx_ring_psram;                         // rx_ring is the PSRAM staging tier
+    RingbufHandle_t tx_ringbuf;                 // will be consumed by the Bluetooth interface
+    SemaphoreHandle_t tx_lock;                  // Held for a whole message written to tx_ringbuf
+    volatile uint32_t tx_lock_waiters;          // Replies waiting for tx_lock, restore frames wait for them
+    QueueHandle_t file_queue;                   // transfer_file_t, announced files in order
+
+    // Arbiter
+    BT_ARBITER_STATE cur_state;
+    uint64_t cur_file_size;
+    uint64_t bytes_sent_so_far;
+    uint8_t leftover_buffer[LEFTOVER_MAX_SIZE];
+    char rx_path_buffer[MAX_PATH_SIZE];         // Path as sent by the phone
+    transfer_file_t meta;                       // File described by the last metadata
+    bool meta_valid;
+
+    // Receiver
+    transfer_file_t rx_file;                    // File being written
+    uint64_t rx_file_remaining;
+    bool rx_active;                             // rx_file was started and not finished yet
+    bool rx_failed;                             // Rest of rx_file is discarded
+    pv_aio_req_t rx_req;                        // Opens and closes
+    pv_aio_req_t rx_wr_req[RX_WRITES_IN_FLIGHT]; // Data writes, finished in the order they were queued
+    SemaphoreHandle_t rx_wr_done;               // Given by the I/O task for every finished data write
+    uint8_t rx_wr_next;                         // Oldest write in flight
+    uint8_t rx_wr_count;                        // Writes in flight
+    size_t rx_wr_ring_bytes;                    // Bytes of rx_ring being written in place, released when done
+    pv_aio_handle_t rx_handle;
+    pv_pack_obj_t rx_pack_obj;
+    uint8_t *rx_stage_buf[RX_WRITES_IN_FLIGHT]; // RX_STAGE_CHUNK_SIZE of DMA memory each, NULL if rx_ring is DMA capable
+    size_t rx_ring_peak;                        // Most bytes waiting in rx_ring so far
+
+    // Transmitter
+    TaskHandle_t tx_task;                       // Woken by transfer_control_tx_event() and on close
+    volatile bool tx_congested;                 // Set by ESP_SPP_CONG_EVT, no write is started while set
+    uint32_t tx_write_seq;                      // Writes started on this connection
+    volatile uint32_t tx_done_seq;              // ESP_SPP_WRITE_EVTs received, the write is out while behind tx_write_seq
+    volatile bool tx_write_ok;                  // Result of the last confirmed write
+    volatile uint32_t tx_write_len;             // Bytes the last confirmed write took
+    transfer_tx_stats_t tx_stats;
+} transfer_ctx_t;
+
 // declare variables whose definitions are present in c file
 extern QueueHandle_t tx_cmd_queue;
 extern QueueHandle_t status_queue;
-extern RingbufHandle_t rx_ringbuf;
-extern RingbufHandle_t tx_ringbuf;
 
-void transfer_control_init(uint32_t bt_handle);
-void receiver_task();
-void transmitter_task();
+void transfer_control_init(void);
+transfer_ctx_t *transfer_control_open(uint32_t bt_handle);
+transfer_ctx_t *transfer_control_find(uint32_t bt_handle);
+bool transfer_control_connected(void);
+transfer_ctx_t *transfer_control_active(void);
+void transfer_control_tx_event(transfer_ctx_t *ctx, bool write_done, bool ok, uint32_t len, bool cong);
+void transfer_control_close(transfer_ctx_t *ctx);
+bool transfer_control_queue_file(transfer_ctx_t *ctx);
+bool transfer_control_tx_lock(transfer_ctx_t *ctx, TickType_t wait);
+bool transfer_control_tx_lock_bulk(transfer_ctx_t *ctx, TickType_t wait);
+void transfer_control_tx_unlock(transfer_ctx_t *ctx);
+bool transfer_control_send(transfer_ctx_t *ctx, const void *data, size_t len, TickType_t wait);
+void receiver_task(void *param);
+void transmitter_task(void *param);
 void append_data(char **buffer, size_t *buffer_len, size_t *buffer_size, const char *data, size_t item_size);
 // void process_meta_data(uint8_t * metadata, uint16_t len);
 //testing
@@ -49,6 +207,9 @@ extern volatile int success_flag;
 void dummy_bt_task(void* param);
 void dummy_backup_task();
 void start_transfer_control_tests();
-bool process_photo_metadata(const char *json_str, size_t * size_of_image);
+bool process_photo_metadata(transfer_ctx_t *ctx, const char *json_str, uint64_t * size_of_image);
+esp_err_t transfer_control_delete_backup(transfer_ctx_t *ctx, const uint8_t *name, uint16_t len);
+esp_err_t transfer_control_request_restore(const uint8_t *path, uint16_t len);
+esp_err_t transfer_control_send_stats(transfer_ctx_t *ctx);
 
 #endif
\ No newline at end of file
@@ -4,5 +4,7 @@
 void happy_path();
 void failure_path();
 void overflow_path();
+void reconnect_path();
+void packed_disconnect_path();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_random.h"
+
+#include "pv_static.h"
+#include "backup_mgr.h"
+
+
+#define TAG "PV_BACKUP_MGR"
+
+typedef struct {
+    char path[sizeof(((transfer_cmd_t *)0)->file_path)];
+    uint8_t type;                                       // TRANSFER_TYPE_TX or TRANSFER_TYPE_RX
+    uint8_t priority;
+    uint8_t attempts;                                   // Failed attempts so far
+    backup_state_t state;
+    uint32_t seq;                                       // Enqueue order, equal priorities go oldest first
+    TickType_t due;                                     // When a BACKUP_RETRY_WAIT entry becomes ready
+} backup_entry_t;
+
+// Binary heap of table indexes, before() tells which of two entries goes first
+typedef struct {
+    uint8_t idx[BACKUP_MGR_MAX_ENTRIES];
+    uint32_t count;
+    bool (*before)(const backup_entry_t *a, const backup_entry_t *b);
+} backup_heap_t;
+
+/* STATIC VARIABLES */
+static bool s_initialized = false;
+static SemaphoreHandle_t s_lock = NULL;                 // Guards everything below
+static backup_entry_t s_entries[BACKUP_MGR_MAX_ENTRIES];
+static uint32_t s_seq = 0;
+static uint32_t s_active = 0;                           // Entries in BACKUP_ACTIVE
+static volatile bool s_link_up = false;                 // A connection was opened since the task last ran
+static backup_mgr_stats_t s_stats;
+PV_STATIC_SEMAPHORE_DEFINE(s_lock_mem);
+PV_STATIC_TASK_DEFINE(s_task_mem, BACKUP_MGR_TASK_STACK_SIZE);
+
+static bool ready_before(const backup_entry_t *a, const backup_entry_t *b);
+static bool due_before(const backup_entry_t *a, const backup_entry_t *b);
+static backup_heap_t s_ready = { .before = ready_before };  // BACKUP_PENDING
+static backup_heap_t s_retry = { .before = due_before };    // BACKUP_RETRY_WAIT
+
+
+/***************************************************************************
+ * Function:    ready_before
+ * Purpose:     Order of the ready heap: higher priority first, then older
+ * Parameters:  a, b - Entries to compare
+ * Return:      true if a goes before b
+ ***************************************************************************/
+static bool ready_before(const backup_entry_t *a, const backup_entry_t *b)
+{
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+/***************************************************************************
+ * Function:    due_before
+ * Purpose:     Order of the retry heap: the retry that is due first
+ * Parameters:  a, b - Entries to compare
+ * Return:      true if a is due before b
+ ***************************************************************************/
+static bool due_before(const backup_entry_t *a, const backup_entry_t *b)
+{
+    return (int32_t)(a->due - b->due) < 0;
+}
+
+/***************************************************************************
+ * Function:    heap_swap
+ * Purpose:     Swaps two positions of a heap
+ * Parameters:  h - Heap, a, b - Positions
+ * Return:      None
+ ***************************************************************************/
+static void heap_swap(backup_heap_t *h, uint32_t a, uint32_t b)
+{
+    uint8_t t = h->idx[a];
+    h->idx[a] = h->idx[b];
+    h->idx[b] = t;
+}
+
+/***************************************************************************
+ * Function:    heap_push
+ * Purpose:     Adds an entry to a heap, s_lock must be held
+ * Parameters:  h - Heap, entry - Index in s_entries
+ * Return:      None
+ ***************************************************************************/
+static void heap_push(backup_heap_t *h, uint32_t entry)
+{
+    uint32_t i = h->count++;
+
+    h->idx[i] = (uint8_t)entry;
+    while (i > 0 && h->before(&s_entries[h->idx[i]], &s_entries[h->idx[(i - 1) / 2]])) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/***************************************************************************
+ * Function:    heap_pop
+ * Purpose:     Takes the first entry off a heap, s_lock must be held
+ * Parameters:  h - Heap, not empty
+ * Return:      Index in s_entries of the entry
+ ***************************************************************************/
+static uint32_t heap_pop(backup_heap_t *h)
+{
+    uint32_t top = h->idx[0];
+    uint32_t i = 0;
+
+    h->idx[0] = h->idx[--h->count];
+    while (1) {
+        uint32_t first = i;
+        uint32_t l = 2 * i + 1;
+        uint32_t r = l + 1;
+
+        if (l < h->count && h->before(&s_entries[h->idx[l]], &s_entries[h->idx[first]])) {
+            first = l;
+        }
+        if (r < h->count && h->before(&s_entries[h->idx[r]], &s_entries[h->idx[first]])) {
+            first = r;
+        }
+        if (first == i) {
+            break;
+        }
+        heap_swap(h, i, first);
+        i = first;
+    }
+    return top;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_wake
+ * Purpose:     Makes the manager task look at the table again
+ * Parameters:  None
+ * Return:      None
+ ***************************************************************************/
+static void backup_mgr_wake(void)
+{
+    transfer_cmd_t wake = { .transfer_type = TRANSFER_TYPE_WAKE };
+
+    // If the queue is full the task is about to run anyway
+    xQueueSend(status_queue, &wake, 0);
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_find
+ * Purpose:     Looks up the entry of a transfer, s_lock must be held
+ * Parameters:  path, type - The transfer
+ * Return:      Its index, BACKUP_MGR_MAX_ENTRIES if it is not in the table
+ ***************************************************************************/
+static uint32_t backup_mgr_find(const char *path, uint8_t type)
+{
+    for (uint32_t i = 0; i < BACKUP_MGR_MAX_ENTRIES; i++) {
+        if (s_entries[i].state != BACKUP_NONE && s_entries[i].type == type &&
+            strncmp(s_entries[i].path, path, sizeof(s_entries[i].path)) == 0) {
+            return i;
+        }
+    }
+    return BACKUP_MGR_MAX_ENTRIES;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_backoff
+ * Purpose:     Time to wait before the next attempt
+ * Parameters:  attempts - Failed attempts so far, at least 1
+ * Return:      BACKUP_MGR_BACKOFF_BASE_MS doubled per further failure, up
+ *              to BACKUP_MGR_BACKOFF_MAX_MS, plus up to a quarter of jitter
+ *              so transfers that failed together do not retry together
+ ***************************************************************************/
+static TickType_t backup_mgr_backoff(uint8_t attempts)
+{
+    uint32_t ms = BACKUP_MGR_BACKOFF_MAX_MS;
+
+    if (attempts - 1U < 16U && (BACKUP_MGR_BACKOFF_BASE_MS << (attempts - 1U)) < BACKUP_MGR_BACKOFF_MAX_MS) {
+        ms = BACKUP_MGR_BACKOFF_BASE_MS << (attempts - 1U);
+    }
+    ms += esp_random() % (ms / 4U + 1U);
+    return pdMS_TO_TICKS(ms);
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_handle_result
+ * Purpose:     Updates the entry of a finished transfer, s_lock must be held
+ * Parameters:  msg - Result from status_queue
+ * Return:      None
+ ***************************************************************************/
+static void backup_mgr_handle_result(const transfer_cmd_t *msg)
+{
+    uint32_t i;
+    backup_entry_t *e;
+
+    if (msg->transfer_type == TRANSFER_TYPE_RX) {
+        if (msg->status == 0) {
+            s_stats.rx_done++;
+        }
+        else {
+            s_stats.rx_failed++;
+            ESP_LOGW(TAG, "Receive of %s failed [ERR = %d]", msg->file_path, msg->status);
+        }
+        return;
+    }
+
+    i = backup_mgr_find(msg->file_path, msg->transfer_type);
+    if (i == BACKUP_MGR_MAX_ENTRIES || s_entries[i].state != BACKUP_ACTIVE) {
+        ESP_LOGW(TAG, "Result for %s which was not sent", msg->file_path);
+        return;
+    }
+    e = &s_entries[i];
+    s_active--;
+
+    if (msg->status == 0) {
+        e->state = BACKUP_DONE;
+        s_stats.done++;
+        ESP_LOGI(TAG, "Sent %s", e->path);
+    }
+    else if (++e->attempts >= BACKUP_MGR_MAX_ATTEMPTS) {
+        e->state = BACKUP_FAILED;
+        s_stats.failed++;
+        ESP_LOGE(TAG, "Gave up on %s after %u attempts [ERR = %d]", e->path, e->attempts, msg->status);
+    }
+    else {
+        e->state = BACKUP_RETRY_WAIT;
+        e->due = xTaskGetTickCount() + backup_mgr_backoff(e->attempts);
+        heap_push(&s_retry, i);
+        s_stats.retries++;
+        ESP_LOGW(TAG, "Sending %s failed [ERR = %d], retry %u in %lu ms", e->path, msg->status, e->attempts,
+                 (unsigned long)pdTICKS_TO_MS(e->due - xTaskGetTickCount()));
+    }
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_schedule
+ * Purpose:     Moves retries that are due (all of them after a new
+ *              connection) to the ready heap and hands ready transfers to
+ *              the restore engine until BACKUP_MGR_IN_FLIGHT are out.
+ *              s_lock must be held.
+ * Parameters:  None
+ * Return:      How long the task may sleep if nothing else happens
+ ***************************************************************************/
+static TickType_t backup_mgr_schedule(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    bool link_up = s_link_up;
+
+    s_link_up = false;
+    while (s_retry.count > 0 && (link_up || (int32_t)(s_entries[s_retry.idx[0]].due - now) <= 0)) {
+        uint32_t i = heap_pop(&s_retry);
+        s_entries[i].state = BACKUP_PENDING;
+        heap_push(&s_ready, i);
+    }
+
+    while (s_active < BACKUP_MGR_IN_FLIGHT && s_ready.count > 0 && transfer_control_connected()) {
+        uint32_t i = s_ready.idx[0];
+        transfer_cmd_t cmd = { .transfer_type = s_entries[i].type };
+
+        memcpy(cmd.file_path, s_entries[i].path, sizeof(cmd.file_path));
+        if (xQueueSend(tx_cmd_queue, &cmd, 0) != pdTRUE) {
+            // Someone else filled it, there is no event for space coming free
+            return pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS);
+        }
+        heap_pop(&s_ready);
+        s_entries[i].state = BACKUP_ACTIVE;
+        s_active++;
+    }
+
+    if (s_retry.count == 0) {
+        return portMAX_DELAY;
+    }
+    int32_t wait = (int32_t)(s_entries[s_retry.idx[0]].due - now);
+    return (wait > 0) ? (TickType_t)wait : 0;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_task
+ * Purpose:     Handles the results on status_queue and schedules after
+ *              each batch of them, a new transfer, a new connection or the
+ *              next retry coming due
+ * Parameters:  param - Unused
+ * Return:      None
+ ***************************************************************************/
+static void backup_mgr_task(void *param)
+{
+    TickType_t wait = portMAX_DELAY;
+    transfer_cmd_t msg;
+
+    while (1) {
+        bool got = (xQueueReceive(status_queue, &msg, wait) == pdTRUE);
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        while (got) {
+            if (msg.transfer_type != TRANSFER_TYPE_WAKE) {
+                backup_mgr_handle_result(&msg);
+            }
+            got = (xQueueReceive(status_queue, &msg, 0) == pdTRUE);
+        }
+        wait = backup_mgr_schedule();
+        xSemaphoreGive(s_lock);
+    }
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_init
+ * Purpose:     Starts the manager. Needs the queues of
+ *              transfer_control_init(), which calls it. Calling it again
+ *              does nothing.
+ * Parameters:  None
+ * Return:      ESP_OK on success (or if already started)
+ *              ESP_ERR_INVALID_STATE if the transfer queues do not exist
+ *              ESP_ERR_NO_MEM if the task could not be created
+ ***************************************************************************/
+esp_err_t backup_mgr_init(void)
+{
+    if (s_initialized) {
+        return ESP_OK;
+    }
+    if (tx_cmd_queue == NULL || status_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // One attempt only, static objects must not be created twice
+    s_initialized = true;
+
+    s_lock = PV_STATIC_MUTEX_CREATE(s_lock_mem);
+    if (s_lock == NULL ||
+        PV_STATIC_TASK_CREATE(s_task_mem, backup_mgr_task, "backup_mgr_task", BACKUP_MGR_TASK_STACK_SIZE, NULL,
+                              BACKUP_MGR_TASK_PRIORITY, NULL, PV_TASK_CORE_PROTOCOL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create backup manager");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_enqueue
+ * Purpose:     Queues a transfer. A transfer already queued or in progress
+ *              is left as it is, a finished one is queued again with a
+ *              fresh attempt count. When the table is full the oldest
+ *              finished entry is forgotten.
+ * Parameters:  path - Phone path of the file, at most sizeof(transfer_cmd_t.file_path) - 1
+ *              transfer_type - TRANSFER_TYPE_TX
+ *              priority - BACKUP_PRIO_*, higher goes first
+ * Return:      ESP_OK if the transfer is queued
+ *              ESP_ERR_INVALID_ARG if the path does not fit or the type is not TX
+ *              ESP_ERR_INVALID_STATE if the manager is not running
+ *              ESP_ERR_NO_MEM if BACKUP_MGR_MAX_ENTRIES transfers are unfinished
+ ***************************************************************************/
+esp_err_t backup_mgr_enqueue(const char *path, uint8_t transfer_type, uint8_t priority)
+{
+    uint32_t i;
+    uint32_t oldest = BACKUP_MGR_MAX_ENTRIES;
+
+    if (path == NULL || transfer_type != TRANSFER_TYPE_TX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // A cut path would open another file or miss the pack
+    if (strlen(path) >= sizeof(s_entries[0].path)) {
+        ESP_LOGE(TAG, "Path too long to queue: %.32s...", path);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    i = backup_mgr_find(path, transfer_type);
+    if (i != BACKUP_MGR_MAX_ENTRIES && s_entries[i].state != BACKUP_DONE && s_entries[i].state != BACKUP_FAILED) {
+        xSemaphoreGive(s_lock);
+        return ESP_OK;
+    }
+    for (uint32_t j = 0; i == BACKUP_MGR_MAX_ENTRIES && j < BACKUP_MGR_MAX_ENTRIES; j++) {
+        if (s_entries[j].state == BACKUP_NONE) {
+            i = j;
+        }
+        else if ((s_entries[j].state == BACKUP_DONE || s_entries[j].state == BACKUP_FAILED) &&
+                 (oldest == BACKUP_MGR_MAX_ENTRIES || (int32_t)(s_entries[j].seq - s_entries[oldest].seq) < 0)) {
+            oldest = j;
+        }
+    }
+    if (i == BACKUP_MGR_MAX_ENTRIES) {
+        i = oldest;
+    }
+    if (i == BACKUP_MGR_MAX_ENTRIES) {
+        xSemaphoreGive(s_lock);
+        ESP_LOGE(TAG, "No room to queue %s", path);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&s_entries[i], 0, sizeof(s_entries[i]));
+    strcpy(s_entries[i].path, path);
+    s_entries[i].type = transfer_type;
+    s_entries[i].priority = priority;
+    s_entries[i].seq = s_seq++;
+    s_entries[i].state = BACKUP_PENDING;
+    heap_push(&s_ready, i);
+    xSemaphoreGive(s_lock);
+
+    backup_mgr_wake();
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_get_state
+ * Purpose:     Returns where a transfer stands
+ * Parameters:  path, transfer_type - The transfer
+ * Return:      Its state, BACKUP_NONE if it is not (or no longer) known
+ ***************************************************************************/
+backup_state_t backup_mgr_get_state(const char *path, uint8_t transfer_type)
+{
+    backup_state_t state = BACKUP_NONE;
+    uint32_t i;
+
+    if (s_lock == NULL || path == NULL) {
+        return BACKUP_NONE;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    i = backup_mgr_find(path, transfer_type);
+    if (i != BACKUP_MGR_MAX_ENTRIES) {
+        state = s_entries[i].state;
+    }
+    xSemaphoreGive(s_lock);
+    return state;
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_link_up
+ * Purpose:     Tells the manager a phone connected, waiting retries are
+ *              made ready and dispatching resumes. Called by
+ *              transfer_control_open().
+ * Parameters:  None
+ * Return:      None
+ ***************************************************************************/
+void backup_mgr_link_up(void)
+{
+    if (!s_initialized) {
+        return;
+    }
+    s_link_up = true;
+    backup_mgr_wake();
+}
+
+/***************************************************************************
+ * Function:    backup_mgr_get_stats
+ * Purpose:     Returns a consistent copy of the counters
+ * Parameters:  stats - Returns the counters
+ * Return:      None
+ ***************************************************************************/
+void backup_mgr_get_stats(backup_mgr_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (s_lock == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    for (uint32_t i = 0; i < BACKUP_MGR_MAX_ENTRIES; i++) {
+        stats->pending += (s_entries[i].state == BACKUP_PENDING);
+        stats->retry_wait += (s_entries[i].state == BACKUP_RETRY_WAIT);
+    }
+    stats->active = s_active;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+#include "esp_log.h"
+#include "cJSON.h"
+
+#include "pv_static.h"
+#include "pv_dma.h"
+#include "pv_aio.h"
+#include "restore_engine.h"
+
+
+#define TAG "PV_RESTORE"
+
+#define RESTORE_RATE_SAMPLE_MS      200U                // Shortest interval the link rate is measured over
+#define RESTORE_FLUSH_POLL_MS       20U                 // Check interval while the last bytes of a file go out
+#define RESTORE_PUSH_MAX            (TX_RINGBUF_SIZE / 2U)  // A byte buffer item must fit the ring as a whole
+
+// One of the two read buffers
+typedef struct {
+    pv_aio_req_t req;
+    uint8_t *buf;                                       // RESTORE_READ_MAX of DMA memory
+    bool busy;                                          // Read submitted and not waited for yet
+    StaticSemaphore_t done_buf;
+} restore_slot_t;
+
+/* STATIC VARIABLES */
+static bool s_initialized = false;
+static restore_slot_t s_slots[2];
+static pv_aio_req_t s_file_req;                         // Open and close
+static uint32_t s_rate = 0;                             // Bytes per second the transmitter got confirmed, smoothed
+static uint64_t s_rate_bytes = 0;
+static TickType_t s_rate_tick = 0;
+PV_STATIC_TASK_DEFINE(s_task_mem, RESTORE_TASK_STACK_SIZE);
+
+
+/***************************************************************************
+ * Function:    restore_link_ok
+ * Purpose:     Tells whether the phone a file is being sent to is still
+ *              there, a new connection on the same slot does not count
+ * Parameters:  ctx - Connection, bt_handle - Its handle when the file started
+ * Return:      true if it is still connected
+ ***************************************************************************/
+static bool restore_link_ok(transfer_ctx_t *ctx, uint32_t bt_handle)
+{
+    return ctx->connected && ctx->bt_handle == bt_handle;
+}
+
+/***************************************************************************
+ * Function:    restore_update_rate
+ * Purpose:     Folds the bytes the transmitter got confirmed since the last
+ *              sample into the link rate
+ * Parameters:  ctx - Connection
+ * Return:      None
+ ***************************************************************************/
+static void restore_update_rate(transfer_ctx_t *ctx)
+{
+    TickType_t now = xTaskGetTickCount();
+    uint32_t ms = pdTICKS_TO_MS(now - s_rate_tick);
+    uint64_t bytes = ctx->tx_stats.bytes;
+
+    if (s_rate_tick != 0 && ms < RESTORE_RATE_SAMPLE_MS) {
+        return;
+    }
+    // The counters start over with every connection
+    if (s_rate_tick != 0 && bytes >= s_rate_bytes && ms > 0) {
+        uint32_t sample = (uint32_t)((bytes - s_rate_bytes) * 1000U / ms);
+        s_rate = (s_rate == 0) ? sample : (3U * s_rate + sample) / 4U;
+    }
+    s_rate_tick = now;
+    s_rate_bytes = bytes;
+}
+
+/***************************************************************************
+ * Function:    restore_read_size
+ * Purpose:     Size of the next read, RESTORE_READAHEAD_MS of the link rate
+ * Parameters:  None
+ * Return:      Bytes, a multiple of PV_DMA_BLOCK_SIZE between
+ *              RESTORE_READ_MIN and RESTORE_READ_MAX
+ ***************************************************************************/
+static size_t restore_read_size(void)
+{
+    uint64_t len = (uint64_t)s_rate * RESTORE_READAHEAD_MS / 1000U;
+
+    if (len < RESTORE_READ_MIN) {
+        return RESTORE_READ_MIN;
+    }
+    if (len > RESTORE_READ_MAX) {
+        return RESTORE_READ_MAX;
+    }
+    return (size_t)(len - len % PV_DMA_BLOCK_SIZE);
+}
+
+/***************************************************************************
+ * Function:    restore_read
+ * Purpose:     Starts the next read of a file into a slot
+ * Parameters:  slot - Free slot
+ *              handle - File, read from its current position
+ *              remaining - Bytes of the file not requested yet
+ * Return:      Bytes requested, 0 if the read could not be queued
+ ***************************************************************************/
+static size_t restore_read(restore_slot_t *slot, pv_aio_handle_t handle, uint64_t remaining)
+{
+    size_t len = restore_read_size();
+
+    if (remaining < len) {
+        len = (size_t)remaining;
+    }
+    slot->req.op = PV_AIO_OP_READ;
+    slot->req.prio = PV_AIO_PRIO_NORMAL;
+    slot->req.handle = handle;
+    slot->req.offset = PV_AIO_OFFSET_CURRENT;
+    slot->req.buf = slot->buf;
+    slot->req.len = len;
+    slot->req.cb = NULL;
+    slot->busy = (pv_aio_submit(&slot->req) == ESP_OK);
+    return slot->busy ? len : 0;
+}
+
+/***************************************************************************
+ * Function:    restore_read_wait
+ * Purpose:     Waits for the read of a slot
+ * Parameters:  slot - Slot
+ * Return:      true if it read all it was asked for
+ ***************************************************************************/
+static bool restore_read_wait(restore_slot_t *slot)
+{
+    if (!slot->busy) {
+        return false;
+    }
+    xSemaphoreTake(slot->req.done, portMAX_DELAY);
+    slot->busy = false;
+    return slot->req.err == ESP_OK && slot->req.result == slot->req.len;
+}
+
+/***************************************************************************
+ * Function:    restore_push
+ * Purpose:     Copies bytes to the TX ring buffer, waiting while it is full
+ *              (the transmitter holds it while the link is congested)
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ *              data, len - Bytes to send
+ * Return:      false if the phone disconnected
+ ***************************************************************************/
+static bool restore_push(transfer_ctx_t *ctx, uint32_t bt_handle, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        size_t n = (len < RESTORE_PUSH_MAX) ? len : RESTORE_PUSH_MAX;
+
+        // Wait in steps so a disconnect is noticed
+        while (xRingbufferSend(ctx->tx_ringbuf, p, n, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS)) != pdTRUE) {
+            if (!restore_link_ok(ctx, bt_handle)) {
+                return false;
+            }
+        }
+        p += n;
+        len -= n;
+    }
+    return restore_link_ok(ctx, bt_handle);
+}
+
+/***************************************************************************
+ * Function:    restore_lock
+ * Purpose:     Takes tx_lock for one frame, after any reply waiting for it
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ * Return:      false if the phone disconnected
+ ***************************************************************************/
+static bool restore_lock(transfer_ctx_t *ctx, uint32_t bt_handle)
+{
+    while (restore_link_ok(ctx, bt_handle)) {
+        if (transfer_control_tx_lock_bulk(ctx, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS))) {
+            return true;
+        }
+        vTaskDelay(1); // Let the waiting reply have it
+    }
+    return false;
+}
+
+/***************************************************************************
+ * Function:    restore_take_ring
+ * Purpose:     Waits until the arbiter is idle and takes tx_lock for the
+ *              header of a file
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ * Return:      false if the phone disconnected
+ ***************************************************************************/
+static bool restore_take_ring(transfer_ctx_t *ctx, uint32_t bt_handle)
+{
+    while (restore_link_ok(ctx, bt_handle)) {
+        if (ctx->cur_state == WAIT && transfer_control_tx_lock_bulk(ctx, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS))) {
+            // The arbiter may have left WAIT while the lock was taken
+            if (ctx->cur_state == WAIT) {
+                return true;
+            }
+            transfer_control_tx_unlock(ctx);
+        }
+        vTaskDelay(pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+    }
+    return false;
+}
+
+/***************************************************************************
+ * Function:    restore_send_frames
+ * Purpose:     Sends file data as TX_DATA_CMD frames of at most
+ *              RESTORE_FRAME_MAX bytes. tx_lock is only held for one frame,
+ *              so replies go out between them.
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ *              data, len - File data
+ * Return:      false if the phone disconnected
+ ***************************************************************************/
+static bool restore_send_frames(transfer_ctx_t *ctx, uint32_t bt_handle, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    char hdr[sizeof(TX_DATA_CMD) + 12];
+
+    while (len > 0) {
+        size_t n = (len < RESTORE_FRAME_MAX) ? len : RESTORE_FRAME_MAX;
+        int hdr_len = snprintf(hdr, sizeof(hdr), TX_DATA_CMD "%u\n", (unsigned)n);
+        bool ok = false;
+
+        if (!restore_lock(ctx, bt_handle)) {
+            return false;
+        }
+        ok = restore_push(ctx, bt_handle, hdr, (size_t)hdr_len) && restore_push(ctx, bt_handle, p, n);
+        transfer_control_tx_unlock(ctx);
+        if (!ok) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    restore_send_msg
+ * Purpose:     Sends one message of a restored file (TX_END_CMD, TX_FAIL_CMD)
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ *              msg - The message
+ * Return:      false if the phone disconnected
+ ***************************************************************************/
+static bool restore_send_msg(transfer_ctx_t *ctx, uint32_t bt_handle, const char *msg)
+{
+    bool ok = false;
+
+    if (!restore_lock(ctx, bt_handle)) {
+        return false;
+    }
+    ok = restore_push(ctx, bt_handle, msg, strlen(msg));
+    transfer_control_tx_unlock(ctx);
+    return ok;
+}
+
+/***************************************************************************
+ * Function:    restore_flush
+ * Purpose:     Waits until the transmitter got every byte on the ring
+ *              confirmed, the ring space is only returned then
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ *              dropped - tx_stats.dropped when the file started
+ * Return:      true if the phone got the whole file, false if it left or
+ *              the transmitter gave bytes up
+ ***************************************************************************/
+static bool restore_flush(transfer_ctx_t *ctx, uint32_t bt_handle, uint32_t dropped)
+{
+    while (restore_link_ok(ctx, bt_handle) && xRingbufferGetCurFreeSize(ctx->tx_ringbuf) < TX_RINGBUF_SIZE) {
+        vTaskDelay(pdMS_TO_TICKS(RESTORE_FLUSH_POLL_MS));
+    }
+    return restore_link_ok(ctx, bt_handle) && ctx->tx_stats.dropped == dropped;
+}
+
+/***************************************************************************
+ * Function:    restore_send_header
+ * Purpose:     Sends TX_START_CMD and the JSON line describing a file
+ * Parameters:  ctx, bt_handle - Connection and its handle
+ *              path, size - The file
+ * Return:      false if the line could not be built or the phone left
+ ***************************************************************************/
+static bool restore_send_header(transfer_ctx_t *ctx, uint32_t bt_handle, const char *path, uint64_t size)
+{
+    cJSON *json = cJSON_CreateObject();
+    char *line = NULL;
+    bool ok = false;
+
+    if (json == NULL || cJSON_AddStringToObject(json, "path", path) == NULL ||
+        cJSON_AddNumberToObject(json, "size", (double)size) == NULL) {
+        cJSON_Delete(json);
+        return false;
+    }
+    line = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (line == NULL) {
+        return false;
+    }
+
+    ok = restore_push(ctx, bt_handle, TX_START_CMD, strlen(TX_START_CMD)) &&
+         restore_push(ctx, bt_handle, line, strlen(line)) &&
+         restore_push(ctx, bt_handle, "\n", 1);
+    cJSON_free(line);
+    return ok;
+}
+
+/***************************************************************************
+ * Function:    restore_packed
+ * Purpose:     Sends a file the receiver stored in the pack store. Pack
+ *              objects are small, it is read whole (its CRC checked) before
+ *              the header goes out.
+ * Parameters:  ctx - Connection
+ *              cmd - The file
+ *              size - Its size from the pack index
+ * Return:      0 on success, PV_ERR_SEND_FAIL else
+ ***************************************************************************/
+static uint8_t restore_packed(transfer_ctx_t *ctx, const transfer_cmd_t *cmd, uint32_t size)
+{
+    uint32_t bt_handle = ctx->bt_handle;
+    uint8_t *buf = malloc((size > 0) ? size : 1U);
+    uint32_t len = 0;
+    esp_err_t err;
+    bool link_ok = false;
+
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "No memory to restore %s from the pack", cmd->file_path);
+        return PV_ERR_SEND_FAIL;
+    }
+    err = pv_pack_get(cmd->file_path, buf, size, &len);
+    if (err != ESP_OK || len != size) {
+        ESP_LOGE(TAG, "Failed to read %s from the pack (0x%x)", cmd->file_path, err);
+        free(buf);
+        return PV_ERR_SEND_FAIL;
+    }
+    ESP_LOGI(TAG, "Restoring %s from the pack, %"PRIu32" bytes", cmd->file_path, len);
+
+    if (restore_take_ring(ctx, bt_handle)) {
+        uint32_t dropped = ctx->tx_stats.dropped;
+
+        link_ok = restore_send_header(ctx, bt_handle, cmd->file_path, len);
+        transfer_control_tx_unlock(ctx);
+        link_ok = link_ok &&
+                  restore_send_frames(ctx, bt_handle, buf, len) &&
+                  restore_send_msg(ctx, bt_handle, TX_END_CMD) &&
+                  restore_flush(ctx, bt_handle, dropped);
+    }
+    if (!link_ok) {
+        ESP_LOGW(TAG, "Disconnected while restoring %s", cmd->file_path);
+    }
+    free(buf);
+    return link_ok ? 0 : PV_ERR_SEND_FAIL;
+}
+
+/***************************************************************************
+ * Function:    restore_file
+ * Purpose:     Sends one file to the phone, see restore_engine.h. While a
+ *              buffer is copied to the ring the next read runs into the
+ *              other one, unless the link is congested.
+ * Parameters:  ctx - Connection
+ *              cmd - The file
+ * Return:      0 on success, PV_ERR_SEND_FAIL else
+ ***************************************************************************/
+static uint8_t restore_file(transfer_ctx_t *ctx, const transfer_cmd_t *cmd)
+{
+    uint32_t bt_handle = ctx->bt_handle;
+    pv_aio_handle_t handle;
+    uint64_t size;
+    uint64_t requested = 0;
+    uint64_t pushed = 0;
+    uint32_t packed_size = 0;
+    uint32_t dropped = 0;
+    bool card_ok = true;
+    bool link_ok = true;
+    int cur = 0;
+
+    // Transfers are named by their phone path, the layout knows where it is on the card
+    s_file_req.op = PV_AIO_OP_OPEN_READ;
+    s_file_req.prio = PV_AIO_PRIO_NORMAL;
+    if (pv_layout_resolve_path(cmd->file_path, strlen(cmd->file_path), s_file_req.path, sizeof(s_file_req.path)) != ESP_OK ||
+        pv_aio_submit_wait(&s_file_req) != ESP_OK) {
+        // Small files were packed on the way in and have no file of their own
+        if (pv_pack_contains(cmd->file_path, &packed_size)) {
+            return restore_packed(ctx, cmd, packed_size);
+        }
+        ESP_LOGE(TAG, "Failed to open %s", cmd->file_path);
+        return PV_ERR_SEND_FAIL;
+    }
+    handle = s_file_req.handle;
+    size = s_file_req.size_hint;
+    ESP_LOGI(TAG, "Restoring %s, %"PRIu64" bytes", cmd->file_path, size);
+
+    link_ok = restore_take_ring(ctx, bt_handle);
+    if (!link_ok) {
+        ESP_LOGW(TAG, "Disconnected before restoring %s", cmd->file_path);
+        s_file_req.op = PV_AIO_OP_CLOSE;
+        s_file_req.handle = handle;
+        pv_aio_submit_wait(&s_file_req);
+        return PV_ERR_SEND_FAIL;
+    }
+    dropped = ctx->tx_stats.dropped;
+    link_ok = restore_send_header(ctx, bt_handle, cmd->file_path, size);
+    transfer_control_tx_unlock(ctx);
+    if (link_ok && size > 0) {
+        requested = restore_read(&s_slots[cur], handle, size);
+        card_ok = (requested > 0);
+    }
+
+    while (link_ok && card_ok && pushed < size) {
+        restore_slot_t *slot = &s_slots[cur];
+        restore_slot_t *next = &s_slots[cur ^ 1];
+        bool ahead = false;
+
+        if (!restore_read_wait(slot)) {
+            ESP_LOGE(TAG, "Failed to read %s at %"PRIu64" (0x%x)", cmd->file_path, pushed, slot->req.err);
+            card_ok = false;
+            break;
+        }
+        // A congested link can't take more, don't keep the card busy for it
+        if (requested < size && !ctx->tx_congested) {
+            requested += restore_read(next, handle, size - requested);
+            ahead = true;
+        }
+        link_ok = restore_send_frames(ctx, bt_handle, slot->buf, slot->req.result);
+        if (!link_ok) {
+            break;
+        }
+        pushed += slot->req.result;
+        if (!ahead && requested < size) {
+            requested += restore_read(next, handle, size - requested);
+        }
+        if (pushed < size && !next->busy) {
+            card_ok = false;
+        }
+        restore_update_rate(ctx);
+        cur ^= 1;
+    }
+
+    // A read still running must not outlive its buffer's turn
+    for (int i = 0; i < 2; i++) {
+        if (s_slots[i].busy) {
+            restore_read_wait(&s_slots[i]);
+        }
+    }
+
+    // Frames are self-delimiting, the phone drops what it got of the file on TX_FAIL_CMD
+    if (link_ok) {
+        link_ok = restore_send_msg(ctx, bt_handle, card_ok ? TX_END_CMD : TX_FAIL_CMD);
+    }
+    // The file only counts as restored once the phone has all of it
+    if (link_ok) {
+        link_ok = restore_flush(ctx, bt_handle, dropped);
+    }
+    if (!link_ok) {
+        ESP_LOGW(TAG, "Disconnected while restoring %s", cmd->file_path);
+    }
+
+    s_file_req.op = PV_AIO_OP_CLOSE;
+    s_file_req.handle = handle;
+    pv_aio_submit_wait(&s_file_req);
+
+    return (link_ok && card_ok) ? 0 : PV_ERR_SEND_FAIL;
+}
+
+/***************************************************************************
+ * Function:    restore_task
+ * Purpose:     Restores the files queued on tx_cmd_queue in order
+ * Parameters:  param - Unused
+ * Send to queue:     PV_ERR_SEND_FAIL or 0 on success
+ ***************************************************************************/
+static void restore_task(void *param)
+{
+    transfer_cmd_t cmd;
+
+    while (1) {
+        if (xQueueReceive(tx_cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        transfer_ctx_t *ctx = transfer_control_active();
+
+        cmd.status = (ctx != NULL) ? restore_file(ctx, &cmd) : PV_ERR_SEND_FAIL;
+        xQueueSend(status_queue, &cmd, portMAX_DELAY);
+    }
+}
+
+/***************************************************************************
+ * Function:    restore_engine_init
+ * Purpose:     Allocates the read buffers and starts the engine. Needs the
+ *              queues of transfer_control_init(), which calls it. Calling
+ *              it again does nothing.
+ * Parameters:  None
+ * Return:      ESP_OK on success (or if already started)
+ *              ESP_ERR_INVALID_STATE if the transfer queues do not exist
+ *              ESP_ERR_NO_MEM if the buffers or the task could not be created
+ ***************************************************************************/
+esp_err_t restore_engine_init(void)
+{
+    if (s_initialized) {
+        return ESP_OK;
+    }
+    if (tx_cmd_queue == NULL || status_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // One attempt only, static objects must not be created twice
+    s_initialized = true;
+
+    for (int i = 0; i < 2; i++) {
+        s_slots[i].buf = pv_dma_alloc(RESTORE_READ_MAX);
+        if (s_slots[i].buf == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate read buffers");
+            return ESP_ERR_NO_MEM;
+        }
+        // Given by pv_aio on every completed read of the slot
+        s_slots[i].req.done = xSemaphoreCreateBinaryStatic(&s_slots[i].done_buf);
+    }
+    if (PV_STATIC_TASK_CREATE(s_task_mem, restore_task, "restore_task", RESTORE_TASK_STACK_SIZE, NULL,
+                              RESTORE_TASK_PRIORITY, NULL, PV_TASK_CORE_STORAGE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create restore task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -3,6 +3,7 @@
 #include <freertos/queue.h>
 #include <freertos/ringbuf.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include "transfer_control.h"
 #include <stdint.h>
@@ -20,50 +21,86 @@
 #include "esp_gap_bt_api.h"
 #include "esp_bt_device.h"
 #include "esp_spp_api.h"
+#include "esp_system.h"
+#include "pv_static.h"
+#include "pv_dma.h"
+#include "esp_heap_caps.h"
+#include "backup_mgr.h"
+#include "restore_engine.h"
 
 
 #include <sys/types.h>
 #include <sys/errno.h>
-
 #define TAG "PV_TRANSFER_CTRL"
-char *path_buffer;
-char *rx_path_buffer;
-struct stat sb;
 // 1. Successful transfer to bluetooth by transmitter
 // 2. Failure on bluetooth, e.g., disconnected
 // 3. Receiver will read from ring buffer that failure occured
 // 4. Receiver notifies backup manager of failure
 // 5. Backup manager now knows of failure
 // 6. Backup manager tries to re-transmit failed file later by talking to tx_cmd_queue
-RingbufHandle_t rx_ringbuf; // will be written to by the Bluetooth interface
-RingbufHandle_t tx_ringbuf; // will be consumed by the Bluetooth interface
-QueueHandle_t tx_cmd_queue; // transmission thread consumes from here, written by backup manager
-QueueHandle_t status_queue; // for the backup manager
+QueueHandle_t tx_cmd_queue; // restore engine consumes from here, written by backup manager
+QueueHandle_t status_queue; // for the backup manager, see backup_mgr.h
 volatile int success_flag = 0; // used to indicate success or failure of happypath test
 #define MAX_LEN 1024
 
-uint32_t int_bt_handle;
+// Created once by transfer_control_init() and reused by every connection, see pv_static.h
+static bool s_initialized = false;
+static transfer_ctx_t s_ctx[TRANSFER_MAX_SESSIONS];
+PV_STATIC_RINGBUF_DEFINE_N(s_tx_ringbuf_mem, TX_RINGBUF_SIZE, TRANSFER_MAX_SESSIONS);
+PV_STATIC_SEMAPHORE_DEFINE_N(s_tx_lock_mem, TRANSFER_MAX_SESSIONS);
+PV_STATIC_SEMAPHORE_DEFINE_N(s_rx_wr_done_mem, TRANSFER_MAX_SESSIONS);
+static portMUX_TYPE s_tx_waiters_lock = portMUX_INITIALIZER_UNLOCKED;
+PV_STATIC_QUEUE_DEFINE_N(s_file_queue_mem, TRANSFER_FILES_IN_FLIGHT, sizeof(transfer_file_t), TRANSFER_MAX_SESSIONS);
+PV_STATIC_TASK_DEFINE_N(s_receiver_mem, TRANSFER_TASK_STACK_SIZE, TRANSFER_MAX_SESSIONS);
+PV_STATIC_TASK_DEFINE_N(s_transmitter_mem, TRANSFER_TASK_STACK_SIZE, TRANSFER_MAX_SESSIONS);
+PV_STATIC_QUEUE_DEFINE(s_tx_cmd_queue_mem, TRANSFER_CMD_QUEUE_LEN, sizeof(transfer_cmd_t));
+PV_STATIC_QUEUE_DEFINE(s_status_queue_mem, TRANSFER_CMD_QUEUE_LEN, sizeof(transfer_cmd_t));
+
+// Backup folder deletes run one at a time on their own task
+typedef struct {
+    transfer_ctx_t *ctx;
+    char dir_path[sizeof(SD_CARD_MOUNT_POINT) + DEVICE_DIRECTORY_NAME_MAX_LENGTH];
+} delete_backup_req_t;
 
+static QueueHandle_t s_delete_queue = NULL;
+PV_STATIC_QUEUE_DEFINE(s_delete_queue_mem, TRANSFER_DELETE_QUEUE_LEN, sizeof(delete_backup_req_t));
+PV_STATIC_TASK_DEFINE(s_delete_mem, TRANSFER_DELETE_TASK_STACK_SIZE);
 
 /***************************************************************************
  * Function:    process_file_path
  * Purpose:     Take File Path from Metadata Json Then:
- *              1. Store Path of img to write during Reciever Task
- *              2. Create Directories if they do not exist yet
- * Parameters:  None
+ *              1. Store Path of img to write during Reciever Task, as mapped
+ *                 by the storage layout (phone folders or hash shards)
+ *              2. Queue creation of its directories on the storage I/O task
+ *                 (runs before the receiver opens the file, so the BT
+ *                 callback never waits on the card), unless the directory
+ *                 cache already knows the folder exists
+ * Parameters:  ctx - Connection, the path is stored in ctx->meta
+ *              metadata, len - Path as sent by the phone
+ * Return:      false if the path can't be stored or its directory queued
  ***************************************************************************/
 
-void process_file_path(char * metadata, uint16_t len)
+bool process_file_path(transfer_ctx_t *ctx, char * metadata, uint16_t len)
 {
-    const char* prefix = SD_CARD_MOUNT_POINT;
-    size_t prefix_len = strlen(SD_CARD_MOUNT_POINT);
-    memcpy(path_buffer, prefix, prefix_len);
-    memcpy(path_buffer + prefix_len, metadata, len);
-    memcpy(path_buffer + prefix_len + len, "\0", 1);
+    char *path_buffer = ctx->meta.path;
 
+    // The storage layout decides where the phone path lives on the card
+    if (pv_layout_get_path(metadata, len, path_buffer, MAX_PATH_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "No storage path for %.*s", len, metadata);
+        return false;
+    }
+    // A hashed 8.3 name may already belong to another photo, the receiver falls back to this one
+    ctx->meta.alt_path[0] = '\0';
+    if (pv_layout_uses_short_names() &&
+        pv_layout_get_long_path(metadata, len, ctx->meta.alt_path, MAX_PATH_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "No storage path for %.*s", len, metadata);
+        return false;
+    }
+    size_t prefix_len = strlen(SD_CARD_MOUNT_POINT);
+    size_t path_len = strlen(path_buffer);
 
     int end_of_dir = 0;
-    for(int i = prefix_len + len; i>0; i--)
+    for(int i = path_len; i>0; i--)
     {
         if(path_buffer[i] == '/'){
             end_of_dir = i;
@@ -72,37 +109,49 @@ void process_file_path(char * metadata, uint16_t len)
     }
 
 
-    char dir_buffer[end_of_dir + 1];
-    //skip first SDCARD '/'
-    for(int j = prefix_len + 1; j<end_of_dir+1; j++)
+    if(end_of_dir > (int)prefix_len)
     {
-        if(path_buffer[j] == '/'){
-            memcpy(dir_buffer, path_buffer, j);
-            memcpy(dir_buffer + j, "\0", 1);
-            ESP_LOGI(TAG, "Will create Dir %s", dir_buffer);
-    
-            if(stat(dir_buffer, &sb) != 0)
-            {
-                if (mkdir(dir_buffer, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
-                    ESP_LOGE(TAG, "Failed to create a new directory: %s", strerror(errno));
-                    return;
-                }
-            }
+        char dir_buffer[end_of_dir + 1];
+        memcpy(dir_buffer, path_buffer, end_of_dir);
+        memcpy(dir_buffer + end_of_dir, "\0", 1);
+        // Folders already used this session need no work at all
+        if (pv_dircache_contains(dir_buffer)) {
+            ESP_LOGI(TAG, "Will open file %s", path_buffer);
+            return true;
+        }
+        ESP_LOGI(TAG, "Will create Dir %s", dir_buffer);
+
+        if (pv_aio_mkdir_async(dir_buffer) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to queue directory creation for %s", dir_buffer);
+            return false;
         }
     }
 
-    // snprintf(path_buffer, sizeof(path_buffer), "%s/%s", MOUNT_POINT, metadata)
     ESP_LOGI(TAG, "Will open file %s", path_buffer);
+    return true;
 }
 
 /***************************************************************************
  * Function:    process_photo_metadata
  * Purpose:     Process Json sent from User Stores the file size and sendds file path
- *              to process_file_path
- * Parameters:  None
+ *              to process_file_path. The file is described in ctx->meta until
+ *              transfer_control_queue_file() hands it to the receiver.
+ * Parameters:  ctx - Connection the metadata came from
+ *              json_str - Metadata, size_of_image - Set to the announced size
+ * Return:      false if the metadata is invalid or the file does not fit on the card
  ***************************************************************************/
-bool process_photo_metadata(const char *json_str, size_t * size_of_image)
+bool process_photo_metadata(transfer_ctx_t *ctx, const char *json_str, uint64_t * size_of_image)
 {
+    char *rx_path_buffer = ctx->rx_path_buffer;
+
+    ctx->meta_valid = false;
+
+    // The receiver still holds the file of the last connection
+    if (ctx->reset_pending) {
+        ESP_LOGE(TAG, "❌ Previous session not reset yet");
+        return false;
+    }
+
     cJSON *json = cJSON_Parse(json_str);
     if (!json) {
         ESP_LOGE(TAG, "❌ Invalid JSON metadata");
@@ -120,7 +169,13 @@ bool process_photo_metadata(const char *json_str, size_t * size_of_image)
         cJSON_Delete(json);
         return false;
     }
-    
+
+    // Admission control: the free space query is cached so this costs nothing
+    if (!pv_fs_has_room((uint64_t)cJSON_GetNumberValue(size))) {
+        ESP_LOGE(TAG, "❌ Not enough free space for %s", cJSON_GetStringValue(filepath));
+        cJSON_Delete(json);
+        return false;
+    }
 
     int len_path = 0;
 
@@ -134,9 +189,22 @@ bool process_photo_metadata(const char *json_str, size_t * size_of_image)
     ESP_LOGI(TAG, "📸 Receiving path: %s with len %d", 
             rx_path_buffer, len_path);
 
-    process_file_path(rx_path_buffer, len_path);
+    // Small files are appended to the pack under their phone path, no file or folder is made
+    ctx->meta.packed = (len_path < MAX_PATH_SIZE) && pv_pack_accepts((uint64_t)cJSON_GetNumberValue(size));
+    if (ctx->meta.packed) {
+        memcpy(ctx->meta.path, rx_path_buffer, len_path + 1);
+        ctx->meta.alt_path[0] = '\0';
+        ESP_LOGI(TAG, "Will pack file %s", ctx->meta.path);
+    }
+    else if (len_path >= MAX_PATH_SIZE || !process_file_path(ctx, rx_path_buffer, len_path)) {
+        cJSON_Delete(json);
+        return false;
+    }
 
-    *size_of_image = (uint32_t)cJSON_GetNumberValue(size);
+    // Sizes over 4GB are valid on exFAT so don't truncate to 32 bits
+    *size_of_image = (uint64_t)cJSON_GetNumberValue(size);
+    ctx->meta.size = *size_of_image;
+    ctx->meta_valid = true;
     
     ESP_LOGI(TAG, "📸 Receiving photo: %s (%.1f KB)", 
              cJSON_GetStringValue(filepath), *size_of_image / 1024.0);
@@ -147,175 +215,1059 @@ bool process_photo_metadata(const char *json_str, size_t * size_of_image)
 }
 
 /***************************************************************************
- * Function:    receiver_task
- * Purpose:     Write recieved data to a file on SD card specified by "path_buffer" 
- *              should only be entered after metadata is sent
- * Parameters:  None
- * Send to queue:     PV_ERR_SEND_FAIL or 0 on success
+ * Function:    transfer_control_tx_lock
+ * Purpose:     Take tx_lock of a connection to write a message made of
+ *              several pieces to tx_ringbuf, see transfer_ctx_t
+ * Parameters:  ctx - Connection, wait - Longest wait for the lock
+ * Return:      false if the lock was not free in time
+ ***************************************************************************/
+bool transfer_control_tx_lock(transfer_ctx_t *ctx, TickType_t wait)
+{
+    bool taken = false;
+
+    portENTER_CRITICAL(&s_tx_waiters_lock);
+    ctx->tx_lock_waiters++;
+    portEXIT_CRITICAL(&s_tx_waiters_lock);
+
+    taken = (xSemaphoreTake(ctx->tx_lock, wait) == pdTRUE);
+
+    portENTER_CRITICAL(&s_tx_waiters_lock);
+    ctx->tx_lock_waiters--;
+    portEXIT_CRITICAL(&s_tx_waiters_lock);
+    return taken;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_tx_lock_bulk
+ * Purpose:     Take tx_lock for a frame of bulk data (a restored file). A
+ *              reply waiting for the lock goes first, so the lock is not
+ *              taken while one does.
+ * Parameters:  ctx - Connection, wait - Longest wait for the lock
+ * Return:      false if a reply is waiting or the lock was not free in time
  ***************************************************************************/
-void receiver_task()
+bool transfer_control_tx_lock_bulk(transfer_ctx_t *ctx, TickType_t wait)
+{
+    if (ctx->tx_lock_waiters > 0 || xSemaphoreTake(ctx->tx_lock, wait) != pdTRUE) {
+        return false;
+    }
+    // A reply may have started waiting meanwhile
+    if (ctx->tx_lock_waiters > 0) {
+        xSemaphoreGive(ctx->tx_lock);
+        return false;
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_tx_unlock
+ * Purpose:     Give back tx_lock taken with transfer_control_tx_lock()
+ * Parameters:  ctx - Connection
+ * Return:      None
+ ***************************************************************************/
+void transfer_control_tx_unlock(transfer_ctx_t *ctx)
+{
+    xSemaphoreGive(ctx->tx_lock);
+}
+
+/***************************************************************************
+ * Function:    transfer_control_send
+ * Purpose:     Write one message to tx_ringbuf under tx_lock, so it can't
+ *              land inside a restored file frame or another reply
+ * Parameters:  ctx - Connection, data, len - Message
+ *              wait - Longest wait for the lock and again for ring space
+ * Return:      false if it was not sent
+ ***************************************************************************/
+bool transfer_control_send(transfer_ctx_t *ctx, const void *data, size_t len, TickType_t wait)
+{
+    BaseType_t sent = pdFALSE;
+
+    if (!transfer_control_tx_lock(ctx, wait)) {
+        ESP_LOGW(TAG, "TX ring busy, reply of %u bytes not sent", (unsigned)len);
+        return false;
+    }
+    sent = xRingbufferSend(ctx->tx_ringbuf, data, len, wait);
+    transfer_control_tx_unlock(ctx);
+    return sent == pdTRUE;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_queue_file
+ * Purpose:     Hand the file described by the last metadata to the receiver.
+ *              Its data must follow on rx_ring after the data of the files
+ *              queued before it. Blocks while TRANSFER_FILES_IN_FLIGHT files
+ *              are waiting.
+ * Parameters:  ctx - Connection
+ * Return:      false if there was no valid metadata
+ ***************************************************************************/
+bool transfer_control_queue_file(transfer_ctx_t *ctx)
+{
+    if (!ctx->meta_valid) {
+        ESP_LOGE(TAG, "No metadata for the next file");
+        return false;
+    }
+    ctx->meta_valid = false;
+    return xQueueSend(ctx->file_queue, &ctx->meta, portMAX_DELAY) == pdTRUE;
+}
+
+/***************************************************************************
+ * Function:    receiver_write_done
+ * Purpose:     Completion callback of a data write, runs on the I/O task
+ * Parameters:  req - The finished write
+ *              arg - Connection (transfer_ctx_t)
+ * Return:     None
+ ***************************************************************************/
+static void receiver_write_done(pv_aio_req_t *req, void *arg)
+{
+    xSemaphoreGive(((transfer_ctx_t *)arg)->rx_wr_done);
+}
+
+/***************************************************************************
+ * Function:    receiver_retire_write
+ * Purpose:     Waits for the oldest data write in flight, records its result
+ *              and frees its part of rx_ring if it was written in place
+ * Parameters:  ctx - Connection
+ *              wait - Longest time to wait for it
+ * Return:      false if it is still running
+ ***************************************************************************/
+static bool receiver_retire_write(transfer_ctx_t *ctx, TickType_t wait)
+{
+    pv_aio_req_t *req = &ctx->rx_wr_req[ctx->rx_wr_next];
+
+    if (ctx->rx_wr_count == 0 || xSemaphoreTake(ctx->rx_wr_done, wait) != pdTRUE) {
+        return false;
+    }
+    if (req->err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write all data to file");
+        ctx->rx_failed = true;
+    }
+    else {
+        pv_diskio_add_payload(req->len);
+    }
+    if (ctx->rx_stage_buf[0] == NULL) {
+        pv_spsc_release(&ctx->rx_ring, req->len);
+        ctx->rx_wr_ring_bytes -= req->len;
+    }
+    ctx->rx_wr_next = (ctx->rx_wr_next + 1) % RX_WRITES_IN_FLIGHT;
+    ctx->rx_wr_count--;
+    return true;
+}
+
+/***************************************************************************
+ * Function:    receiver_drain_writes
+ * Purpose:     Waits for every data write in flight
+ * Parameters:  ctx - Connection
+ * Return:     None
+ ***************************************************************************/
+static void receiver_drain_writes(transfer_ctx_t *ctx)
+{
+    while (receiver_retire_write(ctx, portMAX_DELAY)) {
+    }
+}
+
+/***************************************************************************
+ * Function:    receiver_end_file
+ * Purpose:     Commit the pack record or close the file of ctx->rx_file
+ * Parameters:  ctx - Connection
+ * Send to queue:     PV_ERR_RECV_FAIL or 0 on success
+ ***************************************************************************/
+static void receiver_end_file(transfer_ctx_t *ctx)
+{
+    esp_err_t ret = ESP_OK;
+
+    if (ctx->rx_file.packed) {
+        if (!ctx->rx_failed) {
+            ret = pv_pack_end(&ctx->rx_pack_obj);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to pack %s (0x%x)", ctx->rx_file.path, ret);
+            }
+        }
+        // A file cut short (e.g. by a disconnect) must not keep the pack store locked
+        if (ctx->rx_failed || ret != ESP_OK) {
+            pv_pack_abort(&ctx->rx_pack_obj);
+        }
+    }
+    else if (ctx->rx_handle != PV_AIO_INVALID_HANDLE) {
+        // Its last writes may still be queued, their result decides the status
+        receiver_drain_writes(ctx);
+        ctx->rx_req.op = PV_AIO_OP_CLOSE;
+        ctx->rx_req.handle = ctx->rx_handle;
+        if (pv_aio_submit_wait(&ctx->rx_req) != ESP_OK) {
+            ret = ESP_FAIL;
+        }
+        ctx->rx_handle = PV_AIO_INVALID_HANDLE;
+    }
+    ctx->rx_active = false;
+
+    // The backup manager only counts these, never block the receiver on it
+    transfer_cmd_t status_msg = {
+        .transfer_type = TRANSFER_TYPE_RX,
+        .status = (ctx->rx_failed || ret != ESP_OK) ? PV_ERR_RECV_FAIL : 0
+    };
+    snprintf(status_msg.file_path, sizeof(status_msg.file_path), "%s", ctx->rx_file.path);
+    xQueueSend(status_queue, &status_msg, 0);
+}
+
+/***************************************************************************
+ * Function:    receiver_begin_file
+ * Purpose:     Start writing ctx->rx_file: open it (kept open for the whole
+ *              transfer instead of reopening it per chunk) or begin its pack
+ *              record. On failure its data is discarded as it arrives.
+ * Parameters:  ctx - Connection
+ * Return:     None
+ ***************************************************************************/
+static void receiver_begin_file(transfer_ctx_t *ctx)
 {
     esp_err_t ret;
-    ret = ESP_OK;
-    size_t written;
-    // const char *file_hello = MOUNT_POINT"/test_5.png";
-    // ret = s_example_write_file(file_hello, buffer);
 
-    while (1) {
-        size_t item_size;
-        uint8_t *data = (uint8_t *)xRingbufferReceive(rx_ringbuf, &item_size, portMAX_DELAY);
+    ctx->rx_active = true;
+    ctx->rx_failed = false;
+    ctx->rx_file_remaining = ctx->rx_file.size;
 
-        if (item_size != 0) {
-            ESP_LOGI(TAG, "Attempting to open %s", path_buffer);
-            FILE *f = fopen(path_buffer, "a");
-            if (f == NULL) {
+    if (ctx->rx_file.packed) {
+        // One record per file, the pack store stays locked until it is committed
+        ret = pv_pack_begin(&ctx->rx_pack_obj, ctx->rx_file.path, (uint32_t)ctx->rx_file.size);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to pack %s (0x%x)", ctx->rx_file.path, ret);
+            pv_pack_abort(&ctx->rx_pack_obj);
+            ctx->rx_failed = true;
+        }
+    }
+    else {
+        ESP_LOGI(TAG, "Attempting to open %s", ctx->rx_file.path);
+        // Nothing may be opened in a folder that is being deleted. The fence is only checked here,
+        // the open runs on the I/O task after the delete and holding it across would deadlock.
+        ret = pv_fs_fence_enter(ctx->rx_file.path);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Folder of %s is being deleted", ctx->rx_file.path);
+        }
+        else {
+            pv_fs_fence_exit();
+            // Never replace a file under a hashed 8.3 name, it may be another photo's
+            ctx->rx_req.op = (ctx->rx_file.alt_path[0] != '\0') ? PV_AIO_OP_CREATE : PV_AIO_OP_OPEN_WRITE;
+            ctx->rx_req.buf = ctx->rx_file.alt_path;
+            snprintf(ctx->rx_req.path, sizeof(ctx->rx_req.path), "%s", ctx->rx_file.path);
+            ctx->rx_req.size_hint = ctx->rx_file.size;
+            ret = pv_aio_submit_wait(&ctx->rx_req);
+            if (ret != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to open file for writing");
-                 ret = ESP_FAIL;
-            }
-            else {
-                written = fwrite((char *)data,1,item_size, f);
-                if (written != item_size) {
-                    ESP_LOGE(TAG, "Failed to write all data to file");
-                }
             }
+        }
+        if (ret != ESP_OK) {
+            ctx->rx_failed = true;
+        }
+        else {
+            ctx->rx_handle = ctx->rx_req.handle;
+            snprintf(ctx->rx_file.path, sizeof(ctx->rx_file.path), "%s", ctx->rx_req.path);
+        }
+    }
 
-            if (ret != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to write to file\n");
+    if (ctx->rx_file_remaining == 0) {
+        receiver_end_file(ctx);
+    }
+}
+
+/***************************************************************************
+ * Function:    receiver_write
+ * Purpose:     Write one chunk of ctx->rx_file. File data is queued on the
+ *              I/O task without waiting (see receiver_retire_write()), pack
+ *              records are written at once. In place chunks of rx_ring are
+ *              released here unless a write still uses them.
+ * Parameters:  ctx - Connection, data, len - Chunk, never past the file end
+ * Return:     None
+ ***************************************************************************/
+static void receiver_write(transfer_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    esp_err_t ret = ESP_OK;
+    bool in_place = (ctx->rx_stage_buf[0] == NULL);
+
+    if (!ctx->rx_failed && !ctx->rx_file.packed) {
+        pv_aio_req_t *req = &ctx->rx_wr_req[(ctx->rx_wr_next + ctx->rx_wr_count) % RX_WRITES_IN_FLIGHT];
+        req->op = PV_AIO_OP_WRITE;
+        req->prio = PV_AIO_PRIO_NORMAL;
+        req->handle = ctx->rx_handle;
+        req->buf = (void *)data;
+        req->len = len;
+        req->cb = receiver_write_done;
+        req->cb_arg = ctx;
+        ret = pv_aio_submit(req);
+        if (ret == ESP_OK) {
+            ctx->rx_wr_count++;
+            if (in_place) {
+                ctx->rx_wr_ring_bytes += len;
             }
+            return;
+        }
+        ESP_LOGE(TAG, "Failed to queue a write of %s (0x%x)", ctx->rx_file.path, ret);
+    }
+    else if (!ctx->rx_failed) {
+        ret = pv_pack_write(&ctx->rx_pack_obj, data, len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to pack %s (0x%x)", ctx->rx_file.path, ret);
+            pv_pack_abort(&ctx->rx_pack_obj);
+        }
+        else {
+            pv_diskio_add_payload(len);
+        }
+    }
+
+    if (ret != ESP_OK) {
+        ctx->rx_failed = true;
+    }
+    if (in_place) {
+        // Ring space is freed in order, the writes before this chunk go first
+        receiver_drain_writes(ctx);
+        pv_spsc_release(&ctx->rx_ring, len);
+    }
+}
+
+/***************************************************************************
+ * Function:    receiver_reset
+ * Purpose:     Drop the state of the last connection: close or abort the
+ *              file being received, forget the files queued after it and
+ *              discard unread data. A partial file is left on the card, the
+ *              phone resends it from the start.
+ * Parameters:  ctx - Connection
+ * Return:     None
+ ***************************************************************************/
+static void receiver_reset(transfer_ctx_t *ctx)
+{
+    uint32_t discarded = (uint32_t)pv_spsc_used(&ctx->rx_ring);
+    UBaseType_t queued = uxQueueMessagesWaiting(ctx->file_queue);
+
+    if (ctx->rx_active) {
+        ESP_LOGW(TAG, "Disconnected while receiving %s", ctx->rx_file.path);
+        ctx->rx_failed = true;
+        receiver_end_file(ctx);
+    }
+    ctx->rx_file_remaining = 0;
+    xQueueReset(ctx->file_queue);
+
+    pv_spsc_discard(&ctx->rx_ring);
+    if (discarded > 0 || queued > 0) {
+        ESP_LOGI(TAG, "Discarded %"PRIu32" unread bytes and %u queued files", discarded, (unsigned)queued);
+    }
+}
+
+/***************************************************************************
+ * Function:    receiver_task
+ * Purpose:     Write recieved data of the files queued on ctx->file_queue,
+ *              in order, to the SD card. Never reads past the end of the
+ *              current file so data of the next one stays in the ring buffer.
+ * Parameters:  param - Connection (transfer_ctx_t)
+ * Send to queue:     PV_ERR_SEND_FAIL or 0 on success
+ ***************************************************************************/
+void receiver_task(void *param)
+{
+    transfer_ctx_t *ctx = (transfer_ctx_t *)param;
 
+    while (1) {
+        // Wake up now and then so a disconnect is handled even without data
+        if (ctx->reset_pending) {
+            receiver_reset(ctx);
+            ctx->reset_pending = false;
+            continue;
+        }
 
-            fclose(f);
+        if (!ctx->rx_active) {
+            if (xQueueReceive(ctx->file_queue, &ctx->rx_file, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS)) == pdTRUE) {
+                receiver_begin_file(ctx);
+            }
+            continue;
         }
 
-        // Return space in ring buffer
-        vRingbufferReturnItem(rx_ringbuf, data);
+        // Free what the card finished, and wait only if every write is still in flight
+        while (receiver_retire_write(ctx, 0)) {
+        }
+        if (ctx->rx_wr_count == RX_WRITES_IN_FLIGHT) {
+            receiver_retire_write(ctx, portMAX_DELAY);
+        }
 
+        // Everything received so far is written in one go, straight from the ring
+        const uint8_t *data = NULL;
+        size_t item_size = pv_spsc_peek_wait_at(&ctx->rx_ring, ctx->rx_wr_ring_bytes, &data,
+                                                pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+        if (item_size == 0) {
+            continue;
+        }
+        size_t used = pv_spsc_used(&ctx->rx_ring);
+        if (used > ctx->rx_ring_peak) {
+            ctx->rx_ring_peak = used;
+        }
+        if (ctx->rx_stage_buf[0] != NULL) {
+            // PSRAM can't be DMAed to the card, copy out (across the wrap) to a free staging buffer
+            // and free the ring space at once
+            uint8_t *stage = ctx->rx_stage_buf[(ctx->rx_wr_next + ctx->rx_wr_count) % RX_WRITES_IN_FLIGHT];
+            size_t want = (ctx->rx_file_remaining < RX_STAGE_CHUNK_SIZE) ? (size_t)ctx->rx_file_remaining : RX_STAGE_CHUNK_SIZE;
+            item_size = pv_spsc_read(&ctx->rx_ring, stage, want);
+            data = stage;
+        }
+        else if (item_size > ctx->rx_file_remaining) {
+            item_size = (size_t)ctx->rx_file_remaining;
+        }
 
-        
+        if (!ctx->reset_pending) {
+            receiver_write(ctx, data, item_size);
+            ctx->rx_file_remaining -= item_size;
+            if (ctx->rx_file_remaining == 0) {
+                receiver_end_file(ctx);
+            }
+        }
+        else if (ctx->rx_stage_buf[0] == NULL) {
+            // Return space in ring buffer, receiver_reset() discards the rest
+            receiver_drain_writes(ctx);
+            pv_spsc_release(&ctx->rx_ring, item_size);
+        }
     }
 }
 
 
 
+/***************************************************************************
+ * Function:    transmitter_write
+ * Purpose:     One esp_spp_write() straight from the TX ring buffer: waits
+ *              until the link is not congested, starts the write and waits
+ *              for its own ESP_SPP_WRITE_EVT, however late it comes
+ * Parameters:  ctx - Connection
+ *              data, len - Bytes to send, at most TRANSFER_TX_WRITE_MAX
+ *              written - Returns the bytes Bluedroid took
+ * Return:      ESP_OK if the write was confirmed
+ *              ESP_FAIL if it was rejected or failed
+ *              ESP_ERR_INVALID_STATE if the phone disconnected
+ ***************************************************************************/
+static esp_err_t transmitter_write(transfer_ctx_t *ctx, const uint8_t *data, size_t len, size_t *written)
+{
+    TickType_t start;
+    uint32_t seq;
+    bool late = false;
+
+    *written = 0;
+    if (ctx->tx_congested) {
+        ctx->tx_stats.cong_waits++;
+    }
+    // Writing into a congested link only grows Bluedroid's queue
+    while (ctx->tx_congested && ctx->connected) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+    }
+    if (!ctx->connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // A rejected write gets no event, so it is only numbered once Bluedroid took it
+    seq = ctx->tx_write_seq + 1;
+    if (esp_spp_write(ctx->bt_handle, (int)len, (uint8_t *)data) != ESP_OK) {
+        ctx->tx_stats.failures++;
+        return ESP_FAIL;
+    }
+    ctx->tx_write_seq = seq;
+
+    start = xTaskGetTickCount();
+    while ((int32_t)(ctx->tx_done_seq - seq) < 0 && ctx->connected) {
+        if (!late && xTaskGetTickCount() - start >= pdMS_TO_TICKS(TRANSFER_TX_WRITE_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "Write %"PRIu32" on handle [%"PRIu32"] not confirmed yet", seq, ctx->bt_handle);
+            ctx->tx_stats.timeouts++;
+            late = true;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+    }
+    if (!ctx->connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!ctx->tx_write_ok) {
+        ctx->tx_stats.failures++;
+        return ESP_FAIL;
+    }
+
+    *written = (ctx->tx_write_len < len) ? ctx->tx_write_len : len;
+    ctx->tx_stats.writes++;
+    ctx->tx_stats.bytes += *written;
+    return ESP_OK;
+}
+
 /***************************************************************************
  * Function:    transmitter_task
- * Purpose:     Possibly will be split into two functions or use cmd queue.
- *              Current function sends Data that was placed on the ring buffer.
- *              Concurrently iterate over all the files needing to be transmitted to the 
- *              mobile device and send data in 1024-byte chunks (TO BE IMPLEMENTED)
- *              
- * Parameters:  None
- * Send to queue:     PV_ERR_SEND_FAIL or 0 on success
+ * Purpose:     Sends what was placed on the TX ring buffer, see
+ *              transfer_ctx_t. Every reply queued since the last write goes
+ *              out in one write (up to TRANSFER_TX_WRITE_MAX, the ring buffer
+ *              keeps them as plain bytes), without copying it out first.
+ *              The ring space is returned once the write is confirmed. A
+ *              failed write is repeated for as long as the phone is there.
+ * Parameters:  param - Connection (transfer_ctx_t)
+ * Return:     None
  ***************************************************************************/
-void transmitter_task()
+void transmitter_task(void *param)
 {
-    // transfer_cmd_t cmd;
-    char *buffer_tx = malloc(INITIAL_BUFFER_SIZE); 
+    transfer_ctx_t *ctx = (transfer_ctx_t *)param;
     while (1)
     {
-        // will block forever
-        // get file name here
-        size_t item_size;
-        uint8_t *data = (uint8_t *)xRingbufferReceive(tx_ringbuf, &item_size, portMAX_DELAY);
-        memcpy(buffer_tx, data, item_size);
-
-        ESP_LOGI(TAG, "Attempting to send on handle: [%lu]", int_bt_handle);
-        esp_spp_write(int_bt_handle, item_size, (uint8_t *)buffer_tx);
-        memcpy(buffer_tx + item_size, "\0", 1);
-        ESP_LOGI(TAG, "Sent: %s", buffer_tx);
-
-        
-
-
-        // if (xQueueReceive(tx_cmd_queue, &cmd, portMAX_DELAY) == pdPASS)
-        // {
-        //     printf("Transmitter received command: %s, type: %d\n", cmd.file_path, cmd.transfer_type);
-
-        //     // Mimic reading file contents
-        //     //TODO: Remove dummy content
-        //     /*
-        //     FILE *f = fopen(cmd.file_path, "rb");
-        //     if (f == NULL) {
-        //         status_msg.status = PV_ERR_SEND_FAIL;
-        //     } else {
-        //         uint8_t buffer[1024];
-        //         size_t read_len;
-        //         while ((read_len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-        //             esp_spp_write(bt_handle, read_len, buffer);
-        //             // optionally add delay or flow control here
-        //         }
-        //         fclose(f);
-        //     }
-        //     */
-
-        //     // transfer_cmd_t status_msg = {
-        //     //     .transfer_type = TRANSFER_TYPE_TX,
-        //     //     .status = 0
-        //     // };
-        //     // strncpy(status_msg.file_path, cmd.file_path, sizeof(cmd.file_path));
-
-        //     // const char *mock_file_content = "DylanMichaelAndrewKeen";
-        //     // size_t total_len = strlen(mock_file_content);
-        //     // size_t chunk_size = 8;  // for example, send in 8-byte chunks
-        //     // BaseType_t sent = pdTRUE;
-        //     // size_t offset = 0;
-        //     // while (offset < total_len) {
-        //     //     size_t remaining = total_len - offset;
-        //     //     size_t send_len = (remaining < chunk_size) ? remaining : chunk_size;
-
-        //     //     sent = xRingbufferSend(tx_ringbuf, mock_file_content + offset, send_len, portMAX_DELAY);
-        //     //     if (sent != pdTRUE) {
-        //     //         printf("Failed to send chunk to TX ring buffer\n");
-        //     //         break;
-        //     //     }
-
-        //     //     //printf("Sent chunk: %.*s\n", (int)send_len, mock_file_content + offset);
-
-        //     //     offset += send_len;
-        //     // }
-            
-        //     // if (sent != pdTRUE) {
-        //     //     printf("Transmitter failed to send data");
-        //     //     status_msg.status = PV_ERR_SEND_FAIL;
-        //     // }
-        //     // strncpy(status_msg.file_path, cmd.file_path, sizeof(status_msg.file_path));
-        //     xQueueSend(status_queue, &status_msg, portMAX_DELAY);
-        // }
-        vRingbufferReturnItem(tx_ringbuf, data);
+        size_t item_size = 0;
+        size_t sent = 0;
+        uint32_t failures = 0;
+        uint8_t *data = (uint8_t *)xRingbufferReceiveUpTo(ctx->tx_ringbuf, &item_size, portMAX_DELAY, TRANSFER_TX_WRITE_MAX);
+        if (data == NULL) {
+            continue;
+        }
+
+        while (sent < item_size) {
+            size_t written = 0;
+            esp_err_t ret = transmitter_write(ctx, data + sent, item_size - sent, &written);
+
+            if (ret == ESP_ERR_INVALID_STATE) {
+                break;
+            }
+            if (ret != ESP_OK) {
+                if (++failures == 1) {
+                    ESP_LOGW(TAG, "Write failed on handle [%"PRIu32"], retrying", ctx->bt_handle);
+                }
+                vTaskDelay(pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+            }
+            sent += written;
+        }
+        // Replies queued after the phone left have nobody to go to, restore_engine checks the count
+        if (sent < item_size) {
+            ESP_LOGW(TAG, "Not connected, dropped %u of %u bytes", (unsigned)(item_size - sent), (unsigned)item_size);
+            ctx->tx_stats.dropped += item_size - sent;
+        }
+        ESP_LOGD(TAG, "Sent: %.*s", (int)sent, (const char *)data);
+        vRingbufferReturnItem(ctx->tx_ringbuf, data);
     }
 }
+
+/***************************************************************************
+ * Function:    delete_backup_receivers_idle
+ * Purpose:     Checks that no receiver is writing into a backup folder or
+ *              has files queued. Queued files can't be looked at without
+ *              taking them, so any queued file counts.
+ * Parameters:  dir_path - Card path of the folder
+ * Return:      true if the folder can be deleted
+ ***************************************************************************/
+static bool delete_backup_receivers_idle(const char *dir_path)
+{
+    size_t len = strlen(dir_path);
+
+    for (int i = 0; i < TRANSFER_MAX_SESSIONS; i++) {
+        transfer_ctx_t *ctx = &s_ctx[i];
+        if (uxQueueMessagesWaiting(ctx->file_queue) > 0) {
+            return false;
+        }
+        if (ctx->rx_active && !ctx->rx_file.packed && strncasecmp(ctx->rx_file.path, dir_path, len) == 0 &&
+            (ctx->rx_file.path[len] == '\0' || ctx->rx_file.path[len] == '/')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    delete_backup_task
+ * Purpose:     Deletes device backup folders, and the files of the device
+ *              in the pack store, off the BT callback and reports each
+ *              result to the phone. The folder is deleted on the storage
+ *              I/O task once the receivers are done with it, waiting at
+ *              most TRANSFER_DELETE_DRAIN_MS.
+ * Parameters:  param - Unused
+ * Send to TX ring buffer: DEL_BACKUP_CMD on success, FAILURE_PATTERN else
+ ***************************************************************************/
+static void delete_backup_task(void *param)
+{
+    static pv_aio_req_t aio_req;
+    delete_backup_req_t req;
+    esp_err_t ret;
+
+    while (1) {
+        if (xQueueReceive(s_delete_queue, &req, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        ret = ESP_ERR_TIMEOUT;
+        for (int i = 0; i <= TRANSFER_DELETE_DRAIN_MS / TRANSFER_RESET_POLL_MS; i++) {
+            if (delete_backup_receivers_idle(req.dir_path)) {
+                ret = ESP_OK;
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(TRANSFER_RESET_POLL_MS));
+        }
+
+        if (ret == ESP_OK) {
+            // Runs between the I/O task's own opens and writes, an open file in the folder fails it
+            memset(&aio_req, 0, sizeof(aio_req));
+            aio_req.op = PV_AIO_OP_DELETE_DIR;
+            aio_req.prio = PV_AIO_PRIO_NORMAL;
+            snprintf(aio_req.path, sizeof(aio_req.path), "%s", req.dir_path);
+            ret = pv_aio_submit_wait(&aio_req);
+        }
+        else {
+            ESP_LOGE(TAG, "Receiver still busy, not deleting %s", req.dir_path);
+        }
+
+        // Small files of the device live in the pack store under their phone path, not in the folder
+        if (ret == ESP_OK || ret == ESP_ERR_NOT_FOUND) {
+            esp_err_t pack_ret = pv_pack_delete_prefix(req.dir_path + strlen(SD_CARD_MOUNT_POINT));
+            if (ret == ESP_OK) {
+                ret = pack_ret;
+            }
+        }
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "Deleted backup %s", req.dir_path);
+            transfer_control_send(req.ctx, DEL_BACKUP_CMD, strlen(DEL_BACKUP_CMD), portMAX_DELAY);
+        }
+        else {
+            ESP_LOGE(TAG, "Failed to delete backup %s (0x%x)", req.dir_path, ret);
+            transfer_control_send(req.ctx, FAILURE_PATTERN, strlen(FAILURE_PATTERN), portMAX_DELAY);
+        }
+    }
+}
+
+/***************************************************************************
+ * Function:    transfer_control_request_restore
+ * Purpose:     Queues sending a backed up file back to the phone (RESTORE_CMD).
+ *              The backup manager retries it with backoff if it fails.
+ * Parameters:  path - Phone path of the file (not null terminated)
+ *              len - Length of path, a trailing newline is ignored
+ * Return:      ESP_OK if the restore was queued
+ *              ESP_ERR_INVALID_ARG if the path is empty, relative or too long
+ *              As backup_mgr_enqueue() else
+ ***************************************************************************/
+esp_err_t transfer_control_request_restore(const uint8_t *path, uint16_t len)
+{
+    char buf[MAX_PATH_SIZE];
+
+    if (len > 0 && path[len - 1] == '\n') {
+        len--;
+    }
+    if (len == 0 || len >= sizeof(buf) || path[0] != '/' || memchr(path, '\0', len) != NULL) {
+        ESP_LOGE(TAG, "Invalid restore path");
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(buf, path, len);
+    buf[len] = '\0';
+
+    // The user is waiting for it, it goes before queued backups
+    return backup_mgr_enqueue(buf, TRANSFER_TYPE_TX, BACKUP_PRIO_HIGH);
+}
+
+/***************************************************************************
+ * Function:    transfer_control_delete_backup
+ * Purpose:     Queues deleting the backup folder of a device. The folder name
+ *              must be a single path component under SD_CARD_MOUNT_POINT.
+ * Parameters:  ctx - Connection the result is sent to
+ *              name - Folder name as sent by the phone (not null terminated)
+ *              len - Length of name, a trailing newline is ignored
+ * Return:      ESP_OK if the delete was queued
+ *              ESP_ERR_INVALID_ARG if the name is not a valid folder name
+ *              ESP_ERR_NO_MEM if TRANSFER_DELETE_QUEUE_LEN deletes are pending
+ ***************************************************************************/
+esp_err_t transfer_control_delete_backup(transfer_ctx_t *ctx, const uint8_t *name, uint16_t len)
+{
+    delete_backup_req_t req;
+    size_t prefix_len = strlen(SD_CARD_MOUNT_POINT);
+
+    if (len > 0 && name[len - 1] == '\n') {
+        len--;
+    }
+    if (len == 0 || len >= DEVICE_DIRECTORY_NAME_MAX_LENGTH || memchr(name, '/', len) != NULL ||
+        (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))) {
+        ESP_LOGE(TAG, "Invalid backup folder name");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    req.ctx = ctx;
+    memcpy(req.dir_path, SD_CARD_MOUNT_POINT "/", prefix_len + 1);
+    memcpy(req.dir_path + prefix_len + 1, name, len);
+    req.dir_path[prefix_len + 1 + len] = '\0';
+
+    if (s_delete_queue == NULL || xQueueSend(s_delete_queue, &req, 0) != pdTRUE) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    rx_staging_pow2
+ * Purpose:     Rounds a staging size down to a power of two for pv_spsc_t
+ * Parameters:  n - Size in bytes
+ * Return:      The largest power of two not above n
+ ***************************************************************************/
+static size_t rx_staging_pow2(size_t n)
+{
+    while (n & (n - 1)) {
+        n &= n - 1;
+    }
+    return n;
+}
+
+/***************************************************************************
+ * Function:    rx_staging_create
+ * Purpose:     Sets up the receive staging ring of a connection. With PSRAM
+ *              the largest power of two up to RX_STAGING_PSRAM_SIZE that
+ *              PSRAM can provide, plus RX_WRITES_IN_FLIGHT DMA buffers to
+ *              copy it out through.
+ *              Else (or if that fails) RX_STAGING_INTERNAL_SIZE or less of
+ *              DMA capable internal RAM the receiver writes from in place.
+ * Parameters:  ctx - Connection
+ * Return:      false if not even RX_RINGBUF_SIZE could be allocated
+ ***************************************************************************/
+static bool rx_staging_create(transfer_ctx_t *ctx)
+{
+    uint8_t *storage = NULL;
+    size_t size = 0;
+
+#if CONFIG_SPIRAM
+    bool have_stage = true;
+    for (int i = 0; i < RX_WRITES_IN_FLIGHT; i++) {
+        ctx->rx_stage_buf[i] = pv_dma_alloc(RX_STAGE_CHUNK_SIZE);
+        have_stage &= (ctx->rx_stage_buf[i] != NULL);
+    }
+    size = rx_staging_pow2(RX_STAGING_PSRAM_SIZE);
+    while (have_stage && storage == NULL && size > RX_STAGING_INTERNAL_SIZE) {
+        storage = heap_caps_aligned_alloc(PV_SPSC_CACHE_LINE, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (storage == NULL) {
+            size /= 2;
+        }
+    }
+    if (storage != NULL) {
+        ctx->rx_ring_psram = true;
+    }
+    else {
+        ESP_LOGW(TAG, "No PSRAM for receive staging, using internal RAM");
+        for (int i = 0; i < RX_WRITES_IN_FLIGHT; i++) {
+            pv_dma_free(ctx->rx_stage_buf[i]);
+            ctx->rx_stage_buf[i] = NULL;
+        }
+    }
+#endif
+
+    if (storage == NULL) {
+        size = rx_staging_pow2(RX_STAGING_INTERNAL_SIZE);
+        while (storage == NULL && size >= RX_RINGBUF_SIZE) {
+            storage = pv_dma_alloc(size);
+            if (storage == NULL) {
+                size /= 2;
+            }
+        }
+        if (storage == NULL) {
+            return false;
+        }
+    }
+
+    ESP_LOGI(TAG, "Receive staging: %u KB in %s", (unsigned)(size / 1024U), ctx->rx_ring_psram ? "PSRAM" : "internal RAM");
+    return pv_spsc_init(&ctx->rx_ring, storage, size);
+}
+
 /***************************************************************************
  * Function:    transfer_control_init
- * Purpose:     Init ring buffers, create tasks and queues
+ * Purpose:     Init ring buffers, create tasks and queues for every
+ *              connection slot. Everything lives for the whole run (on link
+ *              time storage with CONFIG_PV_STATIC_ALLOC), connections only
+ *              bind to it (transfer_control_open/close). Calling it again
+ *              does nothing.
  * Parameters:  None
  * Return:     None
  ***************************************************************************/
-void transfer_control_init(uint32_t bt_handle)
+void transfer_control_init(void)
 {
-    // All data is stored as a sequence of byte and do not maintain separate items
-    rx_ringbuf = xRingbufferCreate(RX_RINGBUF_SIZE, RINGBUF_TYPE_BYTEBUF); 
-    tx_ringbuf = xRingbufferCreate(TX_RINGBUF_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (s_initialized) {
+        return;
+    }
+    // One attempt only, static objects must not be created twice
+    s_initialized = true;
+
+    tx_cmd_queue = PV_STATIC_QUEUE_CREATE(s_tx_cmd_queue_mem, TRANSFER_CMD_QUEUE_LEN, sizeof(transfer_cmd_t));
+    status_queue = PV_STATIC_QUEUE_CREATE(s_status_queue_mem, TRANSFER_CMD_QUEUE_LEN, sizeof(transfer_cmd_t));
+    s_delete_queue = PV_STATIC_QUEUE_CREATE(s_delete_queue_mem, TRANSFER_DELETE_QUEUE_LEN, sizeof(delete_backup_req_t));
+    if (tx_cmd_queue == NULL || status_queue == NULL || s_delete_queue == NULL ||
+        PV_STATIC_TASK_CREATE(s_delete_mem, delete_backup_task, "delete_backup_task", TRANSFER_DELETE_TASK_STACK_SIZE,
+                              NULL, TRANSFER_DELETE_TASK_PRIORITY, NULL, PV_TASK_CORE_STORAGE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create transfer queues");
+        return;
+    }
 
-    // TODO: Change size
-    tx_cmd_queue = xQueueCreate(10, sizeof(transfer_cmd_t));
-    status_queue = xQueueCreate(10, sizeof(transfer_cmd_t));
+    for (int i = 0; i < TRANSFER_MAX_SESSIONS; i++) {
+        transfer_ctx_t *ctx = &s_ctx[i];
 
-    xTaskCreate(receiver_task, "receiver_task", 8192, NULL, 5, NULL);
-    xTaskCreate(transmitter_task, "transmitter_task", 8192, NULL, 5, NULL);
+        ctx->cur_state = WAIT;
+        ctx->rx_handle = PV_AIO_INVALID_HANDLE;
+        // All data is stored as a sequence of byte and do not maintain separate items
+        if (!rx_staging_create(ctx)) {
+            ESP_LOGE(TAG, "Failed to create session %d buffers", i);
+            return;
+        }
+        ctx->tx_ringbuf = PV_STATIC_RINGBUF_CREATE_N(s_tx_ringbuf_mem, i, TX_RINGBUF_SIZE, RINGBUF_TYPE_BYTEBUF);
+        ctx->tx_lock = PV_STATIC_MUTEX_CREATE_N(s_tx_lock_mem, i);
+        ctx->file_queue = PV_STATIC_QUEUE_CREATE_N(s_file_queue_mem, i, TRANSFER_FILES_IN_FLIGHT, sizeof(transfer_file_t));
+        ctx->rx_wr_done = PV_STATIC_COUNTING_CREATE_N(s_rx_wr_done_mem, i, RX_WRITES_IN_FLIGHT, 0);
+        if (ctx->tx_ringbuf == NULL || ctx->tx_lock == NULL || ctx->file_queue == NULL || ctx->rx_wr_done == NULL) {
+            ESP_LOGE(TAG, "Failed to create session %d buffers", i);
+            return;
+        }
+
+        // The receiver writes to the card, the transmitter feeds Bluedroid, see pv_tasks.h
+        if (PV_STATIC_TASK_CREATE_N(s_receiver_mem, i, receiver_task, "receiver_task", TRANSFER_TASK_STACK_SIZE, ctx,
+                                    TRANSFER_RX_TASK_PRIORITY, NULL, PV_TASK_CORE_STORAGE) != pdPASS ||
+            PV_STATIC_TASK_CREATE_N(s_transmitter_mem, i, transmitter_task, "transmitter_task", TRANSFER_TASK_STACK_SIZE, ctx,
+                                    TRANSFER_TX_TASK_PRIORITY, &ctx->tx_task, PV_TASK_CORE_PROTOCOL) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create session %d tasks", i);
+            return;
+        }
+    }
 
-    path_buffer = malloc(MAX_PATH_SIZE); 
-    rx_path_buffer = malloc(MAX_PATH_SIZE); 
+    if (backup_mgr_init() != ESP_OK || restore_engine_init() != ESP_OK) {
+        return;
+    }
 
-    int_bt_handle = bt_handle;
+    ESP_LOGI(TAG, "Transfer control ready, %u bytes free", (unsigned)esp_get_free_heap_size());
     // start_transfer_control_tests();
 }
 
-// void start_transfer_control_tests() {
-//     printf("start_transfer_control_tests\n");
-//     UNITY_BEGIN();
-//     // transfer_control_init(0);
-//     RUN_TEST(failure_path);
-//     RUN_TEST(happy_path);
-//     RUN_TEST(overflow_path);
-//     UNITY_END();  
-// }
\ No newline at end of file
+/***************************************************************************
+ * Function:    transfer_control_open
+ * Purpose:     Bind a new SPP connection to a free connection slot. Waits up
+ *              to TRANSFER_RESET_POLL_MS for the receiver of that slot to
+ *              finish resetting after its previous connection.
+ * Parameters:  bt_handle - SPP handle of the connection
+ * Return:      The connection, NULL if all slots are in use
+ ***************************************************************************/
+transfer_ctx_t *transfer_control_open(uint32_t bt_handle)
+{
+    transfer_ctx_t *ctx = NULL;
+
+    transfer_control_init();
+
+    // Prefer a slot that is already reset
+    for (int i = 0; i < TRANSFER_MAX_SESSIONS; i++) {
+        if (!s_ctx[i].connected && (ctx == NULL || ctx->reset_pending)) {
+            ctx = &s_ctx[i];
+        }
+    }
+    if (ctx == NULL) {
+        ESP_LOGE(TAG, "No free session for handle [%"PRIu32"]", bt_handle);
+        return NULL;
+    }
+
+    for (int i = 0; ctx->reset_pending && i < TRANSFER_RESET_POLL_MS / 10; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    ctx->bt_handle = bt_handle;
+    ctx->tx_congested = false;
+    ctx->tx_write_seq = 0;
+    ctx->tx_done_seq = 0;
+    memset(&ctx->tx_stats, 0, sizeof(ctx->tx_stats));
+    ctx->connected = true;
+    ESP_LOGI(TAG, "Session open on handle [%"PRIu32"], %u bytes free", bt_handle, (unsigned)esp_get_free_heap_size());
+    backup_mgr_link_up();
+    return ctx;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_find
+ * Purpose:     Look up the connection bound to an SPP handle
+ * Parameters:  bt_handle - SPP handle
+ * Return:      The connection, NULL if the handle is not open
+ ***************************************************************************/
+transfer_ctx_t *transfer_control_find(uint32_t bt_handle)
+{
+    for (int i = 0; s_initialized && i < TRANSFER_MAX_SESSIONS; i++) {
+        if (s_ctx[i].connected && s_ctx[i].bt_handle == bt_handle) {
+            return &s_ctx[i];
+        }
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_connected
+ * Purpose:     Tells whether any phone is connected
+ * Parameters:  None
+ * Return:      true if at least one connection is open
+ ***************************************************************************/
+bool transfer_control_connected(void)
+{
+    return transfer_control_active() != NULL;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_active
+ * Purpose:     Returns the connection restored files are sent to
+ * Parameters:  None
+ * Return:      The first open connection, NULL if no phone is connected
+ ***************************************************************************/
+transfer_ctx_t *transfer_control_active(void)
+{
+    for (int i = 0; s_initialized && i < TRANSFER_MAX_SESSIONS; i++) {
+        if (s_ctx[i].connected) {
+            return &s_ctx[i];
+        }
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * Function:    transfer_control_tx_event
+ * Purpose:     Passes ESP_SPP_CONG_EVT and ESP_SPP_WRITE_EVT of a
+ *              connection to its transmitter. Called from the SPP callback.
+ * Parameters:  ctx - Connection
+ *              write_done - true for ESP_SPP_WRITE_EVT
+ *              ok, len - Result of the write (ESP_SPP_WRITE_EVT only)
+ *              cong - Whether the link is congested now
+ * Return:      None
+ ***************************************************************************/
+void transfer_control_tx_event(transfer_ctx_t *ctx, bool write_done, bool ok, uint32_t len, bool cong)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    ctx->tx_congested = cong;
+    if (write_done) {
+        ctx->tx_write_ok = ok;
+        ctx->tx_write_len = len;
+        ctx->tx_done_seq++;
+    }
+    if (ctx->tx_task != NULL) {
+        xTaskNotifyGive(ctx->tx_task);
+    }
+}
+
+/***************************************************************************
+ * Function:    transfer_control_close
+ * Purpose:     Unbind the connection. The transmitter drops what is still
+ *              queued for the phone and the receiver drops the files in
+ *              progress, nothing is freed.
+ * Parameters:  ctx - Connection
+ * Return:     None
+ ***************************************************************************/
+void transfer_control_close(transfer_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    ctx->connected = false;
+    ctx->meta_valid = false;
+    ctx->reset_pending = true;
+    if (ctx->tx_task != NULL) {
+        // Gives up a write waiting for the link or its confirmation
+        xTaskNotifyGive(ctx->tx_task);
+    }
+    ESP_LOGI(TAG, "Session closed on handle [%"PRIu32"]", ctx->bt_handle);
+}
+
+/***************************************************************************
+ * Function:    transfer_control_send_stats
+ * Purpose:     Answers STATS_CMD: sends the storage I/O counters (see
+ *              pv_diskio.h, pv_trim.h and pv_dma.h), the receive staging
+ *              use and transmitter counters of the connection and the
+ *              backup manager counters (see backup_mgr.h) to the phone as
+ *              one JSON line and logs them
+ * Parameters:  ctx - Connection the line is sent to
+ * Return:      ESP_OK if the line was queued
+ *              ESP_ERR_NO_MEM if the JSON could not be built
+ *              ESP_FAIL if the TX ring buffer did not take it
+ ***************************************************************************/
+esp_err_t transfer_control_send_stats(transfer_ctx_t *ctx)
+{
+    static const char *class_names[PV_DISKIO_CLASS_COUNT] = { "data", "fat", "dir" };
+    pv_diskio_stats_t stats;
+    cJSON *json = cJSON_CreateObject();
+    cJSON *read = cJSON_AddObjectToObject(json, "sectors_read");
+    cJSON *written = cJSON_AddObjectToObject(json, "sectors_written");
+    cJSON *read_hist = cJSON_AddArrayToObject(json, "read_hist");
+    cJSON *write_hist = cJSON_AddArrayToObject(json, "write_hist");
+    cJSON *trim = cJSON_AddObjectToObject(json, "trim");
+    cJSON *dma = cJSON_AddObjectToObject(json, "dma");
+    cJSON *staging = cJSON_AddObjectToObject(json, "rx_staging");
+    cJSON *backup = cJSON_AddObjectToObject(json, "backup");
+    cJSON *tx = cJSON_AddObjectToObject(json, "tx");
+    pv_trim_stats_t trim_stats;
+    pv_dma_stats_t dma_stats;
+    backup_mgr_stats_t backup_stats;
+    char *line = NULL;
+    BaseType_t sent = pdFALSE;
+
+    if (json == NULL || read == NULL || written == NULL || read_hist == NULL || write_hist == NULL || trim == NULL || dma == NULL || staging == NULL ||
+        backup == NULL || tx == NULL) {
+        cJSON_Delete(json);
+        return ESP_ERR_NO_MEM;
+    }
+
+    pv_diskio_get_stats(&stats);
+    for (int i = 0; i < PV_DISKIO_CLASS_COUNT; i++) {
+        cJSON_AddNumberToObject(read, class_names[i], (double)stats.sectors_read[i]);
+        cJSON_AddNumberToObject(written, class_names[i], (double)stats.sectors_written[i]);
+    }
+    for (int i = 0; i < PV_DISKIO_HIST_BUCKETS; i++) {
+        cJSON_AddItemToArray(read_hist, cJSON_CreateNumber(stats.read_hist[i]));
+        cJSON_AddItemToArray(write_hist, cJSON_CreateNumber(stats.write_hist[i]));
+    }
+    cJSON_AddNumberToObject(json, "reads", stats.reads);
+    cJSON_AddNumberToObject(json, "writes", stats.writes);
+    cJSON_AddNumberToObject(json, "ioctls", stats.ioctls);
+    cJSON_AddNumberToObject(json, "errors", stats.errors);
+    cJSON_AddNumberToObject(json, "read_us", (double)stats.read_us);
+    cJSON_AddNumberToObject(json, "write_us", (double)stats.write_us);
+    cJSON_AddNumberToObject(json, "hist_min_log2", PV_DISKIO_HIST_MIN_LOG2);
+    cJSON_AddNumberToObject(json, "payload_bytes", (double)stats.payload_bytes);
+    cJSON_AddNumberToObject(json, "wa_x100", pv_diskio_write_amplification_x100(&stats));
+    cJSON_AddNumberToObject(json, "pre_erases", stats.pre_erases);
+    cJSON_AddNumberToObject(json, "pre_erase_sectors", (double)stats.pre_erase_sectors);
+    cJSON_AddNumberToObject(json, "pre_erase_us", (double)stats.pre_erase_us);
+    cJSON_AddNumberToObject(json, "bounce_reads", stats.bounce_reads);
+    cJSON_AddNumberToObject(json, "bounce_writes", stats.bounce_writes);
+    cJSON_AddNumberToObject(json, "bounce_sectors", (double)stats.bounce_sectors);
+
+    pv_trim_get_stats(&trim_stats);
+    cJSON_AddNumberToObject(trim, "mode", pv_trim_get_mode());
+    cJSON_AddNumberToObject(trim, "ranges", trim_stats.ranges);
+    cJSON_AddNumberToObject(trim, "sectors", (double)trim_stats.sectors);
+    cJSON_AddNumberToObject(trim, "inline", trim_stats.inline_erases);
+    cJSON_AddNumberToObject(trim, "background", trim_stats.background_erases);
+    cJSON_AddNumberToObject(trim, "cancelled", trim_stats.cancelled);
+    cJSON_AddNumberToObject(trim, "dropped", trim_stats.dropped);
+    cJSON_AddNumberToObject(trim, "failed", trim_stats.failed);
+    cJSON_AddNumberToObject(trim, "erase_us", (double)trim_stats.erase_us);
+
+    pv_dma_get_stats(&dma_stats);
+    cJSON_AddNumberToObject(dma, "pool", dma_stats.pool_size);
+    cJSON_AddNumberToObject(dma, "used", dma_stats.used);
+    cJSON_AddNumberToObject(dma, "peak", dma_stats.peak);
+    cJSON_AddNumberToObject(dma, "fallbacks", dma_stats.heap_fallbacks);
+    cJSON_AddNumberToObject(dma, "failures", dma_stats.failures);
+
+    cJSON_AddNumberToObject(staging, "size", ctx->rx_ring.size);
+    cJSON_AddBoolToObject(staging, "psram", ctx->rx_ring_psram);
+    cJSON_AddNumberToObject(staging, "peak", ctx->rx_ring_peak);
+
+    cJSON_AddNumberToObject(tx, "writes", ctx->tx_stats.writes);
+    cJSON_AddNumberToObject(tx, "bytes", (double)ctx->tx_stats.bytes);
+    cJSON_AddNumberToObject(tx, "cong_waits", ctx->tx_stats.cong_waits);
+    cJSON_AddNumberToObject(tx, "failures", ctx->tx_stats.failures);
+    cJSON_AddNumberToObject(tx, "timeouts", ctx->tx_stats.timeouts);
+    cJSON_AddNumberToObject(tx, "dropped", ctx->tx_stats.dropped);
+
+    backup_mgr_get_stats(&backup_stats);
+    cJSON_AddNumberToObject(backup, "pending", backup_stats.pending);
+    cJSON_AddNumberToObject(backup, "active", backup_stats.active);
+    cJSON_AddNumberToObject(backup, "retry_wait", backup_stats.retry_wait);
+    cJSON_AddNumberToObject(backup, "done", backup_stats.done);
+    cJSON_AddNumberToObject(backup, "failed", backup_stats.failed);
+    cJSON_AddNumberToObject(backup, "retries", backup_stats.retries);
+    cJSON_AddNumberToObject(backup, "rx_done", backup_stats.rx_done);
+    cJSON_AddNumberToObject(backup, "rx_failed", backup_stats.rx_failed);
+
+    line = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (line == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    pv_diskio_log_stats();
+    // Called from the Bluetooth callback, see TRANSFER_TX_REPLY_WAIT_MS
+    sent = pdFALSE;
+    if (transfer_control_tx_lock(ctx, pdMS_TO_TICKS(TRANSFER_TX_REPLY_WAIT_MS))) {
+        sent = xRingbufferSend(ctx->tx_ringbuf, line, strlen(line), pdMS_TO_TICKS(TRANSFER_TX_REPLY_WAIT_MS));
+        if (sent == pdTRUE) {
+            sent = xRingbufferSend(ctx->tx_ringbuf, "\n", 1, pdMS_TO_TICKS(TRANSFER_TX_REPLY_WAIT_MS));
+        }
+        transfer_control_tx_unlock(ctx);
+    }
+    cJSON_free(line);
+    return (sent == pdTRUE) ? ESP_OK : ESP_FAIL;
+}
@@ -4,6 +4,10 @@
 #include <freertos/task.h>
 #include <string.h>
 #include <stdio.h>
+#include "esp_system.h"
+#include "backup_mgr.h"
+#include "pv_pack.h"
+#include "unity.h"
 
 #include "transfer_control.h"
 #include <freertos/FreeRTOS.h>
@@ -18,14 +22,23 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+static transfer_ctx_t *test_ctx; // Session the dummy tasks talk to, bound to handle 0
+
+static void open_test_ctx(void)
+{
+    if ((test_ctx = transfer_control_find(0)) == NULL) {
+        test_ctx = transfer_control_open(0);
+    }
+}
+
 void dummy_bt_task(void* param)
 {
     size_t item_size;
-    char *data = (char *)xRingbufferReceive(tx_ringbuf, &item_size, portMAX_DELAY);
+    char *data = (char *)xRingbufferReceive(test_ctx->tx_ringbuf, &item_size, portMAX_DELAY);
     if (data)
     {
         printf("Dummy Bluetooth consumer received: %.*s\n", (int)item_size, data);
-        vRingbufferReturnItem(tx_ringbuf, data);
+        vRingbufferReturnItem(test_ctx->tx_ringbuf, data);
     }
     const char *mock_file_content = (const char *)param;
     size_t total_len = strlen(mock_file_content) + 1; // +1 for null terminator
@@ -39,7 +52,7 @@ void dummy_bt_task(void* param)
         size_t remaining = total_len - offset;
         size_t send_len = (remaining < chunk_size) ? remaining : chunk_size;
 
-        sent = xRingbufferSend(rx_ringbuf, buffer_to_send + offset, send_len, portMAX_DELAY);
+        sent = (pv_spsc_send(&test_ctx->rx_ring, buffer_to_send + offset, send_len, portMAX_DELAY) == send_len) ? pdTRUE : pdFALSE;
         if (sent != pdTRUE) {
             printf("Failed to send chunk to RX ring buffer\n");
             break;
@@ -53,29 +66,17 @@ void dummy_bt_task(void* param)
 
 void dummy_backup_task()
 {
-    transfer_cmd_t tx_cmd = {
-        .transfer_type = TRANSFER_TYPE_TX,
-        .status = 0
-    };
-    strncpy(tx_cmd.file_path, "/dummy/path/file_tx.txt", sizeof(tx_cmd.file_path));
-
-    xQueueSend(tx_cmd_queue, &tx_cmd, portMAX_DELAY);
+    const char *path = "/dummy/path/file_tx.txt";
+    backup_state_t state;
 
-    int i = 0;
-    while (i < 2)
-    {
-        transfer_cmd_t status_msg;
-        if (xQueueReceive(status_queue, &status_msg, portMAX_DELAY) == pdTRUE)
-        {
-            const char *type_str = status_msg.transfer_type == TRANSFER_TYPE_TX ? "TX" : "RX";
-            if (status_msg.status == 0) {
-                printf("[BackupManager] SUCCESS: %s completed for %s\n", type_str, status_msg.file_path);
-            } else {
-                printf("[BackupManager] FAIL: %s failed for %s [ERR = %d]\n",
-                       type_str, status_msg.file_path, status_msg.status);
-            }
-            i++;
-        }
+    backup_mgr_enqueue(path, TRANSFER_TYPE_TX, BACKUP_PRIO_NORMAL);
+    while ((state = backup_mgr_get_state(path, TRANSFER_TYPE_TX)) != BACKUP_DONE && state != BACKUP_FAILED) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    if (state == BACKUP_DONE) {
+        printf("[BackupManager] SUCCESS: TX completed for %s\n", path);
+    } else {
+        printf("[BackupManager] FAIL: TX failed for %s\n", path);
     }
     success_flag = 1;
     vTaskDelete(NULL);
@@ -121,6 +122,7 @@ void append_data(char **buffer, size_t *buffer_len, size_t *buffer_size, const c
 
 void happy_path(){
     printf("Happy Path\n");
+    open_test_ctx();
     const char *mock_file_content = "MobileDeviceData";
     xTaskCreate(dummy_bt_task, "dummy_bt_task", 2048, (void*)mock_file_content, 4, NULL);
     xTaskCreate(dummy_backup_task, "dummy_backup_task", 2048, NULL, 4, NULL);
@@ -132,6 +134,7 @@ void happy_path(){
 
 void failure_path(){
     printf("Failure Path\n");
+    open_test_ctx();
     const char *failure_content = FAILURE_PATTERN;
     xTaskCreate(dummy_bt_task, "dummy_bt_task", 8192, (void *) failure_content, 4, NULL);
     xTaskCreate(dummy_backup_task, "dummy_backup_task", 8192, NULL, 4, NULL);
@@ -142,6 +145,7 @@ void failure_path(){
 }
 void overflow_path(){
     printf("Overflow Path\n");
+    open_test_ctx();
     char buffer[INITIAL_BUFFER_SIZE+5];
     memset(buffer, 'd', INITIAL_BUFFER_SIZE+4);
     buffer[INITIAL_BUFFER_SIZE+4] = '\0';
@@ -152,3 +156,135 @@ void overflow_path(){
     }
     success_flag = 0;
 }
+
+void reconnect_path(){
+    printf("Reconnect Path\n");
+    uint32_t free_before = 0;
+    transfer_ctx_t *ctx = transfer_control_find(0);
+    // The first cycle may allocate lazily inside the BT stack, measure after it
+    transfer_control_close(ctx);
+    transfer_control_close(transfer_control_open(0));
+    vTaskDelay(pdMS_TO_TICKS(2 * TRANSFER_RESET_POLL_MS));
+    free_before = esp_get_free_heap_size();
+    for (int i = 0; i < 20; i++) {
+        ctx = transfer_control_open(0);
+        pv_spsc_send(&ctx->rx_ring, "stale", 5, portMAX_DELAY);
+        transfer_control_close(ctx);
+        vTaskDelay(pdMS_TO_TICKS(2 * TRANSFER_RESET_POLL_MS));
+    }
+    printf("Free heap before %lu after %lu\n", (unsigned long)free_before, (unsigned long)esp_get_free_heap_size());
+    success_flag = (esp_get_free_heap_size() >= free_before) ? 1 : -1;
+}
+
+static void pack_put_task(void *param)
+{
+    *(esp_err_t *)param = pv_pack_put("/test/after_cut.txt", "x", 1);
+    vTaskDelete(NULL);
+}
+
+void packed_disconnect_path(){
+    printf("Packed Disconnect Path\n");
+    volatile esp_err_t put_err = ESP_ERR_TIMEOUT;
+    uint64_t size = 0;
+    uint32_t len = 0;
+    transfer_ctx_t *ctx = transfer_control_find(0);
+
+    if (ctx == NULL) {
+        ctx = transfer_control_open(0);
+    }
+    if (!pv_pack_accepts(64)) {
+        printf("Pack store not running, skipped\n");
+        success_flag = 1;
+        return;
+    }
+
+    // Half a packed file, then the phone goes away
+    if (!process_photo_metadata(ctx, "{\"filepath\":\"/test/packed_cut.txt\",\"filesize\":64}", &size) ||
+        !ctx->meta.packed || !transfer_control_queue_file(ctx)) {
+        success_flag = -1;
+        return;
+    }
+    pv_spsc_send(&ctx->rx_ring, "0123456789abcdef", 16, portMAX_DELAY);
+    vTaskDelay(pdMS_TO_TICKS(2 * TRANSFER_RESET_POLL_MS));
+    transfer_control_close(ctx);
+    vTaskDelay(pdMS_TO_TICKS(2 * TRANSFER_RESET_POLL_MS));
+
+    // The pack store must be unlocked again, a writer that blocks on it fails the test
+    xTaskCreate(pack_put_task, "pack_put_task", 4096, (void *)&put_err, 4, NULL);
+    for (int i = 0; i < 10 && put_err == ESP_ERR_TIMEOUT; i++) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    printf("Pack put after disconnect: 0x%x\n", put_err);
+    success_flag = (put_err == ESP_OK && !pv_pack_contains("/test/packed_cut.txt", &len)) ? 1 : -1;
+    if (put_err == ESP_OK) {
+        pv_pack_delete("/test/after_cut.txt");
+    }
+}
+
+/***************************************************************************
+ * Function:    test_reconnectPath
+ * Purpose:     Runs reconnect_path(): opening and closing a session many
+ *              times must not leak heap
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void test_reconnectPath(void)
+{
+    reconnect_path();
+    TEST_ASSERT_EQUAL(1, success_flag);
+    success_flag = 0;
+}
+
+/***************************************************************************
+ * Function:    test_packedDisconnectPath
+ * Purpose:     Runs packed_disconnect_path(): a disconnect in the middle of
+ *              a packed file must abort its record and unlock the pack store
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void test_packedDisconnectPath(void)
+{
+    packed_disconnect_path();
+    TEST_ASSERT_EQUAL(1, success_flag);
+    success_flag = 0;
+}
+
+/***************************************************************************
+ * Function:    test_restoreRequest
+ * Purpose:     The RESTORE_CMD packet must queue the file with the backup
+ *              manager, and bad paths must be refused without queueing
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void test_restoreRequest(void)
+{
+    static const char path[] = "/test/restore_req.txt\n";
+    char too_long[MAX_PATH_SIZE + 1];
+
+    TEST_ASSERT_EQUAL(ESP_OK, transfer_control_request_restore((const uint8_t *)path, strlen(path)));
+    TEST_ASSERT_NOT_EQUAL(BACKUP_NONE, backup_mgr_get_state("/test/restore_req.txt", TRANSFER_TYPE_TX));
+
+    memset(too_long, 'a', sizeof(too_long));
+    too_long[0] = '/';
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, transfer_control_request_restore((const uint8_t *)too_long, sizeof(too_long)));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, transfer_control_request_restore((const uint8_t *)"\n", 1));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, transfer_control_request_restore((const uint8_t *)"test/rel.txt", 12));
+    TEST_ASSERT_EQUAL(BACKUP_NONE, backup_mgr_get_state("test/rel.txt", TRANSFER_TYPE_TX));
+}
+
+/***************************************************************************
+ * Function:    start_transfer_control_tests
+ * Purpose:     Run the transfer control tests that need no phone. The
+ *              happy, failure and overflow paths send over Bluetooth and
+ *              can only run with a phone connected.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void start_transfer_control_tests(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_reconnectPath);
+    RUN_TEST(test_packedDisconnectPath);
+    RUN_TEST(test_restoreRequest);
+    UNITY_END();
+}
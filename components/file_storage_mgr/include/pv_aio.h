@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "pv_fs.h"
+#include "pv_tasks.h"
+
+/*
+    Asynchronous storage service. A single I/O task owns the SD card; clients
+    fill in a pv_aio_req_t and submit it. Requests run in submission order,
+    except that PV_AIO_PRIO_HIGH requests are taken before queued normal ones
+    (only use it for requests that don't depend on queued normal requests).
+    Adjacent small writes to the same file are merged into one f_write and
+    back to back mkdirs of the same path run once.
+*/
+
+#define PV_AIO_QUEUE_LEN            16U                         // Requests that can be waiting per priority
+#define PV_AIO_MAX_FILES            4U                          // Files that can be open through the service
+#define PV_AIO_POOL_SIZE            8U                          // Fire and forget requests from pv_aio_req_alloc()
+#define PV_AIO_MERGE_BUF_SIZE       (8U * 1024U)                // Staging buffer for merged writes
+#define PV_AIO_MERGE_MAX_WRITE      (2U * 1024U)                // Only writes up to this size are merged
+#define PV_AIO_TASK_STACK_SIZE      4096U
+#define PV_AIO_TASK_PRIORITY        PV_TASK_PRIO_AIO
+#define PV_AIO_OFFSET_CURRENT       UINT64_MAX                  // Read from the current file position
+
+#define PV_AIO_INVALID_HANDLE       (-1)
+
+typedef enum {
+    PV_AIO_OP_OPEN_WRITE,       // Create/truncate path, preallocating size_hint bytes
+    PV_AIO_OP_OPEN_READ,        // Open path for reading
+    PV_AIO_OP_CREATE,           // As OPEN_WRITE, but an existing path is kept and the file is
+                                // created at the path in buf instead (path returns the one used)
+    PV_AIO_OP_WRITE,            // Write len bytes of buf to handle
+    PV_AIO_OP_READ,             // Read up to len bytes into buf from handle at offset
+    PV_AIO_OP_MKDIR,            // Create path and any missing parents
+    PV_AIO_OP_CLOSE,            // Close handle
+    PV_AIO_OP_DELETE_DIR,       // Delete path and everything in it (pv_delete_dir()), refused
+                                // with ESP_ERR_INVALID_STATE while a file in it is open
+} pv_aio_op_t;
+
+typedef enum {
+    PV_AIO_PRIO_NORMAL,
+    PV_AIO_PRIO_HIGH,
+} pv_aio_prio_t;
+
+typedef int pv_aio_handle_t;
+typedef struct pv_aio_req pv_aio_req_t;
+typedef void (*pv_aio_cb_t)(pv_aio_req_t *req, void *arg);
+
+struct pv_aio_req {
+    /* Filled in by the client */
+    pv_aio_op_t op;
+    pv_aio_prio_t prio;
+    pv_aio_handle_t handle;             // WRITE/READ/CLOSE
+    char path[FATFS_PATH_MAX_LENGTH];   // OPEN_*/CREATE/MKDIR/DELETE_DIR, POSIX path under SD_CARD_BASE_PATH
+    uint64_t size_hint;                 // OPEN_WRITE/CREATE, OPEN_READ returns the file size here
+    uint64_t offset;                    // READ, or PV_AIO_OFFSET_CURRENT
+    void *buf;                          // WRITE/READ, must stay valid until completion
+                                        // (CREATE: alternative path, may be NULL)
+    size_t len;                         // WRITE/READ
+    pv_aio_cb_t cb;                     // Completion callback, runs on the I/O task (may be NULL)
+    void *cb_arg;
+
+    /* Filled in on completion */
+    esp_err_t err;                      // Result of the request
+    size_t result;                      // Bytes read or written
+                                        // (OPEN_* return the new handle in handle)
+
+    /* Internal */
+    SemaphoreHandle_t done;
+    bool from_pool;
+};
+
+/* FUNCTION DEFS */
+esp_err_t pv_aio_init(void);
+esp_err_t pv_aio_submit(pv_aio_req_t *req);
+esp_err_t pv_aio_submit_wait(pv_aio_req_t *req);
+pv_aio_req_t *pv_aio_req_alloc(void);
+esp_err_t pv_aio_mkdir_async(const char *path);
+void pv_aio_request_sync(void);
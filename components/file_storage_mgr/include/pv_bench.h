@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#include "pv_fs.h"
+
+/*
+    Storage benchmarks, run on a development card when
+    CONFIG_PV_FS_RUN_BENCHMARKS is enabled. Results are logged.
+*/
+
+#define PV_BENCH_DIR                SD_CARD_BASE_PATH "/bench"
+#define PV_BENCH_BATCH_FILES        500U                        // Create rate is reported per batch
+#define PV_BENCH_WRITE_CHUNK        (32U * 1024U)               // Bytes per write, like a merged aio write
+#define PV_BENCH_PACKET_SIZE        4096U                       // Bytes per packet, like an RX ring buffer item
+#define PV_BENCH_PACKETS            8U                          // Packets in flight between radio and writer
+#define PV_BENCH_RADIO_PRIORITY     19U                         // Bluedroid's BTC task priority
+#define PV_BENCH_RADIO_US_PER_PACKET 1000U                      // CPU time the stand-in radio spends per packet
+
+typedef struct {
+    uint32_t files;                 // Files created
+    int64_t total_us;               // Time for all creates
+    int64_t first_us_per_file;      // Average create time over the first batch
+    int64_t last_us_per_file;       // Average create time over the last batch
+} pv_bench_create_result_t;
+
+typedef struct {
+    uint64_t bytes;                 // File size written
+    int64_t open_us;                // Create and preallocate, including a pre-erase
+    int64_t write_us;               // Writing the data
+    int64_t close_us;               // Final sync and close
+} pv_bench_write_result_t;
+
+typedef struct {
+    uint64_t bytes;                 // Bytes written to the card
+    int64_t total_us;               // First packet to file closed
+    int64_t radio_us;               // Time the radio stand-in spent on packets
+} pv_bench_placement_result_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_bench_bulk_create(const char *dir, uint32_t n_files, bool short_names, pv_bench_create_result_t *result);
+esp_err_t pv_bench_sequential_write(const char *path, uint64_t bytes, bool pre_erase, pv_bench_write_result_t *result);
+esp_err_t pv_bench_placement(const char *path, uint64_t bytes, BaseType_t writer_core, pv_bench_placement_result_t *result);
+void pv_bench_run_all(void);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+    Bounded RAM cache of directory entries, keyed by (parent directory, name)
+    hashes of the POSIX path (case folded, as FAT names are case insensitive).
+    A hit answers exists/stat questions without reading directory sectors from
+    the card; misses fall back to f_stat and are cached, including "does not
+    exist" answers. Least recently used entries are replaced. A miss is only
+    cached if no entry was updated or dropped while f_stat ran, so a lookup
+    never overwrites what a concurrent create recorded.
+
+    Coherence: every create, write, mkdir and delete done through
+    file_storage_mgr (pv_file, pv_aio, pv_delete_dir, pv_fmt_sdc and the
+    backup log) updates or invalidates the affected entries. Files changed
+    behind its back (e.g. with fopen() from another component) must be
+    passed to pv_dentry_invalidate().
+*/
+
+#define PV_DENTRY_CACHE_SIZE        64U                     // Entries kept
+
+typedef struct {
+    bool exists;                    // false for a cached "no such file"
+    uint8_t attrib;                 // FatFs AM_* attributes
+    uint64_t size;                  // File size in bytes (0 for directories)
+} pv_dentry_t;
+
+typedef struct {
+    uint64_t parent_hash;           // Hash of the parent directory path
+    uint64_t name_hash;             // Hash of the last path component
+} pv_dentry_key_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_dentry_stat(const char *path, pv_dentry_t *dentry);
+bool pv_dentry_exists(const char *path);
+void pv_dentry_get_key(const char *path, pv_dentry_key_t *key);
+void pv_dentry_update(const char *path, const pv_dentry_t *dentry);
+void pv_dentry_update_key(const pv_dentry_key_t *key, const pv_dentry_t *dentry);
+void pv_dentry_invalidate(const char *path);
+void pv_dentry_invalidate_n(const char *path, size_t len);
+void pv_dentry_clear(void);
+void pv_dentry_get_stats(uint32_t *hits, uint32_t *misses);
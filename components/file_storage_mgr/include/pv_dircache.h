@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    RAM cache of directories known to exist on the card, so that preparing the
+    directory of every received photo doesn't cost a lookup per path component.
+    Only 64 bit hashes of the POSIX paths are kept (case folded, as FAT names
+    are case insensitive). Entries are only ever positive: the whole cache is
+    cleared whenever a directory may have been removed (delete or format).
+*/
+
+#define PV_DIRCACHE_SLOTS           128U                        // Power of two
+#define PV_DIRCACHE_MAX_ENTRIES     (PV_DIRCACHE_SLOTS * 3U / 4U) // Cleared when fuller than this
+
+/* FUNCTION DEFS */
+bool pv_dircache_contains(const char *path);
+bool pv_dircache_contains_n(const char *path, size_t len);
+void pv_dircache_add(const char *path);
+void pv_dircache_add_n(const char *path, size_t len);
+void pv_dircache_clear(void);
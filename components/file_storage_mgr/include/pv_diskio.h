@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "ff.h"
+#include "diskio_impl.h"
+#include "sdmmc_cmd.h"
+#include "sdkconfig.h"
+
+#include "pv_fs.h"
+#include "pv_tasks.h"
+#include "pv_trace_format.h"
+
+/*
+    FatFs diskio driver for the SD card that counts every access before
+    passing it to the sdmmc driver. Sectors are split by what they hold:
+
+    DATA    file contents
+    FAT     the FAT, exFAT allocation bitmap, boot sector and FSINFO
+    DIR     directory entries (anything else FatFs reads or writes through
+            its window buffer fs->win)
+
+    Transaction latencies are kept in log2 histograms: bucket 0 counts
+    transactions under 2^(PV_DISKIO_HIST_MIN_LOG2 + 1) us, bucket i above
+    that counts [2^(i + PV_DISKIO_HIST_MIN_LOG2), 2^(i + PV_DISKIO_HIST_MIN_LOG2 + 1))
+    and the last bucket everything slower.
+
+    Photo bytes received are added with pv_diskio_add_payload(), so the
+    write amplification is sectors written * sector size / payload bytes.
+
+    Transfers whose buffer the SD driver can't DMA in place (see pv_dma.h)
+    are counted as bounces. They are staged through one PV_DISKIO_BOUNCE_SIZE
+    DMA buffer so the driver still sees multi-sector transfers, but every
+    bounce is a copy a pv_dma_alloc() buffer would have avoided.
+
+    With CONFIG_PV_FS_PRE_ERASE, files preallocated in one contiguous run of
+    at least CONFIG_PV_FS_PRE_ERASE_MIN_KB are erased before their data is
+    written (pv_diskio_pre_erase()), for the card models listed in
+    CONFIG_PV_FS_PRE_ERASE_CARDS or all cards if the list is empty.
+
+    With CONFIG_PV_DISKIO_TRACE every read, write and ioctl can also be
+    recorded to PV_DISKIO_TRACE_PATH in the format of pv_trace_format.h, for
+    replay on a PC with tools/diskio_replay. Records are collected in two RAM
+    buffers and a low priority task appends each full one to the file. The
+    task's own writes are not recorded, and records arriving while both
+    buffers are full are dropped and counted.
+*/
+
+#define PV_DISKIO_HIST_BUCKETS      12U
+#define PV_DISKIO_HIST_MIN_LOG2     6U                          // Bucket 0 is under 128 us
+#define PV_DISKIO_BOUNCE_SIZE       4096U                       // Staging buffer of unaligned transfers
+
+#if CONFIG_PV_FS_PRE_ERASE
+#define PV_DISKIO_PRE_ERASE_MIN_SIZE ((uint64_t)CONFIG_PV_FS_PRE_ERASE_MIN_KB * 1024U)
+#else
+#define PV_DISKIO_PRE_ERASE_MIN_SIZE (1024U * 1024U)                 // Used by the benchmark
+#endif
+
+#define PV_DISKIO_TRACE_PATH        SD_CARD_BASE_PATH "/DISKIO.TRC"
+#define PV_DISKIO_TRACE_TASK_STACK_SIZE 3072U
+#define PV_DISKIO_TRACE_TASK_PRIORITY   PV_TASK_PRIO_BACKGROUND
+
+typedef enum {
+    PV_DISKIO_DATA,
+    PV_DISKIO_FAT,
+    PV_DISKIO_DIR,
+    PV_DISKIO_CLASS_COUNT,
+} pv_diskio_class_t;
+
+typedef struct {
+    uint64_t sectors_read[PV_DISKIO_CLASS_COUNT];
+    uint64_t sectors_written[PV_DISKIO_CLASS_COUNT];
+    uint32_t reads;                                             // Read transactions
+    uint32_t writes;                                            // Write transactions
+    uint32_t ioctls;
+    uint32_t errors;                                            // Failed reads and writes
+    uint64_t read_us;                                           // Total time in reads
+    uint64_t write_us;                                          // Total time in writes
+    uint32_t read_hist[PV_DISKIO_HIST_BUCKETS];
+    uint32_t write_hist[PV_DISKIO_HIST_BUCKETS];
+    uint64_t payload_bytes;                                     // Photo bytes received
+    uint32_t pre_erases;                                        // Preallocated runs erased before writing
+    uint64_t pre_erase_sectors;
+    uint64_t pre_erase_us;
+    uint32_t bounce_reads;                                      // Transfers whose buffer was not DMA capable
+    uint32_t bounce_writes;
+    uint64_t bounce_sectors;
+} pv_diskio_stats_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_diskio_register(BYTE pdrv, sdmmc_card_t *card, bool status_check);
+DRESULT pv_diskio_read(unsigned char pdrv, unsigned char *buff, uint32_t sector, unsigned count);
+DRESULT pv_diskio_write(unsigned char pdrv, const unsigned char *buff, uint32_t sector, unsigned count);
+uint32_t pv_diskio_fat_writes(void);
+bool pv_diskio_card_in_list(const sdmmc_card_t *card, const char *list);
+esp_err_t pv_diskio_pre_erase(LBA_t first, LBA_t count);
+void pv_diskio_set_pre_erase(bool enable);
+bool pv_diskio_pre_erase_enabled(void);
+void pv_diskio_add_payload(size_t bytes);
+void pv_diskio_get_stats(pv_diskio_stats_t *stats);
+void pv_diskio_reset_stats(void);
+uint64_t pv_diskio_sectors_written(const pv_diskio_stats_t *stats);
+uint32_t pv_diskio_write_amplification_x100(const pv_diskio_stats_t *stats);
+void pv_diskio_log_stats(void);
+esp_err_t pv_diskio_trace_start(void);
+esp_err_t pv_diskio_trace_stop(void);
+uint32_t pv_diskio_trace_dropped(void);
+
+#if CONFIG_PV_DISKIO_TRACE
+void pv_diskio_trace_record(pv_trace_op_t op, uint8_t info, uint32_t sector, uint32_t count, int64_t start_us,
+                            uint32_t dur_us, DRESULT result);
+#else
+static inline void pv_diskio_trace_record(pv_trace_op_t op, uint8_t info, uint32_t sector, uint32_t count,
+                                          int64_t start_us, uint32_t dur_us, DRESULT result) { }
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+    Durability policy for received photos and backup log entries, selected
+    with CONFIG_PV_DURABILITY_MODE. A sync (f_sync on every open file plus a
+    flush of the buffered log entries) always runs on the storage I/O task.
+
+    In every mode a photo is committed when its file is closed: FatFs writes
+    the directory entry, FAT/bitmap and cached sectors on f_close. The modes
+    differ in what survives a crash or power loss in the middle of a transfer.
+
+    PER_FILE (default)
+        Log entries are written to the card as soon as they are added.
+        After a crash: every closed photo and every logged entry is on the
+        card. The photo being received is lost (its directory entry still has
+        the size from before the transfer), and clusters preallocated for it
+        may stay allocated until the card is checked.
+
+    PER_N_MB
+        In-progress files and buffered log entries are synced each time
+        CONFIG_PV_DURABILITY_SYNC_MB of photo data has been written.
+        After a crash: closed photos are intact; the photo being received is
+        intact up to the last sync point; log entries added after the last
+        sync are lost, so those photos are sent again on the next backup.
+
+    PER_SESSION
+        Log entries are buffered until the connection closes.
+        After a crash: closed photos are intact but may be missing from the
+        log (they are sent again on the next backup); the photo being
+        received is lost as in PER_FILE. Fewest writes to the card.
+
+    TIMER
+        In-progress files and buffered log entries are synced every
+        CONFIG_PV_DURABILITY_SYNC_MS milliseconds.
+        After a crash: at most the last period of data and log entries is
+        lost, regardless of transfer speed.
+
+    The log buffer also flushes whenever it fills up or a different device's
+    log is written, so no mode ever drops an entry without a crash.
+*/
+
+typedef enum {
+    PV_DURABILITY_PER_FILE,
+    PV_DURABILITY_PER_N_MB,
+    PV_DURABILITY_PER_SESSION,
+    PV_DURABILITY_TIMER,
+} pv_durability_mode_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_durability_init(void);
+pv_durability_mode_t pv_durability_get_mode(void);
+bool pv_durability_log_sync_on_append(void);
+bool pv_durability_data_written(size_t len);
+void pv_durability_synced(void);
+void pv_durability_session_end(void);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "ff.h"
+
+#include "pv_dentry.h"
+
+/*
+    Files written through this API bypass the VFS/stdio layer and talk to FatFs
+    directly, so a file stays open for its whole transfer and its clusters can
+    be preallocated in one contiguous block.
+*/
+typedef struct {
+    FIL fil;                    // FatFs file object
+    bool is_open;               // true between pv_file_open_*() and pv_file_close()
+    bool is_contiguous;         // true if the file was preallocated as one contiguous block
+    uint64_t size_hint;         // Expected final size (0 if unknown)
+    pv_dentry_key_t dentry_key; // Keeps the dentry cache entry of the file up to date
+} pv_file_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_file_open_write(pv_file_t *file, const char *path, uint64_t size_hint);
+esp_err_t pv_file_create(pv_file_t *file, const char *path, const char *alt_path, uint64_t size_hint, bool *used_alt);
+esp_err_t pv_file_open_read(pv_file_t *file, const char *path);
+esp_err_t pv_file_write(pv_file_t *file, const void *data, size_t len);
+esp_err_t pv_file_read(pv_file_t *file, void *data, size_t len, size_t *read_len);
+esp_err_t pv_file_sync(pv_file_t *file);
+esp_err_t pv_file_seek(pv_file_t *file, uint64_t offset);
+esp_err_t pv_file_close(pv_file_t *file);
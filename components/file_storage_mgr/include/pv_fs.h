@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "sdkconfig.h"
+#include "ff.h"
 
 #define SD_CARD_BASE_PATH               "/sdcard"                   // Base path for the SD card
 
@@ -10,11 +15,39 @@
 #define FATFS_MAX_FILES                 1U                          // Maximum number of files that can be opened simultaneously
 #define FATFS_WORKBUF_SIZE              4096U                       // 4KB work buffer size for FATFS operations
 #define FATFS_ALLOCATION_UNIT_SIZE      4U * 1024U                  // 4KB allocation unit size
+#define FATFS_EXFAT_ALLOCATION_UNIT_SIZE (CONFIG_PV_FS_EXFAT_AU_KB * 1024U) // exFAT allocation unit size
+#define FATFS_EXFAT_AUTO_THRESHOLD      (32ULL * 1024U * 1024U * 1024U) // Cards this size and up get exFAT in auto mode
+#define FATFS_PATH_MAX_LENGTH           264U                        // Max FatFs path ("0:" + 255 char LFN + slack)
 
 #define FORMAT_SD_CARD_ON_MOUNT_FAIL    1U                          // Format SD card if mounting fails
 
+#define FS_DELETE_MAX_DEPTH             16                          // Deepest directory tree pv_delete_dir() will walk
+#define FS_DELETE_YIELD_BATCH           32U                         // Deletions between yields in pv_delete_dir()
+#define FS_FREE_SPACE_RESERVE           (1024U * 1024U)             // Space kept free for logs and directory growth
+
+
+typedef struct {
+    uint64_t free_bytes;        // Free space in bytes
+    uint32_t free_clusters;     // Free clusters
+    uint32_t cluster_size;      // Cluster size in bytes
+    uint32_t next_free_hint;    // Cluster where the next allocation search starts
+    bool validated;             // true once the count was checked against a full FAT/bitmap scan
+} pv_fs_space_t;
+
 
 /* FUNCTION DEFS */
 esp_err_t pv_init_fs(void);
 esp_err_t pv_fmt_sdc(void);
-esp_err_t pv_delete_dir(const char *path);
\ No newline at end of file
+esp_err_t pv_delete_dir(const char *path);
+bool pv_fs_is_being_deleted(const char *path);
+uint32_t pv_fs_delete_seq(void);
+esp_err_t pv_fs_fence_enter(const char *path);
+void pv_fs_fence_exit(void);
+bool pv_fs_is_exfat(void);
+esp_err_t pv_fs_get_ff_path(const char *vfs_path, char *ff_path, size_t ff_path_len);
+uint64_t pv_fs_hash(const char *str, size_t len, bool ignore_case);
+FATFS *pv_fs_get_fatfs(void);
+BYTE pv_fs_get_pdrv(void);
+esp_err_t pv_fs_space_start(void);
+esp_err_t pv_fs_get_space(pv_fs_space_t *info);
+bool pv_fs_has_room(uint64_t size);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#include "pv_fs.h"
+
+/*
+    Maps the path a photo has on the phone (its logical name) to where it is
+    stored on the card. By default the phone's folders are recreated under
+    SD_CARD_MOUNT_POINT. With CONFIG_PV_FS_SHARDED_LAYOUT the photo is stored
+    as PV_LAYOUT_OBJECTS_DIR/xx[/yy]/<fingerprint>.<ext>, where the directories
+    and name come from a 64 bit hash of the logical name. With
+    CONFIG_PV_FS_SHORT_NAMES the file name on FAT volumes is an 8.3 name
+    made of PV_LAYOUT_SHORT_NAME_CHARS base32 digits of the hash, so FatFs
+    never has to search for a free ~N short name. Two photos can still hash
+    to the same 8.3 name, and that name has no long name entry saying whose
+    file it is, so a file that already exists is never replaced: the new
+    photo is stored at its long path (pv_layout_get_long_path()) instead
+    and pv_layout_resolve_path() looks there first. Only a file of exactly
+    the announced size is taken for an earlier copy of the same photo and
+    replaced (see pv_file_create()).
+    The mapping is deterministic, the stored path is always one of the two
+    and can be recomputed from the logical name; the backup log also
+    records it.
+*/
+
+#define PV_LAYOUT_OBJECTS_DIR       SD_CARD_MOUNT_POINT "/objects"
+#define PV_LAYOUT_FANOUT_BITS       8U                          // 256 directories per level
+#define PV_LAYOUT_MAX_EXT_LENGTH    8U                          // Longer extensions are dropped
+#define PV_LAYOUT_SHORT_NAME_CHARS  8U                          // 8.3 stem, 5 hash bits per character
+#define PV_LAYOUT_SHORT_EXT_LENGTH  3U                          // 8.3 extension
+#define PV_LAYOUT_SHORT_NAME_SIZE   (PV_LAYOUT_SHORT_NAME_CHARS + 1U + PV_LAYOUT_SHORT_EXT_LENGTH + 1U)
+
+/* FUNCTION DEFS */
+bool pv_layout_is_sharded(void);
+bool pv_layout_uses_short_names(void);
+uint64_t pv_layout_fingerprint(const char *logical_path, size_t len);
+esp_err_t pv_layout_get_short_name(const char *logical_path, size_t len, char *name, size_t name_len);
+esp_err_t pv_layout_get_path(const char *logical_path, size_t len, char *path, size_t path_len);
+esp_err_t pv_layout_get_long_path(const char *logical_path, size_t len, char *path, size_t path_len);
+esp_err_t pv_layout_resolve_path(const char *logical_path, size_t len, char *path, size_t path_len);
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#include "pv_fs.h"
+#include "pv_tasks.h"
+
+/*
+    Pack store for small files. Objects are appended as records to segment
+    files (PV_PACK_DIR/SEGnnnnn.DAT) that are preallocated to their full size
+    when created, so an append only writes data sectors: no cluster
+    allocation, no FAT update and no new directory entry per object.
+
+    Each segment starts with a pv_pack_seg_hdr_t holding a random salt that
+    seeds every record header CRC, so stale records left on the card by a
+    deleted segment (or before a format) never validate. The commit word of
+    a record is derived from its header CRC, so a stale trailer left where a
+    new record was cut off can't commit it either.
+
+    Record layout (little endian):
+        header  (pv_pack_hdr_t, with its own CRC)
+        name    (the logical path, name_len bytes, not terminated)
+        data    (data_len bytes)
+        trailer (pv_pack_trailer_t: data CRC and commit marker)
+
+    The header is written first and the trailer last, so an object cut off by
+    a power loss is skipped (and counted as dead) when the segments are
+    scanned at mount. Segments are scanned in id order and later records win;
+    deletes append a tombstone record. The index lives in RAM and is rebuilt
+    from the segments at mount.
+
+    A background task copies the live objects out of sealed segments whose
+    deleted share reaches CONFIG_PV_FS_PACK_REPACK_PCT and removes the old
+    segment.
+*/
+
+#define PV_PACK_DIR                 SD_CARD_BASE_PATH "/pack"
+#define PV_PACK_MAX_SEGMENTS        64U
+#define PV_PACK_SEG_MAGIC           0x47535650U                 // "PVSG"
+#define PV_PACK_MAGIC               0x4B505650U                 // "PVPK"
+#define PV_PACK_COMMIT              0x4B4F5650U                 // "PVOK", XORed with the header CRC
+#define PV_PACK_REPACK_PERIOD_MS    10000U                      // How often sealed segments are checked
+#define PV_PACK_TASK_STACK_SIZE     4096U
+#define PV_PACK_TASK_PRIORITY       PV_TASK_PRIO_BACKGROUND
+#define PV_PACK_COPY_BUF_SIZE       4096U
+
+#if CONFIG_PV_FS_PACK_STORE
+#define PV_PACK_MAX_OBJECT_SIZE     ((uint32_t)CONFIG_PV_FS_PACK_MAX_OBJECT_KB * 1024U)
+#define PV_PACK_SEGMENT_SIZE        ((uint32_t)CONFIG_PV_FS_PACK_SEGMENT_MB * 1024U * 1024U)
+#define PV_PACK_INDEX_ENTRIES       CONFIG_PV_FS_PACK_INDEX_ENTRIES
+#define PV_PACK_REPACK_PCT          CONFIG_PV_FS_PACK_REPACK_PCT
+#endif
+
+typedef enum {
+    PV_PACK_REC_OBJECT = 1,
+    PV_PACK_REC_TOMBSTONE = 2,
+} pv_pack_rec_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;                 // PV_PACK_SEG_MAGIC
+    uint32_t id;                    // Segment id, same as in the file name
+    uint32_t salt;                  // Seeds the record header CRCs
+    uint32_t crc;                   // CRC32 of the fields above
+} pv_pack_seg_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;                 // PV_PACK_MAGIC
+    uint8_t type;                   // pv_pack_rec_type_t
+    uint8_t reserved;
+    uint16_t name_len;
+    uint32_t data_len;
+    uint64_t name_hash;             // pv_layout_fingerprint() of the name
+    uint32_t hdr_crc;               // CRC32 of the fields above
+} pv_pack_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t data_crc;              // CRC32 of the data
+    uint32_t commit;                // PV_PACK_COMMIT ^ hdr_crc once the record is complete
+} pv_pack_trailer_t;
+
+/* An object being written with pv_pack_begin()/pv_pack_write()/pv_pack_end() */
+typedef struct {
+    bool active;
+    uint8_t seg;                    // Segment slot
+    uint32_t offset;                // Offset of the record in the segment
+    uint64_t name_hash;
+    uint16_t name_len;
+    uint32_t data_len;
+    uint32_t hdr_crc;               // Salts the commit word
+    uint32_t written;
+    uint32_t crc;
+} pv_pack_obj_t;
+
+typedef struct {
+    uint32_t objects;               // Live objects in the index
+    uint32_t segments;              // Segment files on the card
+    uint64_t live_bytes;            // Bytes of live records
+    uint64_t dead_bytes;            // Bytes of deleted, replaced or incomplete records
+} pv_pack_stats_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_pack_init(void);
+bool pv_pack_accepts(uint64_t size);
+esp_err_t pv_pack_begin(pv_pack_obj_t *obj, const char *name, uint32_t len);
+esp_err_t pv_pack_write(pv_pack_obj_t *obj, const void *data, size_t len);
+esp_err_t pv_pack_end(pv_pack_obj_t *obj);
+void pv_pack_abort(pv_pack_obj_t *obj);
+esp_err_t pv_pack_put(const char *name, const void *data, uint32_t len);
+esp_err_t pv_pack_get(const char *name, void *buf, size_t buf_len, uint32_t *len);
+bool pv_pack_contains(const char *name, uint32_t *len);
+esp_err_t pv_pack_delete(const char *name);
+esp_err_t pv_pack_delete_prefix(const char *prefix);
+esp_err_t pv_pack_repack(void);
+void pv_pack_sync(void);
+void pv_pack_get_stats(pv_pack_stats_t *stats);
@@ -12,11 +12,16 @@
 #define DEVICE_DIRECTORY_NAME_MAX_LENGTH 64
 #define BACKUP_PATH_MAX_LENGTH 128
 #define LOG_ENTRY_MAX_LENGTH 256
-#define LOG_FILE_NAME "log.csv"
+#define LOG_FILE_NAME "log.csv"                // Written by older firmware, still read
+#define LOG_SEGMENT_PREFIX "LOG"                // Log segments are LOG00000.CSV, LOG00001.CSV, ...
+#define LOG_SEGMENT_EXT "CSV"
+#define LOG_BUFFER_SIZE 4096            // Log entries held in RAM between durability syncs
 
 /* FUNCTION DEFS */
 esp_err_t pv_init_sdc(void);
 void pv_test_sdc(void);
 void pv_card_get(sdmmc_card_t **out_card);
 esp_err_t pv_update_backup_log(const char *serial_number, const char *file_path); // TODO: Move this to a more appropriate file during integration
-bool pv_is_backedUp(const char *serial_number, const char *file_path); // TODO: Move this to a more appropriate file during integration
\ No newline at end of file
+bool pv_is_backedUp(const char *serial_number, const char *file_path); // TODO: Move this to a more appropriate file during integration
+void pv_backup_log_init(void);
+esp_err_t pv_backup_log_flush(void);
\ No newline at end of file
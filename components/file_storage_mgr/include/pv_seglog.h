@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#include "pv_fs.h"
+
+/*
+    Append-only text logs kept in preallocated segment files
+    (<dir>/<prefix>NNNNN.<ext>, e.g. LOG00000.CSV).
+
+    A segment is created at its full size as one contiguous run of clusters
+    and zero filled, so its directory entry and FAT chain never change again.
+    Appends are written straight to the data sectors of the segment: the
+    sector holding the end of the log is kept in RAM and rewritten with the
+    new bytes, the rest of it still zero. The first NUL byte is the end
+    marker. When the bytes don't fit the next segment is created.
+
+    Segments are plain text followed by zeros, so they stay readable on a PC.
+    A line cut off by a power loss is terminated when the log is reopened, so
+    it never merges with the next entry; readers skip it as malformed.
+*/
+
+#define PV_SEGLOG_SEGMENT_SIZE      ((uint32_t)CONFIG_PV_SEGLOG_SEGMENT_KB * 1024U)
+#define PV_SEGLOG_NAME_PART_MAX     3U                          // Characters in prefix and extension (8.3 name)
+#define PV_SEGLOG_MAX_ID            99999U
+#define PV_SEGLOG_LINE_MAX          256U                        // Longest line returned by pv_seglog_for_each_line()
+#define PV_SEGLOG_ZERO_SECTORS      8U                          // Sectors zeroed per write when a segment is created
+
+typedef struct {
+    bool open;
+    char dir[FATFS_PATH_MAX_LENGTH];                            // POSIX path of the directory holding the segments
+    char prefix[PV_SEGLOG_NAME_PART_MAX + 1];
+    char ext[PV_SEGLOG_NAME_PART_MAX + 1];
+    uint32_t generation;                                        // pv_seglog_invalidate_all() count at open
+    bool has_segment;                                           // false until the first segment exists
+    uint32_t id;                                                // Segment appended to
+    uint32_t size;                                              // Size of that segment
+    LBA_t sector;                                               // Its first data sector, 0 if it can't be appended to
+    uint32_t end;                                               // Offset of the end marker
+    uint8_t *tail;                                              // Copy of the sector holding the end marker
+} pv_seglog_t;
+
+/* Called per line, return true to stop reading */
+typedef bool (*pv_seglog_line_cb_t)(const char *line, void *ctx);
+
+/* FUNCTION DEFS */
+esp_err_t pv_seglog_open(pv_seglog_t *log, const char *dir, const char *prefix, const char *ext);
+esp_err_t pv_seglog_append(pv_seglog_t *log, const void *data, size_t len);
+void pv_seglog_close(pv_seglog_t *log);
+esp_err_t pv_seglog_for_each_line(const char *dir, const char *prefix, const char *ext, pv_seglog_line_cb_t cb, void *ctx);
+void pv_seglog_invalidate_all(void);
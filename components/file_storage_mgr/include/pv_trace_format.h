@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+    Binary format of the diskio traces written by pv_diskio (with
+    CONFIG_PV_DISKIO_TRACE) and read by tools/diskio_replay. Shared by the
+    firmware and the host tool, so it only depends on stdint.h.
+
+    A trace is a pv_trace_hdr_t followed by pv_trace_rec_t records until the
+    end of the file; a partial record at the end (power loss while tracing)
+    is ignored. All fields are little endian.
+*/
+
+#include <stdint.h>
+
+#define PV_TRACE_MAGIC          0x52545650U     // "PVTR"
+#define PV_TRACE_VERSION        1U
+
+typedef enum {
+    PV_TRACE_OP_READ = 1,
+    PV_TRACE_OP_WRITE = 2,
+    PV_TRACE_OP_IOCTL = 3,
+} pv_trace_op_t;
+
+/* Same values as pv_diskio_class_t */
+typedef enum {
+    PV_TRACE_CLASS_DATA = 0,
+    PV_TRACE_CLASS_FAT = 1,
+    PV_TRACE_CLASS_DIR = 2,
+} pv_trace_class_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;                 // PV_TRACE_MAGIC
+    uint16_t version;               // PV_TRACE_VERSION
+    uint16_t sector_size;           // Bytes per sector of the traced card
+    uint32_t sector_count;          // Sectors on the traced card
+    uint32_t rec_size;              // sizeof(pv_trace_rec_t), lets readers skip added fields
+} pv_trace_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t delta_us;              // Start time since the start of the previous record
+    uint32_t sector;                // First sector, or first sector of a trimmed range
+    uint32_t count;                 // Sectors transferred or trimmed
+    uint32_t dur_us;                // Time the card took
+    uint8_t op;                     // pv_trace_op_t
+    uint8_t info;                   // pv_trace_class_t for reads/writes, the FatFs control code for ioctls
+    uint8_t result;                 // FatFs DRESULT
+    uint8_t reserved;
+} pv_trace_rec_t;
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "ff.h"
+#include "diskio_impl.h"
+#include "sdmmc_cmd.h"
+#include "sdkconfig.h"
+#include "pv_tasks.h"
+
+/*
+    Discard of clusters freed by FatFs. When a cluster chain is removed
+    (f_unlink, f_truncate, pv_delete_dir, segment deletes) FatFs passes each
+    contiguous run of freed sectors to the diskio driver as CTRL_TRIM, which
+    hands it to pv_trim_range(). This needs FF_USE_TRIM in the FatFs config.
+
+    Runs of at least CONFIG_PV_FS_TRIM_INLINE_KB are discarded right away.
+    Smaller runs are queued, merged with adjacent queued runs, and discarded
+    by a background task once the card has been idle for PV_TRIM_IDLE_MS.
+    When the queue is full it is drained inline in AUTO mode, in BACKGROUND
+    mode the new run is left alone. A queued run that is written again
+    before it is discarded is dropped from the queue, FatFs may reuse freed
+    clusters immediately.
+
+    Cards supporting SD discard get a discard, others a plain erase. Some
+    cards erase slowly, so the policy is per card:
+
+    PV_TRIM_OFF         Nothing is discarded
+    PV_TRIM_BACKGROUND  Every run is queued, the card is only busy while idle
+    PV_TRIM_AUTO        Large runs inline, small runs queued
+
+    Cards whose CID product name is in CONFIG_PV_FS_TRIM_DENY_CARDS start
+    OFF. In AUTO mode a card that needs more than
+    CONFIG_PV_FS_TRIM_SLOW_MS_PER_MB for an inline discard is switched to
+    BACKGROUND for the rest of the session.
+*/
+
+#define PV_TRIM_IDLE_MS             1000U                       // Time without writes before queued runs are discarded
+#define PV_TRIM_MAX_ERASE_SECTORS   (64U * 1024U * 2U)          // Sectors per erase command (64 MB at 512 bytes)
+#define PV_TRIM_TASK_STACK_SIZE     3072U
+#define PV_TRIM_TASK_PRIORITY       PV_TASK_PRIO_BACKGROUND
+
+typedef enum {
+    PV_TRIM_OFF,
+    PV_TRIM_BACKGROUND,
+    PV_TRIM_AUTO,
+} pv_trim_mode_t;
+
+typedef struct {
+    uint32_t ranges;                                            // CTRL_TRIM requests received
+    uint32_t inline_erases;                                     // Erase commands issued inline
+    uint32_t background_erases;                                 // Erase commands issued by the task
+    uint32_t cancelled;                                         // Queued runs dropped because they were written
+    uint32_t dropped;                                           // Runs not queued because the queue was full
+    uint32_t failed;                                            // Erase commands the card rejected
+    uint64_t sectors;                                           // Sectors discarded
+    uint64_t erase_us;                                          // Time spent erasing
+} pv_trim_stats_t;
+
+/* FUNCTION DEFS */
+esp_err_t pv_trim_init(BYTE pdrv, sdmmc_card_t *card);
+DRESULT pv_trim_range(LBA_t first, LBA_t last);
+void pv_trim_cancel(LBA_t sector, unsigned count);
+void pv_trim_set_mode(pv_trim_mode_t mode);
+pv_trim_mode_t pv_trim_get_mode(void);
+void pv_trim_flush(void);
+void pv_trim_get_stats(pv_trim_stats_t *stats);
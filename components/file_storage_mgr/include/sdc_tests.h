@@ -6,4 +6,23 @@
 /* FUNCTION DEFS */
 void test_sdcWriteFile(void);
 void test_log_writes(void);
-void test_log_checks(void);
\ No newline at end of file
+void test_log_checks(void);
+void test_filePreallocWrite(void);
+void test_fsFreeSpace(void);
+void test_deleteDirTree(void);
+void test_aioWriteRead(void);
+void test_aioDeleteDirOpenFile(void);
+void test_logBufferedEntries(void);
+void test_dirCache(void);
+void test_layoutPaths(void);
+void test_bulkCreateShortNames(void);
+void test_createKeepsExisting(void);
+void test_dentryCache(void);
+void test_packPutGetDelete(void);
+void test_segLogAppend(void);
+void test_segLogAppendDuringDelete(void);
+void test_diskioCounters(void);
+void test_diskioTrace(void);
+void test_trimFreedClusters(void);
+void test_preEraseLargeFile(void);
+void test_dmaBuffers(void);
\ No newline at end of file
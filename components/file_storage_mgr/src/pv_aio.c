@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_file.h"
+#include "pv_aio.h"
+#include "pv_durability.h"
+#include "pv_dircache.h"
+#include "pv_dentry.h"
+#include "pv_pack.h"
+#include "pv_sdc.h"
+#include "pv_static.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_AIO"
+
+#define AIO_MERGE_MAX_REQS          8U                  // Writes merged into one f_write at most
+
+/* STATIC VARIABLES */
+static QueueHandle_t s_normal_queue = NULL;
+static QueueHandle_t s_high_queue = NULL;
+static SemaphoreHandle_t s_pending = NULL;              // Counts requests waiting in both queues
+static TaskHandle_t s_task = NULL;
+static pv_file_t s_files[PV_AIO_MAX_FILES];             // Only touched by the I/O task
+static char s_file_paths[PV_AIO_MAX_FILES][FATFS_PATH_MAX_LENGTH]; // Path each open file was opened at
+static uint8_t *s_merge_buf = NULL;                    // PV_AIO_MERGE_BUF_SIZE from pv_dma_alloc()
+static pv_aio_req_t s_pool[PV_AIO_POOL_SIZE];
+static bool s_pool_used[PV_AIO_POOL_SIZE];
+static portMUX_TYPE s_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+PV_STATIC_QUEUE_DEFINE(s_normal_queue_mem, PV_AIO_QUEUE_LEN, sizeof(pv_aio_req_t *));
+PV_STATIC_QUEUE_DEFINE(s_high_queue_mem, PV_AIO_QUEUE_LEN, sizeof(pv_aio_req_t *));
+PV_STATIC_SEMAPHORE_DEFINE(s_pending_mem);
+PV_STATIC_TASK_DEFINE(s_task_mem, PV_AIO_TASK_STACK_SIZE);
+static volatile bool s_sync_requested = false;          // Set by pv_aio_request_sync(), cleared by the I/O task
+
+
+/***************************************************************************
+ * Function:    pv_aio_complete
+ * Purpose:     Reports a finished request to its client and returns pooled
+ *              requests to the pool
+ * Parameters:  req - The finished request
+ * Returns:     None
+ ***************************************************************************/
+static void pv_aio_complete(pv_aio_req_t *req) {
+    if (req->cb != NULL) {
+        req->cb(req, req->cb_arg);
+    }
+
+    if (req->done != NULL) {
+        xSemaphoreGive(req->done);
+    }
+    else if (req->from_pool) {
+        taskENTER_CRITICAL(&s_pool_lock);
+        s_pool_used[req - s_pool] = false;
+        taskEXIT_CRITICAL(&s_pool_lock);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_aio_get_file
+ * Purpose:     Looks up the open file for a handle
+ * Parameters:  handle - Handle returned by an OPEN request
+ * Returns:     The open file, NULL if the handle is not valid
+ ***************************************************************************/
+static pv_file_t *pv_aio_get_file(pv_aio_handle_t handle) {
+    if (handle < 0 || handle >= (pv_aio_handle_t)PV_AIO_MAX_FILES || !s_files[handle].is_open) {
+        return NULL;
+    }
+    return &s_files[handle];
+}
+
+/***************************************************************************
+ * Function:    pv_aio_tree_has_open_file
+ * Purpose:     Checks if a file opened through the service is inside a tree.
+ *              Names compare without case, as on FAT.
+ * Parameters:  path - POSIX path of the tree
+ * Returns:     true if an open file is the tree or inside it
+ *              false else
+ ***************************************************************************/
+static bool pv_aio_tree_has_open_file(const char *path) {
+    size_t len = strlen(path);
+
+    for (int h = 0; h < (int)PV_AIO_MAX_FILES; h++) {
+        if (s_files[h].is_open && strncasecmp(s_file_paths[h], path, len) == 0 &&
+            (s_file_paths[h][len] == '\0' || s_file_paths[h][len] == '/')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_mkdir_p
+ * Purpose:     Creates a directory and any missing parents. Directories in
+ *              the directory cache are skipped, so preparing a folder that
+ *              was already used costs no card access.
+ * Parameters:  path - POSIX path of the directory
+ * Returns:     ESP_OK if the directory exists afterwards
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pv_aio_mkdir_p(const char *path) {
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FRESULT f_res = FR_OK;
+    size_t base_len = strlen(SD_CARD_BASE_PATH);
+    size_t len = strlen(path);
+
+    if (pv_dircache_contains(path)) {
+        return ESP_OK;
+    }
+    if (pv_fs_get_ff_path(path, ff_path, sizeof(ff_path)) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // ff_path is path with SD_CARD_BASE_PATH replaced by "0:", so a component
+    // ending at path[i] ends at ff_path[i - ff_offset]
+    size_t ff_offset = base_len - strlen("0:");
+    for (size_t i = base_len + 1; i <= len; i++) {
+        if ((i == len || path[i] == '/') && path[i - 1] != '/') {
+            if (pv_dircache_contains_n(path, i)) {
+                continue;
+            }
+            char c = ff_path[i - ff_offset];
+            ff_path[i - ff_offset] = '\0';
+            f_res = f_mkdir(ff_path);
+            ff_path[i - ff_offset] = c;
+            if (f_res != FR_OK && f_res != FR_EXIST) {
+                PV_LOGE(TAG, "Failed to create directory %s (0x%x)", path, f_res);
+                return ESP_FAIL;
+            }
+            pv_dircache_add_n(path, i);
+            pv_dentry_invalidate_n(path, i);
+        }
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_sync_all
+ * Purpose:     Commits every open file, the buffered backup log entries and
+ *              the pack segment to the card, as required by the durability
+ *              policy
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pv_aio_sync_all(void) {
+    for (size_t i = 0; i < PV_AIO_MAX_FILES; i++) {
+        if (s_files[i].is_open) {
+            pv_file_sync(&s_files[i]);
+        }
+    }
+    pv_backup_log_flush();
+    pv_pack_sync();
+    pv_durability_synced();
+}
+
+/***************************************************************************
+ * Function:    pv_aio_do_write
+ * Purpose:     Runs a write request, merging it with following small writes
+ *              to the same file that are already queued
+ * Parameters:  req - The dequeued write request
+ * Returns:     None
+ ***************************************************************************/
+static void pv_aio_do_write(pv_aio_req_t *req) {
+    pv_aio_req_t *batch[AIO_MERGE_MAX_REQS];
+    pv_aio_req_t *next = NULL;
+    pv_file_t *file = pv_aio_get_file(req->handle);
+    size_t n_batch = 1;
+    size_t merged_len = req->len;
+    esp_err_t err = ESP_OK;
+
+    batch[0] = req;
+
+    if (file == NULL) {
+        req->err = ESP_ERR_INVALID_ARG;
+        pv_aio_complete(req);
+        return;
+    }
+
+    // Only normal priority writes are merged, high priority ones are rare
+    while (req->prio == PV_AIO_PRIO_NORMAL && req->len <= PV_AIO_MERGE_MAX_WRITE && n_batch < AIO_MERGE_MAX_REQS &&
+           xQueuePeek(s_normal_queue, &next, 0) == pdTRUE &&
+           next->op == PV_AIO_OP_WRITE && next->handle == req->handle &&
+           next->len <= PV_AIO_MERGE_MAX_WRITE && merged_len + next->len <= PV_AIO_MERGE_BUF_SIZE) {
+        xQueueReceive(s_normal_queue, &next, 0);
+        xSemaphoreTake(s_pending, 0);
+        batch[n_batch++] = next;
+        merged_len += next->len;
+    }
+
+    if (n_batch == 1) {
+        err = pv_file_write(file, req->buf, req->len);
+    }
+    else {
+        size_t offset = 0;
+        for (size_t i = 0; i < n_batch; i++) {
+            memcpy(s_merge_buf + offset, batch[i]->buf, batch[i]->len);
+            offset += batch[i]->len;
+        }
+        err = pv_file_write(file, s_merge_buf, merged_len);
+    }
+
+    if (err == ESP_OK && pv_durability_data_written(merged_len)) {
+        pv_aio_sync_all();
+    }
+
+    for (size_t i = 0; i < n_batch; i++) {
+        batch[i]->err = err;
+        batch[i]->result = (err == ESP_OK) ? batch[i]->len : 0;
+        pv_aio_complete(batch[i]);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_aio_do_request
+ * Purpose:     Runs one request on the I/O task
+ * Parameters:  req - The dequeued request
+ * Returns:     None
+ ***************************************************************************/
+static void pv_aio_do_request(pv_aio_req_t *req) {
+    pv_file_t *file = NULL;
+    pv_aio_req_t *next = NULL;
+
+    req->result = 0;
+
+    switch (req->op) {
+        case PV_AIO_OP_OPEN_WRITE:
+        case PV_AIO_OP_OPEN_READ:
+        case PV_AIO_OP_CREATE:
+            req->handle = PV_AIO_INVALID_HANDLE;
+            req->err = ESP_ERR_NO_MEM;
+            for (pv_aio_handle_t h = 0; h < (pv_aio_handle_t)PV_AIO_MAX_FILES; h++) {
+                if (!s_files[h].is_open) {
+                    if (req->op == PV_AIO_OP_CREATE) {
+                        bool used_alt = false;
+                        req->err = pv_file_create(&s_files[h], req->path, req->buf, req->size_hint, &used_alt);
+                        if (used_alt) {
+                            snprintf(req->path, sizeof(req->path), "%s", (const char *)req->buf);
+                        }
+                    }
+                    else {
+                        req->err = (req->op == PV_AIO_OP_OPEN_WRITE) ?
+                                   pv_file_open_write(&s_files[h], req->path, req->size_hint) :
+                                   pv_file_open_read(&s_files[h], req->path);
+                    }
+                    if (req->err == ESP_OK) {
+                        req->handle = h;
+                        snprintf(s_file_paths[h], sizeof(s_file_paths[h]), "%s", req->path);
+                        if (req->op == PV_AIO_OP_OPEN_READ) {
+                            req->size_hint = f_size(&s_files[h].fil);
+                        }
+                    }
+                    break;
+                }
+            }
+            break;
+        case PV_AIO_OP_WRITE:
+            pv_aio_do_write(req);
+            return; // Completed by pv_aio_do_write
+        case PV_AIO_OP_READ:
+            file = pv_aio_get_file(req->handle);
+            if (file == NULL) {
+                req->err = ESP_ERR_INVALID_ARG;
+                break;
+            }
+            req->err = ESP_OK;
+            if (req->offset != PV_AIO_OFFSET_CURRENT) {
+                req->err = pv_file_seek(file, req->offset);
+            }
+            if (req->err == ESP_OK) {
+                req->err = pv_file_read(file, req->buf, req->len, &req->result);
+            }
+            break;
+        case PV_AIO_OP_MKDIR:
+            req->err = pv_aio_mkdir_p(req->path);
+            // Identical mkdirs queued right behind this one are already done
+            while (xQueuePeek(s_normal_queue, &next, 0) == pdTRUE && next->op == PV_AIO_OP_MKDIR &&
+                   strcmp(next->path, req->path) == 0) {
+                xQueueReceive(s_normal_queue, &next, 0);
+                xSemaphoreTake(s_pending, 0);
+                next->err = req->err;
+                next->result = 0;
+                pv_aio_complete(next);
+            }
+            break;
+        case PV_AIO_OP_CLOSE:
+            file = pv_aio_get_file(req->handle);
+            req->err = (file != NULL) ? pv_file_close(file) : ESP_ERR_INVALID_ARG;
+            break;
+        case PV_AIO_OP_DELETE_DIR:
+            // FF_FS_LOCK is off, unlinking an open file would leave its writer in freed clusters.
+            // Files can only be opened on this task, so none can appear during the walk.
+            if (pv_aio_tree_has_open_file(req->path)) {
+                PV_LOGE(TAG, "Not deleting %s, a file in it is open", req->path);
+                req->err = ESP_ERR_INVALID_STATE;
+            }
+            else {
+                req->err = pv_delete_dir(req->path);
+            }
+            break;
+        default:
+            req->err = ESP_ERR_NOT_SUPPORTED;
+            break;
+    }
+
+    pv_aio_complete(req);
+}
+
+/***************************************************************************
+ * Function:    pv_aio_task
+ * Purpose:     The I/O task. Owns every file opened through the service and
+ *              runs requests, high priority first.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pv_aio_task(void *param) {
+    pv_aio_req_t *req = NULL;
+
+    while (1) {
+        xSemaphoreTake(s_pending, portMAX_DELAY);
+
+        if (s_sync_requested) {
+            s_sync_requested = false;
+            pv_aio_sync_all();
+        }
+
+        if (xQueueReceive(s_high_queue, &req, 0) != pdTRUE &&
+            xQueueReceive(s_normal_queue, &req, 0) != pdTRUE) {
+            continue; // Already consumed by a merge
+        }
+        pv_aio_do_request(req);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_aio_init
+ * Purpose:     Creates the request queues and starts the I/O task
+ * Parameters:  None
+ * Returns:     ESP_OK on success (or if already initialized)
+ *              ESP_ERR_NO_MEM else
+ ***************************************************************************/
+esp_err_t pv_aio_init(void) {
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+
+    s_normal_queue = PV_STATIC_QUEUE_CREATE(s_normal_queue_mem, PV_AIO_QUEUE_LEN, sizeof(pv_aio_req_t *));
+    s_high_queue = PV_STATIC_QUEUE_CREATE(s_high_queue_mem, PV_AIO_QUEUE_LEN, sizeof(pv_aio_req_t *));
+    s_pending = PV_STATIC_COUNTING_CREATE(s_pending_mem, 2 * PV_AIO_QUEUE_LEN + 1, 0); // +1 for a sync request
+    if (s_merge_buf == NULL) {
+        s_merge_buf = pv_dma_alloc(PV_AIO_MERGE_BUF_SIZE);
+    }
+    if (s_normal_queue == NULL || s_high_queue == NULL || s_pending == NULL || s_merge_buf == NULL) {
+        PV_LOGE(TAG, "Failed to create request queues");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (PV_STATIC_TASK_CREATE(s_task_mem, pv_aio_task, "pv_aio", PV_AIO_TASK_STACK_SIZE, NULL, PV_AIO_TASK_PRIORITY, &s_task, PV_TASK_CORE_STORAGE) != pdPASS) {
+        PV_LOGE(TAG, "Failed to create I/O task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_submit
+ * Purpose:     Queues a request. The request (and any buffer it points to)
+ *              must stay valid until it completes.
+ * Parameters:  req - The request to queue
+ * Returns:     ESP_OK if queued
+ *              ESP_ERR_INVALID_STATE if the service is not running
+ *              ESP_ERR_TIMEOUT if the queue stayed full
+ ***************************************************************************/
+esp_err_t pv_aio_submit(pv_aio_req_t *req) {
+    QueueHandle_t queue = (req->prio == PV_AIO_PRIO_HIGH) ? s_high_queue : s_normal_queue;
+
+    if (s_task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (xQueueSend(queue, &req, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    xSemaphoreGive(s_pending);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_submit_wait
+ * Purpose:     Queues a request and blocks until it completes
+ * Parameters:  req - The request to run
+ * Returns:     The result of the request
+ *              ESP_ERR_INVALID_STATE if called from the I/O task itself
+ ***************************************************************************/
+esp_err_t pv_aio_submit_wait(pv_aio_req_t *req) {
+    StaticSemaphore_t done_buf;
+    esp_err_t err = ESP_OK;
+
+    if (xTaskGetCurrentTaskHandle() == s_task) {
+        return ESP_ERR_INVALID_STATE; // Would wait on itself forever
+    }
+
+    req->done = xSemaphoreCreateBinaryStatic(&done_buf);
+    err = pv_aio_submit(req);
+    if (err == ESP_OK) {
+        xSemaphoreTake(req->done, portMAX_DELAY);
+        err = req->err;
+    }
+    req->done = NULL;
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_req_alloc
+ * Purpose:     Takes a zeroed request from the internal pool. Pooled requests
+ *              are returned to the pool automatically after completion, for
+ *              fire and forget use.
+ * Parameters:  None
+ * Returns:     A request, NULL if the pool is empty
+ ***************************************************************************/
+pv_aio_req_t *pv_aio_req_alloc(void) {
+    pv_aio_req_t *req = NULL;
+
+    taskENTER_CRITICAL(&s_pool_lock);
+    for (size_t i = 0; i < PV_AIO_POOL_SIZE; i++) {
+        if (!s_pool_used[i]) {
+            s_pool_used[i] = true;
+            req = &s_pool[i];
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_pool_lock);
+
+    if (req != NULL) {
+        memset(req, 0, sizeof(*req));
+        req->from_pool = true;
+    }
+    return req;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_mkdir_async
+ * Purpose:     Queues creation of a directory (and its parents) without
+ *              waiting. Failures are logged by the I/O task; a later open in
+ *              the same directory reports them to its caller.
+ * Parameters:  path - POSIX path of the directory
+ * Returns:     ESP_OK if queued
+ *              ESP_ERR_NO_MEM if no pooled request is free
+ *              ESP_ERR_INVALID_SIZE if the path is too long
+ ***************************************************************************/
+esp_err_t pv_aio_mkdir_async(const char *path) {
+    pv_aio_req_t *req = NULL;
+    esp_err_t err = ESP_OK;
+
+    if (strlen(path) >= sizeof(req->path)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    req = pv_aio_req_alloc();
+    if (req == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    req->op = PV_AIO_OP_MKDIR;
+    strcpy(req->path, path);
+
+    err = pv_aio_submit(req);
+    if (err != ESP_OK) {
+        taskENTER_CRITICAL(&s_pool_lock);
+        s_pool_used[req - s_pool] = false;
+        taskEXIT_CRITICAL(&s_pool_lock);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_aio_request_sync
+ * Purpose:     Asks the I/O task to sync all open files and the backup log
+ *              before its next request. Never blocks, so it can be used from
+ *              timer callbacks and event handlers.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_aio_request_sync(void) {
+    if (s_task == NULL) {
+        return;
+    }
+    s_sync_requested = true;
+    xSemaphoreGive(s_pending); // If the count is full the task is awake anyway
+}
@@ -8,43 +8,87 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
 #include "pv_sdc.h"
 #include "pv_fs.h"
+#include "pv_durability.h"
+#include "pv_dircache.h"
+#include "pv_dentry.h"
+#include "pv_layout.h"
+#include "pv_seglog.h"
 #include "esp_log.h"
 #include "pv_logging.h"
 
 #define TAG "PV_UPDATE_LOG"
 
+typedef struct {
+    const char *file_path;                              // Path of file (on the mobile device) looked up
+    bool found;
+} pv_backup_log_lookup_t;
+
+/* STATIC VARIABLES */
+// Entries not yet written to the card, all for the device in s_log_serial
+static char s_log_buf[LOG_BUFFER_SIZE];
+static size_t s_log_len = 0;
+static char s_log_serial[DEVICE_DIRECTORY_NAME_MAX_LENGTH] = {0};
+static SemaphoreHandle_t s_log_lock = NULL;
+static StaticSemaphore_t s_log_lock_buf;
+static pv_seglog_t s_seglog;                            // Segments of the device in s_seglog.dir
+
+
 /***************************************************************************
- * Function:    pv_update_backup_log
- * Purpose:     Updates the backup log with the given filepath that was backed up.
- *              It creates a directory for the serial number if it does not exist.
- * Parameters:  serial_number - The serial number to identify the device.
- *              file_path - The path of file (on the mobile device) that was backed up
- * Returns:     ESP_OK on success
- *              ESP_FAIL else
- * Note:        The log file will caontain entries in the format:
- *              "file_path",<valid_bit> // valid is 1 if the file is not deleted, 0 if it is deleted
- *              The log file will be created in the directory: SD_CARD_BASE_PATH/serial_number
+ * Function:    pv_backup_log_flush_locked
+ * Purpose:     Appends the buffered entries to the log segments of their
+ *              device (see pv_seglog.h), so only data sectors are written.
+ *              Falls back to appending to LOG_FILE_NAME if no segment can be
+ *              created. It creates a directory for the serial number if it
+ *              does not exist. Must be called with s_log_lock held.
+ * Parameters:  None
+ * Returns:     ESP_OK on success (or if nothing is buffered)
+ *              ESP_FAIL else, the entries stay buffered
  ***************************************************************************/
-esp_err_t pv_update_backup_log(const char *serial_number, const char *file_path) {
+static esp_err_t pv_backup_log_flush_locked(void) {
     char dir_path[DEVICE_DIRECTORY_NAME_MAX_LENGTH] = {0};
-    char log_entry[LOG_ENTRY_MAX_LENGTH] = {0};
-    struct stat st = {0};
     FILE *log_file;
     int log_file_path_name_length = DEVICE_DIRECTORY_NAME_MAX_LENGTH + 1 + sizeof(LOG_FILE_NAME); // +1 for slash, sizeof includes null terminator
     char log_file_path[log_file_path_name_length];
+    size_t written = 0;
+    esp_err_t err = ESP_OK;
 
-    snprintf(dir_path, sizeof(dir_path), "%s/%s", SD_CARD_BASE_PATH, serial_number);
+    if (s_log_len == 0) {
+        return ESP_OK;
+    }
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", SD_CARD_BASE_PATH, s_log_serial);
 
     // Check if directory exists
-    if (stat(dir_path, &st) != 0) {
+    if (!pv_dircache_contains(dir_path) && !pv_dentry_exists(dir_path)) {
         // Directory does not exist, create it
+        pv_dentry_invalidate(dir_path);
         if (mkdir(dir_path, S_IRWXU | S_IRWXG | S_IRWXO) != 0) {
             PV_LOGE(TAG, "Failed to create directory");
             return ESP_FAIL;
         }
     }
+    pv_dircache_add(dir_path);
+
+    // The open segment log follows the device being written
+    if (!s_seglog.open || strcmp(s_seglog.dir, dir_path) != 0) {
+        if (s_seglog.open) {
+            pv_seglog_close(&s_seglog);
+        }
+        err = pv_seglog_open(&s_seglog, dir_path, LOG_SEGMENT_PREFIX, LOG_SEGMENT_EXT);
+    }
+    if (err == ESP_OK) {
+        err = pv_seglog_append(&s_seglog, s_log_buf, s_log_len);
+    }
+    if (err == ESP_OK) {
+        s_log_len = 0;
+        return ESP_OK;
+    }
+    PV_LOGW(TAG, "Log segment not written (0x%x), appending to %s", err, LOG_FILE_NAME);
 
     // Construct full log file path
     snprintf(log_file_path, log_file_path_name_length, "%s/%s", dir_path, LOG_FILE_NAME);
@@ -55,23 +99,183 @@ esp_err_t pv_update_backup_log(const char *serial_number, const char *file_path)
         return ESP_FAIL;
     }
 
+    written = fwrite(s_log_buf, 1, s_log_len, log_file);
+    pv_dentry_invalidate(log_file_path); // Written through the VFS, size has changed
+    if (fclose(log_file) != 0 || written != s_log_len) {
+        PV_LOGE(TAG, "Failed to write log file");
+        return ESP_FAIL;
+    }
+
+    s_log_len = 0;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_backup_log_init
+ * Purpose:     Prepares the backup log entry buffer
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_backup_log_init(void) {
+    if (s_log_lock == NULL) {
+        s_log_lock = xSemaphoreCreateMutexStatic(&s_log_lock_buf);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_backup_log_flush
+ * Purpose:     Writes all buffered log entries to the card. Called when the
+ *              durability policy (see pv_durability.h) requires a sync.
+ * Parameters:  None
+ * Returns:     ESP_OK on success
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_backup_log_flush(void) {
+    esp_err_t err = ESP_OK;
+
+    if (s_log_lock == NULL) {
+        return ESP_OK; // Nothing can have been buffered
+    }
+
+    xSemaphoreTake(s_log_lock, portMAX_DELAY);
+    err = pv_backup_log_flush_locked();
+    xSemaphoreGive(s_log_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_update_backup_log
+ * Purpose:     Updates the backup log with the given filepath that was backed up.
+ *              The entry is buffered and written to the card according to
+ *              the durability policy (immediately in PER_FILE mode).
+ * Parameters:  serial_number - The serial number to identify the device.
+ *              file_path - The path of file (on the mobile device) that was backed up
+ * Returns:     ESP_OK on success
+ *              ESP_FAIL else
+ * Note:        The log file will caontain entries in the format:
+ *              "file_path",<valid_bit> // valid is 1 if the file is not deleted, 0 if it is deleted
+ *              With the sharded layout the stored path is appended:
+ *              "file_path",<valid_bit>,"stored_path"
+ *              The log file will be created in the directory: SD_CARD_BASE_PATH/serial_number
+ ***************************************************************************/
+esp_err_t pv_update_backup_log(const char *serial_number, const char *file_path) {
+    char log_entry[LOG_ENTRY_MAX_LENGTH] = {0};
+    int entry_len = 0;
+    esp_err_t err = ESP_OK;
 
-    // Write entry to log: "file_path",<valid_bit>
-    if (snprintf(log_entry, LOG_ENTRY_MAX_LENGTH, "\"%s\",1\n", file_path) >= LOG_ENTRY_MAX_LENGTH) {
+    if (pv_layout_is_sharded()) {
+        // Keep the phone path as the logical name next to where it is stored
+        char stored_path[FATFS_PATH_MAX_LENGTH];
+        if (pv_layout_resolve_path(file_path, strlen(file_path), stored_path, sizeof(stored_path)) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        entry_len = snprintf(log_entry, LOG_ENTRY_MAX_LENGTH, "\"%s\",1,\"%s\"\n", file_path, stored_path);
+    }
+    else {
+        // Write entry to log: "file_path",<valid_bit>
+        entry_len = snprintf(log_entry, LOG_ENTRY_MAX_LENGTH, "\"%s\",1\n", file_path);
+    }
+    if (entry_len >= LOG_ENTRY_MAX_LENGTH) {
         PV_LOGE(TAG, "Log entry exceeds maximum length defined by LOG_ENTRY_MAX_LENGTH");
-        fclose(log_file);
         return ESP_FAIL;
     }
-    fprintf(log_file, log_entry);
-    fclose(log_file);
-    
-    return ESP_OK;
+    if (strlen(serial_number) >= sizeof(s_log_serial)) {
+        PV_LOGE(TAG, "Serial number too long");
+        return ESP_FAIL;
+    }
+
+    pv_backup_log_init();
+    xSemaphoreTake(s_log_lock, portMAX_DELAY);
+
+    // The buffer only holds one device's entries and must have room for this one
+    if ((s_log_len > 0 && strcmp(s_log_serial, serial_number) != 0) ||
+        s_log_len + entry_len > sizeof(s_log_buf)) {
+        err = pv_backup_log_flush_locked();
+    }
+
+    if (err == ESP_OK) {
+        strcpy(s_log_serial, serial_number);
+        memcpy(s_log_buf + s_log_len, log_entry, entry_len);
+        s_log_len += entry_len;
+
+        if (pv_durability_log_sync_on_append()) {
+            err = pv_backup_log_flush_locked();
+            if (err != ESP_OK) {
+                s_log_len -= entry_len; // Report the failure, don't retry the entry later
+            }
+        }
+    }
+
+    xSemaphoreGive(s_log_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_backup_log_buffered
+ * Purpose:     Checks the entries that are not on the card yet
+ * Parameters:  serial_number - The serial number to identify the device.
+ *              file_path - The path of file (on the mobile device) to check
+ * Returns:     true if a valid entry for the file is buffered
+ ***************************************************************************/
+static bool pv_backup_log_buffered(const char *serial_number, const char *file_path) {
+    char logged_path[BACKUP_PATH_MAX_LENGTH] = {0};
+    int valid_bit = 0;
+    size_t pos = 0;
+    bool found = false;
+
+    if (s_log_lock == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(s_log_lock, portMAX_DELAY);
+    if (s_log_len > 0 && strcmp(s_log_serial, serial_number) == 0) {
+        while (pos < s_log_len && !found) {
+            const char *line = s_log_buf + pos;
+            const char *end = memchr(line, '\n', s_log_len - pos);
+            size_t line_len = (end != NULL) ? (size_t)(end - line) + 1 : s_log_len - pos;
+            char entry[LOG_ENTRY_MAX_LENGTH];
+
+            if (line_len < sizeof(entry)) {
+                memcpy(entry, line, line_len);
+                entry[line_len] = '\0';
+                if (sscanf(entry, "\"%127[^\"]\",%d", logged_path, &valid_bit) == 2 &&
+                    strcmp(logged_path, file_path) == 0 && valid_bit == 1) {
+                    found = true;
+                }
+            }
+            pos += line_len;
+        }
+    }
+    xSemaphoreGive(s_log_lock);
+    return found;
+}
+
+/***************************************************************************
+ * Function:    pv_backup_log_match
+ * Purpose:     Checks a log line against the file being looked up. Also the
+ *              line callback for pv_seglog_for_each_line().
+ * Parameters:  line - A line of the log
+ *              ctx - The pv_backup_log_lookup_t of the lookup
+ * Returns:     true if the line is a valid entry for the file
+ ***************************************************************************/
+static bool pv_backup_log_match(const char *line, void *ctx) {
+    pv_backup_log_lookup_t *lookup = ctx;
+    char logged_path[BACKUP_PATH_MAX_LENGTH] = {0};
+    int valid_bit = 0;
+
+    // Check if the line contains the file_path and is valid
+    if (sscanf(line, "\"%127[^\"]\",%d", logged_path, &valid_bit) == 2 &&
+        strcmp(logged_path, lookup->file_path) == 0 && valid_bit == 1) {
+        lookup->found = true;
+    }
+    return lookup->found;
 }
 
 /***************************************************************************
  * Function:    pv_is_backedUp
- * Purpose:     Check if a file is backed up by checking the log file for device 
- *              device with the given serial number. * 
+ * Purpose:     Check if a file is backed up by checking the log of the
+ *              device with the given serial number: buffered entries, the
+ *              log file written by older firmware and the log segments.
  * Parameters:  serial_number - The serial number to identify the device.
  *              file_path - The path of file (on the mobile device) to check
  * Returns:     true if file is backed up and valid (not deleted)
@@ -80,42 +284,41 @@ esp_err_t pv_update_backup_log(const char *serial_number, const char *file_path)
 bool pv_is_backedUp(const char *serial_number, const char *file_path) {
     char dir_path[DEVICE_DIRECTORY_NAME_MAX_LENGTH] = {0};
     char log_entry[LOG_ENTRY_MAX_LENGTH] = {0};
-    char logged_path[BACKUP_PATH_MAX_LENGTH] = {0};
-    int valid_bit = 0;
-    struct stat st = {0};
     FILE *log_file;
     int log_file_path_name_length = DEVICE_DIRECTORY_NAME_MAX_LENGTH + 1 + sizeof(LOG_FILE_NAME); // +1 for slash, sizeof includes null terminator
     char log_file_path[log_file_path_name_length];
+    pv_backup_log_lookup_t lookup = { .file_path = file_path, .found = false };
+
+    if (pv_backup_log_buffered(serial_number, file_path)) {
+        return true; // Logged but not synced to the card yet
+    }
 
     snprintf(dir_path, sizeof(dir_path), "%s/%s", SD_CARD_BASE_PATH, serial_number);
 
     // Check if directory exists
-    if (stat(dir_path, &st) != 0) {
+    if (!pv_dentry_exists(dir_path)) {
         // Directory does not exist, therefore file is not backed up
         return false;
     }
 
     // Construct full log file path
     snprintf(log_file_path, log_file_path_name_length, "%s/%s", dir_path, LOG_FILE_NAME);
-
-    log_file = fopen(log_file_path, "r");
-    if (!log_file) {
-        PV_LOGE(TAG, "Failed to open log file");
-        return false; // Log file does not exist, therefore file is not backed up
-    }
-
-    // Read the log file line by line to find the file_path
-    while (fgets(log_entry, LOG_ENTRY_MAX_LENGTH, log_file) != NULL) {
-        // Check if the line contains the file_path and is valid
-        if (sscanf(log_entry, "\"%[^\"]\",%d", logged_path, &valid_bit) == 2){
-            if (strcmp(logged_path, file_path) == 0 && valid_bit == 1) {
-                fclose(log_file);
-                return true; // File is backed up
+    if (pv_dentry_exists(log_file_path)) {
+        log_file = fopen(log_file_path, "r");
+        if (!log_file) {
+            PV_LOGE(TAG, "Failed to open log file");
+        }
+        else {
+            // Read the log file line by line to find the file_path
+            while (fgets(log_entry, LOG_ENTRY_MAX_LENGTH, log_file) != NULL &&
+                   !pv_backup_log_match(log_entry, &lookup)) {
             }
+            fclose(log_file);
         }
     }
 
-
-    fclose(log_file);
-    return false; // File not found in log or is marked as deleted
-}
\ No newline at end of file
+    if (!lookup.found) {
+        pv_seglog_for_each_line(dir_path, LOG_SEGMENT_PREFIX, LOG_SEGMENT_EXT, pv_backup_log_match, &lookup);
+    }
+    return lookup.found;
+}
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_layout.h"
+#include "pv_file.h"
+#include "pv_diskio.h"
+#include "pv_bench.h"
+#include "pv_tasks.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_BENCH"
+
+#if CONFIG_PV_FS_RUN_BENCHMARKS
+#define BENCH_FILES         CONFIG_PV_FS_BENCH_FILES
+#define BENCH_WRITE_MB      CONFIG_PV_FS_BENCH_WRITE_MB
+#else
+#define BENCH_FILES         10000U
+#define BENCH_WRITE_MB      16U
+#endif
+
+// The radio stand-in runs where Bluedroid runs, the split run puts the writer where receiver_task goes
+#if CONFIG_PV_TASK_PINNING
+#define BENCH_RADIO_CORE    PV_TASK_CORE_PROTOCOL
+#define BENCH_SPLIT_CORE    PV_TASK_CORE_STORAGE
+#elif CONFIG_FREERTOS_UNICORE
+#define BENCH_RADIO_CORE    0
+#define BENCH_SPLIT_CORE    0
+#else
+#define BENCH_RADIO_CORE    0
+#define BENCH_SPLIT_CORE    1
+#endif
+
+#define PLACEMENT_END       UINT8_MAX                   // Packet index that ends a placement run
+
+// Shared by the two tasks of pv_bench_placement()
+typedef struct {
+    QueueHandle_t free_q;           // Indices of empty packets
+    QueueHandle_t full_q;           // Indices of received packets, PLACEMENT_END last
+    SemaphoreHandle_t done;         // Given by each task when it finishes
+    uint8_t *packets;               // PV_BENCH_PACKETS buffers, then the radio's own buffer
+    uint64_t bytes;
+    pv_file_t file;
+    esp_err_t err;
+    uint64_t written;
+    int64_t radio_us;
+} pv_bench_placement_t;
+
+
+/***************************************************************************
+ * Function:    pv_bench_bulk_create
+ * Purpose:     Creates n_files empty files in one new directory, named like a
+ *              phone camera names its photos (IMG_20240101_000001.jpg, ...).
+ *              Those long names all shorten to the same 8.3 stem, so FatFs
+ *              has to search the directory for a free ~N name on every create.
+ *              With short_names the files get the layout's hash-derived 8.3
+ *              names instead. The directory is deleted afterwards.
+ * Parameters:  dir - POSIX path of the directory to create the files in
+ *              n_files - Number of files to create
+ *              short_names - Use pv_layout_get_short_name() names
+ *              result - Returns the timings
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if the path is not on the SD card
+ *              ESP_FAIL if a file could not be created
+ ***************************************************************************/
+esp_err_t pv_bench_bulk_create(const char *dir, uint32_t n_files, bool short_names, pv_bench_create_result_t *result) {
+    char ff_dir[FATFS_PATH_MAX_LENGTH];
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    char logical[32];
+    char name[PV_LAYOUT_SHORT_NAME_SIZE];
+    FIL fil;
+    FRESULT f_res = FR_OK;
+    int64_t start = 0;
+    int64_t batch_start = 0;
+    uint32_t batch_files = 0;
+    esp_err_t err = ESP_OK;
+
+    memset(result, 0, sizeof(*result));
+
+    err = pv_fs_get_ff_path(dir, ff_dir, sizeof(ff_dir));
+    if (err != ESP_OK) {
+        return err;
+    }
+    pv_delete_dir(dir);
+    f_res = f_mkdir(ff_dir);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to create %s (0x%x)", dir, f_res);
+        return ESP_FAIL;
+    }
+
+    start = esp_timer_get_time();
+    batch_start = start;
+    for (uint32_t i = 0; i < n_files; i++) {
+        snprintf(logical, sizeof(logical), "IMG_20240101_%06u.jpg", (unsigned)i);
+        if (short_names) {
+            pv_layout_get_short_name(logical, strlen(logical), name, sizeof(name));
+            snprintf(ff_path, sizeof(ff_path), "%s/%s", ff_dir, name);
+        }
+        else {
+            snprintf(ff_path, sizeof(ff_path), "%s/%s", ff_dir, logical);
+        }
+
+        f_res = f_open(&fil, ff_path, FA_WRITE | FA_CREATE_NEW);
+        if (f_res == FR_OK) {
+            f_res = f_close(&fil);
+        }
+        if (f_res != FR_OK) {
+            PV_LOGE(TAG, "Failed to create file %u (0x%x)", (unsigned)i, f_res);
+            err = ESP_FAIL;
+            break;
+        }
+        result->files++;
+
+        if (++batch_files == PV_BENCH_BATCH_FILES || result->files == n_files) {
+            int64_t now = esp_timer_get_time();
+            result->last_us_per_file = (now - batch_start) / batch_files;
+            if (result->first_us_per_file == 0) {
+                result->first_us_per_file = result->last_us_per_file;
+            }
+            PV_LOGI(TAG, "%u files: %lld us/file", (unsigned)result->files, result->last_us_per_file);
+            batch_start = now;
+            batch_files = 0;
+        }
+    }
+    result->total_us = esp_timer_get_time() - start;
+
+    pv_delete_dir(dir);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_bench_sequential_write
+ * Purpose:     Writes one large preallocated file in PV_BENCH_WRITE_CHUNK
+ *              writes, the way a received photo or video is written, with
+ *              pre-erase forced on or off. The file is deleted afterwards.
+ * Parameters:  path - POSIX path of the file
+ *              bytes - File size
+ *              pre_erase - Erase the preallocated run before writing
+ *              result - Returns the timings
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if the write buffer could not be allocated
+ *              Error from pv_file_*() else
+ ***************************************************************************/
+esp_err_t pv_bench_sequential_write(const char *path, uint64_t bytes, bool pre_erase, pv_bench_write_result_t *result) {
+    bool was_enabled = pv_diskio_pre_erase_enabled();
+    uint8_t *buf = NULL;
+    pv_file_t file;
+    int64_t start = 0;
+    esp_err_t err = ESP_OK;
+
+    memset(result, 0, sizeof(*result));
+    buf = heap_caps_aligned_alloc(PV_DMA_BLOCK_SIZE, PV_BENCH_WRITE_CHUNK, MALLOC_CAP_DMA); // Like a pv_dma_alloc() buffer
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(buf, 0x5A, PV_BENCH_WRITE_CHUNK);
+
+    pv_diskio_set_pre_erase(pre_erase);
+    start = esp_timer_get_time();
+    err = pv_file_open_write(&file, path, bytes);
+    result->open_us = esp_timer_get_time() - start;
+    pv_diskio_set_pre_erase(was_enabled);
+    if (err != ESP_OK) {
+        heap_caps_free(buf);
+        return err;
+    }
+
+    start = esp_timer_get_time();
+    for (uint64_t done = 0; done < bytes && err == ESP_OK; done += PV_BENCH_WRITE_CHUNK) {
+        size_t len = (bytes - done < PV_BENCH_WRITE_CHUNK) ? (size_t)(bytes - done) : PV_BENCH_WRITE_CHUNK;
+        err = pv_file_write(&file, buf, len);
+        if (err == ESP_OK) {
+            result->bytes += len;
+        }
+    }
+    result->write_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    if (pv_file_close(&file) != ESP_OK && err == ESP_OK) {
+        err = ESP_FAIL;
+    }
+    result->close_us = esp_timer_get_time() - start;
+
+    remove(path);
+    heap_caps_free(buf);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_bench_radio_task
+ * Purpose:     Stands in for Bluedroid receiving a transfer: at the BT task
+ *              priority it spends PV_BENCH_RADIO_US_PER_PACKET of CPU on
+ *              each packet and copies it out of its own buffer
+ * Parameters:  param - The pv_bench_placement_t
+ * Returns:     None
+ ***************************************************************************/
+static void pv_bench_radio_task(void *param) {
+    pv_bench_placement_t *run = (pv_bench_placement_t *)param;
+    uint8_t *radio_buf = run->packets + PV_BENCH_PACKETS * PV_BENCH_PACKET_SIZE;
+    uint8_t idx = 0;
+
+    for (uint64_t done = 0; done < run->bytes; done += PV_BENCH_PACKET_SIZE) {
+        xQueueReceive(run->free_q, &idx, portMAX_DELAY);
+        int64_t start = esp_timer_get_time();
+        esp_rom_delay_us(PV_BENCH_RADIO_US_PER_PACKET);
+        memcpy(run->packets + idx * PV_BENCH_PACKET_SIZE, radio_buf, PV_BENCH_PACKET_SIZE);
+        run->radio_us += esp_timer_get_time() - start;
+        xQueueSend(run->full_q, &idx, portMAX_DELAY);
+    }
+    idx = PLACEMENT_END;
+    xQueueSend(run->full_q, &idx, portMAX_DELAY);
+    xSemaphoreGive(run->done);
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************
+ * Function:    pv_bench_writer_task
+ * Purpose:     Stands in for receiver_task: writes every packet the radio
+ *              hands over to the file and gives the buffer back
+ * Parameters:  param - The pv_bench_placement_t
+ * Returns:     None
+ ***************************************************************************/
+static void pv_bench_writer_task(void *param) {
+    pv_bench_placement_t *run = (pv_bench_placement_t *)param;
+    uint8_t idx = 0;
+
+    while (xQueueReceive(run->full_q, &idx, portMAX_DELAY) == pdTRUE && idx != PLACEMENT_END) {
+        if (run->err == ESP_OK) {
+            run->err = pv_file_write(&run->file, run->packets + idx * PV_BENCH_PACKET_SIZE, PV_BENCH_PACKET_SIZE);
+            if (run->err == ESP_OK) {
+                run->written += PV_BENCH_PACKET_SIZE;
+            }
+        }
+        xQueueSend(run->free_q, &idx, portMAX_DELAY);
+    }
+    xSemaphoreGive(run->done);
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************
+ * Function:    pv_bench_placement
+ * Purpose:     Receives a file through a radio stand-in task on the protocol
+ *              core and a writer task on writer_core, to compare the writer
+ *              sharing the core with the Bluetooth stack against running on
+ *              the other core. The file is deleted afterwards.
+ * Parameters:  path - POSIX path of the file
+ *              bytes - File size, a multiple of PV_BENCH_PACKET_SIZE
+ *              writer_core - Core of the writer task
+ *              result - Returns the timings
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if bytes is not a multiple of PV_BENCH_PACKET_SIZE
+ *              ESP_ERR_NO_MEM if the buffers or tasks could not be created
+ *              Error from pv_file_*() else
+ ***************************************************************************/
+esp_err_t pv_bench_placement(const char *path, uint64_t bytes, BaseType_t writer_core, pv_bench_placement_result_t *result) {
+    pv_bench_placement_t run = {0};
+    int64_t start = 0;
+    esp_err_t err = ESP_OK;
+
+    memset(result, 0, sizeof(*result));
+    if (bytes == 0 || bytes % PV_BENCH_PACKET_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    run.bytes = bytes;
+    run.packets = heap_caps_aligned_alloc(PV_DMA_BLOCK_SIZE, (PV_BENCH_PACKETS + 1) * PV_BENCH_PACKET_SIZE, MALLOC_CAP_DMA);
+    run.free_q = xQueueCreate(PV_BENCH_PACKETS, sizeof(uint8_t));
+    run.full_q = xQueueCreate(PV_BENCH_PACKETS + 1, sizeof(uint8_t));
+    run.done = xSemaphoreCreateCounting(2, 0);
+    if (run.packets == NULL || run.free_q == NULL || run.full_q == NULL || run.done == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    memset(run.packets, 0x5A, (PV_BENCH_PACKETS + 1) * PV_BENCH_PACKET_SIZE);
+    for (uint8_t i = 0; i < PV_BENCH_PACKETS; i++) {
+        xQueueSend(run.free_q, &i, 0);
+    }
+
+    err = pv_file_open_write(&run.file, path, bytes);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+
+    start = esp_timer_get_time();
+    if (xTaskCreatePinnedToCore(pv_bench_writer_task, "bench_writer", 4096, &run, PV_TASK_PRIO_RECEIVER, NULL, writer_core) != pdPASS) {
+        pv_file_close(&run.file);
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    if (xTaskCreatePinnedToCore(pv_bench_radio_task, "bench_radio", 2048, &run, PV_BENCH_RADIO_PRIORITY, NULL, BENCH_RADIO_CORE) != pdPASS) {
+        // Let the writer finish on its own
+        uint8_t idx = PLACEMENT_END;
+        xQueueSend(run.full_q, &idx, portMAX_DELAY);
+        xSemaphoreGive(run.done);
+        err = ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(run.done, portMAX_DELAY);
+    xSemaphoreTake(run.done, portMAX_DELAY);
+
+    if (pv_file_close(&run.file) != ESP_OK && run.err == ESP_OK) {
+        run.err = ESP_FAIL;
+    }
+    result->total_us = esp_timer_get_time() - start;
+    result->bytes = run.written;
+    result->radio_us = run.radio_us;
+    if (err == ESP_OK) {
+        err = run.err;
+    }
+    remove(path);
+
+cleanup:
+    if (run.done != NULL) {
+        vSemaphoreDelete(run.done);
+    }
+    if (run.full_q != NULL) {
+        vQueueDelete(run.full_q);
+    }
+    if (run.free_q != NULL) {
+        vQueueDelete(run.free_q);
+    }
+    heap_caps_free(run.packets);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_bench_log_placement
+ * Purpose:     Logs one placement result
+ * Parameters:  name - Label of the run
+ *              r - The result
+ * Returns:     None
+ ***************************************************************************/
+static void pv_bench_log_placement(const char *name, const pv_bench_placement_result_t *r) {
+    PV_LOGI(TAG, "%s: %llu KB in %lld ms, %llu KB/s, radio busy %lld ms", name, r->bytes / 1024U, r->total_us / 1000,
+            r->total_us > 0 ? r->bytes * 1000000U / 1024U / (uint64_t)r->total_us : 0, r->radio_us / 1000);
+}
+
+/***************************************************************************
+ * Function:    pv_bench_log_write
+ * Purpose:     Logs one sequential write result
+ * Parameters:  name - Label of the run
+ *              r - The result
+ * Returns:     None
+ ***************************************************************************/
+static void pv_bench_log_write(const char *name, const pv_bench_write_result_t *r) {
+    int64_t total_us = r->open_us + r->write_us + r->close_us;
+
+    PV_LOGI(TAG, "%s: %llu KB, open %lld ms, write %lld ms, close %lld ms, %llu KB/s writing, %llu KB/s overall", name,
+            r->bytes / 1024U, r->open_us / 1000, r->write_us / 1000, r->close_us / 1000,
+            r->write_us > 0 ? r->bytes * 1000000U / 1024U / (uint64_t)r->write_us : 0,
+            total_us > 0 ? r->bytes * 1000000U / 1024U / (uint64_t)total_us : 0);
+}
+
+/***************************************************************************
+ * Function:    pv_bench_run_all
+ * Purpose:     Runs the storage benchmarks and logs the results
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_bench_run_all(void) {
+    pv_bench_create_result_t long_names = {0};
+    pv_bench_create_result_t short_names = {0};
+    pv_bench_write_result_t plain;
+    pv_bench_write_result_t erased;
+    pv_bench_placement_result_t shared;
+    pv_bench_placement_result_t split;
+
+    if (pv_fs_is_exfat()) {
+        PV_LOGI(TAG, "exFAT volume has no short names, both create runs should match");
+    }
+
+    PV_LOGI(TAG, "Bulk create, %u camera style long names", (unsigned)BENCH_FILES);
+    pv_bench_bulk_create(PV_BENCH_DIR, BENCH_FILES, false, &long_names);
+    PV_LOGI(TAG, "Bulk create, %u hash-derived 8.3 names", (unsigned)BENCH_FILES);
+    pv_bench_bulk_create(PV_BENCH_DIR, BENCH_FILES, true, &short_names);
+
+    PV_LOGI(TAG, "Long names:  %u files in %lld ms, %lld -> %lld us/file", (unsigned)long_names.files,
+            long_names.total_us / 1000, long_names.first_us_per_file, long_names.last_us_per_file);
+    PV_LOGI(TAG, "Short names: %u files in %lld ms, %lld -> %lld us/file", (unsigned)short_names.files,
+            short_names.total_us / 1000, short_names.first_us_per_file, short_names.last_us_per_file);
+
+    // Pre-erase pays off per card model, compare both on the card under test
+    mkdir(PV_BENCH_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    PV_LOGI(TAG, "Sequential write, %u MB, without and with pre-erase", (unsigned)BENCH_WRITE_MB);
+    if (pv_bench_sequential_write(PV_BENCH_DIR "/seq.bin", (uint64_t)BENCH_WRITE_MB * 1024U * 1024U, false, &plain) == ESP_OK) {
+        pv_bench_log_write("No pre-erase", &plain);
+    }
+    if (pv_bench_sequential_write(PV_BENCH_DIR "/seq.bin", (uint64_t)BENCH_WRITE_MB * 1024U * 1024U, true, &erased) == ESP_OK) {
+        pv_bench_log_write("Pre-erase", &erased);
+    }
+
+    // Writer next to the Bluetooth stack, then on the other core as placed by pv_tasks.h
+    PV_LOGI(TAG, "Receive, %u MB, writer on the radio core %d and on core %d", (unsigned)BENCH_WRITE_MB,
+            BENCH_RADIO_CORE, BENCH_SPLIT_CORE);
+    if (pv_bench_placement(PV_BENCH_DIR "/rx.bin", (uint64_t)BENCH_WRITE_MB * 1024U * 1024U, BENCH_RADIO_CORE, &shared) == ESP_OK) {
+        pv_bench_log_placement("Shared core", &shared);
+    }
+    if (pv_bench_placement(PV_BENCH_DIR "/rx.bin", (uint64_t)BENCH_WRITE_MB * 1024U * 1024U, BENCH_SPLIT_CORE, &split) == ESP_OK) {
+        pv_bench_log_placement("Split cores", &split);
+    }
+    pv_delete_dir(PV_BENCH_DIR);
+}
@@ -0,0 +1,285 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_dentry.h"
+
+
+#define TAG "PV_DENTRY"
+
+
+typedef struct {
+    pv_dentry_key_t key;
+    uint32_t last_use;              // s_clock value at the last hit, 0 if the slot is free
+    pv_dentry_t dentry;
+} dentry_slot_t;
+
+/* STATIC VARIABLES */
+static dentry_slot_t s_slots[PV_DENTRY_CACHE_SIZE];
+static uint32_t s_clock = 0;
+static uint32_t s_hits = 0;
+static uint32_t s_misses = 0;
+static uint32_t s_gen = 0;                  // Bumped whenever an entry is updated or dropped
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/***************************************************************************
+ * Function:    pv_dentry_key
+ * Purpose:     Splits a path into its (parent, name) key
+ * Parameters:  path - POSIX path (need not be terminated)
+ *              len - Length of the path
+ *              key - Returns the key
+ * Returns:     None
+ ***************************************************************************/
+static void pv_dentry_key(const char *path, size_t len, pv_dentry_key_t *key) {
+    size_t split = 0;
+
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    split = len;
+    while (split > 0 && path[split - 1] != '/') {
+        split--;
+    }
+    key->parent_hash = pv_fs_hash(path, split, true);
+    key->name_hash = pv_fs_hash(path + split, len - split, true);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_find
+ * Purpose:     Finds the slot of a key. Must be called with s_lock held.
+ * Parameters:  key - The key
+ * Returns:     The slot, NULL if the key is not cached
+ ***************************************************************************/
+static dentry_slot_t *pv_dentry_find(const pv_dentry_key_t *key) {
+    for (size_t i = 0; i < PV_DENTRY_CACHE_SIZE; i++) {
+        if (s_slots[i].last_use != 0 && s_slots[i].key.parent_hash == key->parent_hash &&
+            s_slots[i].key.name_hash == key->name_hash) {
+            return &s_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_store
+ * Purpose:     Stores an entry, replacing the least recently used one if
+ *              the key is not cached yet. Must be called with s_lock held.
+ * Parameters:  key - Key of the entry
+ *              dentry - The entry
+ * Returns:     None
+ ***************************************************************************/
+static void pv_dentry_store(const pv_dentry_key_t *key, const pv_dentry_t *dentry) {
+    dentry_slot_t *slot = pv_dentry_find(key);
+
+    if (slot == NULL) {
+        slot = &s_slots[0];
+        for (size_t i = 1; i < PV_DENTRY_CACHE_SIZE && slot->last_use != 0; i++) {
+            if (s_slots[i].last_use < slot->last_use) {
+                slot = &s_slots[i];
+            }
+        }
+        slot->key = *key;
+    }
+    slot->dentry = *dentry;
+    slot->last_use = ++s_clock;
+    s_gen++;
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_stat
+ * Purpose:     Looks up a file or directory, from the cache if possible
+ * Parameters:  path - POSIX path under SD_CARD_BASE_PATH
+ *              dentry - Returns the entry (may be NULL)
+ * Returns:     ESP_OK if the path exists
+ *              ESP_ERR_NOT_FOUND if it does not
+ *              ESP_ERR_INVALID_ARG if the path is not on the SD card
+ *              ESP_FAIL if the card could not be read
+ ***************************************************************************/
+esp_err_t pv_dentry_stat(const char *path, pv_dentry_t *dentry) {
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    pv_dentry_key_t key;
+    dentry_slot_t *slot = NULL;
+    pv_dentry_t found = {0};
+    FILINFO fno;
+    FRESULT f_res = FR_OK;
+    uint32_t delete_seq = pv_fs_delete_seq();
+    uint32_t gen = 0;
+
+    pv_dentry_key(path, strlen(path), &key);
+
+    taskENTER_CRITICAL(&s_lock);
+    slot = pv_dentry_find(&key);
+    if (slot != NULL) {
+        found = slot->dentry;
+        slot->last_use = ++s_clock;
+        s_hits++;
+    }
+    else {
+        s_misses++;
+        gen = s_gen;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (slot == NULL) {
+        if (pv_fs_get_ff_path(path, ff_path, sizeof(ff_path)) != ESP_OK) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        f_res = f_stat(ff_path, &fno);
+        if (f_res == FR_OK) {
+            found.exists = true;
+            found.attrib = fno.fattrib;
+            found.size = (fno.fattrib & AM_DIR) ? 0 : fno.fsize;
+        }
+        else if (f_res == FR_NO_FILE || f_res == FR_NO_PATH) {
+            found.exists = false;
+        }
+        else if (f_res == FR_INVALID_NAME) {
+            return ESP_ERR_NOT_FOUND; // e.g. the root directory, never cached
+        }
+        else {
+            PV_LOGE(TAG, "Failed to stat %s (0x%x)", path, f_res);
+            return ESP_FAIL;
+        }
+        // A create or delete that ran meanwhile may have changed what was found
+        taskENTER_CRITICAL(&s_lock);
+        if (s_gen == gen && pv_fs_delete_seq() == delete_seq && !(delete_seq & 1U)) {
+            pv_dentry_store(&key, &found);
+        }
+        taskEXIT_CRITICAL(&s_lock);
+    }
+
+    if (dentry != NULL) {
+        *dentry = found;
+    }
+    return found.exists ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_exists
+ * Purpose:     Checks whether a file or directory exists
+ * Parameters:  path - POSIX path under SD_CARD_BASE_PATH
+ * Returns:     true if it exists
+ ***************************************************************************/
+bool pv_dentry_exists(const char *path) {
+    return pv_dentry_stat(path, NULL) == ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_get_key
+ * Purpose:     Computes the cache key of a path, for callers that update an
+ *              entry later without keeping the path
+ * Parameters:  path - POSIX path
+ *              key - Returns the key
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_get_key(const char *path, pv_dentry_key_t *key) {
+    pv_dentry_key(path, strlen(path), key);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_update_key
+ * Purpose:     Records the current state of an entry after file_storage_mgr
+ *              created or changed it, replacing the least recently used
+ *              entry if the key is not cached yet. While pv_delete_dir()
+ *              runs the entry is dropped instead.
+ * Parameters:  key - Key of the entry
+ *              dentry - The new entry
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_update_key(const pv_dentry_key_t *key, const pv_dentry_t *dentry) {
+    dentry_slot_t *slot = NULL;
+
+    taskENTER_CRITICAL(&s_lock);
+    slot = pv_dentry_find(key);
+    if (pv_fs_delete_seq() & 1U) {
+        // The entry may be inside the tree being deleted, drop it instead
+        if (slot != NULL) {
+            slot->last_use = 0;
+        }
+        s_gen++;
+        taskEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    pv_dentry_store(key, dentry);
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_update
+ * Purpose:     Records the current state of an entry after file_storage_mgr
+ *              created or changed it
+ * Parameters:  path - POSIX path under SD_CARD_BASE_PATH
+ *              dentry - The new entry
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_update(const char *path, const pv_dentry_t *dentry) {
+    pv_dentry_key_t key;
+
+    pv_dentry_key(path, strlen(path), &key);
+    pv_dentry_update_key(&key, dentry);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_invalidate_n
+ * Purpose:     Drops the cached entry of a path, so the next lookup reads
+ *              the card
+ * Parameters:  path - POSIX path (need not be terminated)
+ *              len - Length of the path
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_invalidate_n(const char *path, size_t len) {
+    pv_dentry_key_t key;
+    dentry_slot_t *slot = NULL;
+
+    pv_dentry_key(path, len, &key);
+
+    taskENTER_CRITICAL(&s_lock);
+    slot = pv_dentry_find(&key);
+    if (slot != NULL) {
+        slot->last_use = 0;
+    }
+    s_gen++;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_invalidate
+ * Purpose:     Drops the cached entry of a path
+ * Parameters:  path - POSIX path
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_invalidate(const char *path) {
+    pv_dentry_invalidate_n(path, strlen(path));
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_clear
+ * Purpose:     Drops every cached entry. Used when a whole tree is deleted,
+ *              as only hashes of the paths are kept.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_clear(void) {
+    taskENTER_CRITICAL(&s_lock);
+    memset(s_slots, 0, sizeof(s_slots));
+    s_gen++;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_dentry_get_stats
+ * Purpose:     Returns the lookup counters
+ * Parameters:  hits - Returns lookups answered from RAM
+ *              misses - Returns lookups that read the card
+ * Returns:     None
+ ***************************************************************************/
+void pv_dentry_get_stats(uint32_t *hits, uint32_t *misses) {
+    taskENTER_CRITICAL(&s_lock);
+    *hits = s_hits;
+    *misses = s_misses;
+    taskEXIT_CRITICAL(&s_lock);
+}
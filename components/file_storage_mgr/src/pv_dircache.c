@@ -0,0 +1,130 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "pv_fs.h"
+#include "pv_dircache.h"
+
+
+#define DIRCACHE_EMPTY          0ULL                    // Marks a free slot, never a valid hash
+
+/* STATIC VARIABLES */
+static uint64_t s_slots[PV_DIRCACHE_SLOTS];
+static size_t s_count = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/***************************************************************************
+ * Function:    pv_dircache_hash
+ * Purpose:     FNV-1a hash of a path, ignoring case and trailing slashes
+ * Parameters:  path - POSIX path
+ *              len - Length of the path
+ * Returns:     The hash, never DIRCACHE_EMPTY
+ ***************************************************************************/
+static uint64_t pv_dircache_hash(const char *path, size_t len) {
+    uint64_t hash = 0;
+
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    hash = pv_fs_hash(path, len, true);
+    return (hash == DIRCACHE_EMPTY) ? 1 : hash;
+}
+
+/***************************************************************************
+ * Function:    pv_dircache_contains_n
+ * Purpose:     Checks whether a directory is known to exist
+ * Parameters:  path - POSIX path of the directory (need not be terminated)
+ *              len - Length of the path
+ * Returns:     true if the directory was created or found since the last clear
+ ***************************************************************************/
+bool pv_dircache_contains_n(const char *path, size_t len) {
+    uint64_t hash = pv_dircache_hash(path, len);
+    size_t slot = hash & (PV_DIRCACHE_SLOTS - 1);
+    bool found = false;
+
+    taskENTER_CRITICAL(&s_lock);
+    for (size_t i = 0; i < PV_DIRCACHE_SLOTS; i++) {
+        uint64_t entry = s_slots[(slot + i) & (PV_DIRCACHE_SLOTS - 1)];
+        if (entry == DIRCACHE_EMPTY) {
+            break;
+        }
+        if (entry == hash) {
+            found = true;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    return found;
+}
+
+/***************************************************************************
+ * Function:    pv_dircache_contains
+ * Purpose:     Checks whether a directory is known to exist
+ * Parameters:  path - POSIX path of the directory
+ * Returns:     true if the directory was created or found since the last clear
+ ***************************************************************************/
+bool pv_dircache_contains(const char *path) {
+    return pv_dircache_contains_n(path, strlen(path));
+}
+
+/***************************************************************************
+ * Function:    pv_dircache_add_n
+ * Purpose:     Records that a directory exists. When the table gets too full
+ *              it is cleared and refills with the directories in use. Nothing
+ *              is recorded while pv_delete_dir() runs, the directory may be
+ *              about to go.
+ * Parameters:  path - POSIX path of the directory (need not be terminated)
+ *              len - Length of the path
+ * Returns:     None
+ ***************************************************************************/
+void pv_dircache_add_n(const char *path, size_t len) {
+    uint64_t hash = pv_dircache_hash(path, len);
+    size_t slot = hash & (PV_DIRCACHE_SLOTS - 1);
+
+    if (pv_fs_delete_seq() & 1U) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    if (s_count >= PV_DIRCACHE_MAX_ENTRIES) {
+        memset(s_slots, 0, sizeof(s_slots));
+        s_count = 0;
+    }
+    for (size_t i = 0; i < PV_DIRCACHE_SLOTS; i++) {
+        uint64_t *entry = &s_slots[(slot + i) & (PV_DIRCACHE_SLOTS - 1)];
+        if (*entry == hash) {
+            break;
+        }
+        if (*entry == DIRCACHE_EMPTY) {
+            *entry = hash;
+            s_count++;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_dircache_add
+ * Purpose:     Records that a directory exists
+ * Parameters:  path - POSIX path of the directory
+ * Returns:     None
+ ***************************************************************************/
+void pv_dircache_add(const char *path) {
+    pv_dircache_add_n(path, strlen(path));
+}
+
+/***************************************************************************
+ * Function:    pv_dircache_clear
+ * Purpose:     Forgets every directory. Called whenever directories may have
+ *              been removed from the card.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_dircache_clear(void) {
+    taskENTER_CRITICAL(&s_lock);
+    memset(s_slots, 0, sizeof(s_slots));
+    s_count = 0;
+    taskEXIT_CRITICAL(&s_lock);
+}
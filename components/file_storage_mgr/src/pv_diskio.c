@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include "sdmmc_cmd.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_diskio.h"
+#include "pv_trim.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_DISKIO"
+
+/* STATIC VARIABLES */
+static sdmmc_card_t *s_card = NULL;
+static bool s_status_check = false;
+static bool s_pre_erase = false;
+static uint8_t *s_bounce = NULL;                   // PV_DISKIO_BOUNCE_SIZE, used with the volume lock held
+static pv_diskio_stats_t s_stats;
+static volatile uint32_t s_fat_writes = 0;         // FAT and allocation bitmap write transactions, never reset
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/***************************************************************************
+ * Function:    pv_diskio_classify
+ * Purpose:     Tells what a transfer touches from its first sector and the
+ *              buffer FatFs passed. FatFs moves FAT, bitmap and directory
+ *              sectors through fs->win and file data through anything else.
+ * Parameters:  buff - Buffer of the transfer
+ *              sector - First sector
+ * Returns:     The sector class
+ ***************************************************************************/
+static pv_diskio_class_t pv_diskio_classify(const unsigned char *buff, uint32_t sector) {
+    FATFS *fs = pv_fs_get_fatfs();
+
+    if (fs == NULL || fs->fs_type == 0) {
+        return PV_DISKIO_FAT; // Boot sector and partition table while mounting
+    }
+    if (sector < fs->database) {
+        // FAT12/16 keep the root directory between the FATs and the data area
+        if ((fs->fs_type == FS_FAT12 || fs->fs_type == FS_FAT16) && sector >= fs->dirbase) {
+            return PV_DISKIO_DIR;
+        }
+        return PV_DISKIO_FAT;
+    }
+    if (buff != fs->win) {
+        return PV_DISKIO_DATA;
+    }
+#if FF_FS_EXFAT
+    if (fs->fs_type == FS_EXFAT) {
+        LBA_t bitmap_sectors = ((fs->n_fatent - 2) / 8 + fs->ssize - 1) / fs->ssize;
+        if (sector >= fs->bitbase && sector < fs->bitbase + bitmap_sectors) {
+            return PV_DISKIO_FAT;
+        }
+    }
+#endif
+    return PV_DISKIO_DIR;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_bucket
+ * Purpose:     Returns the histogram bucket of a latency
+ * Parameters:  us - Latency in microseconds
+ * Returns:     Bucket index
+ ***************************************************************************/
+static uint32_t pv_diskio_bucket(uint32_t us) {
+    uint32_t log2 = 0;
+
+    if (us < (1U << (PV_DISKIO_HIST_MIN_LOG2 + 1))) {
+        return 0;
+    }
+    log2 = 31U - (uint32_t)__builtin_clz(us);
+    return (log2 - PV_DISKIO_HIST_MIN_LOG2 < PV_DISKIO_HIST_BUCKETS) ? log2 - PV_DISKIO_HIST_MIN_LOG2 : PV_DISKIO_HIST_BUCKETS - 1;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_account
+ * Purpose:     Adds a finished read or write to the counters
+ * Parameters:  write - true for a write
+ *              cls - Sector class
+ *              count - Number of sectors
+ *              us - Duration of the transaction
+ *              ok - false if the driver reported an error
+ * Returns:     None
+ ***************************************************************************/
+static void pv_diskio_account(bool write, pv_diskio_class_t cls, unsigned count, uint32_t us, bool ok) {
+    uint32_t bucket = pv_diskio_bucket(us);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    if (write) {
+        s_stats.writes++;
+        s_stats.write_us += us;
+        s_stats.write_hist[bucket]++;
+        if (ok) {
+            s_stats.sectors_written[cls] += count;
+        }
+    }
+    else {
+        s_stats.reads++;
+        s_stats.read_us += us;
+        s_stats.read_hist[bucket]++;
+        if (ok) {
+            s_stats.sectors_read[cls] += count;
+        }
+    }
+    if (!ok) {
+        s_stats.errors++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_init
+ * Purpose:     diskio initialize callback, the card was set up by pv_init_sdc()
+ * Parameters:  pdrv - FatFs drive number
+ * Returns:     0 if the card is ready, STA_NOINIT else
+ ***************************************************************************/
+static DSTATUS pv_diskio_init(unsigned char pdrv) {
+    if (s_card == NULL) {
+        return STA_NOINIT;
+    }
+    if (s_status_check && sdmmc_get_status(s_card) != ESP_OK) {
+        return STA_NOINIT;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_status
+ * Purpose:     diskio status callback
+ * Parameters:  pdrv - FatFs drive number
+ * Returns:     0 if the card is ready, STA_NOINIT else
+ ***************************************************************************/
+static DSTATUS pv_diskio_status(unsigned char pdrv) {
+    return pv_diskio_init(pdrv);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_count_bounce
+ * Purpose:     Counts a transfer whose buffer the driver can't DMA in place
+ * Parameters:  write - true for a write
+ *              count - Number of sectors
+ * Returns:     None
+ ***************************************************************************/
+static void pv_diskio_count_bounce(bool write, unsigned count) {
+    portENTER_CRITICAL(&s_stats_lock);
+    if (write) {
+        s_stats.bounce_writes++;
+    }
+    else {
+        s_stats.bounce_reads++;
+    }
+    s_stats.bounce_sectors += count;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_transfer
+ * Purpose:     Reads or writes sectors. A buffer the driver can't DMA would
+ *              make it bounce and transfer one sector at a time, such
+ *              transfers are counted and go through s_bounce in multi-sector
+ *              chunks instead.
+ * Parameters:  write - true for a write
+ *              buff - Buffer of the transfer
+ *              sector - First sector
+ *              count - Number of sectors
+ * Returns:     ESP_OK on success, error from the SD driver else
+ ***************************************************************************/
+static esp_err_t pv_diskio_transfer(bool write, unsigned char *buff, uint32_t sector, unsigned count) {
+    size_t ss = s_card->csd.sector_size;
+    unsigned chunk = (s_bounce != NULL) ? (unsigned)(PV_DISKIO_BOUNCE_SIZE / ss) : 0;
+    esp_err_t err = ESP_OK;
+
+    if (pv_dma_capable(buff)) {
+        return write ? sdmmc_write_sectors(s_card, buff, sector, count) : sdmmc_read_sectors(s_card, buff, sector, count);
+    }
+
+    pv_diskio_count_bounce(write, count);
+    if (chunk == 0) {
+        // No staging buffer, let the driver bounce
+        return write ? sdmmc_write_sectors(s_card, buff, sector, count) : sdmmc_read_sectors(s_card, buff, sector, count);
+    }
+    for (unsigned done = 0; done < count && err == ESP_OK; done += chunk) {
+        unsigned n = (count - done < chunk) ? count - done : chunk;
+        if (write) {
+            memcpy(s_bounce, buff + done * ss, n * ss);
+            err = sdmmc_write_sectors(s_card, s_bounce, sector + done, n);
+        }
+        else {
+            err = sdmmc_read_sectors(s_card, s_bounce, sector + done, n);
+            if (err == ESP_OK) {
+                memcpy(buff + done * ss, s_bounce, n * ss);
+            }
+        }
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_read
+ * Purpose:     diskio read callback. Also used by code reading sectors
+ *              outside FatFs (with the volume lock held) so they are counted.
+ * Parameters:  pdrv - FatFs drive number
+ *              buff - Buffer to read into
+ *              sector - First sector
+ *              count - Number of sectors
+ * Returns:     RES_OK on success, RES_ERROR else
+ ***************************************************************************/
+DRESULT pv_diskio_read(unsigned char pdrv, unsigned char *buff, uint32_t sector, unsigned count) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = pv_diskio_transfer(false, buff, sector, count);
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+    pv_diskio_class_t cls = pv_diskio_classify(buff, sector);
+
+    pv_diskio_account(false, cls, count, us, err == ESP_OK);
+    pv_diskio_trace_record(PV_TRACE_OP_READ, (uint8_t)cls, sector, count, start, us, (err == ESP_OK) ? RES_OK : RES_ERROR);
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Read of %u sectors at %lu failed (0x%x)", count, (unsigned long)sector, err);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_write
+ * Purpose:     diskio write callback. Also used by code writing data sectors
+ *              outside FatFs (with the volume lock held) so they are counted.
+ * Parameters:  pdrv - FatFs drive number
+ *              buff - Data to write
+ *              sector - First sector
+ *              count - Number of sectors
+ * Returns:     RES_OK on success, RES_ERROR else
+ ***************************************************************************/
+DRESULT pv_diskio_write(unsigned char pdrv, const unsigned char *buff, uint32_t sector, unsigned count) {
+    int64_t start = 0;
+    esp_err_t err = ESP_OK;
+
+    pv_trim_cancel(sector, count); // A queued discard must not hit the new data
+    start = esp_timer_get_time();
+    err = pv_diskio_transfer(true, (unsigned char *)buff, sector, count);
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+    pv_diskio_class_t cls = pv_diskio_classify(buff, sector);
+
+    if (cls == PV_DISKIO_FAT) {
+        s_fat_writes++; // Written with the volume lock held
+    }
+    pv_diskio_account(true, cls, count, us, err == ESP_OK);
+    pv_diskio_trace_record(PV_TRACE_OP_WRITE, (uint8_t)cls, sector, count, start, us, (err == ESP_OK) ? RES_OK : RES_ERROR);
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Write of %u sectors at %lu failed (0x%x)", count, (unsigned long)sector, err);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_control
+ * Purpose:     Carries out a diskio control code
+ * Parameters:  cmd - Control code
+ *              buff - Parameter of the control code
+ * Returns:     RES_OK on success
+ *              RES_PARERR for unsupported codes
+ *              RES_ERROR else
+ ***************************************************************************/
+static DRESULT pv_diskio_control(unsigned char cmd, void *buff) {
+    switch (cmd) {
+        case CTRL_SYNC:
+            return RES_OK; // Writes complete on the card before they return
+        case GET_SECTOR_COUNT:
+            *((LBA_t *)buff) = s_card->csd.capacity;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *((WORD *)buff) = s_card->csd.sector_size;
+            return RES_OK;
+#if FF_USE_TRIM
+        case CTRL_TRIM:
+            return pv_trim_range(((LBA_t *)buff)[0], ((LBA_t *)buff)[1]);
+#endif
+        default:
+            return RES_PARERR;
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_ioctl
+ * Purpose:     diskio ioctl callback
+ * Parameters:  pdrv - FatFs drive number
+ *              cmd - Control code
+ *              buff - Parameter of the control code
+ * Returns:     RES_OK on success
+ *              RES_PARERR for unsupported codes
+ *              RES_ERROR else
+ ***************************************************************************/
+static DRESULT pv_diskio_ioctl(unsigned char pdrv, unsigned char cmd, void *buff) {
+    int64_t start = esp_timer_get_time();
+    uint32_t sector = 0;
+    uint32_t count = 0;
+    DRESULT res = RES_OK;
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.ioctls++;
+    portEXIT_CRITICAL(&s_stats_lock);
+
+#if FF_USE_TRIM
+    if (cmd == CTRL_TRIM) {
+        sector = (uint32_t)((LBA_t *)buff)[0];
+        count = (uint32_t)(((LBA_t *)buff)[1] - ((LBA_t *)buff)[0] + 1);
+    }
+#endif
+    res = pv_diskio_control(cmd, buff);
+    pv_diskio_trace_record(PV_TRACE_OP_IOCTL, cmd, sector, count, start, (uint32_t)(esp_timer_get_time() - start), res);
+    return res;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_card_in_list
+ * Purpose:     Checks whether a card's CID product name is in a comma
+ *              separated list such as a Kconfig string
+ * Parameters:  card - The card
+ *              list - Product names, e.g. "SD16G,SL32G"
+ * Returns:     true if the name is listed
+ ***************************************************************************/
+bool pv_diskio_card_in_list(const sdmmc_card_t *card, const char *list) {
+    size_t name_len = strnlen(card->cid.name, sizeof(card->cid.name));
+
+    while (*list != '\0') {
+        const char *end = strchr(list, ',');
+        size_t len = (end != NULL) ? (size_t)(end - list) : strlen(list);
+        if (len == name_len && strncmp(list, card->cid.name, len) == 0) {
+            return true;
+        }
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return false;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_register
+ * Purpose:     Installs the counting driver for the SD card. The card is also
+ *              registered with the IDF sdmmc driver first so IDF helpers that
+ *              look the card up by drive number still find it.
+ * Parameters:  pdrv - FatFs drive number
+ *              card - Initialized SD card
+ *              status_check - Ask the card for its status on every FatFs call
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if card is NULL
+ ***************************************************************************/
+esp_err_t pv_diskio_register(BYTE pdrv, sdmmc_card_t *card, bool status_check) {
+    static const ff_diskio_impl_t impl = {
+        .init = &pv_diskio_init,
+        .status = &pv_diskio_status,
+        .read = &pv_diskio_read,
+        .write = &pv_diskio_write,
+        .ioctl = &pv_diskio_ioctl,
+    };
+
+    if (card == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ff_diskio_register_sdmmc(pdrv, card);
+    s_card = card;
+    if (s_bounce == NULL && (s_bounce = pv_dma_alloc(PV_DISKIO_BOUNCE_SIZE)) == NULL) {
+        PV_LOGW(TAG, "No bounce buffer, unaligned transfers go one sector at a time");
+    }
+    s_status_check = status_check;
+    ff_diskio_register(pdrv, &impl);
+    if (pv_trim_init(pdrv, card) != ESP_OK) {
+        PV_LOGW(TAG, "Freed clusters are not discarded");
+    }
+#if CONFIG_PV_FS_PRE_ERASE
+    s_pre_erase = CONFIG_PV_FS_PRE_ERASE_CARDS[0] == '\0' || pv_diskio_card_in_list(card, CONFIG_PV_FS_PRE_ERASE_CARDS);
+#endif
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_pre_erase
+ * Purpose:     Erases the sectors a large file was just preallocated on, so
+ *              the card has erased blocks ready when the data arrives instead
+ *              of erasing them during the multi-block writes. Takes the
+ *              volume lock, the caller must not hold it.
+ * Parameters:  first - First sector of the preallocated run
+ *              count - Number of sectors
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NOT_SUPPORTED if pre-erase is off for this card
+ *              Error from sdmmc_erase_sectors() else
+ ***************************************************************************/
+esp_err_t pv_diskio_pre_erase(LBA_t first, LBA_t count) {
+    int vol = pv_fs_get_pdrv();
+    int64_t start = 0;
+    uint32_t us = 0;
+    esp_err_t err = ESP_OK;
+
+    if (!s_pre_erase || s_card == NULL || count == 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    ff_mutex_take(vol);
+    pv_trim_cancel(first, (unsigned)count); // Already being erased
+    start = esp_timer_get_time();
+    err = sdmmc_erase_sectors(s_card, (size_t)first, (size_t)count, SDMMC_ERASE_ARG);
+    us = (uint32_t)(esp_timer_get_time() - start);
+    ff_mutex_give(vol);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.pre_erases++;
+    s_stats.pre_erase_us += us;
+    if (err == ESP_OK) {
+        s_stats.pre_erase_sectors += count;
+    }
+    else {
+        s_stats.errors++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    if (err != ESP_OK) {
+        PV_LOGW(TAG, "Pre-erase of %lu sectors at %lu failed (0x%x)", (unsigned long)count, (unsigned long)first, err);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_set_pre_erase
+ * Purpose:     Turns pre-erase on or off for the mounted card until the next
+ *              mount, overriding CONFIG_PV_FS_PRE_ERASE_CARDS
+ * Parameters:  enable - true to pre-erase large preallocated files
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_set_pre_erase(bool enable) {
+    s_pre_erase = enable;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_pre_erase_enabled
+ * Purpose:     Tells whether large preallocated files are pre-erased
+ * Parameters:  None
+ * Returns:     true if pre-erase is on for the mounted card
+ ***************************************************************************/
+bool pv_diskio_pre_erase_enabled(void) {
+    return s_pre_erase;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_add_payload
+ * Purpose:     Counts photo bytes received, the reference for the write
+ *              amplification
+ * Parameters:  bytes - Bytes received
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_add_payload(size_t bytes) {
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.payload_bytes += bytes;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_fat_writes
+ * Purpose:     Returns a count of writes to the FAT or exFAT allocation
+ *              bitmap, so a scan of them can tell whether they changed
+ * Parameters:  None
+ * Returns:     The count, it only ever grows (and wraps)
+ ***************************************************************************/
+uint32_t pv_diskio_fat_writes(void) {
+    return s_fat_writes;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_get_stats
+ * Purpose:     Returns a consistent copy of the counters
+ * Parameters:  stats - Returns the counters
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_get_stats(pv_diskio_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_reset_stats
+ * Purpose:     Clears all counters
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_reset_stats(void) {
+    portENTER_CRITICAL(&s_stats_lock);
+    memset(&s_stats, 0, sizeof(s_stats));
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_sectors_written
+ * Purpose:     Sums the sectors written of all classes
+ * Parameters:  stats - Counters from pv_diskio_get_stats()
+ * Returns:     Sectors written
+ ***************************************************************************/
+uint64_t pv_diskio_sectors_written(const pv_diskio_stats_t *stats) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < PV_DISKIO_CLASS_COUNT; i++) {
+        total += stats->sectors_written[i];
+    }
+    return total;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_write_amplification_x100
+ * Purpose:     Bytes written to the card per photo byte received
+ * Parameters:  stats - Counters from pv_diskio_get_stats()
+ * Returns:     The ratio times 100, 0 if no payload was counted
+ ***************************************************************************/
+uint32_t pv_diskio_write_amplification_x100(const pv_diskio_stats_t *stats) {
+    uint32_t sector_size = (s_card != NULL) ? (uint32_t)s_card->csd.sector_size : 512U;
+
+    if (stats->payload_bytes == 0) {
+        return 0;
+    }
+    return (uint32_t)(pv_diskio_sectors_written(stats) * sector_size * 100U / stats->payload_bytes);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_log_hist
+ * Purpose:     Logs one latency histogram on a single line
+ * Parameters:  name - "read" or "write"
+ *              hist - The histogram
+ * Returns:     None
+ ***************************************************************************/
+static void pv_diskio_log_hist(const char *name, const uint32_t *hist) {
+    char line[PV_DISKIO_HIST_BUCKETS * 12];
+    size_t len = 0;
+
+    for (uint32_t i = 0; i < PV_DISKIO_HIST_BUCKETS && len < sizeof(line); i++) {
+        len += snprintf(line + len, sizeof(line) - len, " %lu", (unsigned long)hist[i]);
+    }
+    PV_LOGI(TAG, "%s latency histogram (<%uus, x2 per bucket):%s", name, 1U << (PV_DISKIO_HIST_MIN_LOG2 + 1), line);
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_log_stats
+ * Purpose:     Logs all counters
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_log_stats(void) {
+    pv_diskio_stats_t stats;
+    pv_trim_stats_t trim;
+    uint32_t wa = 0;
+
+    pv_diskio_get_stats(&stats);
+    wa = pv_diskio_write_amplification_x100(&stats);
+
+    PV_LOGI(TAG, "Sectors read data/fat/dir: %llu/%llu/%llu",
+            stats.sectors_read[PV_DISKIO_DATA], stats.sectors_read[PV_DISKIO_FAT], stats.sectors_read[PV_DISKIO_DIR]);
+    PV_LOGI(TAG, "Sectors written data/fat/dir: %llu/%llu/%llu",
+            stats.sectors_written[PV_DISKIO_DATA], stats.sectors_written[PV_DISKIO_FAT], stats.sectors_written[PV_DISKIO_DIR]);
+    PV_LOGI(TAG, "Transactions read/write/ioctl: %lu/%lu/%lu, errors %lu", (unsigned long)stats.reads,
+            (unsigned long)stats.writes, (unsigned long)stats.ioctls, (unsigned long)stats.errors);
+    PV_LOGI(TAG, "Average latency read %llu us, write %llu us",
+            stats.reads ? stats.read_us / stats.reads : 0, stats.writes ? stats.write_us / stats.writes : 0);
+    PV_LOGI(TAG, "Pre-erased %llu sectors in %lu erases (%llu ms)", stats.pre_erase_sectors,
+            (unsigned long)stats.pre_erases, stats.pre_erase_us / 1000U);
+    PV_LOGI(TAG, "Payload %llu bytes, write amplification %lu.%02lu", stats.payload_bytes,
+            (unsigned long)(wa / 100), (unsigned long)(wa % 100));
+    PV_LOGI(TAG, "Bounced transfers read/write: %lu/%lu, %llu sectors", (unsigned long)stats.bounce_reads,
+            (unsigned long)stats.bounce_writes, stats.bounce_sectors);
+    pv_diskio_log_hist("Read", stats.read_hist);
+    pv_diskio_log_hist("Write", stats.write_hist);
+
+    pv_trim_get_stats(&trim);
+    PV_LOGI(TAG, "Discarded %llu sectors in %lu inline/%lu background erases (%llu ms), %lu cancelled, %lu dropped, %lu failed",
+            trim.sectors, (unsigned long)trim.inline_erases, (unsigned long)trim.background_erases, trim.erase_us / 1000U,
+            (unsigned long)trim.cancelled, (unsigned long)trim.dropped, (unsigned long)trim.failed);
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "diskio.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_diskio.h"
+#include "pv_static.h"
+
+
+#define TAG "PV_DISKIO_TRACE"
+
+#if CONFIG_PV_DISKIO_TRACE
+
+#define TRACE_BUF_RECORDS       CONFIG_PV_DISKIO_TRACE_BUF_RECORDS  // Records per buffer
+#define TRACE_STOP_WAIT_MS      2000U
+#define TRACE_STOP_POLL_MS      10U
+
+/* STATIC VARIABLES */
+static pv_trace_rec_t s_buf[2][TRACE_BUF_RECORDS];
+static volatile bool s_full[2];                 // Buffer waits for the task
+static uint32_t s_cur;                          // Buffer being filled
+static uint32_t s_fill;                         // Records in it
+static int64_t s_last_us;                       // Start of the previous record
+static uint32_t s_dropped;
+static volatile bool s_on = false;              // Recorder accepts records
+static volatile bool s_start = false;           // Requests for the task
+static volatile bool s_stop = false;
+static volatile bool s_running = false;         // From pv_diskio_trace_start() until the file is closed
+static TaskHandle_t s_task = NULL;
+static FIL s_fil;
+static portMUX_TYPE s_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+PV_STATIC_TASK_DEFINE(s_task_mem, PV_DISKIO_TRACE_TASK_STACK_SIZE);
+
+
+/***************************************************************************
+ * Function:    trace_open
+ * Purpose:     Creates the trace file and writes its header
+ * Parameters:  None
+ * Returns:     true on success
+ ***************************************************************************/
+static bool trace_open(void) {
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FATFS *fs = pv_fs_get_fatfs();
+    pv_trace_hdr_t hdr = {
+        .magic = PV_TRACE_MAGIC,
+        .version = PV_TRACE_VERSION,
+        .sector_size = 512,
+        .rec_size = sizeof(pv_trace_rec_t),
+    };
+    LBA_t sectors = 0;
+    WORD sector_size = 0;
+    UINT bw = 0;
+
+    if (fs == NULL || pv_fs_get_ff_path(PV_DISKIO_TRACE_PATH, ff_path, sizeof(ff_path)) != ESP_OK) {
+        return false;
+    }
+    if (disk_ioctl(fs->pdrv, GET_SECTOR_COUNT, &sectors) == RES_OK) {
+        hdr.sector_count = (uint32_t)sectors;
+    }
+    if (disk_ioctl(fs->pdrv, GET_SECTOR_SIZE, &sector_size) == RES_OK) {
+        hdr.sector_size = sector_size;
+    }
+
+    if (f_open(&s_fil, ff_path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        return false;
+    }
+    if (f_write(&s_fil, &hdr, sizeof(hdr), &bw) != FR_OK || bw != sizeof(hdr) || f_sync(&s_fil) != FR_OK) {
+        f_close(&s_fil);
+        return false;
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    trace_write
+ * Purpose:     Appends records to the trace file and syncs it, so a trace cut
+ *              off by a power loss still ends on the last written buffer
+ * Parameters:  recs - Records
+ *              n - Number of records
+ * Returns:     true on success
+ ***************************************************************************/
+static bool trace_write(const pv_trace_rec_t *recs, uint32_t n) {
+    UINT bw = 0;
+
+    if (n == 0) {
+        return true;
+    }
+    if (f_write(&s_fil, recs, n * sizeof(pv_trace_rec_t), &bw) != FR_OK || bw != n * sizeof(pv_trace_rec_t)) {
+        return false;
+    }
+    return f_sync(&s_fil) == FR_OK;
+}
+
+/***************************************************************************
+ * Function:    trace_write_full
+ * Purpose:     Writes the buffers the recorder has filled. If both are full
+ *              the recorder is stuck on the older one, s_cur.
+ * Parameters:  None
+ * Returns:     true on success
+ ***************************************************************************/
+static bool trace_write_full(void) {
+    uint32_t first = 0;
+
+    portENTER_CRITICAL(&s_trace_lock);
+    first = s_cur;
+    portEXIT_CRITICAL(&s_trace_lock);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        uint32_t idx = first ^ i;
+        if (s_full[idx]) {
+            if (!trace_write(s_buf[idx], TRACE_BUF_RECORDS)) {
+                return false;
+            }
+            s_full[idx] = false;
+        }
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    trace_close
+ * Purpose:     Writes what is left in the buffers and closes the trace file.
+ *              The recorder must be off.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void trace_close(void) {
+    if (trace_write_full() && !s_full[s_cur]) {
+        trace_write(s_buf[s_cur], s_fill);
+    }
+    f_close(&s_fil);
+    PV_LOGI(TAG, "Trace closed, %lu records dropped", (unsigned long)s_dropped);
+}
+
+/***************************************************************************
+ * Function:    trace_task
+ * Purpose:     Opens the trace file when a trace is started, writes each
+ *              buffer the recorder fills and closes the file when the trace
+ *              is stopped. The task is kept between traces so the recorder
+ *              never notifies a deleted task.
+ * Parameters:  arg - Unused
+ * Returns:     None
+ ***************************************************************************/
+static void trace_task(void *arg) {
+    bool open = false;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (s_start && !open) {
+            s_start = false;
+            open = trace_open();
+            if (open) {
+                PV_LOGI(TAG, "Tracing to %s", PV_DISKIO_TRACE_PATH);
+                portENTER_CRITICAL(&s_trace_lock);
+                s_cur = 0;
+                s_fill = 0;
+                s_full[0] = s_full[1] = false;
+                s_last_us = esp_timer_get_time();
+                s_on = true;
+                portEXIT_CRITICAL(&s_trace_lock);
+            }
+            else {
+                PV_LOGE(TAG, "Could not create %s", PV_DISKIO_TRACE_PATH);
+                s_running = false;
+            }
+        }
+
+        if (open && !trace_write_full()) {
+            PV_LOGE(TAG, "Write to %s failed, tracing stopped", PV_DISKIO_TRACE_PATH);
+            s_on = false;
+            f_close(&s_fil);
+            open = false;
+            s_running = false;
+        }
+
+        if (s_stop) {
+            if (open) {
+                trace_close();
+                open = false;
+            }
+            s_stop = false;
+            s_running = false;
+        }
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_trace_record
+ * Purpose:     Adds a record for a diskio call to the current buffer and
+ *              hands the buffer to the trace task when it is full
+ * Parameters:  op - Read, write or ioctl
+ *              info - Sector class or control code
+ *              sector - First sector
+ *              count - Number of sectors
+ *              start_us - esp_timer time the call started
+ *              dur_us - Duration of the call
+ *              result - Result returned to FatFs
+ * Returns:     None
+ ***************************************************************************/
+void pv_diskio_trace_record(pv_trace_op_t op, uint8_t info, uint32_t sector, uint32_t count, int64_t start_us,
+                            uint32_t dur_us, DRESULT result) {
+    bool notify = false;
+
+    if (!s_on || xTaskGetCurrentTaskHandle() == s_task) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_trace_lock);
+    if (!s_on) {
+        // Stopped meanwhile
+    }
+    else if (s_full[s_cur]) {
+        s_dropped++; // The task has not written this buffer yet
+    }
+    else {
+        pv_trace_rec_t *rec = &s_buf[s_cur][s_fill++];
+        rec->delta_us = (start_us > s_last_us) ? (uint32_t)(start_us - s_last_us) : 0;
+        rec->sector = sector;
+        rec->count = count;
+        rec->dur_us = dur_us;
+        rec->op = (uint8_t)op;
+        rec->info = info;
+        rec->result = (uint8_t)result;
+        rec->reserved = 0;
+        s_last_us = start_us;
+        if (s_fill == TRACE_BUF_RECORDS) {
+            s_full[s_cur] = true;
+            s_cur ^= 1U;
+            s_fill = 0;
+            notify = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_trace_lock);
+
+    if (notify) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_trace_start
+ * Purpose:     Starts recording to PV_DISKIO_TRACE_PATH, replacing an older
+ *              trace. Recording begins once the task has created the file.
+ * Parameters:  None
+ * Returns:     ESP_OK if the trace was requested
+ *              ESP_ERR_INVALID_STATE if a trace is running or nothing is mounted
+ *              ESP_ERR_NO_MEM if the task could not be created
+ ***************************************************************************/
+esp_err_t pv_diskio_trace_start(void) {
+    if (s_running || pv_fs_get_fatfs() == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_task == NULL &&
+        PV_STATIC_TASK_CREATE(s_task_mem, trace_task, "pv_trace", PV_DISKIO_TRACE_TASK_STACK_SIZE, NULL, PV_DISKIO_TRACE_TASK_PRIORITY,
+                              &s_task, PV_TASK_CORE_STORAGE) != pdPASS) {
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    s_dropped = 0;
+    s_stop = false;
+    s_start = true;
+    s_running = true;
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_trace_stop
+ * Purpose:     Stops recording and waits for the remaining records to be
+ *              written and the trace file closed
+ * Parameters:  None
+ * Returns:     ESP_OK when the trace is closed
+ *              ESP_ERR_INVALID_STATE if no trace is running
+ *              ESP_ERR_TIMEOUT if the task did not finish in time
+ ***************************************************************************/
+esp_err_t pv_diskio_trace_stop(void) {
+    if (!s_running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    portENTER_CRITICAL(&s_trace_lock);
+    s_on = false;
+    s_stop = true;
+    portEXIT_CRITICAL(&s_trace_lock);
+    xTaskNotifyGive(s_task);
+
+    for (uint32_t waited = 0; s_running; waited += TRACE_STOP_POLL_MS) {
+        if (waited >= TRACE_STOP_WAIT_MS) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(TRACE_STOP_POLL_MS));
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_diskio_trace_dropped
+ * Purpose:     Records lost because the trace task fell behind
+ * Parameters:  None
+ * Returns:     Dropped records of the current or last trace
+ ***************************************************************************/
+uint32_t pv_diskio_trace_dropped(void) {
+    return s_dropped;
+}
+
+#else /* CONFIG_PV_DISKIO_TRACE */
+
+esp_err_t pv_diskio_trace_start(void) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t pv_diskio_trace_stop(void) { return ESP_ERR_NOT_SUPPORTED; }
+uint32_t pv_diskio_trace_dropped(void) { return 0; }
+
+#endif /* CONFIG_PV_DISKIO_TRACE */
@@ -0,0 +1,126 @@
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+
+#include "pv_logging.h"
+#include "pv_aio.h"
+#include "pv_durability.h"
+#include "pv_static.h"
+
+
+#define TAG "PV_DURABILITY"
+
+#if CONFIG_PV_DURABILITY_PER_N_MB
+#define DURABILITY_MODE         PV_DURABILITY_PER_N_MB
+#define DURABILITY_SYNC_BYTES   ((uint64_t)CONFIG_PV_DURABILITY_SYNC_MB * 1024U * 1024U)
+#elif CONFIG_PV_DURABILITY_PER_SESSION
+#define DURABILITY_MODE         PV_DURABILITY_PER_SESSION
+#elif CONFIG_PV_DURABILITY_TIMER
+#define DURABILITY_MODE         PV_DURABILITY_TIMER
+#define DURABILITY_SYNC_MS      CONFIG_PV_DURABILITY_SYNC_MS
+#else
+#define DURABILITY_MODE         PV_DURABILITY_PER_FILE
+#endif
+
+/* STATIC VARIABLES */
+static uint64_t s_bytes_since_sync = 0;                 // Only touched by the I/O task
+#if CONFIG_PV_DURABILITY_TIMER
+static TimerHandle_t s_sync_timer = NULL;
+PV_STATIC_TIMER_DEFINE(s_sync_timer_mem);
+#endif
+
+
+#if CONFIG_PV_DURABILITY_TIMER
+/***************************************************************************
+ * Function:    pv_durability_timer_cb
+ * Purpose:     Periodic sync in TIMER mode. Runs on the timer task, so it
+ *              only flags the sync for the I/O task.
+ * Parameters:  timer - The sync timer
+ * Returns:     None
+ ***************************************************************************/
+static void pv_durability_timer_cb(TimerHandle_t timer) {
+    pv_aio_request_sync();
+}
+#endif
+
+/***************************************************************************
+ * Function:    pv_durability_init
+ * Purpose:     Starts the sync timer when the TIMER mode is selected
+ * Parameters:  None
+ * Returns:     ESP_OK on success (or if already initialized)
+ *              ESP_ERR_NO_MEM if the timer could not be created
+ ***************************************************************************/
+esp_err_t pv_durability_init(void) {
+#if CONFIG_PV_DURABILITY_TIMER
+    if (s_sync_timer != NULL) {
+        return ESP_OK;
+    }
+
+    s_sync_timer = PV_STATIC_TIMER_CREATE(s_sync_timer_mem, "pv_sync", pdMS_TO_TICKS(DURABILITY_SYNC_MS), pdTRUE, NULL, pv_durability_timer_cb);
+    if (s_sync_timer == NULL || xTimerStart(s_sync_timer, 0) != pdPASS) {
+        PV_LOGE(TAG, "Failed to start sync timer");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    PV_LOGI(TAG, "Durability mode %d", DURABILITY_MODE);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_durability_get_mode
+ * Purpose:     Returns the configured durability mode
+ * Parameters:  None
+ * Returns:     The durability mode
+ ***************************************************************************/
+pv_durability_mode_t pv_durability_get_mode(void) {
+    return DURABILITY_MODE;
+}
+
+/***************************************************************************
+ * Function:    pv_durability_log_sync_on_append
+ * Purpose:     Tells the backup log whether a new entry has to be written to
+ *              the card right away or can stay buffered until the next sync
+ * Parameters:  None
+ * Returns:     true if entries are written immediately
+ ***************************************************************************/
+bool pv_durability_log_sync_on_append(void) {
+    return DURABILITY_MODE == PV_DURABILITY_PER_FILE;
+}
+
+/***************************************************************************
+ * Function:    pv_durability_data_written
+ * Purpose:     Accounts photo data written by the I/O task
+ * Parameters:  len - Number of bytes just written
+ * Returns:     true if a sync is due now
+ ***************************************************************************/
+bool pv_durability_data_written(size_t len) {
+#if CONFIG_PV_DURABILITY_PER_N_MB
+    s_bytes_since_sync += len;
+    return s_bytes_since_sync >= DURABILITY_SYNC_BYTES;
+#else
+    return false;
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_durability_synced
+ * Purpose:     Restarts the accounting after the I/O task ran a sync
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_durability_synced(void) {
+    s_bytes_since_sync = 0;
+}
+
+/***************************************************************************
+ * Function:    pv_durability_session_end
+ * Purpose:     Commits everything written during a session. Called when the
+ *              connection closes; harmless in modes that are already synced.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_durability_session_end(void) {
+    pv_aio_request_sync();
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_file.h"
+#include "pv_diskio.h"
+
+
+#define TAG "PV_FILE"
+
+#define FAT32_MAX_FILE_SIZE     0xFFFFFFFFULL           // FAT32 stores file sizes in 32 bits
+#define EXPAND_ALLOCATE_NOW     1U                      // f_expand option: allocate the clusters immediately
+
+
+/***************************************************************************
+ * Function:    pv_file_update_dentry
+ * Purpose:     Records the size of an open file in the dentry cache
+ * Parameters:  file - Open file
+ * Returns:     None
+ ***************************************************************************/
+static void pv_file_update_dentry(pv_file_t *file) {
+    pv_dentry_t dentry = {
+        .exists = true,
+        .attrib = AM_ARC,
+        .size = f_size(&file->fil),
+    };
+
+    pv_dentry_update_key(&file->dentry_key, &dentry);
+}
+
+#if FF_USE_EXPAND && CONFIG_PV_FS_CONTIGUOUS_RX
+/***************************************************************************
+ * Function:    pv_file_pre_erase
+ * Purpose:     Lets the card erase the run a large file was preallocated on
+ *              before its data is written, if pre-erase is on for the card
+ * Parameters:  file - File just preallocated as one contiguous block
+ * Returns:     None
+ ***************************************************************************/
+static void pv_file_pre_erase(pv_file_t *file) {
+    FATFS *fs = file->fil.obj.fs;
+    uint32_t cluster_size = (uint32_t)fs->csize * fs->ssize;
+    LBA_t first = 0;
+    LBA_t count = 0;
+
+    if (!pv_diskio_pre_erase_enabled() || file->size_hint < PV_DISKIO_PRE_ERASE_MIN_SIZE ||
+        file->fil.obj.sclust < 2) {
+        return;
+    }
+    first = fs->database + (LBA_t)fs->csize * (file->fil.obj.sclust - 2);
+    count = (LBA_t)((file->size_hint + cluster_size - 1) / cluster_size) * fs->csize;
+    pv_diskio_pre_erase(first, count);
+}
+#endif
+
+/***************************************************************************
+ * Function:    pv_file_open_create
+ * Purpose:     Creates a file for writing. If the final size is known, the
+ *              whole file is preallocated as one contiguous block so that
+ *              later writes never have to search for free clusters.
+ *              On exFAT a contiguous file has no FAT chain at all.
+ * Parameters:  file - File object to initialize
+ *              path - POSIX path of the file (under SD_CARD_BASE_PATH)
+ *              mode - FA_CREATE_ALWAYS to truncate an existing file,
+ *                     FA_CREATE_NEW to leave it alone
+ *              size_hint - Expected final size in bytes, 0 if unknown
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if the path is not on the SD card
+ *              ESP_ERR_INVALID_SIZE if the file is too large for the volume
+ *              ESP_ERR_INVALID_STATE if mode is FA_CREATE_NEW and the file exists
+ *              ESP_FAIL on other failures
+ ***************************************************************************/
+static esp_err_t pv_file_open_create(pv_file_t *file, const char *path, BYTE mode, uint64_t size_hint) {
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FRESULT f_res = FR_OK;
+    esp_err_t err = ESP_OK;
+
+    memset(file, 0, sizeof(*file));
+
+    err = pv_fs_get_ff_path(path, ff_path, sizeof(ff_path));
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Invalid path %s", path);
+        return err;
+    }
+
+    if (size_hint > FAT32_MAX_FILE_SIZE && !pv_fs_is_exfat()) {
+        PV_LOGE(TAG, "%s is too large for FAT32 (%llu bytes)", path, size_hint);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    pv_dentry_get_key(path, &file->dentry_key);
+    f_res = f_open(&file->fil, ff_path, FA_WRITE | mode);
+    if (f_res == FR_EXIST) {
+        return ESP_ERR_INVALID_STATE; // Left as it was
+    }
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to open %s (0x%x)", path, f_res);
+        pv_dentry_invalidate(path);
+        return ESP_FAIL;
+    }
+    file->is_open = true;
+    file->size_hint = size_hint;
+
+#if FF_USE_EXPAND && CONFIG_PV_FS_CONTIGUOUS_RX
+    if (size_hint > 0) {
+        f_res = f_expand(&file->fil, (FSIZE_t)size_hint, EXPAND_ALLOCATE_NOW);
+        if (f_res == FR_OK) {
+            file->is_contiguous = true;
+            pv_file_pre_erase(file);
+        }
+        else if (f_res == FR_DENIED) {
+            // No contiguous run large enough, fall back to allocating as we write
+            PV_LOGW(TAG, "No contiguous space for %s, using fragmented allocation", path);
+        }
+        else {
+            PV_LOGE(TAG, "Failed to preallocate %s (0x%x)", path, f_res);
+            pv_file_close(file);
+            return ESP_FAIL;
+        }
+    }
+#endif
+
+    pv_file_update_dentry(file);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_open_write
+ * Purpose:     Creates (or truncates) a file for writing, preallocated as
+ *              pv_file_open_create() describes
+ * Parameters:  file - File object to initialize
+ *              path - POSIX path of the file (under SD_CARD_BASE_PATH)
+ *              size_hint - Expected final size in bytes, 0 if unknown
+ * Returns:     As pv_file_open_create()
+ ***************************************************************************/
+esp_err_t pv_file_open_write(pv_file_t *file, const char *path, uint64_t size_hint) {
+    return pv_file_open_create(file, path, FA_CREATE_ALWAYS, size_hint);
+}
+
+/***************************************************************************
+ * Function:    pv_file_create
+ * Purpose:     Creates a file that must not replace an existing one. Hashed
+ *              8.3 names (see pv_layout.h) can collide, and the short entry
+ *              has no long name to tell whose file it is, so an existing
+ *              file is kept and the new one goes to alt_path instead. An
+ *              existing file of exactly size_hint bytes is taken to be an
+ *              earlier copy of the same photo (resent after a failure; it
+ *              was preallocated to that size) and is replaced, so a resend
+ *              does not leave its own first copy behind.
+ * Parameters:  file - File object to initialize
+ *              path - POSIX path of the file (under SD_CARD_BASE_PATH)
+ *              alt_path - Collision-free path (created or truncated) if path
+ *                         exists, may be NULL
+ *              size_hint - Expected final size in bytes, 0 if unknown
+ *              used_alt - Returns whether the file was created at alt_path
+ * Returns:     As pv_file_open_create()
+ ***************************************************************************/
+esp_err_t pv_file_create(pv_file_t *file, const char *path, const char *alt_path, uint64_t size_hint, bool *used_alt) {
+    pv_dentry_t dentry;
+    esp_err_t err = pv_file_open_create(file, path, FA_CREATE_NEW, size_hint);
+
+    *used_alt = false;
+    if (err == ESP_ERR_INVALID_STATE && size_hint > 0 && pv_dentry_stat(path, &dentry) == ESP_OK &&
+        dentry.exists && !(dentry.attrib & AM_DIR) && dentry.size == size_hint) {
+        PV_LOGI(TAG, "%s has the size of the resent file, replacing it", path);
+        return pv_file_open_create(file, path, FA_CREATE_ALWAYS, size_hint);
+    }
+    if (err == ESP_ERR_INVALID_STATE && alt_path != NULL) {
+        PV_LOGW(TAG, "%s exists, storing as %s", path, alt_path);
+        err = pv_file_open_create(file, alt_path, FA_CREATE_ALWAYS, size_hint);
+        *used_alt = true;
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_file_open_read
+ * Purpose:     Opens an existing file for reading
+ * Parameters:  file - File object to initialize
+ *              path - POSIX path of the file (under SD_CARD_BASE_PATH)
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if the path is not on the SD card
+ *              ESP_ERR_NOT_FOUND if the file does not exist
+ *              ESP_FAIL on other failures
+ ***************************************************************************/
+esp_err_t pv_file_open_read(pv_file_t *file, const char *path) {
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FRESULT f_res = FR_OK;
+    esp_err_t err = ESP_OK;
+
+    memset(file, 0, sizeof(*file));
+
+    err = pv_fs_get_ff_path(path, ff_path, sizeof(ff_path));
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Invalid path %s", path);
+        return err;
+    }
+
+    pv_dentry_get_key(path, &file->dentry_key);
+    f_res = f_open(&file->fil, ff_path, FA_READ | FA_OPEN_EXISTING);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to open %s (0x%x)", path, f_res);
+        return (f_res == FR_NO_FILE || f_res == FR_NO_PATH) ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+    }
+    file->is_open = true;
+    file->size_hint = f_size(&file->fil);
+    pv_file_update_dentry(file);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_write
+ * Purpose:     Writes data at the current position of an open file
+ * Parameters:  file - File opened with pv_file_open_write()
+ *              data - Data to write
+ *              len - Number of bytes to write
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the file is not open
+ *              ESP_FAIL on write failure or if the volume is full
+ ***************************************************************************/
+esp_err_t pv_file_write(pv_file_t *file, const void *data, size_t len) {
+    FRESULT f_res = FR_OK;
+    UINT written = 0;
+
+    if (!file->is_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    f_res = f_write(&file->fil, data, len, &written);
+    if (f_res != FR_OK || written != len) {
+        PV_LOGE(TAG, "Failed to write file (0x%x, %u/%u bytes)", f_res, written, (unsigned)len);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_read
+ * Purpose:     Reads data from the current position of an open file
+ * Parameters:  file - File opened with pv_file_open_read()
+ *              data - Buffer to read into
+ *              len - Maximum number of bytes to read
+ *              read_len - Returns the number of bytes read, 0 at end of file
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the file is not open
+ *              ESP_FAIL on read failure
+ ***************************************************************************/
+esp_err_t pv_file_read(pv_file_t *file, void *data, size_t len, size_t *read_len) {
+    FRESULT f_res = FR_OK;
+    UINT br = 0;
+
+    *read_len = 0;
+    if (!file->is_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    f_res = f_read(&file->fil, data, len, &br);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to read file (0x%x)", f_res);
+        return ESP_FAIL;
+    }
+    *read_len = br;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_sync
+ * Purpose:     Commits the data written so far and the current file size to
+ *              the card, so it survives a power loss before pv_file_close()
+ * Parameters:  file - Open file
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the file is not open
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_file_sync(pv_file_t *file) {
+    FRESULT f_res = FR_OK;
+
+    if (!file->is_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    f_res = f_sync(&file->fil);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to sync file (0x%x)", f_res);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_seek
+ * Purpose:     Moves the read/write position of an open file
+ * Parameters:  file - Open file
+ *              offset - New position from the start of the file
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the file is not open
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_file_seek(pv_file_t *file, uint64_t offset) {
+    FRESULT f_res = FR_OK;
+
+    if (!file->is_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    f_res = f_lseek(&file->fil, (FSIZE_t)offset);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to seek file (0x%x)", f_res);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_file_close
+ * Purpose:     Closes a file. If the file was preallocated but fewer bytes
+ *              were written than expected, the unused tail is released.
+ * Parameters:  file - File opened with pv_file_open_write() or pv_file_open_read()
+ * Returns:     ESP_OK on success
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_file_close(pv_file_t *file) {
+    FRESULT f_res = FR_OK;
+    esp_err_t err = ESP_OK;
+
+    if (!file->is_open) {
+        return ESP_OK;
+    }
+
+    if (file->is_contiguous && f_tell(&file->fil) < f_size(&file->fil)) {
+        f_res = f_truncate(&file->fil);
+        if (f_res != FR_OK) {
+            PV_LOGE(TAG, "Failed to truncate preallocated file (0x%x)", f_res);
+            err = ESP_FAIL;
+        }
+    }
+
+    pv_file_update_dentry(file); // Final size, before f_close() invalidates the object
+    f_res = f_close(&file->fil);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to close file (0x%x)", f_res);
+        err = ESP_FAIL;
+    }
+    file->is_open = false;
+    return err;
+}
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_vfs_fat.h"
 #include "diskio_sdmmc.h"
 #include "diskio_impl.h"
@@ -13,12 +17,92 @@
 #include "pv_logging.h"
 #include "pv_fs.h"
 #include "pv_sdc.h"
+#include "pv_dma.h"
+#include "pv_aio.h"
+#include "pv_durability.h"
+#include "pv_dircache.h"
+#include "pv_dentry.h"
+#include "pv_pack.h"
+#include "pv_seglog.h"
+#include "pv_diskio.h"
 
 
 #define TAG "PV_FS"
 
+#define EXFAT_OEM_NAME              "EXFAT   "                   // OEM name field of an exFAT boot sector
+#define EXFAT_OEM_NAME_OFFSET       3U
+#define MBR_PART_TABLE_OFFSET       446U
+#define MBR_PART_TYPE_OFFSET        4U
+#define MBR_PART_LBA_OFFSET         8U
+#define MBR_PART_TYPE_EXFAT         0x07U                       // Partition type used by exFAT (and NTFS)
+#define FNV64_OFFSET_BASIS          0xcbf29ce484222325ULL
+#define FNV64_PRIME                 0x100000001b3ULL
+
 /* STATIC VARIABLES */
 static BYTE pdrv = FF_DRV_NOT_USED;
+static FATFS *s_fs = NULL;
+static SemaphoreHandle_t s_delete_lock = NULL;          // Held while the fence is set or a fenced write runs
+static StaticSemaphore_t s_delete_lock_buf;
+static char s_delete_path[FATFS_PATH_MAX_LENGTH];       // Tree pv_delete_dir() is removing (POSIX path)
+static volatile bool s_delete_active = false;
+static volatile uint32_t s_delete_seq = 0;              // Bumped when a delete starts and when it ends
+
+/***************************************************************************
+ * Function:    pv_fs_is_exfat_card
+ * Purpose:     Checks the boot sector (or the first partition's boot sector)
+ *              for an exFAT signature without going through FatFs, so cards
+ *              that FatFs cannot mount are not mistaken for blank cards.
+ * Parameters:  card - The initialized SD card
+ * Returns:     true if the card holds an exFAT volume
+ *              false else
+ ***************************************************************************/
+static bool pv_fs_is_exfat_card(sdmmc_card_t *card) {
+    bool is_exfat = false;
+    uint8_t *sect = NULL;
+    size_t sect_size = card->csd.sector_size;
+    uint8_t *part = NULL;
+
+    sect = pv_dma_alloc(sect_size);
+    if (sect == NULL) {
+        return false;
+    }
+
+    if (sdmmc_read_sectors(card, sect, 0, 1) == ESP_OK) {
+        if (memcmp(sect + EXFAT_OEM_NAME_OFFSET, EXFAT_OEM_NAME, strlen(EXFAT_OEM_NAME)) == 0) {
+            is_exfat = true; // Super floppy (no partition table)
+        }
+        else {
+            part = sect + MBR_PART_TABLE_OFFSET;
+            if (part[MBR_PART_TYPE_OFFSET] == MBR_PART_TYPE_EXFAT) {
+                uint32_t lba = part[MBR_PART_LBA_OFFSET] | (part[MBR_PART_LBA_OFFSET + 1] << 8) |
+                               (part[MBR_PART_LBA_OFFSET + 2] << 16) | ((uint32_t)part[MBR_PART_LBA_OFFSET + 3] << 24);
+                if (sdmmc_read_sectors(card, sect, lba, 1) == ESP_OK &&
+                    memcmp(sect + EXFAT_OEM_NAME_OFFSET, EXFAT_OEM_NAME, strlen(EXFAT_OEM_NAME)) == 0) {
+                    is_exfat = true;
+                }
+            }
+        }
+    }
+
+    pv_dma_free(sect);
+    return is_exfat;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_exfat_supported
+ * Purpose:     Returns whether exFAT volumes can be mounted with this build
+ *              and configuration.
+ * Parameters:  None
+ * Returns:     true if exFAT volumes are accepted
+ *              false else
+ ***************************************************************************/
+static bool pv_fs_exfat_supported(void) {
+#if FF_FS_EXFAT && CONFIG_PV_FS_MOUNT_EXFAT
+    return true;
+#else
+    return false;
+#endif
+}
 
 /***************************************************************************
  * Function:    pv_init_fs
@@ -39,20 +123,23 @@ esp_err_t pv_init_fs(void){
     FRESULT f_res = FR_OK;
     sdmmc_card_t *card = NULL;
 
+    if (s_delete_lock == NULL) {
+        s_delete_lock = xSemaphoreCreateRecursiveMutexStatic(&s_delete_lock_buf);
+    }
+
     pv_card_get(&card);
     if (card == NULL) {
         PV_LOGE(TAG, "SD card not initialized.");
         return ESP_ERR_INVALID_STATE; // SD card not initialized
     }
 
-    /* Register SD/MMC diskio driver */
+    /* Register the counting SD/MMC diskio driver */
     ff_diskio_get_drive(&pdrv); // Get drive number for the card
     if (pdrv == FF_DRV_NOT_USED) {
         PV_LOGE(TAG, "No available drive number for SD/MMC card");
         return ESP_ERR_NO_MEM; // No available drive number
     }
-    ff_diskio_register_sdmmc(pdrv, card);
-    ff_sdmmc_set_disk_status_check(pdrv, true); // Enable disk status check
+    pv_diskio_register(pdrv, card, true); // With disk status check
     char drv[3] = {(char)('0' + pdrv), ':', 0};
     esp_vfs_fat_conf_t conf = {
         .base_path = SD_CARD_BASE_PATH,
@@ -73,11 +160,18 @@ esp_err_t pv_init_fs(void){
         PV_LOGE(TAG, "FATFS pointer is NULL after registration");
         return ESP_FAIL;
     }
+    s_fs = fs;
 
     /* Mount the filesystem */
     f_res = f_mount(fs, drv, 1);
     if (f_res != FR_OK) {
         // If mount fails, check if we need to format the SD card and try to mount again
+        // Never wipe an exFAT card just because this build can't mount it
+        if (f_res == FR_NO_FILESYSTEM && !pv_fs_exfat_supported() && pv_fs_is_exfat_card(card)) {
+            PV_LOGE(TAG, "SD card is formatted with exFAT, which is not enabled in this build");
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+
         if ((f_res == FR_NO_FILESYSTEM || f_res == FR_INT_ERR) && FORMAT_SD_CARD_ON_MOUNT_FAIL) {
             PV_LOGW(TAG, "No filesystem found, formatting SD card and trying to mount again...");
             if (pv_fmt_sdc() != ESP_OK) {
@@ -96,15 +190,155 @@ esp_err_t pv_init_fs(void){
             return ESP_FAIL; // Mount failed
         }
     }
-    
-    PV_LOGI(TAG, "FATFS mounted successfully at %s", SD_CARD_BASE_PATH);
+
+    if (pv_fs_is_exfat() && !pv_fs_exfat_supported()) {
+        PV_LOGE(TAG, "exFAT volumes are disabled (CONFIG_PV_FS_MOUNT_EXFAT)");
+        f_mount(NULL, drv, 0);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    PV_LOGI(TAG, "FATFS mounted successfully at %s (%s)", SD_CARD_BASE_PATH, pv_fs_is_exfat() ? "exFAT" : "FAT");
+
+#if CONFIG_PV_DISKIO_TRACE
+    /* Record the card accesses from here on for tools/diskio_replay */
+    if (pv_diskio_trace_start() != ESP_OK) {
+        PV_LOGW(TAG, "Diskio trace not started");
+    }
+#endif
+
+    /* Validate the free cluster count in the background so space queries are instant */
+    if (pv_fs_space_start() != ESP_OK) {
+        PV_LOGW(TAG, "Free space validation not started");
+    }
+
+    /* Log entries and syncs follow the configured durability policy */
+    pv_backup_log_init();
+    if (pv_durability_init() != ESP_OK) {
+        PV_LOGW(TAG, "Durability timer not started, data is synced per file");
+    }
+
+    /* Small files are appended to the pack segments, the index is rebuilt from them */
+    if (pv_pack_init() != ESP_OK) {
+        PV_LOGW(TAG, "Pack store not available, small files are stored as normal files");
+    }
+
+    /* Start the I/O task that owns the card for asynchronous clients */
+    err = pv_aio_init();
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Failed to start async I/O service (0x%x)", err);
+        return err;
+    }
     return ESP_OK;
 }
 
+/***************************************************************************
+ * Function:    pv_fs_get_fatfs
+ * Purpose:     Returns the FatFs volume of the SD card
+ * Parameters:  None
+ * Returns:     Pointer to the volume, NULL if pv_init_fs() has not run
+ ***************************************************************************/
+FATFS *pv_fs_get_fatfs(void) {
+    return s_fs;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_get_pdrv
+ * Purpose:     Returns the FatFs drive number of the SD card
+ * Parameters:  None
+ * Returns:     Drive number, FF_DRV_NOT_USED if pv_init_fs() has not run
+ ***************************************************************************/
+BYTE pv_fs_get_pdrv(void) {
+    return pdrv;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_is_exfat
+ * Purpose:     Returns whether the mounted volume is exFAT
+ * Parameters:  None
+ * Returns:     true if the mounted volume is exFAT
+ *              false else (including when nothing is mounted)
+ ***************************************************************************/
+bool pv_fs_is_exfat(void) {
+#if FF_FS_EXFAT
+    return s_fs != NULL && s_fs->fs_type == FS_EXFAT;
+#else
+    return false;
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_fs_get_ff_path
+ * Purpose:     Converts a VFS path under SD_CARD_BASE_PATH into the
+ *              equivalent FatFs path on the SD card drive (e.g.
+ *              "/sdcard/a/b.jpg" -> "0:/a/b.jpg").
+ * Parameters:  vfs_path - The POSIX path to convert
+ *              ff_path - Buffer to store the FatFs path
+ *              ff_path_len - Size of ff_path
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if the path is not on the SD card
+ *              ESP_ERR_INVALID_SIZE if ff_path is too small
+ ***************************************************************************/
+esp_err_t pv_fs_get_ff_path(const char *vfs_path, char *ff_path, size_t ff_path_len) {
+    size_t base_len = strlen(SD_CARD_BASE_PATH);
+    int len = 0;
+
+    if (strncmp(vfs_path, SD_CARD_BASE_PATH, base_len) != 0 ||
+        (vfs_path[base_len] != '/' && vfs_path[base_len] != '\0')) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    len = snprintf(ff_path, ff_path_len, "%c:%s", (char)('0' + pdrv), vfs_path[base_len] ? vfs_path + base_len : "/");
+    if (len < 0 || (size_t)len >= ff_path_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+
+/***************************************************************************
+ * Function:    pv_fs_hash
+ * Purpose:     FNV-1a hash of a path or part of one, shared by the layout,
+ *              the directory cache and the dentry cache
+ * Parameters:  str - Characters to hash (need not be terminated)
+ *              len - Number of characters
+ *              ignore_case - Hash upper and lower case alike, as FAT compares names
+ * Returns:     The hash
+ ***************************************************************************/
+uint64_t pv_fs_hash(const char *str, size_t len, bool ignore_case) {
+    uint64_t hash = FNV64_OFFSET_BASIS;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)str[i];
+        hash ^= ignore_case ? (uint8_t)tolower(c) : c;
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+
+/***************************************************************************
+ * Function:    pv_fs_card_is_large
+ * Purpose:     Returns whether the card is above the size where FatFs
+ *              chooses exFAT over FAT32 when both are allowed.
+ * Parameters:  None
+ * Returns:     true if the card is larger than FATFS_EXFAT_AUTO_THRESHOLD
+ *              false else
+ ***************************************************************************/
+static bool pv_fs_card_is_large(void) {
+    sdmmc_card_t *card = NULL;
+
+    pv_card_get(&card);
+    if (card == NULL) {
+        return false;
+    }
+    return (uint64_t)card->csd.capacity * card->csd.sector_size >= FATFS_EXFAT_AUTO_THRESHOLD;
+}
+
 
 /***************************************************************************
  * Function:    pv_fmt_sdc
- * Purpose:     Formats the SD card with a FAT filesystem.
+ * Purpose:     Formats the SD card with the filesystem selected by
+ *              CONFIG_PV_FS_FORMAT (FAT32, exFAT or chosen by card size).
  * Parameters:  None
  * Returns:     ESP_OK on successful mount.
  *              ESP_ERR_NO_MEM if insufficient memory for FS operations
@@ -112,24 +346,43 @@ esp_err_t pv_init_fs(void){
  * Notes:       pv_init_fs() must be called before this function
  ***************************************************************************/
 esp_err_t pv_fmt_sdc(void) {
-    LBA_t plist[] = {1000, 0, 0, 0}; // Partition table list, 100 sectors for the first partition, rest are empty
+    LBA_t plist[] = {100, 0, 0, 0}; // Partition table list, 100% of the card for the first partition, rest are empty
     void *workbuf = NULL;
     FRESULT f_res = FR_OK;
     MKFS_PARM opt = { // FATFS format parameters
         .fmt = FM_FAT32,
         .n_fat = 1,
         .align = 0,
-        .n_root = 0, // Not applicable for FAT32
+        .n_root = 0, // Not applicable for FAT32/exFAT
         .au_size = FATFS_ALLOCATION_UNIT_SIZE
     };
 
+#if FF_FS_EXFAT && CONFIG_PV_FS_FORMAT_EXFAT
+    opt.fmt = FM_EXFAT;
+    opt.au_size = FATFS_EXFAT_ALLOCATION_UNIT_SIZE;
+#elif FF_FS_EXFAT && CONFIG_PV_FS_FORMAT_AUTO
+    // FatFs picks exFAT over FAT32 for volumes larger than 32GB
+    opt.fmt = FM_FAT32 | FM_EXFAT;
+    if (pv_fs_card_is_large()) {
+        opt.au_size = FATFS_EXFAT_ALLOCATION_UNIT_SIZE;
+    }
+#elif CONFIG_PV_FS_FORMAT_EXFAT
+    PV_LOGW(TAG, "exFAT requested but FF_FS_EXFAT is disabled, formatting as FAT32");
+#endif
+
     char drv[3] = {(char)('0' + pdrv), ':', 0};
 
+    /* The trace file is on the volume, close it first */
+    pv_diskio_trace_stop();
+
     /* Try to unmount, we don't care about the result */
     f_mount(NULL, drv, 0);
+    pv_dircache_clear();
+    pv_dentry_clear();
+    pv_seglog_invalidate_all();
 
     /* Allocate memory for partition and format operations */
-    workbuf = ff_memalloc(FATFS_WORKBUF_SIZE);
+    workbuf = pv_dma_alloc(FATFS_WORKBUF_SIZE);
     if (workbuf == NULL) {
         return ESP_ERR_NO_MEM;
     }
@@ -138,6 +391,7 @@ esp_err_t pv_fmt_sdc(void) {
     f_res = f_fdisk(pdrv, plist, workbuf);
     if (f_res != FR_OK) {
         PV_LOGE(TAG, "Failed to partition SD card (0x%x)", f_res);
+        pv_dma_free(workbuf);
         return ESP_FAIL;
     }
 
@@ -145,67 +399,248 @@ esp_err_t pv_fmt_sdc(void) {
     f_res = f_mkfs(drv, &opt, workbuf, FATFS_WORKBUF_SIZE);
     if (f_res != FR_OK) {
         PV_LOGE(TAG, "Failed to format SD card (0x%x)", f_res);
+        pv_dma_free(workbuf);
         return ESP_FAIL;
     }
 
-    ff_memfree(workbuf);
+    pv_dma_free(workbuf);
     PV_LOGI(TAG, "SD card formatted successfully");
     return ESP_OK;
 
 }
 
+/***************************************************************************
+ * Function:    pv_fs_delete_fence_set
+ * Purpose:     Marks a tree as being deleted. Waits for a fenced write that
+ *              is already running, so none can land in freed clusters.
+ * Parameters:  path - POSIX path of the tree
+ * Returns:     None
+ ***************************************************************************/
+static void pv_fs_delete_fence_set(const char *path) {
+    if (s_delete_lock != NULL) {
+        xSemaphoreTakeRecursive(s_delete_lock, portMAX_DELAY);
+    }
+    snprintf(s_delete_path, sizeof(s_delete_path), "%s", path);
+    s_delete_active = true;
+    s_delete_seq++;
+    if (s_delete_lock != NULL) {
+        xSemaphoreGiveRecursive(s_delete_lock);
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_fs_delete_fence_clear
+ * Purpose:     Ends the fence set by pv_fs_delete_fence_set()
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pv_fs_delete_fence_clear(void) {
+    if (s_delete_lock != NULL) {
+        xSemaphoreTakeRecursive(s_delete_lock, portMAX_DELAY);
+    }
+    s_delete_active = false;
+    s_delete_seq++;
+    if (s_delete_lock != NULL) {
+        xSemaphoreGiveRecursive(s_delete_lock);
+    }
+}
+
 /***************************************************************************
  * Function:    pv_delete_dir
- * Purpose:     Deletes a directory and all its contents recursively.
+ * Purpose:     Deletes a directory and all its contents. The tree is walked
+ *              iteratively with FatFs directly: entry attributes come from
+ *              f_readdir so no stat() is needed, one path buffer is shared by
+ *              all levels and the walk state lives on the heap, so stack use
+ *              does not grow with depth. The task yields every
+ *              FS_DELETE_YIELD_BATCH deletions so transfers keep running;
+ *              the tree stays fenced (see pv_fs_fence_enter()) until the
+ *              walk is over and the caches are cleared again.
  * Parameters:  path - The path of the directory to delete.
  * Returns:     ESP_OK on success
+ *              ESP_ERR_NOT_FOUND if the directory does not exist
+ *              ESP_ERR_INVALID_SIZE if the tree is deeper than FS_DELETE_MAX_DEPTH
+ *              ESP_ERR_NO_MEM if the walk state could not be allocated
  *              ESP_FAIL else
  ***************************************************************************/
 esp_err_t pv_delete_dir(const char *path){
-    DIR *d = opendir(path);
-    struct dirent *entry;
-    char filepath[1024];
+    struct {
+        FF_DIR dirs[FS_DELETE_MAX_DEPTH];           // Open directory at each level
+        size_t path_len[FS_DELETE_MAX_DEPTH];       // Length of path at each level
+        FILINFO fno;
+        char path[FATFS_PATH_MAX_LENGTH];
+    } *walk = NULL;
+    int depth = 0;
+    uint32_t deleted = 0;
+    size_t len = 0;
+    FRESULT f_res = FR_OK;
+    esp_err_t err = ESP_OK;
+
+    walk = malloc(sizeof(*walk));
+    if (walk == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
 
-    if (!d) {
-        perror("opendir");
-        return -1;
+    err = pv_fs_get_ff_path(path, walk->path, sizeof(walk->path));
+    if (err != ESP_OK) {
+        free(walk);
+        return err;
     }
 
-    while ((entry = readdir(d)) != NULL) {
-        // Skip "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+    // Fence the tree before anything is freed: log appends into it are refused and the caches
+    // stop taking its entries until the walk is over
+    pv_fs_delete_fence_set(path);
+
+    // Any cached directory or open log segment may be inside the tree, and the caches only keep hashes
+    pv_dircache_clear();
+    pv_dentry_clear();
+    pv_seglog_invalidate_all();
+
+    f_res = f_opendir(&walk->dirs[0], walk->path);
+    if (f_res != FR_OK) {
+        pv_fs_delete_fence_clear();
+        free(walk);
+        return (f_res == FR_NO_PATH || f_res == FR_NO_FILE) ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+    }
+    walk->path_len[0] = strlen(walk->path);
+
+    while (depth >= 0) {
+        f_res = f_readdir(&walk->dirs[depth], &walk->fno);
+        if (f_res != FR_OK) {
+            PV_LOGE(TAG, "Failed to read directory %s (0x%x)", walk->path, f_res);
+            err = ESP_FAIL;
+            break;
+        }
+
+        if (walk->fno.fname[0] == '\0') {
+            // End of this directory, it is empty now so remove it and go back up
+            f_closedir(&walk->dirs[depth]);
+            f_res = f_unlink(walk->path);
+            if (f_res != FR_OK) {
+                PV_LOGE(TAG, "Failed to remove directory %s (0x%x)", walk->path, f_res);
+                err = ESP_FAIL;
+                depth--;
+                break;
+            }
+            depth--;
+            if (depth >= 0) {
+                walk->path[walk->path_len[depth]] = '\0';
+            }
             continue;
+        }
 
-        snprintf(filepath, sizeof(filepath), "%s/%s", path, entry->d_name);
+        len = walk->path_len[depth];
+        if (snprintf(walk->path + len, sizeof(walk->path) - len, "/%s", walk->fno.fname) >= (int)(sizeof(walk->path) - len)) {
+            PV_LOGE(TAG, "Path too long in %s", walk->path);
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
 
-        struct stat statbuf;
-        if (stat(filepath, &statbuf) == 0) {
-            if (S_ISDIR(statbuf.st_mode)) {
-                // It's a directory; recurse
-                if (pv_delete_dir(filepath) != 0) {
-                    closedir(d);
-                    return -1;
-                }
-            } else {
-                // It's a file; delete it
-                if (remove(filepath) != 0) {
-                    perror("remove file");
-                    closedir(d);
-                    return -1;
-                }
+        if (walk->fno.fattrib & AM_DIR) {
+            if (depth + 1 >= FS_DELETE_MAX_DEPTH) {
+                PV_LOGE(TAG, "Directory tree deeper than %d levels", FS_DELETE_MAX_DEPTH);
+                err = ESP_ERR_INVALID_SIZE;
+                break;
             }
+            depth++;
+            f_res = f_opendir(&walk->dirs[depth], walk->path);
+            if (f_res != FR_OK) {
+                PV_LOGE(TAG, "Failed to open directory %s (0x%x)", walk->path, f_res);
+                err = ESP_FAIL;
+                depth--;
+                break;
+            }
+            walk->path_len[depth] = strlen(walk->path);
+            continue;
+        }
+
+        f_res = f_unlink(walk->path);
+        walk->path[len] = '\0';
+        if (f_res != FR_OK) {
+            PV_LOGE(TAG, "Failed to remove file in %s (0x%x)", walk->path, f_res);
+            err = ESP_FAIL;
+            break;
+        }
+
+        if (++deleted % FS_DELETE_YIELD_BATCH == 0) {
+            vTaskDelay(1); // Give transfers a chance to use the card
         }
     }
 
-    closedir(d);
+    // Close whatever is still open after an error
+    for (; depth >= 0; depth--) {
+        f_closedir(&walk->dirs[depth]);
+    }
 
-    // Finally delete the directory itself
-    if (rmdir(path) != 0) {
-        perror("rmdir");
-        return -1;
+    // Lookups made while the walk yielded may have cached entries that are gone now
+    pv_dircache_clear();
+    pv_dentry_clear();
+    pv_seglog_invalidate_all();
+    pv_fs_delete_fence_clear();
+
+    free(walk);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_is_being_deleted
+ * Purpose:     Checks if a path is inside the tree pv_delete_dir() is
+ *              removing right now. Names compare without case, as on FAT.
+ * Parameters:  path - POSIX path
+ * Returns:     true if the path is the tree or inside it
+ *              false else
+ ***************************************************************************/
+bool pv_fs_is_being_deleted(const char *path) {
+    size_t len = 0;
+
+    if (!s_delete_active || path == NULL) {
+        return false;
     }
+    len = strlen(s_delete_path);
+    return strncasecmp(path, s_delete_path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
 
-    return 0;
+/***************************************************************************
+ * Function:    pv_fs_delete_seq
+ * Purpose:     Returns a count bumped when pv_delete_dir() starts and when it
+ *              ends. Caches compare it around a card lookup to drop results
+ *              a delete may have overtaken.
+ * Parameters:  None
+ * Returns:     The count, odd while a delete is running
+ ***************************************************************************/
+uint32_t pv_fs_delete_seq(void) {
+    return s_delete_seq;
 }
 
+/***************************************************************************
+ * Function:    pv_fs_fence_enter
+ * Purpose:     Starts a raw write into a directory. The write must not run
+ *              while the directory is being deleted, its clusters may be
+ *              freed under it. On success the caller holds the fence until
+ *              pv_fs_fence_exit(), so no delete can start meanwhile. Calls
+ *              can nest within a task.
+ * Parameters:  path - POSIX path of the directory written to
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the directory is being deleted
+ ***************************************************************************/
+esp_err_t pv_fs_fence_enter(const char *path) {
+    if (s_delete_lock != NULL) {
+        xSemaphoreTakeRecursive(s_delete_lock, portMAX_DELAY);
+    }
+    if (pv_fs_is_being_deleted(path)) {
+        pv_fs_fence_exit();
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
 
+/***************************************************************************
+ * Function:    pv_fs_fence_exit
+ * Purpose:     Ends a write started with pv_fs_fence_enter()
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_fs_fence_exit(void) {
+    if (s_delete_lock != NULL) {
+        xSemaphoreGiveRecursive(s_delete_lock);
+    }
+}
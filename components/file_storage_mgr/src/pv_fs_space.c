@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_tasks.h"
+#include "pv_static.h"
+#include "pv_dma.h"
+#include "pv_diskio.h"
+
+
+#define TAG "PV_FS_SPACE"
+
+#define SPACE_TASK_STACK_SIZE       4096U
+#define SPACE_TASK_PRIORITY         PV_TASK_PRIO_BACKGROUND                  // Below every transfer task, only uses idle card time
+#define SPACE_SCAN_SECTORS          8U                  // Sectors read per chunk while scanning the FAT/bitmap
+#define SPACE_SCAN_RETRIES          3U                  // Rescans if the volume changed under the scan
+#define SPACE_SCAN_RETRY_DELAY_MS   5000U
+#define FAT32_ENTRY_MASK            0x0FFFFFFFU
+#define FREE_CLST_UNKNOWN           0xFFFFFFFFU
+
+/* STATIC VARIABLES */
+static volatile bool s_validated = false;   // true once the free count was checked against a full scan
+static TaskHandle_t s_task = NULL;
+PV_STATIC_TASK_DEFINE(s_task_mem, SPACE_TASK_STACK_SIZE);
+
+
+/***************************************************************************
+ * Function:    pv_fs_space_read
+ * Purpose:     Reads a chunk of the FAT or allocation bitmap through the
+ *              diskio driver with the volume lock held, so no write of FatFs
+ *              is in progress. If FatFs holds one of the sectors modified in
+ *              its window, that copy is used instead.
+ * Parameters:  fs - Mounted volume
+ *              buf - Buffer of count sectors
+ *              sector - First sector
+ *              count - Number of sectors
+ * Returns:     ESP_OK on success, ESP_FAIL on read errors
+ ***************************************************************************/
+static esp_err_t pv_fs_space_read(FATFS *fs, uint8_t *buf, LBA_t sector, UINT count) {
+    int vol = pv_fs_get_pdrv();
+    DRESULT res = RES_OK;
+
+    ff_mutex_take(vol);
+    res = pv_diskio_read(pv_fs_get_pdrv(), buf, (uint32_t)sector, count);
+    if (res == RES_OK && fs->wflag && fs->winsect >= sector && fs->winsect < sector + count) {
+        memcpy(buf + (fs->winsect - sector) * fs->ssize, fs->win, fs->ssize);
+    }
+    ff_mutex_give(vol);
+    return (res == RES_OK) ? ESP_OK : ESP_FAIL;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_space_count_fat32
+ * Purpose:     Counts free clusters by reading the FAT a chunk at a time,
+ *              the volume lock is only held for each chunk.
+ * Parameters:  fs - Mounted volume
+ *              buf - Scratch buffer of SPACE_SCAN_SECTORS sectors
+ *              free_clst - Returns the number of free clusters
+ *              first_free - Returns the first free cluster (0 if none)
+ * Returns:     ESP_OK on success, ESP_FAIL on read errors
+ ***************************************************************************/
+static esp_err_t pv_fs_space_count_fat32(FATFS *fs, uint8_t *buf, DWORD *free_clst, DWORD *first_free) {
+    uint32_t entries_per_sect = fs->ssize / sizeof(uint32_t);
+    DWORD clst = 0;
+    esp_err_t err = ESP_OK;
+
+    *free_clst = 0;
+    *first_free = 0;
+
+    for (LBA_t sect = 0; sect < fs->fsize && clst < fs->n_fatent; sect += SPACE_SCAN_SECTORS) {
+        UINT count = (fs->fsize - sect < SPACE_SCAN_SECTORS) ? (fs->fsize - sect) : SPACE_SCAN_SECTORS;
+
+        err = pv_fs_space_read(fs, buf, fs->fatbase + sect, count);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        for (uint32_t i = 0; i < count * entries_per_sect && clst < fs->n_fatent; i++, clst++) {
+            uint32_t entry = (buf[i * 4] | (buf[i * 4 + 1] << 8) | (buf[i * 4 + 2] << 16) | ((uint32_t)buf[i * 4 + 3] << 24));
+            if (clst >= 2 && (entry & FAT32_ENTRY_MASK) == 0) {
+                if (*free_clst == 0) {
+                    *first_free = clst;
+                }
+                (*free_clst)++;
+            }
+        }
+        vTaskDelay(1); // Let transfers use the card between chunks
+    }
+    return ESP_OK;
+}
+
+#if FF_FS_EXFAT
+/***************************************************************************
+ * Function:    pv_fs_space_count_exfat
+ * Purpose:     Counts free clusters by reading the exFAT allocation bitmap
+ *              a chunk at a time
+ * Parameters:  See pv_fs_space_count_fat32
+ * Returns:     ESP_OK on success, ESP_FAIL on read errors
+ ***************************************************************************/
+static esp_err_t pv_fs_space_count_exfat(FATFS *fs, uint8_t *buf, DWORD *free_clst, DWORD *first_free) {
+    DWORD n_clst = fs->n_fatent - 2;
+    DWORD clst = 0;
+    LBA_t sect = 0;
+    esp_err_t err = ESP_OK;
+
+    *free_clst = 0;
+    *first_free = 0;
+
+    while (clst < n_clst) {
+        err = pv_fs_space_read(fs, buf, fs->bitbase + sect, SPACE_SCAN_SECTORS);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        for (uint32_t i = 0; i < SPACE_SCAN_SECTORS * fs->ssize && clst < n_clst; i++) {
+            for (uint8_t bit = 0; bit < 8 && clst < n_clst; bit++, clst++) {
+                if ((buf[i] & (1U << bit)) == 0) {
+                    if (*free_clst == 0) {
+                        *first_free = clst + 2;
+                    }
+                    (*free_clst)++;
+                }
+            }
+        }
+        sect += SPACE_SCAN_SECTORS;
+        vTaskDelay(1);
+    }
+    return ESP_OK;
+}
+#endif
+
+/***************************************************************************
+ * Function:    pv_fs_space_scan_range
+ * Purpose:     Returns the sectors a scan reads
+ * Parameters:  fs - Mounted volume
+ *              first - Returns the first sector
+ *              count - Returns the number of sectors
+ * Returns:     None
+ ***************************************************************************/
+static void pv_fs_space_scan_range(FATFS *fs, LBA_t *first, LBA_t *count) {
+#if FF_FS_EXFAT
+    if (fs->fs_type == FS_EXFAT) {
+        *first = fs->bitbase;
+        *count = ((fs->n_fatent - 2) / 8 + fs->ssize - 1) / fs->ssize;
+        return;
+    }
+#endif
+    *first = fs->fatbase;
+    *count = fs->fsize;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_space_scan
+ * Purpose:     Recounts free clusters after mount and checks the count FatFs
+ *              loaded from FSINFO. If FSINFO was stale or missing, the cached
+ *              count and next-free hint are corrected and FSINFO is rewritten
+ *              on the next sync. The count is only taken if nothing wrote
+ *              the FAT/bitmap during the scan (pv_diskio_fat_writes()) and
+ *              FatFs holds none of it modified in its window.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pv_fs_space_scan(void) {
+    FATFS *fs = pv_fs_get_fatfs();
+    uint8_t *buf = NULL;
+    uint32_t fat_writes = 0;
+    DWORD scanned_free = 0;
+    DWORD first_free = 0;
+    LBA_t scan_first = 0;
+    LBA_t scan_count = 0;
+    esp_err_t err = ESP_OK;
+    int vol = pv_fs_get_pdrv();
+
+    buf = (fs != NULL) ? pv_dma_alloc(SPACE_SCAN_SECTORS * fs->ssize) : NULL;
+    if (buf == NULL) {
+        PV_LOGE(TAG, "Failed to start free space scan");
+        pv_dma_free(buf);
+        return;
+    }
+
+    for (int attempt = 0; attempt < SPACE_SCAN_RETRIES && !s_validated; attempt++) {
+        fat_writes = pv_diskio_fat_writes();
+
+        if (fs->fs_type == FS_FAT32) {
+            err = pv_fs_space_count_fat32(fs, buf, &scanned_free, &first_free);
+        }
+#if FF_FS_EXFAT
+        else if (fs->fs_type == FS_EXFAT) {
+            err = pv_fs_space_count_exfat(fs, buf, &scanned_free, &first_free);
+        }
+#endif
+        else {
+            // FAT12/16 volumes are small enough for FatFs to scan quickly
+            FATFS *out_fs = NULL;
+            char drv[3] = {(char)('0' + vol), ':', 0};
+            err = (f_getfree(drv, &scanned_free, &out_fs) == FR_OK) ? ESP_OK : ESP_FAIL;
+            s_validated = (err == ESP_OK);
+            break;
+        }
+
+        if (err != ESP_OK) {
+            PV_LOGE(TAG, "Free space scan failed (0x%x)", err);
+            break;
+        }
+
+        pv_fs_space_scan_range(fs, &scan_first, &scan_count);
+        ff_mutex_take(vol);
+        if (pv_diskio_fat_writes() == fat_writes &&
+            !(fs->wflag && fs->winsect >= scan_first && fs->winsect < scan_first + scan_count)) {
+            // Nothing was allocated or freed during the scan so the count is exact
+            if (fs->free_clst != scanned_free) {
+                PV_LOGW(TAG, "FSINFO free count %lu is stale, actual %lu", (unsigned long)fs->free_clst, (unsigned long)scanned_free);
+                fs->free_clst = scanned_free;
+                fs->fsi_flag |= 1; // Rewrite FSINFO on the next sync
+            }
+            if (fs->last_clst < 2 || fs->last_clst >= fs->n_fatent) {
+                fs->last_clst = (first_free > 2) ? first_free - 1 : 2;
+            }
+            s_validated = true;
+        }
+        ff_mutex_give(vol);
+
+        if (!s_validated) {
+            vTaskDelay(pdMS_TO_TICKS(SPACE_SCAN_RETRY_DELAY_MS));
+        }
+    }
+
+    if (s_validated) {
+        PV_LOGI(TAG, "Free space validated: %lu clusters of %u bytes", (unsigned long)fs->free_clst,
+                (unsigned)(fs->csize * fs->ssize));
+    }
+    pv_dma_free(buf);
+}
+
+/***************************************************************************
+ * Function:    pv_fs_space_task
+ * Purpose:     Background task, runs a scan every time pv_fs_space_start()
+ *              notifies it. It is never deleted so it can live on static
+ *              storage across remounts.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pv_fs_space_task(void *param) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pv_fs_space_scan();
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_fs_space_start
+ * Purpose:     Starts the background free space validation. FatFs keeps the
+ *              free cluster count up to date on every allocation once it is
+ *              known, so after this scan queries never touch the card.
+ * Parameters:  None
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the filesystem is not mounted
+ *              ESP_ERR_NO_MEM if the task could not be created
+ * Notes:       Called by pv_init_fs() after a successful mount, the task is
+ *              created on the first call and reused after that
+ ***************************************************************************/
+esp_err_t pv_fs_space_start(void) {
+    if (pv_fs_get_fatfs() == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (s_task == NULL &&
+        PV_STATIC_TASK_CREATE(s_task_mem, pv_fs_space_task, "pv_fs_space", SPACE_TASK_STACK_SIZE, NULL, SPACE_TASK_PRIORITY,
+                              &s_task, PV_TASK_CORE_STORAGE) != pdPASS) {
+        PV_LOGE(TAG, "Failed to create free space task");
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_validated = false;
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_get_space
+ * Purpose:     Returns the cached free space of the mounted volume without
+ *              touching the card.
+ * Parameters:  info - Filled with the current free space information
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the free count is not known yet
+ ***************************************************************************/
+esp_err_t pv_fs_get_space(pv_fs_space_t *info) {
+    FATFS *fs = pv_fs_get_fatfs();
+    DWORD free_clst = 0;
+
+    if (fs == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    free_clst = fs->free_clst; // Single word read, maintained by FatFs on every allocation
+    if (free_clst == FREE_CLST_UNKNOWN || free_clst > fs->n_fatent - 2) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    info->cluster_size = (uint32_t)fs->csize * fs->ssize;
+    info->free_clusters = free_clst;
+    info->free_bytes = (uint64_t)free_clst * info->cluster_size;
+    info->next_free_hint = fs->last_clst;
+    info->validated = s_validated;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_fs_has_room
+ * Purpose:     Admission check for an incoming file. Accounts for cluster
+ *              rounding and keeps FS_FREE_SPACE_RESERVE free for logs and
+ *              directories.
+ * Parameters:  size - Size of the file in bytes
+ * Returns:     true if the file fits, or if free space is not known yet
+ *              false if the file does not fit
+ ***************************************************************************/
+bool pv_fs_has_room(uint64_t size) {
+    pv_fs_space_t info;
+    uint64_t needed = 0;
+
+    if (pv_fs_get_space(&info) != ESP_OK) {
+        return true; // Don't reject transfers before the first count is available
+    }
+
+    needed = ((size + info.cluster_size - 1) / info.cluster_size) * info.cluster_size;
+    return needed + FS_FREE_SPACE_RESERVE <= info.free_bytes;
+}
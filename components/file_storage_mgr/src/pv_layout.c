@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_layout.h"
+#include "pv_dentry.h"
+
+
+#define TAG "PV_LAYOUT"
+
+#define BASE32_BITS             5U
+
+#if CONFIG_PV_FS_SHARDED_LAYOUT
+#define LAYOUT_SHARD_LEVELS     CONFIG_PV_FS_SHARD_LEVELS
+#endif
+
+// Digits and upper case letters only, all valid in 8.3 names
+static const char s_base32[] = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+
+
+/***************************************************************************
+ * Function:    pv_layout_get_ext
+ * Purpose:     Finds the extension of the last component of a path
+ * Parameters:  logical_path - Path of the photo on the phone
+ *              len - Length of the path
+ *              ext_len - Returns the length of the extension, 0 if there is
+ *                        none or it is too long to keep
+ * Returns:     Pointer to the extension (after the dot)
+ ***************************************************************************/
+static const char *pv_layout_get_ext(const char *logical_path, size_t len, size_t *ext_len) {
+    *ext_len = 0;
+    for (size_t i = len; i > 0 && logical_path[i - 1] != '/'; i--) {
+        if (logical_path[i - 1] == '.') {
+            if (len - i <= PV_LAYOUT_MAX_EXT_LENGTH) {
+                *ext_len = len - i;
+            }
+            return &logical_path[i];
+        }
+    }
+    return "";
+}
+
+/***************************************************************************
+ * Function:    pv_layout_is_sharded
+ * Purpose:     Returns whether photos are stored in the hash-sharded layout
+ * Parameters:  None
+ * Returns:     true if CONFIG_PV_FS_SHARDED_LAYOUT is enabled
+ ***************************************************************************/
+bool pv_layout_is_sharded(void) {
+#if CONFIG_PV_FS_SHARDED_LAYOUT
+    return true;
+#else
+    return false;
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_layout_uses_short_names
+ * Purpose:     Returns whether photos are stored under hash-derived 8.3
+ *              names. Only FAT volumes have short names.
+ * Parameters:  None
+ * Returns:     true if CONFIG_PV_FS_SHORT_NAMES is enabled and the volume is FAT
+ ***************************************************************************/
+bool pv_layout_uses_short_names(void) {
+#if CONFIG_PV_FS_SHORT_NAMES
+    return !pv_fs_is_exfat();
+#else
+    return false;
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_layout_fingerprint
+ * Purpose:     FNV-1a hash of a logical (phone) path
+ * Parameters:  logical_path - Path of the photo on the phone
+ *              len - Length of the path
+ * Returns:     The fingerprint
+ ***************************************************************************/
+uint64_t pv_layout_fingerprint(const char *logical_path, size_t len) {
+    return pv_fs_hash(logical_path, len, false); // Phone paths are case sensitive
+}
+
+/***************************************************************************
+ * Function:    pv_layout_get_short_name
+ * Purpose:     Builds the upper case 8.3 name a photo is stored under. The
+ *              stem is the low 40 bits of the fingerprint in base32 (the
+ *              shard directories use the high bits), the extension is the
+ *              phone's extension cut to 3 characters.
+ * Parameters:  logical_path - Path of the photo on the phone (need not be terminated)
+ *              len - Length of logical_path
+ *              name - Buffer to store the name, at least PV_LAYOUT_SHORT_NAME_SIZE
+ *              name_len - Size of name
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_SIZE if name is too small
+ ***************************************************************************/
+esp_err_t pv_layout_get_short_name(const char *logical_path, size_t len, char *name, size_t name_len) {
+    uint64_t fingerprint = pv_layout_fingerprint(logical_path, len);
+    size_t ext_len = 0;
+    const char *ext = pv_layout_get_ext(logical_path, len, &ext_len);
+    size_t pos = 0;
+
+    if (name_len < PV_LAYOUT_SHORT_NAME_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (size_t i = 0; i < PV_LAYOUT_SHORT_NAME_CHARS; i++) {
+        name[pos++] = s_base32[fingerprint & ((1U << BASE32_BITS) - 1)];
+        fingerprint >>= BASE32_BITS;
+    }
+
+    if (ext_len > PV_LAYOUT_SHORT_EXT_LENGTH) {
+        ext_len = PV_LAYOUT_SHORT_EXT_LENGTH;
+    }
+    for (size_t i = 0; i < ext_len; i++) {
+        if (!isalnum((unsigned char)ext[i])) {
+            ext_len = 0; // Anything else could need a long name entry
+        }
+    }
+    if (ext_len > 0) {
+        name[pos++] = '.';
+        for (size_t i = 0; i < ext_len; i++) {
+            name[pos++] = (char)toupper((unsigned char)ext[i]);
+        }
+    }
+    name[pos] = '\0';
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_layout_build_path
+ * Purpose:     Builds the POSIX path of a photo on the card
+ * Parameters:  logical_path - Path of the photo on the phone (need not be terminated)
+ *              len - Length of logical_path
+ *              short_names - Use the hashed 8.3 file name
+ *              path - Buffer to store the path on the card
+ *              path_len - Size of path
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if the logical path is empty
+ *              ESP_ERR_INVALID_SIZE if path is too small
+ ***************************************************************************/
+static esp_err_t pv_layout_build_path(const char *logical_path, size_t len, bool short_names,
+                                      char *path, size_t path_len) {
+    char short_name[PV_LAYOUT_SHORT_NAME_SIZE] = {0};
+    int written = 0;
+
+    if (len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (short_names) {
+        pv_layout_get_short_name(logical_path, len, short_name, sizeof(short_name));
+    }
+
+#if CONFIG_PV_FS_SHARDED_LAYOUT
+    uint64_t fingerprint = pv_layout_fingerprint(logical_path, len);
+
+    written = snprintf(path, path_len, "%s/%02x", PV_LAYOUT_OBJECTS_DIR, (unsigned)(fingerprint >> 56));
+#if LAYOUT_SHARD_LEVELS > 1
+    if (written > 0 && (size_t)written < path_len) {
+        written += snprintf(path + written, path_len - written, "/%02x", (unsigned)((fingerprint >> 48) & 0xFF));
+    }
+#endif
+    if (written > 0 && (size_t)written < path_len) {
+        if (short_names) {
+            written += snprintf(path + written, path_len - written, "/%s", short_name);
+        }
+        else {
+            // Keep the extension so the stored file is still recognizable
+            size_t ext_len = 0;
+            const char *ext = pv_layout_get_ext(logical_path, len, &ext_len);
+            written += snprintf(path + written, path_len - written, "/%016" PRIx64 "%s%.*s",
+                                fingerprint, ext_len ? "." : "", (int)ext_len, ext);
+        }
+    }
+#else
+    const char *sep = (logical_path[0] == '/') ? "" : "/";
+    if (short_names) {
+        // Keep the phone's folders, only the file name is replaced
+        size_t dir_len = len;
+        while (dir_len > 0 && logical_path[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        written = snprintf(path, path_len, "%s%s%.*s%s", SD_CARD_MOUNT_POINT, sep, (int)dir_len, logical_path, short_name);
+    }
+    else {
+        written = snprintf(path, path_len, "%s%s%.*s", SD_CARD_MOUNT_POINT, sep, (int)len, logical_path);
+    }
+#endif
+
+    if (written < 0 || (size_t)written >= path_len) {
+        PV_LOGE(TAG, "Path for %.*s is too long", (int)len, logical_path);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_layout_get_path
+ * Purpose:     Builds the POSIX path a photo is created at on the card
+ * Parameters:  logical_path - Path of the photo on the phone (need not be terminated)
+ *              len - Length of logical_path
+ *              path - Buffer to store the path on the card
+ *              path_len - Size of path
+ * Returns:     As pv_layout_build_path()
+ ***************************************************************************/
+esp_err_t pv_layout_get_path(const char *logical_path, size_t len, char *path, size_t path_len) {
+    return pv_layout_build_path(logical_path, len, pv_layout_uses_short_names(), path, path_len);
+}
+
+/***************************************************************************
+ * Function:    pv_layout_get_long_path
+ * Purpose:     Builds the path of a photo as if short names were off. A photo
+ *              whose 8.3 name was already taken is stored here; its long
+ *              name holds the whole fingerprint (or the phone's name), so
+ *              it can't collide.
+ * Parameters:  logical_path - Path of the photo on the phone (need not be terminated)
+ *              len - Length of logical_path
+ *              path - Buffer to store the path on the card
+ *              path_len - Size of path
+ * Returns:     As pv_layout_build_path()
+ ***************************************************************************/
+esp_err_t pv_layout_get_long_path(const char *logical_path, size_t len, char *path, size_t path_len) {
+    return pv_layout_build_path(logical_path, len, false, path, path_len);
+}
+
+/***************************************************************************
+ * Function:    pv_layout_resolve_path
+ * Purpose:     Finds where a stored photo is: at its long path if it was
+ *              moved there by a short name collision, else at its usual path
+ * Parameters:  logical_path - Path of the photo on the phone (need not be terminated)
+ *              len - Length of logical_path
+ *              path - Buffer to store the path on the card
+ *              path_len - Size of path
+ * Returns:     As pv_layout_build_path()
+ ***************************************************************************/
+esp_err_t pv_layout_resolve_path(const char *logical_path, size_t len, char *path, size_t path_len) {
+    esp_err_t err = ESP_OK;
+
+    if (!pv_layout_uses_short_names()) {
+        return pv_layout_build_path(logical_path, len, false, path, path_len);
+    }
+    err = pv_layout_build_path(logical_path, len, false, path, path_len);
+    if (err != ESP_OK || pv_dentry_exists(path)) {
+        return err;
+    }
+    return pv_layout_build_path(logical_path, len, true, path, path_len);
+}
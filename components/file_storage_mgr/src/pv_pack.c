@@ -0,0 +1,1163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_rom_crc.h"
+#include "esp_random.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_layout.h"
+#include "pv_durability.h"
+#include "pv_pack.h"
+#include "pv_static.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_PACK"
+
+#if CONFIG_PV_FS_PACK_STORE
+
+#define PACK_NO_SEGMENT         (-1)
+#define PACK_MAX_SEGMENT_ID     99999U                  // SEGnnnnn.DAT
+#define PACK_RECORDS_START      ((uint32_t)sizeof(pv_pack_seg_hdr_t))
+
+typedef struct {
+    bool in_use;
+    uint32_t id;
+    uint32_t salt;
+    uint32_t end;                   // Offset after the last record
+    uint32_t dead;                  // Bytes of records that are no longer live
+} pack_seg_t;
+
+typedef struct {
+    uint64_t name_hash;
+    uint32_t offset;                // Offset of the record in its segment
+    uint32_t data_len;
+    uint16_t name_len;
+    uint8_t seg;                    // Segment slot
+} pack_entry_t;
+
+/* STATIC VARIABLES */
+static pack_seg_t s_segs[PV_PACK_MAX_SEGMENTS];
+static pack_entry_t *s_index = NULL;
+static uint32_t s_index_count = 0;
+static int s_cur = PACK_NO_SEGMENT;                     // Segment appended to
+static FIL s_cur_fil;
+static int s_read_seg = PACK_NO_SEGMENT;                // Segment open in s_read_fil
+static FIL s_read_fil;
+static SemaphoreHandle_t s_lock = NULL;                 // Held from pv_pack_begin() to pv_pack_end()
+static volatile bool s_ready = false;                   // Set once pv_pack_init() fully succeeded
+static volatile bool s_sync_pending = false;
+static TaskHandle_t s_task = NULL;
+PV_STATIC_POOL_DEFINE(s_index_mem, pack_entry_t, PV_PACK_INDEX_ENTRIES);
+PV_STATIC_SEMAPHORE_DEFINE(s_lock_mem);
+PV_STATIC_TASK_DEFINE(s_task_mem, PV_PACK_TASK_STACK_SIZE);
+
+
+/***************************************************************************
+ * Function:    pack_rec_len
+ * Purpose:     Returns the size of a record on the card
+ * Parameters:  name_len - Length of the name
+ *              data_len - Length of the data
+ * Returns:     The record size in bytes
+ ***************************************************************************/
+static uint32_t pack_rec_len(uint16_t name_len, uint32_t data_len) {
+    return sizeof(pv_pack_hdr_t) + name_len + data_len + sizeof(pv_pack_trailer_t);
+}
+
+/***************************************************************************
+ * Function:    pack_hdr_crc
+ * Purpose:     Computes the CRC of a record header, seeded with the salt of
+ *              its segment
+ * Parameters:  hdr - The header
+ *              salt - Salt of the segment holding the record
+ * Returns:     The CRC
+ ***************************************************************************/
+static uint32_t pack_hdr_crc(const pv_pack_hdr_t *hdr, uint32_t salt) {
+    return esp_rom_crc32_le(salt, (const uint8_t *)hdr, offsetof(pv_pack_hdr_t, hdr_crc));
+}
+
+/***************************************************************************
+ * Function:    pack_commit_word
+ * Purpose:     Computes the commit word of a record. It depends on the
+ *              (salted) header CRC, so only the trailer written for this
+ *              very header matches.
+ * Parameters:  hdr_crc - CRC of the record header
+ * Returns:     The commit word
+ ***************************************************************************/
+static uint32_t pack_commit_word(uint32_t hdr_crc) {
+    return PV_PACK_COMMIT ^ hdr_crc;
+}
+
+/***************************************************************************
+ * Function:    pack_seg_path
+ * Purpose:     Builds the FatFs path of a segment file
+ * Parameters:  id - Segment id
+ *              path - Buffer to store the path
+ *              len - Size of path
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_SIZE if path is too small
+ ***************************************************************************/
+static esp_err_t pack_seg_path(uint32_t id, char *path, size_t len) {
+    char posix_path[FATFS_PATH_MAX_LENGTH];
+
+    snprintf(posix_path, sizeof(posix_path), "%s/SEG%05u.DAT", PV_PACK_DIR, (unsigned)id);
+    return pv_fs_get_ff_path(posix_path, path, len);
+}
+
+/***************************************************************************
+ * Function:    pack_index_find
+ * Purpose:     Finds the index entry of a name
+ * Parameters:  name_hash - Fingerprint of the name
+ * Returns:     Position in s_index, -1 if the name is not stored
+ ***************************************************************************/
+static int32_t pack_index_find(uint64_t name_hash) {
+    for (uint32_t i = 0; i < s_index_count; i++) {
+        if (s_index[i].name_hash == name_hash) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+/***************************************************************************
+ * Function:    pack_index_remove
+ * Purpose:     Drops the index entry of a name and accounts its record as dead
+ * Parameters:  name_hash - Fingerprint of the name
+ * Returns:     true if the name was indexed
+ ***************************************************************************/
+static bool pack_index_remove(uint64_t name_hash) {
+    int32_t pos = pack_index_find(name_hash);
+
+    if (pos < 0) {
+        return false;
+    }
+    s_segs[s_index[pos].seg].dead += pack_rec_len(s_index[pos].name_len, s_index[pos].data_len);
+    s_index[pos] = s_index[--s_index_count];
+    return true;
+}
+
+/***************************************************************************
+ * Function:    pack_index_set
+ * Purpose:     Points a name at a new record. A replaced record becomes dead.
+ * Parameters:  entry - The new entry
+ * Returns:     true on success
+ *              false if the index is full (the record is counted as dead)
+ ***************************************************************************/
+static bool pack_index_set(const pack_entry_t *entry) {
+    pack_index_remove(entry->name_hash);
+    if (s_index_count >= PV_PACK_INDEX_ENTRIES) {
+        s_segs[entry->seg].dead += pack_rec_len(entry->name_len, entry->data_len);
+        return false;
+    }
+    s_index[s_index_count++] = *entry;
+    return true;
+}
+
+/***************************************************************************
+ * Function:    pack_read_at
+ * Purpose:     Reads bytes from a segment. The append segment is read through
+ *              its open file object; other segments share one read object.
+ * Parameters:  seg - Segment slot
+ *              offset - Offset in the segment
+ *              buf - Buffer to read into
+ *              len - Number of bytes to read
+ * Returns:     ESP_OK on success
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pack_read_at(int seg, uint32_t offset, void *buf, size_t len) {
+    char path[FATFS_PATH_MAX_LENGTH];
+    FIL *fil = &s_read_fil;
+    FSIZE_t pos = 0;
+    FRESULT f_res = FR_OK;
+    UINT br = 0;
+
+    if (seg == s_cur) {
+        fil = &s_cur_fil;
+        pos = f_tell(fil);
+    }
+    else if (seg != s_read_seg) {
+        if (s_read_seg != PACK_NO_SEGMENT) {
+            f_close(&s_read_fil);
+            s_read_seg = PACK_NO_SEGMENT;
+        }
+        if (pack_seg_path(s_segs[seg].id, path, sizeof(path)) != ESP_OK ||
+            f_open(&s_read_fil, path, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+            return ESP_FAIL;
+        }
+        s_read_seg = seg;
+    }
+
+    f_res = f_lseek(fil, offset);
+    if (f_res == FR_OK) {
+        f_res = f_read(fil, buf, len, &br);
+    }
+    if (fil == &s_cur_fil) {
+        f_lseek(fil, pos); // Appends continue where they were
+    }
+    return (f_res == FR_OK && br == len) ? ESP_OK : ESP_FAIL;
+}
+
+/***************************************************************************
+ * Function:    pack_write
+ * Purpose:     Writes bytes at the current position of the append segment
+ * Parameters:  data - Data to write
+ *              len - Number of bytes
+ * Returns:     ESP_OK on success
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pack_write(const void *data, size_t len) {
+    UINT bw = 0;
+
+    if (f_write(&s_cur_fil, data, len, &bw) != FR_OK || bw != len) {
+        PV_LOGE(TAG, "Failed to write segment %u", (unsigned)s_segs[s_cur].id);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pack_scan_segment
+ * Purpose:     Rebuilds the index entries of one segment by walking its
+ *              records. Stops at the first header that doesn't validate.
+ * Parameters:  seg - Segment slot, with id filled in
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the segment header is not valid
+ *              ESP_FAIL on read errors
+ ***************************************************************************/
+static esp_err_t pack_scan_segment(int seg) {
+    pv_pack_seg_hdr_t seg_hdr;
+    pv_pack_hdr_t hdr;
+    pv_pack_trailer_t trailer;
+    uint32_t offset = PACK_RECORDS_START;
+    uint32_t rec_len = 0;
+
+    if (pack_read_at(seg, 0, &seg_hdr, sizeof(seg_hdr)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (seg_hdr.magic != PV_PACK_SEG_MAGIC || seg_hdr.id != s_segs[seg].id ||
+        seg_hdr.crc != esp_rom_crc32_le(0, (const uint8_t *)&seg_hdr, offsetof(pv_pack_seg_hdr_t, crc))) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_segs[seg].salt = seg_hdr.salt;
+
+    while (offset + sizeof(hdr) <= PV_PACK_SEGMENT_SIZE) {
+        if (pack_read_at(seg, offset, &hdr, sizeof(hdr)) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        if (hdr.magic != PV_PACK_MAGIC || hdr.hdr_crc != pack_hdr_crc(&hdr, seg_hdr.salt)) {
+            break; // End of the records
+        }
+        rec_len = pack_rec_len(hdr.name_len, hdr.data_len);
+        if (offset + rec_len > PV_PACK_SEGMENT_SIZE) {
+            break;
+        }
+        if (pack_read_at(seg, offset + rec_len - sizeof(trailer), &trailer, sizeof(trailer)) != ESP_OK) {
+            return ESP_FAIL;
+        }
+
+        if (trailer.commit != pack_commit_word(hdr.hdr_crc)) {
+            s_segs[seg].dead += rec_len; // Cut off by a power loss or aborted
+        }
+        else if (hdr.type == PV_PACK_REC_OBJECT) {
+            pack_entry_t entry = {
+                .name_hash = hdr.name_hash,
+                .offset = offset,
+                .data_len = hdr.data_len,
+                .name_len = hdr.name_len,
+                .seg = (uint8_t)seg,
+            };
+            if (!pack_index_set(&entry)) {
+                PV_LOGW(TAG, "Index full, object in segment %u not indexed", (unsigned)s_segs[seg].id);
+            }
+        }
+        else {
+            pack_index_remove(hdr.name_hash);
+            s_segs[seg].dead += rec_len;
+        }
+        offset += rec_len;
+    }
+
+    s_segs[seg].end = offset;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pack_new_segment
+ * Purpose:     Seals the append segment and creates the next one, allocated
+ *              to its full size up front (contiguously if possible)
+ * Parameters:  None
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if all segment slots are used
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pack_new_segment(void) {
+    char path[FATFS_PATH_MAX_LENGTH];
+    pv_pack_seg_hdr_t seg_hdr = {0};
+    uint32_t next_id = 0;
+    int slot = PACK_NO_SEGMENT;
+    FRESULT f_res = FR_OK;
+
+    for (int i = 0; i < (int)PV_PACK_MAX_SEGMENTS; i++) {
+        if (s_segs[i].in_use && s_segs[i].id + 1 > next_id) {
+            next_id = s_segs[i].id + 1;
+        }
+        if (!s_segs[i].in_use && slot == PACK_NO_SEGMENT) {
+            slot = i;
+        }
+    }
+    if (slot == PACK_NO_SEGMENT || next_id > PACK_MAX_SEGMENT_ID) {
+        PV_LOGE(TAG, "No segment slot left");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (s_cur != PACK_NO_SEGMENT) {
+        f_close(&s_cur_fil);
+        s_cur = PACK_NO_SEGMENT;
+    }
+
+    pack_seg_path(next_id, path, sizeof(path));
+    f_res = f_open(&s_cur_fil, path, FA_READ | FA_WRITE | FA_CREATE_NEW);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to create segment %u (0x%x)", (unsigned)next_id, f_res);
+        return ESP_FAIL;
+    }
+
+#if FF_USE_EXPAND
+    f_res = f_expand(&s_cur_fil, PV_PACK_SEGMENT_SIZE, 1);
+    if (f_res == FR_DENIED)
+#endif
+    {
+        // No contiguous run free, let FatFs allocate the clusters anywhere
+        f_res = f_lseek(&s_cur_fil, PV_PACK_SEGMENT_SIZE);
+        if (f_res == FR_OK && f_tell(&s_cur_fil) != PV_PACK_SEGMENT_SIZE) {
+            f_res = FR_DENIED; // Volume full
+        }
+    }
+
+    seg_hdr.magic = PV_PACK_SEG_MAGIC;
+    seg_hdr.id = next_id;
+    seg_hdr.salt = esp_random();
+    seg_hdr.crc = esp_rom_crc32_le(0, (const uint8_t *)&seg_hdr, offsetof(pv_pack_seg_hdr_t, crc));
+
+    s_cur = slot;
+    s_segs[slot] = (pack_seg_t){ .in_use = true, .id = next_id, .salt = seg_hdr.salt, .end = PACK_RECORDS_START };
+    if (f_res == FR_OK) {
+        f_res = f_lseek(&s_cur_fil, 0);
+    }
+    if (f_res != FR_OK || pack_write(&seg_hdr, sizeof(seg_hdr)) != ESP_OK || f_sync(&s_cur_fil) != FR_OK) {
+        PV_LOGE(TAG, "Failed to allocate segment %u (0x%x)", (unsigned)next_id, f_res);
+        f_close(&s_cur_fil);
+        f_unlink(path);
+        s_segs[slot].in_use = false;
+        s_cur = PACK_NO_SEGMENT;
+        return ESP_FAIL;
+    }
+
+    PV_LOGI(TAG, "Created segment %u", (unsigned)next_id);
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pack_begin_locked
+ * Purpose:     Reserves room for a record in the append segment and writes
+ *              its header and name. Must be called with s_lock held.
+ * Parameters:  obj - Object to initialize
+ *              type - Record type
+ *              name - Logical name of the object
+ *              name_len - Length of the name
+ *              name_hash - Fingerprint of the name
+ *              len - Size of the data that will follow
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if no new segment could be created
+ *              ESP_FAIL on write errors
+ ***************************************************************************/
+static esp_err_t pack_begin_locked(pv_pack_obj_t *obj, pv_pack_rec_type_t type, const char *name,
+                                   uint16_t name_len, uint64_t name_hash, uint32_t len) {
+    pv_pack_hdr_t hdr = {0};
+    uint32_t rec_len = pack_rec_len(name_len, len);
+    esp_err_t err = ESP_OK;
+
+    memset(obj, 0, sizeof(*obj));
+    if (s_cur == PACK_NO_SEGMENT || s_segs[s_cur].end + rec_len > PV_PACK_SEGMENT_SIZE) {
+        err = pack_new_segment();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    hdr.magic = PV_PACK_MAGIC;
+    hdr.type = type;
+    hdr.name_len = name_len;
+    hdr.data_len = len;
+    hdr.name_hash = name_hash;
+    hdr.hdr_crc = pack_hdr_crc(&hdr, s_segs[s_cur].salt);
+
+    obj->seg = (uint8_t)s_cur;
+    obj->offset = s_segs[s_cur].end;
+    obj->name_hash = name_hash;
+    obj->name_len = name_len;
+    obj->data_len = len;
+    obj->hdr_crc = hdr.hdr_crc;
+
+    if (f_lseek(&s_cur_fil, obj->offset) != FR_OK ||
+        pack_write(&hdr, sizeof(hdr)) != ESP_OK || pack_write(name, name_len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // The room is taken from here on, even if the object is aborted
+    s_segs[s_cur].end += rec_len;
+    obj->active = true;
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pack_end_locked
+ * Purpose:     Commits a record by writing its trailer and indexes objects.
+ *              Syncs the segment when the durability policy asks for it.
+ *              Must be called with s_lock held.
+ * Parameters:  obj - Object started with pack_begin_locked()
+ *              type - Record type
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_SIZE if not all data was written
+ *              ESP_FAIL on write errors
+ ***************************************************************************/
+static esp_err_t pack_end_locked(pv_pack_obj_t *obj, pv_pack_rec_type_t type) {
+    pv_pack_trailer_t trailer = { .data_crc = obj->crc, .commit = pack_commit_word(obj->hdr_crc) };
+    esp_err_t err = ESP_OK;
+
+    if (obj->written != obj->data_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    err = pack_write(&trailer, sizeof(trailer));
+    if (err != ESP_OK) {
+        return err;
+    }
+    obj->active = false;
+
+    if (type == PV_PACK_REC_OBJECT) {
+        pack_entry_t entry = {
+            .name_hash = obj->name_hash,
+            .offset = obj->offset,
+            .data_len = obj->data_len,
+            .name_len = obj->name_len,
+            .seg = obj->seg,
+        };
+        if (!pack_index_set(&entry)) {
+            PV_LOGE(TAG, "Index full");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    else {
+        pack_index_remove(obj->name_hash);
+        s_segs[obj->seg].dead += pack_rec_len(obj->name_len, 0);
+    }
+
+    // The segment is preallocated, so a sync only flushes data sectors and the entry timestamp
+    if (pv_durability_log_sync_on_append() || s_sync_pending) {
+        s_sync_pending = false;
+        if (f_sync(&s_cur_fil) != FR_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pack_abort_locked
+ * Purpose:     Gives up on a record. Its room stays reserved and is counted
+ *              as dead; the trailer is cleared so the record never commits.
+ *              Must be called with s_lock held.
+ * Parameters:  obj - Object started with pack_begin_locked()
+ * Returns:     None
+ ***************************************************************************/
+static void pack_abort_locked(pv_pack_obj_t *obj) {
+    pv_pack_trailer_t trailer = {0};
+    uint32_t rec_len = pack_rec_len(obj->name_len, obj->data_len);
+
+    if (!obj->active) {
+        return;
+    }
+    if (f_lseek(&s_cur_fil, obj->offset + rec_len - sizeof(trailer)) == FR_OK) {
+        pack_write(&trailer, sizeof(trailer));
+    }
+    s_segs[obj->seg].dead += rec_len;
+    obj->active = false;
+}
+
+/***************************************************************************
+ * Function:    pack_copy_record
+ * Purpose:     Appends a copy of a record of a sealed segment to the append
+ *              segment. Must be called with s_lock held.
+ * Parameters:  seg - Slot of the segment holding the record
+ *              offset - Offset of the record
+ *              hdr - Header of the record
+ *              data_crc - Data CRC from the trailer of the record
+ *              buf - Copy buffer of PV_PACK_COPY_BUF_SIZE bytes
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_CRC if the data read back doesn't match
+ *              data_crc (the copy is aborted)
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pack_copy_record(int seg, uint32_t offset, const pv_pack_hdr_t *hdr, uint32_t data_crc, uint8_t *buf) {
+    char name[FATFS_PATH_MAX_LENGTH];
+    pv_pack_obj_t obj;
+    uint32_t pos = offset + sizeof(*hdr) + hdr->name_len;
+    uint32_t remaining = hdr->data_len;
+    esp_err_t err = ESP_OK;
+
+    if (hdr->name_len > sizeof(name) ||
+        pack_read_at(seg, offset + sizeof(*hdr), name, hdr->name_len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    err = pack_begin_locked(&obj, hdr->type, name, hdr->name_len, hdr->name_hash, hdr->data_len);
+    while (err == ESP_OK && remaining > 0) {
+        uint32_t chunk = (remaining < PV_PACK_COPY_BUF_SIZE) ? remaining : PV_PACK_COPY_BUF_SIZE;
+        err = pack_read_at(seg, pos, buf, chunk);
+        if (err == ESP_OK) {
+            err = pack_write(buf, chunk);
+            obj.crc = esp_rom_crc32_le(obj.crc, buf, chunk);
+            obj.written += chunk;
+        }
+        pos += chunk;
+        remaining -= chunk;
+    }
+    if (err == ESP_OK && obj.crc != data_crc) {
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) {
+        err = pack_end_locked(&obj, hdr->type);
+    }
+    if (err != ESP_OK) {
+        pack_abort_locked(&obj);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pack_repack_segment
+ * Purpose:     Moves the live records of a sealed segment to the append
+ *              segment, then deletes it. The lock is taken per record so
+ *              transfers are only held up for one copy at a time.
+ *              Tombstones are kept while an older segment may still hold
+ *              the object they delete.
+ * Parameters:  seg - Slot of a sealed segment
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if the copy buffer could not be allocated
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pack_repack_segment(int seg) {
+    char path[FATFS_PATH_MAX_LENGTH];
+    pv_pack_hdr_t hdr;
+    pv_pack_trailer_t trailer;
+    uint32_t offset = PACK_RECORDS_START;
+    uint32_t end = s_segs[seg].end;
+    uint8_t *buf = NULL;
+    esp_err_t err = ESP_OK;
+
+    buf = pv_dma_alloc(PV_PACK_COPY_BUF_SIZE);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    PV_LOGI(TAG, "Repacking segment %u (%u of %u bytes dead)", (unsigned)s_segs[seg].id,
+            (unsigned)s_segs[seg].dead, (unsigned)end);
+
+    while (err == ESP_OK && offset < end) {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        err = pack_read_at(seg, offset, &hdr, sizeof(hdr));
+        if (err == ESP_OK && (hdr.magic != PV_PACK_MAGIC || hdr.hdr_crc != pack_hdr_crc(&hdr, s_segs[seg].salt))) {
+            err = ESP_FAIL; // The scan at mount never accepted this
+        }
+        uint32_t rec_len = (err == ESP_OK) ? pack_rec_len(hdr.name_len, hdr.data_len) : 0;
+        if (err == ESP_OK) {
+            err = pack_read_at(seg, offset + rec_len - sizeof(trailer), &trailer, sizeof(trailer));
+        }
+
+        if (err == ESP_OK && trailer.commit == pack_commit_word(hdr.hdr_crc)) {
+            int32_t pos = pack_index_find(hdr.name_hash);
+            bool copy = false;
+
+            if (hdr.type == PV_PACK_REC_OBJECT) {
+                copy = (pos >= 0 && s_index[pos].seg == seg && s_index[pos].offset == offset);
+            }
+            else if (pos < 0) {
+                for (int i = 0; i < (int)PV_PACK_MAX_SEGMENTS; i++) {
+                    copy |= (s_segs[i].in_use && s_segs[i].id < s_segs[seg].id);
+                }
+            }
+            if (copy) {
+                err = pack_copy_record(seg, offset, &hdr, trailer.data_crc, buf);
+            }
+            if (err == ESP_ERR_INVALID_CRC) {
+                // Copying it would make a bad object look good, it is lost with the segment
+                PV_LOGE(TAG, "Dropping corrupt object in segment %u", (unsigned)s_segs[seg].id);
+                pack_index_remove(hdr.name_hash);
+                err = ESP_OK;
+            }
+        }
+        offset += rec_len;
+        xSemaphoreGive(s_lock);
+        taskYIELD();
+    }
+    pv_dma_free(buf);
+
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Failed to repack segment %u", (unsigned)s_segs[seg].id);
+        return err;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_read_seg == seg) {
+        f_close(&s_read_fil);
+        s_read_seg = PACK_NO_SEGMENT;
+    }
+    pack_seg_path(s_segs[seg].id, path, sizeof(path));
+    if (f_unlink(path) == FR_OK) {
+        s_segs[seg].in_use = false;
+    }
+    else {
+        err = ESP_FAIL;
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pack_task
+ * Purpose:     Repacks sealed segments with too much dead data in the
+ *              background
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+static void pack_task(void *param) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(PV_PACK_REPACK_PERIOD_MS));
+        pv_pack_repack();
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_pack_init
+ * Purpose:     Loads the pack store: scans all segments in id order to
+ *              rebuild the index, reopens the newest segment for appending
+ *              and starts the repack task
+ * Parameters:  None
+ * Returns:     ESP_OK on success (or if already initialized)
+ *              ESP_ERR_NO_MEM if the index could not be allocated
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_pack_init(void) {
+    char ff_dir[FATFS_PATH_MAX_LENGTH];
+    char path[FATFS_PATH_MAX_LENGTH];
+    uint32_t ids[PV_PACK_MAX_SEGMENTS];
+    uint32_t n_ids = 0;
+    FF_DIR dir;
+    FILINFO fno;
+    FRESULT f_res = FR_OK;
+    unsigned id = 0;
+
+    if (s_ready) {
+        return ESP_OK;
+    }
+
+    // A failed init may be retried, the index and lock are only created once
+    if (s_index == NULL) {
+        s_index = PV_STATIC_POOL_GET(s_index_mem, pack_entry_t, PV_PACK_INDEX_ENTRIES);
+    }
+    if (s_lock == NULL) {
+        s_lock = PV_STATIC_MUTEX_CREATE(s_lock_mem);
+    }
+    if (s_index == NULL || s_lock == NULL) {
+        PV_LOGE(TAG, "Failed to allocate the index");
+        return ESP_ERR_NO_MEM;
+    }
+    s_index_count = 0;
+    memset(s_segs, 0, sizeof(s_segs));
+
+    pv_fs_get_ff_path(PV_PACK_DIR, ff_dir, sizeof(ff_dir));
+    f_res = f_mkdir(ff_dir);
+    if (f_res != FR_OK && f_res != FR_EXIST) {
+        PV_LOGE(TAG, "Failed to create %s (0x%x)", PV_PACK_DIR, f_res);
+        return ESP_FAIL;
+    }
+
+    // Collect the segment ids, records in newer segments replace older ones
+    if (f_opendir(&dir, ff_dir) == FR_OK) {
+        while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0] != '\0' && n_ids < PV_PACK_MAX_SEGMENTS) {
+            if (sscanf(fno.fname, "SEG%5u.DAT", &id) == 1) {
+                uint32_t i = n_ids++;
+                while (i > 0 && ids[i - 1] > id) {
+                    ids[i] = ids[i - 1];
+                    i--;
+                }
+                ids[i] = id;
+            }
+        }
+        f_closedir(&dir);
+    }
+
+    for (uint32_t i = 0; i < n_ids; i++) {
+        s_segs[i] = (pack_seg_t){ .in_use = true, .id = ids[i] };
+        esp_err_t err = pack_scan_segment((int)i);
+        if (err == ESP_ERR_INVALID_STATE) {
+            // Never got its header, nothing in it can be valid
+            PV_LOGW(TAG, "Removing invalid segment %u", (unsigned)ids[i]);
+            if (s_read_seg == (int)i) {
+                f_close(&s_read_fil);
+                s_read_seg = PACK_NO_SEGMENT;
+            }
+            pack_seg_path(ids[i], path, sizeof(path));
+            f_unlink(path);
+            s_segs[i].in_use = false;
+        }
+        else if (err != ESP_OK) {
+            PV_LOGE(TAG, "Failed to scan segment %u", (unsigned)ids[i]);
+        }
+    }
+    if (s_read_seg != PACK_NO_SEGMENT) {
+        f_close(&s_read_fil);
+        s_read_seg = PACK_NO_SEGMENT;
+    }
+
+    // Keep appending to the newest segment
+    for (int i = (int)n_ids - 1; i >= 0; i--) {
+        if (s_segs[i].in_use) {
+            pack_seg_path(s_segs[i].id, path, sizeof(path));
+            if (f_open(&s_cur_fil, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) == FR_OK) {
+                s_cur = i;
+            }
+            break;
+        }
+    }
+
+    PV_LOGI(TAG, "%u objects in %u segments", (unsigned)s_index_count, (unsigned)n_ids);
+    s_ready = true;
+
+    if (PV_STATIC_TASK_CREATE(s_task_mem, pack_task, "pv_pack", PV_PACK_TASK_STACK_SIZE, NULL, PV_PACK_TASK_PRIORITY, &s_task, PV_TASK_CORE_STORAGE) != pdPASS) {
+        PV_LOGW(TAG, "Repack task not started");
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_accepts
+ * Purpose:     Tells the receive path whether a file goes into the pack
+ * Parameters:  size - Size of the file in bytes
+ * Returns:     true if the file is small enough and the index has room
+ ***************************************************************************/
+bool pv_pack_accepts(uint64_t size) {
+    return s_ready && size <= PV_PACK_MAX_OBJECT_SIZE && s_index_count < PV_PACK_INDEX_ENTRIES;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_begin
+ * Purpose:     Starts storing an object whose data is written in pieces with
+ *              pv_pack_write(). The store is locked until pv_pack_end() or
+ *              pv_pack_abort(), so only one object is written at a time.
+ * Parameters:  obj - Object to initialize
+ *              name - Logical name (the phone path)
+ *              len - Size of the object in bytes
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the pack store is not running
+ *              ESP_ERR_INVALID_SIZE if the object or name is too large
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_pack_begin(pv_pack_obj_t *obj, const char *name, uint32_t len) {
+    size_t name_len = strlen(name);
+    esp_err_t err = ESP_OK;
+
+    if (!s_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len > PV_PACK_MAX_OBJECT_SIZE || name_len >= FATFS_PATH_MAX_LENGTH) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    err = pack_begin_locked(obj, PV_PACK_REC_OBJECT, name, (uint16_t)name_len,
+                            pv_layout_fingerprint(name, name_len), len);
+    if (err != ESP_OK) {
+        pack_abort_locked(obj);
+        xSemaphoreGive(s_lock);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_write
+ * Purpose:     Appends data to an object started with pv_pack_begin()
+ * Parameters:  obj - The object
+ *              data - Data to write
+ *              len - Number of bytes
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the object is not being written
+ *              ESP_ERR_INVALID_SIZE if more data than announced is written
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_pack_write(pv_pack_obj_t *obj, const void *data, size_t len) {
+    esp_err_t err = ESP_OK;
+
+    if (!obj->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (obj->written + len > obj->data_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    err = pack_write(data, len);
+    if (err == ESP_OK) {
+        obj->crc = esp_rom_crc32_le(obj->crc, data, len);
+        obj->written += len;
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_end
+ * Purpose:     Commits an object and unlocks the store. On failure the
+ *              object is aborted.
+ * Parameters:  obj - The object
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the object is not being written
+ *              ESP_ERR_INVALID_SIZE if less data than announced was written
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_pack_end(pv_pack_obj_t *obj) {
+    esp_err_t err = ESP_OK;
+
+    if (!obj->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    err = pack_end_locked(obj, PV_PACK_REC_OBJECT);
+    if (err != ESP_OK) {
+        pack_abort_locked(obj);
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_abort
+ * Purpose:     Drops an object being written and unlocks the store
+ * Parameters:  obj - The object
+ * Returns:     None
+ ***************************************************************************/
+void pv_pack_abort(pv_pack_obj_t *obj) {
+    if (!obj->active) {
+        return;
+    }
+    pack_abort_locked(obj);
+    xSemaphoreGive(s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_pack_put
+ * Purpose:     Stores an object that is already in memory
+ * Parameters:  name - Logical name (the phone path)
+ *              data - Object data
+ *              len - Size of the object
+ * Returns:     As pv_pack_begin(), pv_pack_write() and pv_pack_end()
+ ***************************************************************************/
+esp_err_t pv_pack_put(const char *name, const void *data, uint32_t len) {
+    pv_pack_obj_t obj;
+    esp_err_t err = pv_pack_begin(&obj, name, len);
+
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = pv_pack_write(&obj, data, len);
+    if (err != ESP_OK) {
+        pv_pack_abort(&obj);
+        return err;
+    }
+    return pv_pack_end(&obj);
+}
+
+/***************************************************************************
+ * Function:    pv_pack_get
+ * Purpose:     Reads an object and checks its CRC
+ * Parameters:  name - Logical name (the phone path)
+ *              buf - Buffer to read into
+ *              buf_len - Size of buf
+ *              len - Returns the size of the object
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NOT_FOUND if the object is not stored
+ *              ESP_ERR_INVALID_SIZE if buf is too small (len is still set)
+ *              ESP_ERR_INVALID_CRC if the stored data is damaged
+ *              ESP_FAIL on read errors
+ ***************************************************************************/
+esp_err_t pv_pack_get(const char *name, void *buf, size_t buf_len, uint32_t *len) {
+    char stored_name[FATFS_PATH_MAX_LENGTH];
+    size_t name_len = strlen(name);
+    pv_pack_trailer_t trailer;
+    pack_entry_t entry;
+    int32_t pos = -1;
+    esp_err_t err = ESP_OK;
+
+    *len = 0;
+    if (!s_ready) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    pos = pack_index_find(pv_layout_fingerprint(name, name_len));
+    if (pos < 0) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    entry = s_index[pos];
+    *len = entry.data_len;
+
+    // Compare the stored name to rule out a fingerprint collision
+    err = pack_read_at(entry.seg, entry.offset + sizeof(pv_pack_hdr_t), stored_name, entry.name_len);
+    if (err == ESP_OK && (entry.name_len != name_len || memcmp(stored_name, name, name_len) != 0)) {
+        err = ESP_ERR_NOT_FOUND;
+    }
+    else if (err == ESP_OK && entry.data_len > buf_len) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err == ESP_OK) {
+        uint32_t data_offset = entry.offset + sizeof(pv_pack_hdr_t) + entry.name_len;
+        err = pack_read_at(entry.seg, data_offset, buf, entry.data_len);
+        if (err == ESP_OK) {
+            err = pack_read_at(entry.seg, data_offset + entry.data_len, &trailer, sizeof(trailer));
+        }
+        if (err == ESP_OK && trailer.data_crc != esp_rom_crc32_le(0, buf, entry.data_len)) {
+            PV_LOGE(TAG, "CRC mismatch for %s", name);
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_contains
+ * Purpose:     Checks whether an object is stored, from the RAM index only
+ * Parameters:  name - Logical name (the phone path)
+ *              len - Returns the size of the object (may be NULL)
+ * Returns:     true if stored
+ ***************************************************************************/
+bool pv_pack_contains(const char *name, uint32_t *len) {
+    int32_t pos = -1;
+
+    if (!s_ready) {
+        return false;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    pos = pack_index_find(pv_layout_fingerprint(name, strlen(name)));
+    if (pos >= 0 && len != NULL) {
+        *len = s_index[pos].data_len;
+    }
+    xSemaphoreGive(s_lock);
+    return pos >= 0;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_delete
+ * Purpose:     Deletes an object by appending a tombstone record
+ * Parameters:  name - Logical name (the phone path)
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NOT_FOUND if the object is not stored
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_pack_delete(const char *name) {
+    size_t name_len = strlen(name);
+    uint64_t name_hash = pv_layout_fingerprint(name, name_len);
+    pv_pack_obj_t obj;
+    esp_err_t err = ESP_OK;
+
+    if (!s_ready) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (pack_index_find(name_hash) < 0) {
+        err = ESP_ERR_NOT_FOUND;
+    }
+    else {
+        err = pack_begin_locked(&obj, PV_PACK_REC_TOMBSTONE, name, (uint16_t)name_len, name_hash, 0);
+        if (err == ESP_OK) {
+            err = pack_end_locked(&obj, PV_PACK_REC_TOMBSTONE);
+        }
+        if (err != ESP_OK) {
+            pack_abort_locked(&obj);
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_delete_prefix
+ * Purpose:     Deletes every object whose name is prefix or lies below it,
+ *              e.g. all files of a device folder. The index only holds
+ *              fingerprints, so each stored name is read back to compare.
+ * Parameters:  prefix - Logical folder name (the phone path), no trailing '/'
+ * Returns:     ESP_OK on success (also if nothing matched)
+ *              ESP_FAIL if a name could not be read or a tombstone written
+ ***************************************************************************/
+esp_err_t pv_pack_delete_prefix(const char *prefix) {
+    char stored_name[FATFS_PATH_MAX_LENGTH];
+    size_t prefix_len = strlen(prefix);
+    pv_pack_obj_t obj;
+    uint32_t deleted = 0;
+    uint32_t i = 0;
+    esp_err_t err = ESP_OK;
+
+    if (!s_ready) {
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    while (i < s_index_count) {
+        pack_entry_t entry = s_index[i];
+        esp_err_t rec_err = ESP_OK;
+
+        if (entry.name_len < prefix_len || entry.name_len >= sizeof(stored_name)) {
+            i++;
+            continue;
+        }
+        if (pack_read_at(entry.seg, entry.offset + sizeof(pv_pack_hdr_t), stored_name, entry.name_len) != ESP_OK) {
+            err = ESP_FAIL;
+            i++;
+            continue;
+        }
+        // Same boundary rule as the folder walk: the prefix itself or a name below it
+        if (strncasecmp(stored_name, prefix, prefix_len) != 0 ||
+            (entry.name_len > prefix_len && stored_name[prefix_len] != '/')) {
+            i++;
+            continue;
+        }
+
+        // The tombstone drops the entry, the last one moves into slot i
+        rec_err = pack_begin_locked(&obj, PV_PACK_REC_TOMBSTONE, stored_name, entry.name_len, entry.name_hash, 0);
+        if (rec_err == ESP_OK) {
+            rec_err = pack_end_locked(&obj, PV_PACK_REC_TOMBSTONE);
+        }
+        if (rec_err != ESP_OK) {
+            pack_abort_locked(&obj);
+            err = ESP_FAIL;
+            i++;
+            continue;
+        }
+        deleted++;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (deleted > 0) {
+        PV_LOGI(TAG, "Deleted %u objects under %s", (unsigned)deleted, prefix);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_pack_repack
+ * Purpose:     Repacks the sealed segment with the largest share of dead
+ *              data, if it is above CONFIG_PV_FS_PACK_REPACK_PCT
+ * Parameters:  None
+ * Returns:     ESP_OK if a segment was repacked or none needed it
+ *              As pack_repack_segment() else
+ ***************************************************************************/
+esp_err_t pv_pack_repack(void) {
+    int best = PACK_NO_SEGMENT;
+    uint64_t best_pct = 0;
+
+    if (!s_ready) {
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < (int)PV_PACK_MAX_SEGMENTS; i++) {
+        uint32_t used = s_segs[i].end - PACK_RECORDS_START;
+        if (!s_segs[i].in_use || i == s_cur || used == 0) {
+            continue;
+        }
+        uint64_t pct = (uint64_t)s_segs[i].dead * 100U / used;
+        if (pct >= PV_PACK_REPACK_PCT && pct >= best_pct) {
+            best = i;
+            best_pct = pct;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    return (best == PACK_NO_SEGMENT) ? ESP_OK : pack_repack_segment(best);
+}
+
+/***************************************************************************
+ * Function:    pv_pack_sync
+ * Purpose:     Commits the append segment as required by the durability
+ *              policy. Never waits for an object being written; its
+ *              pv_pack_end() syncs instead.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_pack_sync(void) {
+    if (!s_ready) {
+        return;
+    }
+
+    if (xSemaphoreTake(s_lock, 0) != pdTRUE) {
+        s_sync_pending = true;
+        return;
+    }
+    if (s_cur != PACK_NO_SEGMENT) {
+        f_sync(&s_cur_fil);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_pack_get_stats
+ * Purpose:     Returns usage counters of the pack store
+ * Parameters:  stats - Returns the counters
+ * Returns:     None
+ ***************************************************************************/
+void pv_pack_get_stats(pv_pack_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!s_ready) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    stats->objects = s_index_count;
+    for (int i = 0; i < (int)PV_PACK_MAX_SEGMENTS; i++) {
+        if (s_segs[i].in_use) {
+            stats->segments++;
+            stats->live_bytes += s_segs[i].end - PACK_RECORDS_START - s_segs[i].dead;
+            stats->dead_bytes += s_segs[i].dead;
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+#else /* CONFIG_PV_FS_PACK_STORE */
+
+esp_err_t pv_pack_init(void) { return ESP_OK; }
+bool pv_pack_accepts(uint64_t size) { return false; }
+esp_err_t pv_pack_begin(pv_pack_obj_t *obj, const char *name, uint32_t len) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t pv_pack_write(pv_pack_obj_t *obj, const void *data, size_t len) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t pv_pack_end(pv_pack_obj_t *obj) { return ESP_ERR_NOT_SUPPORTED; }
+void pv_pack_abort(pv_pack_obj_t *obj) { }
+esp_err_t pv_pack_put(const char *name, const void *data, uint32_t len) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t pv_pack_get(const char *name, void *buf, size_t buf_len, uint32_t *len) { *len = 0; return ESP_ERR_NOT_FOUND; }
+bool pv_pack_contains(const char *name, uint32_t *len) { return false; }
+esp_err_t pv_pack_delete(const char *name) { return ESP_ERR_NOT_FOUND; }
+esp_err_t pv_pack_delete_prefix(const char *prefix) { return ESP_OK; }
+esp_err_t pv_pack_repack(void) { return ESP_OK; }
+void pv_pack_sync(void) { }
+void pv_pack_get_stats(pv_pack_stats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+
+#endif /* CONFIG_PV_FS_PACK_STORE */
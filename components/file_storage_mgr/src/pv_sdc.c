@@ -6,12 +6,15 @@
 #include "sdc_tests.h"
 
 #include "pv_sdc.h"
+#include "pv_bench.h"
 #include "board_config.h"
+#include "pv_static.h"
 
 #define TAG "PV_SDC"
 
 /* STATIC VARIABLES */
 static sdmmc_card_t *s_card = NULL;
+PV_STATIC_POOL_DEFINE(s_card_mem, sdmmc_card_t, 1);
 static sdmmc_host_t host = SDSPI_HOST_DEFAULT();
 static sdspi_device_config_t devConfig = SDSPI_DEVICE_CONFIG_DEFAULT();
 
@@ -49,7 +52,9 @@ void pv_card_get(sdmmc_card_t **out_card) {
 esp_err_t pv_init_sdc(void){
     esp_err_t ret;
     sdspi_dev_handle_t sdcDevhandle;
-    s_card = (sdmmc_card_t *)malloc(sizeof(sdmmc_card_t));
+    if (s_card == NULL) {
+        s_card = PV_STATIC_POOL_GET(s_card_mem, sdmmc_card_t, 1);
+    }
     if (s_card == NULL) { 
         PV_LOGE(TAG, "Failed to allocate memory for sdmmc_card_t.");
         return ESP_ERR_NO_MEM; // Memory allocation failed
@@ -96,5 +101,28 @@ void pv_test_sdc(void){
     RUN_TEST(test_sdcWriteFile);
     RUN_TEST(test_log_writes);
     RUN_TEST(test_log_checks);
+    RUN_TEST(test_filePreallocWrite);
+    RUN_TEST(test_fsFreeSpace);
+    RUN_TEST(test_deleteDirTree);
+    RUN_TEST(test_aioWriteRead);
+    RUN_TEST(test_aioDeleteDirOpenFile);
+    RUN_TEST(test_logBufferedEntries);
+    RUN_TEST(test_dirCache);
+    RUN_TEST(test_layoutPaths);
+    RUN_TEST(test_bulkCreateShortNames);
+    RUN_TEST(test_createKeepsExisting);
+    RUN_TEST(test_dentryCache);
+    RUN_TEST(test_packPutGetDelete);
+    RUN_TEST(test_segLogAppend);
+    RUN_TEST(test_segLogAppendDuringDelete);
+    RUN_TEST(test_diskioCounters);
+    RUN_TEST(test_diskioTrace);
+    RUN_TEST(test_trimFreedClusters);
+    RUN_TEST(test_preEraseLargeFile);
+    RUN_TEST(test_dmaBuffers);
     UNITY_END();  
+
+#if CONFIG_PV_FS_RUN_BENCHMARKS
+    pv_bench_run_all();
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "freertos/FreeRTOS.h"
+#include "ff.h"
+
+#include "pv_logging.h"
+#include "pv_fs.h"
+#include "pv_seglog.h"
+#include "pv_diskio.h"
+#include "pv_dma.h"
+
+
+#define TAG "PV_SEGLOG"
+
+#define SEGLOG_ID_DIGITS    5U
+
+/* STATIC VARIABLES */
+static volatile uint32_t s_generation = 0;  // Bumped when segments may have been deleted under open logs
+
+
+/***************************************************************************
+ * Function:    pv_seglog_segment_path
+ * Purpose:     Builds the POSIX path of a segment
+ * Parameters:  dir - Directory of the log
+ *              prefix, ext - Name parts of the log
+ *              id - Segment id
+ *              path - Buffer to store the path
+ *              len - Size of path
+ * Returns:     None
+ ***************************************************************************/
+static void pv_seglog_segment_path(const char *dir, const char *prefix, const char *ext, uint32_t id,
+                                   char *path, size_t len) {
+    snprintf(path, len, "%s/%s%05u.%s", dir, prefix, (unsigned)id, ext);
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_scan_ids
+ * Purpose:     Finds the lowest and highest segment ids of a log
+ * Parameters:  dir - Directory of the log (POSIX path)
+ *              prefix, ext - Name parts of the log
+ *              first - Returns the lowest id
+ *              last - Returns the highest id
+ * Returns:     true if at least one segment exists
+ ***************************************************************************/
+static bool pv_seglog_scan_ids(const char *dir, const char *prefix, const char *ext, uint32_t *first, uint32_t *last) {
+    char ff_dir[FATFS_PATH_MAX_LENGTH];
+    size_t prefix_len = strlen(prefix);
+    FF_DIR ff_d;
+    FILINFO fno;
+    bool found = false;
+
+    if (pv_fs_get_ff_path(dir, ff_dir, sizeof(ff_dir)) != ESP_OK || f_opendir(&ff_d, ff_dir) != FR_OK) {
+        return false;
+    }
+
+    while (f_readdir(&ff_d, &fno) == FR_OK && fno.fname[0] != '\0') {
+        const char *name = fno.fname;
+        uint32_t id = 0;
+        size_t i = 0;
+
+        if ((fno.fattrib & AM_DIR) || strncmp(name, prefix, prefix_len) != 0) {
+            continue;
+        }
+        for (i = 0; i < SEGLOG_ID_DIGITS && isdigit((unsigned char)name[prefix_len + i]); i++) {
+            id = id * 10U + (uint32_t)(name[prefix_len + i] - '0');
+        }
+        if (i != SEGLOG_ID_DIGITS || name[prefix_len + i] != '.' || strcmp(name + prefix_len + i + 1, ext) != 0) {
+            continue;
+        }
+
+        if (!found || id < *first) {
+            *first = id;
+        }
+        if (!found || id > *last) {
+            *last = id;
+        }
+        found = true;
+    }
+    f_closedir(&ff_d);
+    return found;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_write_sectors
+ * Purpose:     Writes sectors of a segment straight to the card through the
+ *              diskio driver, so they are counted as data. The FatFs volume
+ *              lock is held so the write never interleaves with a FatFs
+ *              access to the card.
+ * Parameters:  sector - First sector
+ *              buf - Data of count sectors
+ *              count - Number of sectors
+ * Returns:     ESP_OK on success, ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pv_seglog_write_sectors(LBA_t sector, const void *buf, size_t count) {
+    int vol = pv_fs_get_pdrv();
+    DRESULT res = RES_OK;
+
+    ff_mutex_take(vol);
+    res = pv_diskio_write(vol, buf, sector, count);
+    ff_mutex_give(vol);
+    return (res == RES_OK) ? ESP_OK : ESP_FAIL;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_create_segment
+ * Purpose:     Creates the next segment as one contiguous, zero filled run of
+ *              clusters and makes it the segment appended to
+ * Parameters:  log - The log
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if there is no contiguous free space (or RAM)
+ *              ESP_ERR_NOT_SUPPORTED if FatFs was built without f_expand
+ *              ESP_FAIL else
+ ***************************************************************************/
+static esp_err_t pv_seglog_create_segment(pv_seglog_t *log) {
+#if FF_USE_EXPAND
+    char path[FATFS_PATH_MAX_LENGTH];
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FATFS *fs = pv_fs_get_fatfs();
+    uint32_t id = log->has_segment ? log->id + 1 : 0;
+    uint8_t *zeros = NULL;
+    DWORD sclust = 0;
+    FIL fil;
+    FRESULT f_res = FR_OK;
+    esp_err_t err = ESP_OK;
+
+    if (id > PV_SEGLOG_MAX_ID) {
+        return ESP_FAIL;
+    }
+
+    pv_seglog_segment_path(log->dir, log->prefix, log->ext, id, path, sizeof(path));
+    err = pv_fs_get_ff_path(path, ff_path, sizeof(ff_path));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    f_res = f_open(&fil, ff_path, FA_WRITE | FA_CREATE_NEW);
+    if (f_res != FR_OK) {
+        PV_LOGE(TAG, "Failed to create %s (0x%x)", path, f_res);
+        return ESP_FAIL;
+    }
+    f_res = f_expand(&fil, PV_SEGLOG_SEGMENT_SIZE, 1);
+    sclust = fil.obj.sclust;
+    f_close(&fil);
+    if (f_res != FR_OK) {
+        PV_LOGW(TAG, "No contiguous space for %s (0x%x)", path, f_res);
+        f_unlink(ff_path);
+        return (f_res == FR_DENIED) ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    // The clusters hold whatever was deleted before, zero them so the end marker is valid
+    zeros = pv_dma_alloc(PV_SEGLOG_ZERO_SECTORS * fs->ssize);
+    if (zeros == NULL) {
+        f_unlink(ff_path);
+        return ESP_ERR_NO_MEM;
+    }
+    memset(zeros, 0, PV_SEGLOG_ZERO_SECTORS * fs->ssize);
+
+    log->sector = fs->database + (LBA_t)fs->csize * (sclust - 2);
+    for (uint32_t s = 0; s < PV_SEGLOG_SEGMENT_SIZE / fs->ssize && err == ESP_OK; s += PV_SEGLOG_ZERO_SECTORS) {
+        uint32_t count = PV_SEGLOG_SEGMENT_SIZE / fs->ssize - s;
+        err = pv_seglog_write_sectors(log->sector + s, zeros, (count < PV_SEGLOG_ZERO_SECTORS) ? count : PV_SEGLOG_ZERO_SECTORS);
+    }
+    pv_dma_free(zeros);
+    if (err != ESP_OK) {
+        PV_LOGE(TAG, "Failed to clear %s (0x%x)", path, err);
+        f_unlink(ff_path);
+        log->sector = 0;
+        return ESP_FAIL;
+    }
+
+    log->has_segment = true;
+    log->id = id;
+    log->size = PV_SEGLOG_SEGMENT_SIZE;
+    log->end = 0;
+    memset(log->tail, 0, fs->ssize);
+    PV_LOGI(TAG, "Created %s", path);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_load_segment
+ * Purpose:     Loads the last segment of a log: checks that it is still one
+ *              contiguous run of clusters and finds the end marker with a
+ *              binary search over the first byte of each sector
+ * Parameters:  log - The log, with id set
+ *              last_byte - Returns the byte before the end marker ('\n' if
+ *                          the segment is empty)
+ * Returns:     ESP_OK on success (log->sector is 0 if the segment can only
+ *              be read)
+ *              ESP_FAIL on read errors
+ ***************************************************************************/
+static esp_err_t pv_seglog_load_segment(pv_seglog_t *log, char *last_byte) {
+    char path[FATFS_PATH_MAX_LENGTH];
+    char ff_path[FATFS_PATH_MAX_LENGTH];
+    FATFS *fs = pv_fs_get_fatfs();
+    uint32_t ss = fs->ssize;
+    uint32_t cluster_size = fs->csize * ss;
+    uint32_t lo = 0, hi = 0;
+    bool contiguous = true;
+    uint8_t first = 0;
+    DWORD sclust = 0;
+    FIL fil;
+    UINT br = 0;
+    FRESULT f_res = FR_OK;
+
+    *last_byte = '\n';
+    pv_seglog_segment_path(log->dir, log->prefix, log->ext, log->id, path, sizeof(path));
+    if (pv_fs_get_ff_path(path, ff_path, sizeof(ff_path)) != ESP_OK || f_open(&fil, ff_path, FA_READ) != FR_OK) {
+        return ESP_FAIL;
+    }
+
+    log->size = (uint32_t)f_size(&fil);
+    log->end = log->size;
+    log->sector = 0;
+    memset(log->tail, 0, ss);
+    if (log->size == 0 || log->size % ss != 0) {
+        f_close(&fil);
+        return ESP_OK; // Not written by us, leave it alone
+    }
+
+    // Walk the cluster chain, only a contiguous segment can be written by sector
+    for (uint32_t ofs = cluster_size; ofs < log->size && contiguous && f_res == FR_OK; ofs += cluster_size) {
+        f_res = f_lseek(&fil, ofs + 1);
+        contiguous = (fil.clust == fil.obj.sclust + ofs / cluster_size);
+    }
+
+    // First sector that starts with the end marker, the log ends in the sector before it
+    hi = log->size / ss;
+    while (lo < hi && f_res == FR_OK) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        f_res = f_lseek(&fil, (FSIZE_t)mid * ss);
+        if (f_res == FR_OK) {
+            f_res = f_read(&fil, &first, 1, &br);
+        }
+        if (first == 0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+
+    if (f_res == FR_OK && lo > 0) {
+        f_res = f_lseek(&fil, (FSIZE_t)(lo - 1) * ss);
+        if (f_res == FR_OK) {
+            f_res = f_read(&fil, log->tail, ss, &br);
+        }
+        uint8_t *marker = memchr(log->tail, 0, ss);
+        if (marker != NULL) {
+            log->end = (lo - 1) * ss + (uint32_t)(marker - log->tail);
+            *last_byte = (char)marker[-1]; // Never the first byte, the search saw it set
+        }
+        else {
+            log->end = lo * ss;
+            *last_byte = (char)log->tail[ss - 1];
+            memset(log->tail, 0, ss);
+        }
+    }
+    else {
+        log->end = 0;
+    }
+    sclust = fil.obj.sclust;
+    f_close(&fil);
+
+    if (f_res != FR_OK) {
+        return ESP_FAIL;
+    }
+    if (contiguous) {
+        log->sector = fs->database + (LBA_t)fs->csize * (sclust - 2);
+    }
+    else {
+        PV_LOGW(TAG, "%s is fragmented, starting a new segment", path);
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_append_fenced
+ * Purpose:     Does the work of pv_seglog_append() once the directory of
+ *              the log is fenced against deletes
+ * Parameters:  log - The open log
+ *              data - Bytes to append
+ *              len - Number of bytes, at most PV_SEGLOG_SEGMENT_SIZE
+ * Returns:     As pv_seglog_append()
+ ***************************************************************************/
+static esp_err_t pv_seglog_append_fenced(pv_seglog_t *log, const void *data, size_t len) {
+    const uint8_t *src = data;
+    uint32_t ss = 0;
+    esp_err_t err = ESP_OK;
+
+    // Segments may have been deleted or the card formatted, look them up again
+    if (log->generation != s_generation) {
+        char dir[FATFS_PATH_MAX_LENGTH];
+        char prefix[PV_SEGLOG_NAME_PART_MAX + 1];
+        char ext[PV_SEGLOG_NAME_PART_MAX + 1];
+
+        strcpy(dir, log->dir);
+        strcpy(prefix, log->prefix);
+        strcpy(ext, log->ext);
+        pv_seglog_close(log);
+        err = pv_seglog_open(log, dir, prefix, ext);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (!log->has_segment || log->sector == 0 || log->end + len > log->size) {
+        err = pv_seglog_create_segment(log);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    ss = pv_fs_get_fatfs()->ssize;
+    while (len > 0) {
+        uint32_t ofs = log->end % ss;
+        size_t n = (len < ss - ofs) ? len : ss - ofs;
+
+        memcpy(log->tail + ofs, src, n);
+        err = pv_seglog_write_sectors(log->sector + log->end / ss, log->tail, 1);
+        if (err != ESP_OK) {
+            PV_LOGE(TAG, "Failed to append to %s%05u.%s (0x%x)", log->prefix, (unsigned)log->id, log->ext, err);
+            memset(log->tail + ofs, 0, n);
+            return ESP_FAIL;
+        }
+
+        log->end += n;
+        src += n;
+        len -= n;
+        if (log->end % ss == 0) {
+            memset(log->tail, 0, ss); // The next sector is still zero on the card
+        }
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_open
+ * Purpose:     Opens a log for appending. Finds its last segment and the end
+ *              marker in it; a line cut off by a power loss is terminated.
+ * Parameters:  log - The log to initialize
+ *              dir - Directory holding the segments (POSIX path, must exist)
+ *              prefix - Upper case name prefix, up to 3 characters
+ *              ext - Upper case extension, up to 3 characters
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_ARG if a name part is too long
+ *              ESP_ERR_INVALID_STATE if the filesystem is not mounted or
+ *              the directory is being deleted
+ *              ESP_ERR_NO_MEM if the sector buffer could not be allocated
+ *              ESP_FAIL else
+ ***************************************************************************/
+esp_err_t pv_seglog_open(pv_seglog_t *log, const char *dir, const char *prefix, const char *ext) {
+    FATFS *fs = pv_fs_get_fatfs();
+    uint32_t first = 0;
+    char last_byte = '\n';
+    esp_err_t err = ESP_OK;
+
+    memset(log, 0, sizeof(*log));
+    if (strlen(prefix) > PV_SEGLOG_NAME_PART_MAX || strlen(ext) > PV_SEGLOG_NAME_PART_MAX ||
+        strlen(dir) >= sizeof(log->dir)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (fs == NULL || pv_fs_is_being_deleted(dir)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    strcpy(log->dir, dir);
+    strcpy(log->prefix, prefix);
+    strcpy(log->ext, ext);
+    log->generation = s_generation;
+    log->tail = pv_dma_alloc(fs->ssize);
+    if (log->tail == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    log->has_segment = pv_seglog_scan_ids(dir, prefix, ext, &first, &log->id);
+    if (log->has_segment) {
+        err = pv_seglog_load_segment(log, &last_byte);
+        if (err != ESP_OK) {
+            PV_LOGE(TAG, "Failed to load %s/%s%05u.%s", dir, prefix, (unsigned)log->id, ext);
+            pv_seglog_close(log);
+            return err;
+        }
+    }
+    log->open = true;
+
+    if (last_byte != '\n' && log->sector != 0) {
+        err = pv_seglog_append(log, "\n", 1);
+    }
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_append
+ * Purpose:     Appends bytes to a log. Only the data sectors of the segment
+ *              are written; a new segment is created when they don't fit.
+ *              Returns once the sectors are on the card.
+ * Parameters:  log - The log
+ *              data - Bytes to append, must not contain NUL
+ *              len - Number of bytes
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_INVALID_STATE if the log is not open or its
+ *              directory is being deleted
+ *              ESP_ERR_INVALID_SIZE if len is larger than a segment
+ *              As pv_seglog_create_segment() if a segment is needed
+ *              ESP_FAIL on write errors
+ ***************************************************************************/
+esp_err_t pv_seglog_append(pv_seglog_t *log, const void *data, size_t len) {
+    esp_err_t err = ESP_OK;
+
+    if (!log->open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len > PV_SEGLOG_SEGMENT_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // The sectors are written raw, they must not be freed by a delete while this runs
+    err = pv_fs_fence_enter(log->dir);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = pv_seglog_append_fenced(log, data, len);
+    pv_fs_fence_exit();
+    return err;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_close
+ * Purpose:     Closes a log. Appends are already on the card, so nothing is
+ *              written.
+ * Parameters:  log - The log
+ * Returns:     None
+ ***************************************************************************/
+void pv_seglog_close(pv_seglog_t *log) {
+    pv_dma_free(log->tail);
+    log->tail = NULL;
+    log->open = false;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_for_each_line
+ * Purpose:     Reads the lines of a log, oldest segment first. Reading stops
+ *              at the end marker of each segment. The log does not have to
+ *              be open.
+ * Parameters:  dir - Directory holding the segments (POSIX path)
+ *              prefix, ext - Name parts of the log
+ *              cb - Called with each line (including its '\n')
+ *              ctx - Passed to cb
+ * Returns:     ESP_OK on success (also when cb stopped the read)
+ *              ESP_ERR_NOT_FOUND if the log has no segments
+ ***************************************************************************/
+esp_err_t pv_seglog_for_each_line(const char *dir, const char *prefix, const char *ext, pv_seglog_line_cb_t cb, void *ctx) {
+    char path[FATFS_PATH_MAX_LENGTH];
+    char line[PV_SEGLOG_LINE_MAX];
+    uint32_t first = 0, last = 0;
+    bool stop = false;
+
+    if (!pv_seglog_scan_ids(dir, prefix, ext, &first, &last)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    for (uint32_t id = first; id <= last && !stop; id++) {
+        pv_seglog_segment_path(dir, prefix, ext, id, path, sizeof(path));
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue; // Ids can have gaps if a segment was removed
+        }
+        while (!stop && fgets(line, sizeof(line), f) != NULL && line[0] != '\0') {
+            stop = cb(line, ctx);
+        }
+        fclose(f);
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_seglog_invalidate_all
+ * Purpose:     Makes every open log look its segments up again before the
+ *              next append. Called when files are deleted in bulk or the card
+ *              is formatted, so no append lands in freed clusters.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_seglog_invalidate_all(void) {
+    s_generation++;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "sdmmc_cmd.h"
+
+#include "pv_logging.h"
+#include "pv_diskio.h"
+#include "pv_trim.h"
+#include "pv_static.h"
+
+
+#define TAG "PV_TRIM"
+
+#if CONFIG_PV_FS_TRIM
+
+#if !FF_USE_TRIM
+#warning "CONFIG_PV_FS_TRIM needs FF_USE_TRIM in the FatFs config, freed clusters are not discarded"
+#endif
+
+#define TRIM_INLINE_BYTES       ((uint64_t)CONFIG_PV_FS_TRIM_INLINE_KB * 1024U)
+#define TRIM_QUEUE_RANGES       CONFIG_PV_FS_TRIM_QUEUE_RANGES
+#define TRIM_SLOW_MS_PER_MB     CONFIG_PV_FS_TRIM_SLOW_MS_PER_MB
+
+typedef struct {
+    LBA_t first;
+    LBA_t last;
+} trim_range_t;
+
+/* STATIC VARIABLES */
+static sdmmc_card_t *s_card = NULL;
+static BYTE s_pdrv = 0;
+static sdmmc_erase_arg_t s_arg = SDMMC_ERASE_ARG;
+static volatile pv_trim_mode_t s_mode = PV_TRIM_OFF;
+static trim_range_t s_queue[TRIM_QUEUE_RANGES];
+static uint32_t s_queued = 0;
+static int64_t s_last_write_us = 0;
+static pv_trim_stats_t s_stats;
+static TaskHandle_t s_task = NULL;
+static portMUX_TYPE s_trim_lock = portMUX_INITIALIZER_UNLOCKED;
+PV_STATIC_TASK_DEFINE(s_task_mem, PV_TRIM_TASK_STACK_SIZE);
+
+
+/***************************************************************************
+ * Function:    trim_erase
+ * Purpose:     Discards a run of sectors in commands of at most
+ *              PV_TRIM_MAX_ERASE_SECTORS. The caller holds the volume lock,
+ *              so no write can land in the run meanwhile.
+ * Parameters:  first - First sector
+ *              count - Number of sectors
+ *              background - true when called by the task
+ * Returns:     Time the card took in microseconds
+ ***************************************************************************/
+static uint64_t trim_erase(LBA_t first, uint64_t count, bool background) {
+    uint64_t total_us = 0;
+
+    while (count > 0) {
+        size_t n = (count < PV_TRIM_MAX_ERASE_SECTORS) ? (size_t)count : PV_TRIM_MAX_ERASE_SECTORS;
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = sdmmc_erase_sectors(s_card, (size_t)first, n, s_arg);
+        uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+
+        portENTER_CRITICAL(&s_trim_lock);
+        if (background) {
+            s_stats.background_erases++;
+        }
+        else {
+            s_stats.inline_erases++;
+        }
+        s_stats.erase_us += us;
+        if (err == ESP_OK) {
+            s_stats.sectors += n;
+        }
+        else {
+            s_stats.failed++;
+        }
+        portEXIT_CRITICAL(&s_trim_lock);
+
+        if (err != ESP_OK) {
+            PV_LOGW(TAG, "Erase of %u sectors at %lu failed (0x%x)", (unsigned)n, (unsigned long)first, err);
+            break;
+        }
+        total_us += us;
+        first += n;
+        count -= n;
+    }
+    return total_us;
+}
+
+/***************************************************************************
+ * Function:    trim_drain
+ * Purpose:     Takes every queued run off the queue and discards it. The
+ *              caller holds the volume lock.
+ * Parameters:  background - true when called by the task
+ * Returns:     None
+ ***************************************************************************/
+static void trim_drain(bool background) {
+    trim_range_t ranges[TRIM_QUEUE_RANGES];
+    uint32_t n = 0;
+
+    portENTER_CRITICAL(&s_trim_lock);
+    n = s_queued;
+    memcpy(ranges, s_queue, n * sizeof(trim_range_t));
+    s_queued = 0;
+    portEXIT_CRITICAL(&s_trim_lock);
+
+    for (uint32_t i = 0; i < n; i++) {
+        trim_erase(ranges[i].first, ranges[i].last - ranges[i].first + 1, background);
+    }
+}
+
+/***************************************************************************
+ * Function:    trim_queue
+ * Purpose:     Adds a run to the queue, merged with a queued run it touches
+ * Parameters:  first - First sector
+ *              last - Last sector
+ * Returns:     false if the queue is full
+ ***************************************************************************/
+static bool trim_queue(LBA_t first, LBA_t last) {
+    bool queued = false;
+
+    portENTER_CRITICAL(&s_trim_lock);
+    for (uint32_t i = 0; i < s_queued && !queued; i++) {
+        if (s_queue[i].last + 1 == first) {
+            s_queue[i].last = last;
+            queued = true;
+        }
+        else if (last + 1 == s_queue[i].first) {
+            s_queue[i].first = first;
+            queued = true;
+        }
+    }
+    if (!queued && s_queued < TRIM_QUEUE_RANGES) {
+        s_queue[s_queued].first = first;
+        s_queue[s_queued].last = last;
+        s_queued++;
+        queued = true;
+    }
+    portEXIT_CRITICAL(&s_trim_lock);
+    return queued;
+}
+
+/***************************************************************************
+ * Function:    trim_task
+ * Purpose:     Discards the queued runs once the card has been idle for
+ *              PV_TRIM_IDLE_MS
+ * Parameters:  arg - Unused
+ * Returns:     None
+ ***************************************************************************/
+static void trim_task(void *arg) {
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(PV_TRIM_IDLE_MS));
+        if (s_queued == 0 || esp_timer_get_time() - s_last_write_us < (int64_t)PV_TRIM_IDLE_MS * 1000) {
+            continue;
+        }
+        pv_trim_flush();
+    }
+}
+
+/***************************************************************************
+ * Function:    pv_trim_init
+ * Purpose:     Sets the discard policy for a newly mounted card and starts
+ *              the background task
+ * Parameters:  pdrv - FatFs drive number of the card
+ *              card - The card
+ * Returns:     ESP_OK on success
+ *              ESP_ERR_NO_MEM if the task could not be created
+ ***************************************************************************/
+esp_err_t pv_trim_init(BYTE pdrv, sdmmc_card_t *card) {
+    bool discard = (sdmmc_can_discard(card) == ESP_OK);
+    bool denied = pv_diskio_card_in_list(card, CONFIG_PV_FS_TRIM_DENY_CARDS);
+
+    portENTER_CRITICAL(&s_trim_lock);
+    s_card = card;
+    s_pdrv = pdrv;
+    s_arg = discard ? SDMMC_DISCARD_ARG : SDMMC_ERASE_ARG;
+    s_queued = 0;
+    s_mode = denied ? PV_TRIM_OFF : PV_TRIM_AUTO;
+    portEXIT_CRITICAL(&s_trim_lock);
+
+    PV_LOGI(TAG, "Card %.*s: freed clusters are %s", (int)sizeof(card->cid.name), card->cid.name,
+            denied ? "kept (deny list)" : (discard ? "discarded" : "erased"));
+
+    if (s_task == NULL &&
+        PV_STATIC_TASK_CREATE(s_task_mem, trim_task, "pv_trim", PV_TRIM_TASK_STACK_SIZE, NULL, PV_TRIM_TASK_PRIORITY, &s_task, PV_TASK_CORE_STORAGE) != pdPASS) {
+        s_task = NULL;
+        s_mode = PV_TRIM_OFF;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_trim_range
+ * Purpose:     diskio CTRL_TRIM handler, called by FatFs with the volume
+ *              lock held for each run of sectors it freed
+ * Parameters:  first - First freed sector
+ *              last - Last freed sector
+ * Returns:     RES_OK, FatFs does not care whether the run was discarded
+ ***************************************************************************/
+DRESULT pv_trim_range(LBA_t first, LBA_t last) {
+    pv_trim_mode_t mode = s_mode;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t us = 0;
+
+    if (mode == PV_TRIM_OFF || s_card == NULL || last < first) {
+        return RES_OK;
+    }
+    count = (uint64_t)(last - first) + 1;
+    bytes = count * (uint64_t)s_card->csd.sector_size;
+
+    portENTER_CRITICAL(&s_trim_lock);
+    s_stats.ranges++;
+    portEXIT_CRITICAL(&s_trim_lock);
+
+    if (mode == PV_TRIM_AUTO && bytes >= TRIM_INLINE_BYTES) {
+        us = trim_erase(first, count, false);
+        // Slower than the limit: keep this card's erases off the write path
+        if (us * 1024U * 1024U > (uint64_t)TRIM_SLOW_MS_PER_MB * 1000U * bytes) {
+            PV_LOGW(TAG, "Discard of %llu KB took %llu ms, discarding in the background from now on",
+                    bytes / 1024U, us / 1000U);
+            s_mode = PV_TRIM_BACKGROUND;
+        }
+        return RES_OK;
+    }
+
+    if (!trim_queue(first, last)) {
+        if (mode == PV_TRIM_AUTO) {
+            // Queue full, make room while FatFs holds the lock anyway
+            trim_drain(false);
+            trim_queue(first, last);
+        }
+        else {
+            // Keeping the sectors is always safe, a slow card is not erased on the write path
+            portENTER_CRITICAL(&s_trim_lock);
+            s_stats.dropped++;
+            portEXIT_CRITICAL(&s_trim_lock);
+        }
+    }
+    return RES_OK;
+}
+
+/***************************************************************************
+ * Function:    pv_trim_cancel
+ * Purpose:     Called for every write: drops queued runs the write overlaps,
+ *              their clusters were reused, and restarts the idle timer
+ * Parameters:  sector - First sector written
+ *              count - Number of sectors
+ * Returns:     None
+ ***************************************************************************/
+void pv_trim_cancel(LBA_t sector, unsigned count) {
+    LBA_t last = sector + count - 1;
+
+    portENTER_CRITICAL(&s_trim_lock);
+    s_last_write_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < s_queued;) {
+        if (s_queue[i].first <= last && sector <= s_queue[i].last) {
+            s_queue[i] = s_queue[--s_queued];
+            s_stats.cancelled++;
+        }
+        else {
+            i++;
+        }
+    }
+    portEXIT_CRITICAL(&s_trim_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_trim_flush
+ * Purpose:     Discards every queued run now
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void pv_trim_flush(void) {
+    if (s_card == NULL || s_queued == 0) {
+        return;
+    }
+    ff_mutex_take(s_pdrv);
+    trim_drain(true);
+    ff_mutex_give(s_pdrv);
+}
+
+/***************************************************************************
+ * Function:    pv_trim_set_mode
+ * Purpose:     Overrides the policy of the mounted card until the next mount.
+ *              Turning it off drops the queued runs.
+ * Parameters:  mode - New policy
+ * Returns:     None
+ ***************************************************************************/
+void pv_trim_set_mode(pv_trim_mode_t mode) {
+    portENTER_CRITICAL(&s_trim_lock);
+    s_mode = mode;
+    if (mode == PV_TRIM_OFF) {
+        s_queued = 0;
+    }
+    portEXIT_CRITICAL(&s_trim_lock);
+}
+
+/***************************************************************************
+ * Function:    pv_trim_get_mode
+ * Purpose:     Returns the policy of the mounted card
+ * Parameters:  None
+ * Returns:     The policy
+ ***************************************************************************/
+pv_trim_mode_t pv_trim_get_mode(void) {
+    return s_mode;
+}
+
+/***************************************************************************
+ * Function:    pv_trim_get_stats
+ * Purpose:     Returns a consistent copy of the counters
+ * Parameters:  stats - Returns the counters
+ * Returns:     None
+ ***************************************************************************/
+void pv_trim_get_stats(pv_trim_stats_t *stats) {
+    portENTER_CRITICAL(&s_trim_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_trim_lock);
+}
+
+#else /* CONFIG_PV_FS_TRIM */
+
+esp_err_t pv_trim_init(BYTE pdrv, sdmmc_card_t *card) { return ESP_OK; }
+DRESULT pv_trim_range(LBA_t first, LBA_t last) { return RES_OK; }
+void pv_trim_cancel(LBA_t sector, unsigned count) { }
+void pv_trim_set_mode(pv_trim_mode_t mode) { }
+pv_trim_mode_t pv_trim_get_mode(void) { return PV_TRIM_OFF; }
+void pv_trim_flush(void) { }
+void pv_trim_get_stats(pv_trim_stats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+
+#endif /* CONFIG_PV_FS_TRIM */
@@ -1,11 +1,26 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "unity.h"
 #include "sdc_tests.h"
 #include "pv_sdc.h"
 #include "pv_fs.h"
+#include "pv_file.h"
+#include "pv_aio.h"
+#include "pv_dircache.h"
+#include "pv_layout.h"
+#include "pv_bench.h"
+#include "pv_dentry.h"
+#include "pv_pack.h"
+#include "pv_seglog.h"
+#include "pv_diskio.h"
+#include "pv_trim.h"
+#include "pv_dma.h"
 
 
 /***************************************************************************
@@ -61,20 +76,25 @@ void test_log_writes(void) {
     char *serial_number = "12345678";
     char *file_path = "/path/to/test_file.txt";
     char readline[300];
-    int log_file_path_name_length = DEVICE_DIRECTORY_NAME_MAX_LENGTH + 1 + sizeof(LOG_FILE_NAME); // +1 for slash, sizeof includes null terminator
-    char log_file_path[log_file_path_name_length];
+    char log_file_path[FATFS_PATH_MAX_LENGTH];
     char log_dir[DEVICE_DIRECTORY_NAME_MAX_LENGTH];
     char log_entry[LOG_ENTRY_MAX_LENGTH] = {0};
+    struct stat st;
 
     // Clear the log file directory if it exists
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
     snprintf(log_dir, sizeof(log_dir), "%s/%s", SD_CARD_BASE_PATH, serial_number);
     pv_delete_dir(log_dir);
 
-    // Call the function to update the backup log
+    // Call the function to update the backup log, and commit it whatever the durability mode
     TEST_ASSERT_EQUAL(ESP_OK, pv_update_backup_log(serial_number, file_path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
 
-    // Check if the log file was created and contains the expected data
-    snprintf(log_file_path, sizeof(log_file_path), "%s/%s/%s", SD_CARD_BASE_PATH, serial_number, LOG_FILE_NAME);
+    // Check if the first log segment was created and contains the expected data
+    snprintf(log_file_path, sizeof(log_file_path), "%s/%s/%s00000.%s", SD_CARD_BASE_PATH, serial_number,
+             LOG_SEGMENT_PREFIX, LOG_SEGMENT_EXT);
+    TEST_ASSERT_EQUAL(0, stat(log_file_path, &st));
+    TEST_ASSERT_EQUAL(PV_SEGLOG_SEGMENT_SIZE, st.st_size);
     FILE *log_file = fopen(log_file_path, "r");
     TEST_ASSERT_NOT_NULL(log_file); // Check if log file opened successfully
 
@@ -109,7 +129,7 @@ void test_log_checks(void) {
 
     
     // Clear the log file directory if it exists
-    
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
     snprintf(log_dir, sizeof(log_dir), "%s/%s", SD_CARD_BASE_PATH, serial_number);
     pv_delete_dir(log_dir);
 
@@ -120,6 +140,7 @@ void test_log_checks(void) {
     // Update the backup log with valid file paths
     TEST_ASSERT_EQUAL(ESP_OK, pv_update_backup_log(serial_number, file_path1_v));
     TEST_ASSERT_EQUAL(ESP_OK, pv_update_backup_log(serial_number, file_path2_v));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
 
     // Append an invalid file path to the log
     FILE *log_file = fopen(log_file_path, "a");
@@ -137,4 +158,795 @@ void test_log_checks(void) {
     // Check if a missing file path is recognized as not backed up
     TEST_ASSERT_FALSE(pv_is_backedUp(serial_number, file_path3_m));
 
-}
\ No newline at end of file
+}
+
+/***************************************************************************
+ * Function:    test_filePreallocWrite
+ * Purpose:     Writes a file through pv_file with a size hint larger than the
+ *              data written and checks that the preallocated tail is trimmed
+ *              and the content reads back correctly.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_filePreallocWrite(void) {
+    const char *test_file_path = TEST_DIR "/test_filePreallocWrite.bin";
+    const char *test_data = "Preallocated write test data.";
+    char readBuff[strlen(test_data) + 1]; // +1 for null terminator
+    pv_file_t file;
+    struct stat st = {0};
+    FILE *f = NULL;
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, test_file_path, 64 * 1024));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, test_data, strlen(test_data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    // The unused part of the preallocation must be released on close
+    TEST_ASSERT_EQUAL(0, stat(test_file_path, &st));
+    TEST_ASSERT_EQUAL(strlen(test_data), st.st_size);
+
+    f = fopen(test_file_path, "r");
+    TEST_ASSERT_NOT_NULL(f);
+    fgets(readBuff, sizeof(readBuff), f);
+    fclose(f);
+    TEST_ASSERT_EQUAL_STRING(test_data, readBuff);
+}
+
+/***************************************************************************
+ * Function:    test_fsFreeSpace
+ * Purpose:     Checks that the cached free space is available after mount and
+ *              that admission control rejects a file larger than the card.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_fsFreeSpace(void) {
+    pv_fs_space_t info;
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_fs_get_space(&info));
+    TEST_ASSERT_GREATER_THAN(0, info.cluster_size);
+    TEST_ASSERT_TRUE(pv_fs_has_room(1024));
+    TEST_ASSERT_FALSE(pv_fs_has_room(info.free_bytes + 1));
+}
+
+/***************************************************************************
+ * Function:    test_deleteDirTree
+ * Purpose:     Builds a small nested tree with files at every level, deletes
+ *              it with pv_delete_dir and checks that nothing is left.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_deleteDirTree(void) {
+    const char *root = TEST_DIR "/delete_tree";
+    char path[128];
+    struct stat st = {0};
+    FILE *f = NULL;
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    pv_delete_dir(root);
+
+    snprintf(path, sizeof(path), "%s", root);
+    for (int level = 0; level < 4; level++) {
+        TEST_ASSERT_EQUAL(0, mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO));
+        for (int i = 0; i < 3; i++) {
+            char file_path[160];
+            snprintf(file_path, sizeof(file_path), "%s/file_%d.txt", path, i);
+            f = fopen(file_path, "w");
+            TEST_ASSERT_NOT_NULL(f);
+            fprintf(f, "%d", i);
+            fclose(f);
+        }
+        strncat(path, "/sub", sizeof(path) - strlen(path) - 1);
+    }
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(root));
+    TEST_ASSERT_NOT_EQUAL(0, stat(root, &st));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_delete_dir(root));
+}
+
+/***************************************************************************
+ * Function:    test_aioWriteRead
+ * Purpose:     Queues a directory, an open and several small writes without
+ *              waiting (so the I/O task can merge them), then reads the file
+ *              back through the service and checks the content.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_aioWriteRead(void) {
+    const char *parts[] = {"async ", "merged ", "writes"};
+    const char *expected = "async merged writes";
+    char readBuff[32] = {0};
+    pv_aio_req_t open_req = {0};
+    pv_aio_req_t write_reqs[3] = {0};
+    pv_aio_req_t req = {0};
+
+    req.op = PV_AIO_OP_MKDIR;
+    snprintf(req.path, sizeof(req.path), "%s", TEST_DIR "/aio/nested");
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    open_req.op = PV_AIO_OP_OPEN_WRITE;
+    snprintf(open_req.path, sizeof(open_req.path), "%s", TEST_DIR "/aio/nested/test_aio.txt");
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&open_req));
+
+    for (int i = 0; i < 3; i++) {
+        write_reqs[i].op = PV_AIO_OP_WRITE;
+        write_reqs[i].handle = open_req.handle;
+        write_reqs[i].buf = (void *)parts[i];
+        write_reqs[i].len = strlen(parts[i]);
+        TEST_ASSERT_EQUAL(ESP_OK, (i < 2) ? pv_aio_submit(&write_reqs[i]) : pv_aio_submit_wait(&write_reqs[i]));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, write_reqs[0].err);
+    TEST_ASSERT_EQUAL(ESP_OK, write_reqs[1].err);
+
+    req.op = PV_AIO_OP_CLOSE;
+    req.handle = open_req.handle;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    open_req.op = PV_AIO_OP_OPEN_READ;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&open_req));
+
+    req.op = PV_AIO_OP_READ;
+    req.handle = open_req.handle;
+    req.offset = PV_AIO_OFFSET_CURRENT;
+    req.buf = readBuff;
+    req.len = sizeof(readBuff) - 1;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+    TEST_ASSERT_EQUAL(strlen(expected), req.result);
+    TEST_ASSERT_EQUAL_STRING(expected, readBuff);
+
+    req.op = PV_AIO_OP_CLOSE;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+}
+
+/***************************************************************************
+ * Function:    test_aioDeleteDirOpenFile
+ * Purpose:     Checks that a directory delete through the service is refused
+ *              while a file in it is open, and runs once the file is closed
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_aioDeleteDirOpenFile(void) {
+    pv_aio_req_t open_req = {0};
+    pv_aio_req_t req = {0};
+
+    req.op = PV_AIO_OP_MKDIR;
+    snprintf(req.path, sizeof(req.path), "%s", TEST_DIR "/aio_del/sub");
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    open_req.op = PV_AIO_OP_OPEN_WRITE;
+    snprintf(open_req.path, sizeof(open_req.path), "%s", TEST_DIR "/aio_del/sub/open.txt");
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&open_req));
+
+    req.op = PV_AIO_OP_DELETE_DIR;
+    snprintf(req.path, sizeof(req.path), "%s", TEST_DIR "/AIO_DEL");
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, pv_aio_submit_wait(&req));
+
+    req.op = PV_AIO_OP_CLOSE;
+    req.handle = open_req.handle;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    req.op = PV_AIO_OP_DELETE_DIR;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_aio_submit_wait(&req));
+}
+
+/***************************************************************************
+ * Function:    test_logBufferedEntries
+ * Purpose:     Checks that log entries waiting for a durability sync are
+ *              already reported as backed up, and reach the card on a flush
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_logBufferedEntries(void) {
+    char log_file_path[FATFS_PATH_MAX_LENGTH];
+    char log_dir[DEVICE_DIRECTORY_NAME_MAX_LENGTH];
+    char readline[LOG_ENTRY_MAX_LENGTH] = {0};
+    char *serial_number = "DURABLE1";
+    char *file_path = "/path/to/buffered.jpg";
+    FILE *log_file = NULL;
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
+    snprintf(log_dir, sizeof(log_dir), "%s/%s", SD_CARD_BASE_PATH, serial_number);
+    pv_delete_dir(log_dir);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_update_backup_log(serial_number, file_path));
+    TEST_ASSERT_TRUE(pv_is_backedUp(serial_number, file_path));
+
+    // Whatever the mode, a flush leaves the entry on the card
+    TEST_ASSERT_EQUAL(ESP_OK, pv_backup_log_flush());
+    snprintf(log_file_path, sizeof(log_file_path), "%s/%s00000.%s", log_dir, LOG_SEGMENT_PREFIX, LOG_SEGMENT_EXT);
+    log_file = fopen(log_file_path, "r");
+    TEST_ASSERT_NOT_NULL(log_file);
+    fgets(readline, sizeof(readline), log_file);
+    fclose(log_file);
+    TEST_ASSERT_EQUAL_STRING("\"/path/to/buffered.jpg\",1\n", readline);
+    TEST_ASSERT_TRUE(pv_is_backedUp(serial_number, file_path));
+
+    pv_delete_dir(log_dir);
+}
+
+/***************************************************************************
+ * Function:    test_dirCache
+ * Purpose:     Checks that created directories and their parents are cached,
+ *              case insensitively, and that deleting a tree clears the cache
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_dirCache(void) {
+    pv_aio_req_t req = {0};
+    struct stat st = {0};
+
+    pv_delete_dir(TEST_DIR "/dircache");
+    TEST_ASSERT_FALSE(pv_dircache_contains(TEST_DIR "/dircache/a/b"));
+
+    req.op = PV_AIO_OP_MKDIR;
+    snprintf(req.path, sizeof(req.path), "%s", TEST_DIR "/dircache/a/b");
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+    TEST_ASSERT_EQUAL(0, stat(TEST_DIR "/dircache/a/b", &st));
+
+    TEST_ASSERT_TRUE(pv_dircache_contains(TEST_DIR "/dircache/a/b"));
+    TEST_ASSERT_TRUE(pv_dircache_contains(TEST_DIR "/dircache/a/"));
+    TEST_ASSERT_TRUE(pv_dircache_contains(TEST_DIR "/DIRCACHE/A"));
+    TEST_ASSERT_FALSE(pv_dircache_contains(TEST_DIR "/dircache/c"));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(TEST_DIR "/dircache"));
+    TEST_ASSERT_FALSE(pv_dircache_contains(TEST_DIR "/dircache/a/b"));
+}
+
+/***************************************************************************
+ * Function:    test_layoutPaths
+ * Purpose:     Checks the mapping from phone paths to paths on the card for
+ *              the configured layout
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_layoutPaths(void) {
+    const char *logical = "/DCIM/Camera/IMG_20240101_123456.jpg";
+    char path[FATFS_PATH_MAX_LENGTH];
+    char again[FATFS_PATH_MAX_LENGTH];
+    char small[16];
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_layout_get_path(logical, strlen(logical), path, sizeof(path)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_layout_get_path(logical, strlen(logical), again, sizeof(again)));
+    TEST_ASSERT_EQUAL_STRING(path, again);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, pv_layout_get_path(logical, strlen(logical), small, sizeof(small)));
+
+    if (pv_layout_is_sharded()) {
+        // objects/<shard dirs>/<16 hex digits>.jpg, different files get different names
+        TEST_ASSERT_EQUAL(0, strncmp(path, PV_LAYOUT_OBJECTS_DIR "/", strlen(PV_LAYOUT_OBJECTS_DIR "/")));
+        TEST_ASSERT_EQUAL_STRING(".jpg", strrchr(path, '.'));
+        TEST_ASSERT_EQUAL(16 + strlen(".jpg"), strlen(strrchr(path, '/') + 1));
+        TEST_ASSERT_EQUAL(ESP_OK, pv_layout_get_path("/DCIM/Camera/IMG_2.jpg", strlen("/DCIM/Camera/IMG_2.jpg"), again, sizeof(again)));
+        TEST_ASSERT_NOT_EQUAL(0, strcmp(path, again));
+    }
+    else {
+        TEST_ASSERT_EQUAL_STRING(SD_CARD_MOUNT_POINT "/DCIM/Camera/IMG_20240101_123456.jpg", path);
+    }
+}
+
+/***************************************************************************
+ * Function:    test_bulkCreateShortNames
+ * Purpose:     Creates a batch of camera style names and of hash-derived
+ *              8.3 names, checking that the short names are valid, upper
+ *              case 8.3 names and that every file could be created
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_bulkCreateShortNames(void) {
+    const char *logical = "/DCIM/Camera/IMG_20240101_123456.jpeg";
+    char name[PV_LAYOUT_SHORT_NAME_SIZE];
+    pv_bench_create_result_t result = {0};
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_layout_get_short_name(logical, strlen(logical), name, sizeof(name)));
+    TEST_ASSERT_EQUAL(PV_LAYOUT_SHORT_NAME_CHARS + 4, strlen(name));
+    TEST_ASSERT_EQUAL_STRING(".JPE", strchr(name, '.'));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_bench_bulk_create(TEST_DIR "/bulk", 200, false, &result));
+    TEST_ASSERT_EQUAL(200, result.files);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_bench_bulk_create(TEST_DIR "/bulk", 200, true, &result));
+    TEST_ASSERT_EQUAL(200, result.files);
+}
+
+/***************************************************************************
+ * Function:    test_createKeepsExisting
+ * Purpose:     Checks that pv_file_create() never truncates an existing
+ *              file (a hashed 8.3 name another photo may own) and creates
+ *              the new one at its alternative path instead, unless it has
+ *              the size of the new file (a resend of the same photo)
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_createKeepsExisting(void) {
+    const char *dir = TEST_DIR "/collide";
+    const char *path = TEST_DIR "/collide/0123ABCD.JPG";
+    const char *alt_path = TEST_DIR "/collide/IMG_20240101_123456.jpg";
+    char buf[16] = {0};
+    size_t read_len = 0;
+    bool used_alt = false;
+    pv_aio_req_t req = {0};
+    pv_file_t file;
+
+    req.op = PV_AIO_OP_MKDIR;
+    snprintf(req.path, sizeof(req.path), "%s", dir);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_create(&file, path, alt_path, 0, &used_alt));
+    TEST_ASSERT_FALSE(used_alt);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, "first", 5));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, pv_file_create(&file, path, NULL, 0, &used_alt));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_create(&file, path, alt_path, 0, &used_alt));
+    TEST_ASSERT_TRUE(used_alt);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, "second", 6));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_read(&file, path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_read(&file, buf, sizeof(buf) - 1, &read_len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    TEST_ASSERT_EQUAL_STRING("first", buf);
+
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_read(&file, alt_path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_read(&file, buf, sizeof(buf) - 1, &read_len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    TEST_ASSERT_EQUAL_STRING("second", buf);
+
+    // Same size as the file at path: the same photo again, it takes its own name back
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_create(&file, path, alt_path, 5, &used_alt));
+    TEST_ASSERT_FALSE(used_alt);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, "again", 5));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_read(&file, path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_read(&file, buf, sizeof(buf) - 1, &read_len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    TEST_ASSERT_EQUAL_STRING("again", buf);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(dir));
+}
+
+/***************************************************************************
+ * Function:    test_dentryCache
+ * Purpose:     Checks that the dentry cache follows a file written through
+ *              pv_file (its size) and a delete through
+ *              pv_delete_dir, and that repeated lookups are served from RAM
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_dentryCache(void) {
+    const char *dir = TEST_DIR "/dentry";
+    const char *path = TEST_DIR "/dentry/cached.bin";
+    const char *data = "dentry cache";
+    pv_aio_req_t req = {0};
+    pv_file_t file;
+    pv_dentry_t dentry = {0};
+    uint32_t hits = 0, misses = 0, hits_before = 0;
+
+    req.op = PV_AIO_OP_MKDIR;
+    snprintf(req.path, sizeof(req.path), "%s", dir);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_aio_submit_wait(&req));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, 0));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, data, strlen(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    pv_dentry_get_stats(&hits_before, &misses);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_dentry_stat(path, &dentry));
+    TEST_ASSERT_EQUAL(strlen(data), dentry.size);
+    TEST_ASSERT_TRUE(pv_dentry_exists(dir));
+    TEST_ASSERT_TRUE(pv_dentry_exists(dir));
+    pv_dentry_get_stats(&hits, &misses);
+    TEST_ASSERT_GREATER_OR_EQUAL(hits_before + 2, hits);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(dir));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_dentry_stat(path, NULL));
+    TEST_ASSERT_FALSE(pv_dentry_exists(dir));
+}
+
+/***************************************************************************
+ * Function:    test_packPutGetDelete
+ * Purpose:     Stores a small object in the pack store, replaces it, reads
+ *              it back and deletes it. Skipped when the pack store is off.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_packPutGetDelete(void) {
+    const char *name = "/DCIM/Screenshots/pack_test.png";
+    const char *data = "packed object";
+    const char *data2 = "packed object, second version";
+    char buf[64] = {0};
+    uint32_t len = 0;
+    pv_pack_stats_t before, after;
+
+    if (!pv_pack_accepts(strlen(data2))) {
+        TEST_IGNORE_MESSAGE("Pack store disabled");
+    }
+
+    pv_pack_get_stats(&before);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_pack_put(name, data, strlen(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_pack_put(name, data2, strlen(data2)));
+    TEST_ASSERT_TRUE(pv_pack_contains(name, &len));
+    TEST_ASSERT_EQUAL(strlen(data2), len);
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, pv_pack_get(name, buf, 4, &len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_pack_get(name, buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL_MEMORY(data2, buf, strlen(data2));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_pack_delete(name));
+    TEST_ASSERT_FALSE(pv_pack_contains(name, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_pack_get(name, buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_pack_delete(name));
+
+    // Both versions and the tombstone are now dead space for the repacker
+    pv_pack_get_stats(&after);
+    TEST_ASSERT_EQUAL(before.objects, after.objects);
+    TEST_ASSERT_GREATER_THAN(before.dead_bytes, after.dead_bytes);
+}
+
+/***************************************************************************
+ * Function:    test_segLogLines
+ * Purpose:     Counts the lines of a log and keeps the last one. Line
+ *              callback for test_segLogAppend.
+ * Parameters:  line - A line of the log
+ *              ctx - Array of an int count and a char[8] for the last line
+ * Returns:     false to read every line
+ ***************************************************************************/
+static bool test_segLogLines(const char *line, void *ctx) {
+    struct { int count; char last[8]; } *lines = ctx;
+
+    lines->count++;
+    snprintf(lines->last, sizeof(lines->last), "%s", line);
+    return false;
+}
+
+/***************************************************************************
+ * Function:    test_segLogAppend
+ * Purpose:     Appends to a segment log across reopens, including a line
+ *              left without its newline, and checks the lines read back and
+ *              that the segment size never changes
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_segLogAppend(void) {
+    const char *dir = TEST_DIR "/seglog";
+    char path[FATFS_PATH_MAX_LENGTH];
+    struct { int count; char last[8]; } lines = {0};
+    pv_seglog_t log;
+    struct stat st;
+
+    pv_delete_dir(dir);
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    TEST_ASSERT_EQUAL(0, mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, pv_seglog_for_each_line(dir, "TST", "LOG", test_segLogLines, &lines));
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_open(&log, dir, "TST", "LOG"));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_append(&log, "a\n", 2));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_append(&log, "b\n", 2));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_append(&log, "c", 1)); // As if cut off by a power loss
+    pv_seglog_close(&log);
+
+    // Reopening finds the end marker and terminates the cut off line
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_open(&log, dir, "TST", "LOG"));
+    TEST_ASSERT_EQUAL(6, log.end);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_append(&log, "d\n", 2));
+    pv_seglog_close(&log);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_for_each_line(dir, "TST", "LOG", test_segLogLines, &lines));
+    TEST_ASSERT_EQUAL(4, lines.count);
+    TEST_ASSERT_EQUAL_STRING("d\n", lines.last);
+
+    snprintf(path, sizeof(path), "%s/TST00000.LOG", dir);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(PV_SEGLOG_SEGMENT_SIZE, st.st_size);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(dir));
+}
+
+typedef struct {
+    pv_seglog_t log;
+    volatile bool deleting;                 // Set by the test while pv_delete_dir() runs
+    volatile bool stop;
+    uint32_t refused;                       // Appends refused while the tree was being deleted
+    uint32_t written;                       // Appends that went through while it was
+    TaskHandle_t waiter;
+} test_seglog_fence_t;
+
+/***************************************************************************
+ * Function:    test_segLogAppender
+ * Purpose:     Keeps appending to a log until told to stop, counting how the
+ *              appends made during the delete ended
+ * Parameters:  arg - The test_seglog_fence_t of the test
+ * Returns:     None
+ ***************************************************************************/
+static void test_segLogAppender(void *arg) {
+    test_seglog_fence_t *run = arg;
+
+    while (!run->stop) {
+        bool deleting = run->deleting;
+        esp_err_t err = pv_seglog_append(&run->log, "x\n", 2);
+
+        if (deleting && run->deleting) {
+            if (err == ESP_ERR_INVALID_STATE) {
+                run->refused++;
+            } else if (err == ESP_OK) {
+                run->written++;
+            }
+        }
+        vTaskDelay(1);
+    }
+    xTaskNotifyGive(run->waiter);
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************
+ * Function:    test_segLogAppendDuringDelete
+ * Purpose:     Appends to a segment log from a second task while its folder
+ *              is deleted, and checks that every append made during the
+ *              delete is refused and that the folder does not come back
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_segLogAppendDuringDelete(void) {
+    const char *dir = TEST_DIR "/seglog_del";
+    char path[FATFS_PATH_MAX_LENGTH];
+    static test_seglog_fence_t run;
+    struct stat st = {0};
+    FILE *f = NULL;
+
+    memset(&run, 0, sizeof(run));
+    run.waiter = xTaskGetCurrentTaskHandle();
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    pv_delete_dir(dir);
+    TEST_ASSERT_EQUAL(0, mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO));
+
+    // Enough files for the walk to yield a few times
+    for (uint32_t i = 0; i < 4 * FS_DELETE_YIELD_BATCH; i++) {
+        snprintf(path, sizeof(path), "%s/F%03u.TXT", dir, (unsigned)i);
+        f = fopen(path, "w");
+        TEST_ASSERT_NOT_NULL(f);
+        fclose(f);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_open(&run.log, dir, "TST", "LOG"));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_seglog_append(&run.log, "a\n", 2));
+
+    // Same core, so the appender only runs while the walk yields
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(test_segLogAppender, "seglog_app", 4096, &run,
+                                                      uxTaskPriorityGet(NULL), NULL, xPortGetCoreID()));
+    vTaskDelay(pdMS_TO_TICKS(20));
+
+    run.deleting = true;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_delete_dir(dir));
+    run.deleting = false;
+    TEST_ASSERT_FALSE(pv_fs_is_being_deleted(dir));
+
+    run.stop = true;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    pv_seglog_close(&run.log);
+
+    TEST_ASSERT_GREATER_THAN(0, run.refused);
+    TEST_ASSERT_EQUAL(0, run.written);
+    TEST_ASSERT_NOT_EQUAL(0, stat(dir, &st));
+}
+
+/***************************************************************************
+ * Function:    test_diskioCounters
+ * Purpose:     Writes a file and checks that the diskio driver counted its
+ *              data sectors and the metadata written for it
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_diskioCounters(void) {
+    const char *path = TEST_DIR "/diskio.bin";
+    static uint8_t data[4096];
+    pv_diskio_stats_t before, after;
+    pv_file_t file;
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    memset(data, 0xA5, sizeof(data));
+    pv_diskio_get_stats(&before);
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, data, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    pv_diskio_get_stats(&after);
+    TEST_ASSERT_GREATER_OR_EQUAL(before.sectors_written[PV_DISKIO_DATA] + sizeof(data) / 512,
+                                 after.sectors_written[PV_DISKIO_DATA]);
+    TEST_ASSERT_GREATER_THAN(before.sectors_written[PV_DISKIO_DIR], after.sectors_written[PV_DISKIO_DIR]);
+    TEST_ASSERT_GREATER_THAN(before.sectors_written[PV_DISKIO_FAT], after.sectors_written[PV_DISKIO_FAT]);
+    TEST_ASSERT_GREATER_THAN(before.writes, after.writes);
+    TEST_ASSERT_EQUAL(0, after.errors - before.errors);
+
+    unlink(path);
+}
+
+/***************************************************************************
+ * Function:    test_diskioTrace
+ * Purpose:     Traces a file write and checks the trace file holds its data
+ *              sectors. Skipped when the recorder is not built in.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_diskioTrace(void) {
+    const char *path = TEST_DIR "/trace.bin";
+    static uint8_t data[4096];
+    pv_trace_hdr_t hdr;
+    pv_trace_rec_t rec;
+    uint32_t data_sectors = 0;
+    pv_file_t file;
+    FILE *f = NULL;
+
+    if (pv_diskio_trace_stop() == ESP_ERR_NOT_SUPPORTED) {
+        TEST_IGNORE_MESSAGE("Diskio trace disabled");
+    }
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    memset(data, 0x5A, sizeof(data));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_diskio_trace_start());
+    vTaskDelay(pdMS_TO_TICKS(100)); // The trace task creates the file
+
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, data, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_diskio_trace_stop());
+
+    f = fopen(PV_DISKIO_TRACE_PATH, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(1, fread(&hdr, sizeof(hdr), 1, f));
+    TEST_ASSERT_EQUAL_HEX32(PV_TRACE_MAGIC, hdr.magic);
+    TEST_ASSERT_EQUAL(PV_TRACE_VERSION, hdr.version);
+    TEST_ASSERT_EQUAL(sizeof(pv_trace_rec_t), hdr.rec_size);
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.op == PV_TRACE_OP_WRITE && rec.info == PV_TRACE_CLASS_DATA && rec.result == 0) {
+            data_sectors += rec.count;
+        }
+    }
+    fclose(f);
+    TEST_ASSERT_GREATER_OR_EQUAL(sizeof(data) / hdr.sector_size, data_sectors);
+
+    unlink(path);
+    pv_diskio_trace_start(); // Keep tracing like after mount
+}
+
+/***************************************************************************
+ * Function:    test_trimFreedClusters
+ * Purpose:     Deletes a file and checks its clusters were handed to the
+ *              discard queue and discarded on flush. Skipped when discard is
+ *              off for this card.
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_trimFreedClusters(void) {
+    const char *path = TEST_DIR "/trim.bin";
+    static uint8_t data[16 * 1024];
+    pv_trim_stats_t before, after;
+    pv_file_t file;
+
+    if (pv_trim_get_mode() == PV_TRIM_OFF) {
+        TEST_IGNORE_MESSAGE("Discard off for this card");
+    }
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    memset(data, 0x3C, sizeof(data));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, data, sizeof(data)));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    pv_trim_get_stats(&before);
+    TEST_ASSERT_EQUAL(0, unlink(path));
+    pv_trim_flush();
+    pv_trim_get_stats(&after);
+
+    TEST_ASSERT_GREATER_THAN(before.ranges, after.ranges);
+    TEST_ASSERT_EQUAL(0, after.failed - before.failed);
+    TEST_ASSERT_GREATER_OR_EQUAL(before.sectors + sizeof(data) / 512, after.sectors);
+}
+
+/***************************************************************************
+ * Function:    test_preEraseLargeFile
+ * Purpose:     Writes a preallocated file with pre-erase forced on and checks
+ *              its run was erased before the data landed intact
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_preEraseLargeFile(void) {
+    const char *path = TEST_DIR "/preerase.bin";
+    const uint64_t size = PV_DISKIO_PRE_ERASE_MIN_SIZE;
+    static uint8_t chunk[4096];
+    bool was_enabled = pv_diskio_pre_erase_enabled();
+    bool contiguous = false;
+    pv_diskio_stats_t before, after;
+    pv_file_t file;
+    size_t read_len = 0;
+    esp_err_t err = ESP_OK;
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    memset(chunk, 0xC3, sizeof(chunk));
+    pv_diskio_get_stats(&before);
+
+    pv_diskio_set_pre_erase(true);
+    err = pv_file_open_write(&file, path, size);
+    pv_diskio_set_pre_erase(was_enabled);
+    TEST_ASSERT_EQUAL(ESP_OK, err);
+    contiguous = file.is_contiguous; // Only contiguous preallocations are pre-erased
+    for (uint64_t done = 0; done < size; done += sizeof(chunk)) {
+        TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, chunk, sizeof(chunk)));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+
+    pv_diskio_get_stats(&after);
+    if (contiguous) {
+        TEST_ASSERT_EQUAL(before.pre_erases + 1, after.pre_erases);
+        TEST_ASSERT_GREATER_OR_EQUAL(before.pre_erase_sectors + size / 512, after.pre_erase_sectors);
+    }
+
+    // The last chunk must read back, not erased
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_read(&file, path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_seek(&file, size - sizeof(chunk)));
+    memset(chunk, 0, sizeof(chunk));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_read(&file, chunk, sizeof(chunk), &read_len));
+    TEST_ASSERT_EQUAL(sizeof(chunk), read_len);
+    TEST_ASSERT_EACH_EQUAL_UINT8(0xC3, chunk, sizeof(chunk));
+    pv_file_close(&file);
+
+    unlink(path);
+}
+
+/***************************************************************************
+ * Function:    test_dmaBuffers
+ * Purpose:     Checks pv_dma buffers are aligned and DMA capable, and that a
+ *              write from one does not bounce while one from an odd address
+ *              is counted and still lands intact
+ * Parameters:  None
+ * Returns:     None
+ ***************************************************************************/
+void test_dmaBuffers(void) {
+    const char *path = TEST_DIR "/dma.bin";
+    const size_t len = 4096;
+    pv_diskio_stats_t before, after;
+    pv_file_t file;
+    size_t read_len = 0;
+    uint8_t *buf = pv_dma_alloc(len + PV_DMA_BLOCK_SIZE);
+    uint8_t *again = NULL;
+
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)buf % PV_DMA_BLOCK_SIZE);
+    TEST_ASSERT_TRUE(pv_dma_capable(buf));
+    TEST_ASSERT_FALSE(pv_dma_capable(buf + 1));
+
+    mkdir(TEST_DIR, S_IRWXU | S_IRWXG | S_IRWXO);
+    memset(buf, 0x6B, len + 1);
+
+    // Whole sectors at offset 0 go to the driver straight from the caller's buffer,
+    // only FatFs' own sector buffers could still bounce
+    pv_diskio_get_stats(&before);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, buf, len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    pv_diskio_get_stats(&after);
+    TEST_ASSERT_LESS_THAN(len / 512, after.bounce_sectors - before.bounce_sectors);
+
+    before = after;
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_write(&file, path, len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_write(&file, buf + 1, len));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_close(&file));
+    pv_diskio_get_stats(&after);
+    TEST_ASSERT_GREATER_THAN(before.bounce_writes, after.bounce_writes);
+    TEST_ASSERT_GREATER_OR_EQUAL(before.bounce_sectors + len / 512, after.bounce_sectors);
+
+    memset(buf, 0, len);
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_open_read(&file, path));
+    TEST_ASSERT_EQUAL(ESP_OK, pv_file_read(&file, buf, len, &read_len));
+    pv_file_close(&file);
+    TEST_ASSERT_EQUAL(len, read_len);
+    TEST_ASSERT_EACH_EQUAL_UINT8(0x6B, buf, len);
+
+    // Freed blocks are handed out again
+    pv_dma_free(buf);
+    again = pv_dma_alloc(len + PV_DMA_BLOCK_SIZE);
+    TEST_ASSERT_EQUAL_PTR(buf, again);
+    pv_dma_free(again);
+
+    unlink(path);
+}
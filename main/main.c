@@ -41,6 +41,6 @@ void app_main(void)
     // Run SD card tests
     pv_test_sdc();
 
-    // Run transfer control tests (Transfer control requiers bluetooth handle to send over bluetooth can no longer be run without first connecting to bluetooth)
-    // start_transfer_control_tests();
+    // Run transfer control tests (the ones sending over bluetooth need a phone and are not run here)
+    start_transfer_control_tests();
 }
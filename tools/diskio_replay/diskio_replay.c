@@ -0,0 +1,457 @@
+/*
+    Replays a diskio trace recorded with CONFIG_PV_DISKIO_TRACE against a disk
+    image file and estimates how long an SD card described by a latency model
+    would take for it. See README.md.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pv_trace_format.h"
+
+
+/* FatFs control codes (diskio.h) */
+#define CTRL_SYNC           0
+#define CTRL_TRIM           4
+
+#define OP_COUNT            4               // Indexed by pv_trace_op_t
+#define CLASS_COUNT         3               // Indexed by pv_trace_class_t
+#define MAX_XFER_SECTORS    1024U           // Larger transfers are split
+#define IMAGE_PATTERN       0xA5U
+
+typedef struct {
+    const char *name;
+    double read_us;                         // Per read command
+    double read_us_per_sector;
+    double write_us;                        // Per write command
+    double write_us_per_sector;
+    double seek_write_us;                   // Extra when a write does not follow the previous one
+    double meta_write_us;                   // Extra for a FAT or directory write (read-modify-write inside the card)
+    double sync_us;
+    double trim_us;                         // Per trim command
+    double trim_us_per_mb;
+    double gc_every_mb;                     // Written MB between garbage collection stalls, 0 for none
+    double gc_stall_us;
+} model_t;
+
+/* Rough figures for the cards we ship, calibrate them from the STATS command histograms */
+static const model_t s_presets[] = {
+    { "class10", 300, 22, 900, 45, 2500, 1500, 0, 1500, 400, 4, 60000 },
+    { "a1",      180, 12, 500, 25, 1200,  800, 0,  800, 200, 8, 30000 },
+    { "ideal",     0,  0,   0,  0,    0,    0, 0,    0,   0, 0,     0 },
+};
+
+typedef struct {
+    uint64_t ops[OP_COUNT];
+    uint64_t sectors[OP_COUNT][CLASS_COUNT];
+    uint64_t failed;                        // Records of calls that failed on the card, not replayed
+    double recorded_us[OP_COUNT];           // Sum of the recorded durations
+    double model_us[OP_COUNT];              // Sum of the modeled durations
+    double gap_us;                          // Time between the calls
+    double host_us;                         // Time the image I/O took
+    uint64_t gc_stalls;
+} totals_t;
+
+static const char *s_op_names[OP_COUNT] = { "", "read", "write", "ioctl" };
+static const char *s_class_names[CLASS_COUNT] = { "data", "fat", "dir" };
+
+
+/***************************************************************************
+ * Function:    usage
+ * Purpose:     Prints the command line help
+ * Parameters:  prog - Program name
+ * Returns:     None
+ ***************************************************************************/
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] TRACE IMAGE\n"
+            "  -m PRESET     latency model: class10 (default), a1, ideal\n"
+            "  -o KEY=VALUE  override a model parameter, see README.md\n"
+            "  -r            real time: keep the recorded gaps and sleep the modeled latency\n"
+            "  -n            do not touch the image, only evaluate the model\n"
+            "  -f            fdatasync the image on CTRL_SYNC\n"
+            "  -v            print every record\n",
+            prog);
+}
+
+/***************************************************************************
+ * Function:    now_us
+ * Purpose:     Monotonic time
+ * Parameters:  None
+ * Returns:     Microseconds
+ ***************************************************************************/
+static double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/***************************************************************************
+ * Function:    sleep_us
+ * Purpose:     Sleeps for a fractional number of microseconds
+ * Parameters:  us - Time to sleep, nothing if not positive
+ * Returns:     None
+ ***************************************************************************/
+static void sleep_us(double us) {
+    struct timespec ts;
+
+    if (us <= 0) {
+        return;
+    }
+    ts.tv_sec = (time_t)(us / 1e6);
+    ts.tv_nsec = (long)((us - (double)ts.tv_sec * 1e6) * 1e3);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/***************************************************************************
+ * Function:    model_set
+ * Purpose:     Sets one model parameter from a KEY=VALUE string
+ * Parameters:  model - Model to change
+ *              arg - KEY=VALUE
+ * Returns:     true if the key exists and the value is a number
+ ***************************************************************************/
+static bool model_set(model_t *model, const char *arg) {
+    static const struct {
+        const char *key;
+        size_t offset;
+    } keys[] = {
+        { "read_us", offsetof(model_t, read_us) },
+        { "read_us_per_sector", offsetof(model_t, read_us_per_sector) },
+        { "write_us", offsetof(model_t, write_us) },
+        { "write_us_per_sector", offsetof(model_t, write_us_per_sector) },
+        { "seek_write_us", offsetof(model_t, seek_write_us) },
+        { "meta_write_us", offsetof(model_t, meta_write_us) },
+        { "sync_us", offsetof(model_t, sync_us) },
+        { "trim_us", offsetof(model_t, trim_us) },
+        { "trim_us_per_mb", offsetof(model_t, trim_us_per_mb) },
+        { "gc_every_mb", offsetof(model_t, gc_every_mb) },
+        { "gc_stall_us", offsetof(model_t, gc_stall_us) },
+    };
+    const char *eq = strchr(arg, '=');
+    char *end = NULL;
+    double value = 0;
+
+    if (eq == NULL) {
+        return false;
+    }
+    value = strtod(eq + 1, &end);
+    if (end == eq + 1 || *end != '\0' || value < 0) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (strlen(keys[i].key) == (size_t)(eq - arg) && strncmp(keys[i].key, arg, (size_t)(eq - arg)) == 0) {
+            *(double *)((char *)model + keys[i].offset) = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/***************************************************************************
+ * Function:    model_latency
+ * Purpose:     Time the modeled card takes for one record
+ * Parameters:  model - Latency model
+ *              rec - The record
+ *              sector_size - Bytes per sector
+ *              next_write - Sector following the previous write, updated
+ *              gc_bytes - Bytes written since the last stall, updated
+ *              gc_stalls - Incremented on a garbage collection stall
+ * Returns:     Microseconds
+ ***************************************************************************/
+static double model_latency(const model_t *model, const pv_trace_rec_t *rec, uint32_t sector_size,
+                            uint64_t *next_write, double *gc_bytes, uint64_t *gc_stalls) {
+    double us = 0;
+
+    switch (rec->op) {
+        case PV_TRACE_OP_READ:
+            return model->read_us + model->read_us_per_sector * rec->count;
+
+        case PV_TRACE_OP_WRITE:
+            us = model->write_us + model->write_us_per_sector * rec->count;
+            if (rec->sector != *next_write) {
+                us += model->seek_write_us;
+            }
+            if (rec->info != PV_TRACE_CLASS_DATA) {
+                us += model->meta_write_us;
+            }
+            *next_write = (uint64_t)rec->sector + rec->count;
+            *gc_bytes += (double)rec->count * sector_size;
+            if (model->gc_every_mb > 0 && *gc_bytes >= model->gc_every_mb * 1024 * 1024) {
+                *gc_bytes = 0;
+                (*gc_stalls)++;
+                us += model->gc_stall_us;
+            }
+            return us;
+
+        case PV_TRACE_OP_IOCTL:
+            if (rec->info == CTRL_SYNC) {
+                return model->sync_us;
+            }
+            if (rec->info == CTRL_TRIM) {
+                return model->trim_us + model->trim_us_per_mb * ((double)rec->count * sector_size / (1024 * 1024));
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+/***************************************************************************
+ * Function:    image_apply
+ * Purpose:     Performs a record on the image: reads and writes the sectors,
+ *              punches a hole for a trim and optionally syncs
+ * Parameters:  fd - Image file
+ *              rec - The record
+ *              sector_size - Bytes per sector
+ *              buf - Buffer of MAX_XFER_SECTORS sectors
+ *              sync - fdatasync on CTRL_SYNC
+ * Returns:     true on success
+ ***************************************************************************/
+static bool image_apply(int fd, const pv_trace_rec_t *rec, uint32_t sector_size, uint8_t *buf, bool sync) {
+    uint64_t sector = rec->sector;
+    uint32_t left = rec->count;
+
+    if (rec->op == PV_TRACE_OP_IOCTL) {
+        if (rec->info == CTRL_SYNC && sync) {
+            return fdatasync(fd) == 0;
+        }
+        if (rec->info == CTRL_TRIM && rec->count > 0) {
+            // Not every filesystem can punch holes, the trim is only modeled then
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(sector * sector_size),
+                      (off_t)((uint64_t)rec->count * sector_size));
+        }
+        return true;
+    }
+
+    while (left > 0) {
+        uint32_t n = (left < MAX_XFER_SECTORS) ? left : MAX_XFER_SECTORS;
+        size_t len = (size_t)n * sector_size;
+        off_t off = (off_t)(sector * sector_size);
+        ssize_t done = (rec->op == PV_TRACE_OP_READ) ? pread(fd, buf, len, off) : pwrite(fd, buf, len, off);
+        if (done != (ssize_t)len) {
+            return false;
+        }
+        sector += n;
+        left -= n;
+    }
+    return true;
+}
+
+/***************************************************************************
+ * Function:    print_totals
+ * Purpose:     Prints the replay summary
+ * Parameters:  t - Totals
+ *              model - Latency model used
+ *              sector_size - Bytes per sector
+ * Returns:     None
+ ***************************************************************************/
+static void print_totals(const totals_t *t, const model_t *model, uint32_t sector_size) {
+    double recorded = 0;
+    double modeled = 0;
+    double bytes_written = 0;
+
+    printf("model %s\n", model->name);
+    printf("%-6s %10s %12s %12s %12s %14s %14s\n", "op", "calls", "data", "fat", "dir", "recorded ms", "modeled ms");
+    for (int op = PV_TRACE_OP_READ; op < OP_COUNT; op++) {
+        printf("%-6s %10llu", s_op_names[op], (unsigned long long)t->ops[op]);
+        for (int cls = 0; cls < CLASS_COUNT; cls++) {
+            printf(" %12llu", (unsigned long long)t->sectors[op][cls]);
+        }
+        printf(" %14.1f %14.1f\n", t->recorded_us[op] / 1e3, t->model_us[op] / 1e3);
+        recorded += t->recorded_us[op];
+        modeled += t->model_us[op];
+    }
+    for (int cls = 0; cls < CLASS_COUNT; cls++) {
+        bytes_written += (double)t->sectors[PV_TRACE_OP_WRITE][cls] * sector_size;
+    }
+
+    printf("sectors above are per class (%s/%s/%s); for ioctls, trimmed sectors\n",
+           s_class_names[0], s_class_names[1], s_class_names[2]);
+    printf("failed calls skipped: %llu, gc stalls: %llu\n", (unsigned long long)t->failed, (unsigned long long)t->gc_stalls);
+    printf("card time recorded %.1f ms, modeled %.1f ms (%+.1f%%)\n", recorded / 1e3, modeled / 1e3,
+           recorded > 0 ? (modeled - recorded) * 100 / recorded : 0.0);
+    printf("idle time between calls %.1f ms\n", t->gap_us / 1e3);
+    if (modeled > 0) {
+        printf("modeled write throughput %.2f MB/s over card time\n", bytes_written / modeled);
+    }
+    printf("image I/O on this host %.1f ms\n", t->host_us / 1e3);
+}
+
+/***************************************************************************
+ * Function:    main
+ * Purpose:     Reads the trace and replays it record by record
+ * Parameters:  argc, argv - See usage()
+ * Returns:     0 on success, 1 on bad arguments, 2 on I/O errors
+ ***************************************************************************/
+int main(int argc, char **argv) {
+    model_t model = s_presets[0];
+    bool realtime = false;
+    bool dry = false;
+    bool sync = false;
+    bool verbose = false;
+    pv_trace_hdr_t hdr;
+    pv_trace_rec_t rec;
+    totals_t totals;
+    uint64_t next_write = UINT64_MAX;
+    double gc_bytes = 0;
+    double slept_us = 0;                    // Modeled latency of the previous record in real time mode
+    uint8_t *buf = NULL;
+    FILE *trace = NULL;
+    int fd = -1;
+    int opt = 0;
+    int rc = 0;
+
+    while ((opt = getopt(argc, argv, "m:o:rnfv")) != -1) {
+        switch (opt) {
+            case 'm': {
+                size_t i = 0;
+                for (; i < sizeof(s_presets) / sizeof(s_presets[0]); i++) {
+                    if (strcmp(s_presets[i].name, optarg) == 0) {
+                        model = s_presets[i];
+                        break;
+                    }
+                }
+                if (i == sizeof(s_presets) / sizeof(s_presets[0])) {
+                    fprintf(stderr, "unknown model %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'o':
+                if (!model_set(&model, optarg)) {
+                    fprintf(stderr, "bad model parameter %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r': realtime = true; break;
+            case 'n': dry = true; break;
+            case 'f': sync = true; break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace = fopen(argv[optind], "rb");
+    if (trace == NULL) {
+        perror(argv[optind]);
+        return 2;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, trace) != 1 || hdr.magic != PV_TRACE_MAGIC) {
+        fprintf(stderr, "%s is not a diskio trace\n", argv[optind]);
+        fclose(trace);
+        return 2;
+    }
+    if (hdr.version != PV_TRACE_VERSION || hdr.rec_size < sizeof(pv_trace_rec_t) || hdr.sector_size == 0) {
+        fprintf(stderr, "unsupported trace version %u (record size %u)\n", (unsigned)hdr.version, (unsigned)hdr.rec_size);
+        fclose(trace);
+        return 2;
+    }
+    printf("trace of a card with %u sectors of %u bytes\n", (unsigned)hdr.sector_count, (unsigned)hdr.sector_size);
+
+    if (!dry) {
+        fd = open(argv[optind + 1], O_RDWR | O_CREAT, 0644);
+        // Sparse, so a trace of a large card only needs the space it touched
+        if (fd < 0 || ftruncate(fd, (off_t)hdr.sector_count * hdr.sector_size) != 0) {
+            perror(argv[optind + 1]);
+            fclose(trace);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return 2;
+        }
+        buf = malloc((size_t)MAX_XFER_SECTORS * hdr.sector_size);
+        if (buf == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fclose(trace);
+            close(fd);
+            return 2;
+        }
+        memset(buf, IMAGE_PATTERN, (size_t)MAX_XFER_SECTORS * hdr.sector_size);
+    }
+
+    memset(&totals, 0, sizeof(totals));
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        double model_us = 0;
+
+        if (hdr.rec_size > sizeof(rec) && fseek(trace, (long)(hdr.rec_size - sizeof(rec)), SEEK_CUR) != 0) {
+            break;
+        }
+        if (rec.op < PV_TRACE_OP_READ || rec.op >= OP_COUNT) {
+            fprintf(stderr, "bad record op %u, stopping\n", (unsigned)rec.op);
+            rc = 2;
+            break;
+        }
+
+        totals.gap_us += rec.delta_us;
+        if (realtime) {
+            // The recorded gap includes the previous call, which was already slept
+            sleep_us((double)rec.delta_us - slept_us);
+            slept_us = 0;
+        }
+
+        totals.ops[rec.op]++;
+        if (rec.result != 0) {
+            totals.failed++;
+            continue;
+        }
+        if (rec.op != PV_TRACE_OP_IOCTL) {
+            totals.sectors[rec.op][rec.info < CLASS_COUNT ? rec.info : PV_TRACE_CLASS_DATA] += rec.count;
+        }
+        else if (rec.info == CTRL_TRIM) {
+            totals.sectors[rec.op][PV_TRACE_CLASS_DATA] += rec.count;
+        }
+
+        model_us = model_latency(&model, &rec, hdr.sector_size, &next_write, &gc_bytes, &totals.gc_stalls);
+        totals.recorded_us[rec.op] += rec.dur_us;
+        totals.model_us[rec.op] += model_us;
+
+        if (!dry) {
+            double start = now_us();
+            if (rec.op != PV_TRACE_OP_IOCTL && (uint64_t)rec.sector + rec.count > hdr.sector_count) {
+                fprintf(stderr, "record past the end of the card: sector %u count %u\n", (unsigned)rec.sector, (unsigned)rec.count);
+                rc = 2;
+                break;
+            }
+            if (!image_apply(fd, &rec, hdr.sector_size, buf, sync)) {
+                perror("image");
+                rc = 2;
+                break;
+            }
+            totals.host_us += now_us() - start;
+        }
+        if (realtime) {
+            sleep_us(model_us);
+            slept_us = model_us;
+        }
+        if (verbose) {
+            printf("%-5s %-4s %10u %6u  recorded %8u us  modeled %8.0f us\n", s_op_names[rec.op],
+                   rec.op != PV_TRACE_OP_IOCTL ? s_class_names[rec.info % CLASS_COUNT] : "", (unsigned)rec.sector,
+                   (unsigned)rec.count, (unsigned)rec.dur_us, model_us);
+        }
+    }
+    print_totals(&totals, &model, hdr.sector_size);
+
+    free(buf);
+    if (fd >= 0) {
+        close(fd);
+    }
+    fclose(trace);
+    return rc;
+}
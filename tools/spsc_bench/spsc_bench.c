@@ -0,0 +1,273 @@
+/*
+    Host micro-benchmark of the lock-free pv_spsc_t byte queue against a
+    byte ring locked on every send, receive and return, the way a FreeRTOS
+    RINGBUF_TYPE_BYTEBUF takes its spinlock. One producer thread moves the
+    data to one consumer thread in fixed size chunks, the consumer checks
+    every byte. See README.md.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pv_spsc.h"
+
+
+#define DEFAULT_MB          256U
+#define DEFAULT_RING_SIZE   4096U           // RX_RINGBUF_SIZE
+#define PATTERN_SIZE        (64U * 1024U)   // Source of the producer, byte i is (uint8_t)i
+
+static const size_t s_chunks[] = { 16, 64, 256, 1024, 4096, 16384 };
+
+/* Ring with one lock, modeled on xRingbufferSend/ReceiveUpTo/ReturnItem */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    uint8_t *buf;
+    size_t size;
+    size_t head;                            // Bytes sent
+    size_t tail;                            // Bytes returned
+    uint64_t waits;                         // Times a side found the ring full or empty
+} locked_ring_t;
+
+typedef struct {
+    bool locked;                            // Which queue this run uses
+    pv_spsc_t spsc;
+    locked_ring_t ring;
+    size_t chunk;
+    uint64_t bytes;
+    bool verify;
+    bool pin;
+    uint64_t errors;                        // Bytes the consumer found wrong
+    uint64_t waits;                         // Times a side found the queue full or empty
+} run_t;
+
+static uint8_t s_pattern[PATTERN_SIZE + 16384];
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void locked_send(locked_ring_t *r, const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&r->lock);
+    // A byte buffer item must fit as a whole
+    while (r->size - (r->head - r->tail) < len) {
+        r->waits++;
+        pthread_cond_wait(&r->not_full, &r->lock);
+    }
+    size_t off = r->head & (r->size - 1);
+    size_t first = (len < r->size - off) ? len : r->size - off;
+    memcpy(r->buf + off, data, first);
+    memcpy(r->buf, data + first, len - first);
+    r->head += len;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static size_t locked_receive(locked_ring_t *r, const uint8_t **p) {
+    pthread_mutex_lock(&r->lock);
+    while (r->head == r->tail) {
+        r->waits++;
+        pthread_cond_wait(&r->not_empty, &r->lock);
+    }
+    size_t off = r->tail & (r->size - 1);
+    size_t n = r->head - r->tail;
+    if (n > r->size - off) {
+        n = r->size - off;
+    }
+    *p = r->buf + off;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static void locked_return(locked_ring_t *r, size_t n) {
+    pthread_mutex_lock(&r->lock);
+    r->tail += n;
+    pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *producer(void *arg) {
+    run_t *run = arg;
+    uint64_t waits = 0;
+
+    if (run->pin) {
+        pin_to_cpu(0);
+    }
+    for (uint64_t pos = 0; pos < run->bytes; pos += run->chunk) {
+        const uint8_t *src = s_pattern + (pos & (PATTERN_SIZE - 1));
+        if (run->locked) {
+            locked_send(&run->ring, src, run->chunk);
+            continue;
+        }
+        size_t done = 0;
+        while ((done += pv_spsc_write(&run->spsc, src + done, run->chunk - done)) < run->chunk) {
+            waits++;
+            sched_yield();
+        }
+    }
+    __atomic_add_fetch(&run->waits, waits, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    run_t *run = arg;
+    uint64_t pos = 0;
+    uint64_t errors = 0;
+    uint64_t waits = 0;
+
+    if (run->pin) {
+        pin_to_cpu(1);
+    }
+    while (pos < run->bytes) {
+        const uint8_t *p = NULL;
+        size_t n = 0;
+
+        if (run->locked) {
+            n = locked_receive(&run->ring, &p);
+        }
+        else if ((n = pv_spsc_peek(&run->spsc, &p)) == 0) {
+            waits++;
+            sched_yield();
+            continue;
+        }
+        if (run->verify) {
+            for (size_t i = 0; i < n; i++) {
+                errors += (p[i] != (uint8_t)(pos + i));
+            }
+        }
+        pos += n;
+        if (run->locked) {
+            locked_return(&run->ring, n);
+        }
+        else {
+            pv_spsc_release(&run->spsc, n);
+        }
+    }
+    run->errors = errors;
+    __atomic_add_fetch(&run->waits, waits, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static double run_once(run_t *run, uint8_t *storage, size_t ring_size) {
+    pthread_t prod, cons;
+    double start;
+
+    run->errors = 0;
+    run->waits = 0;
+    if (run->locked) {
+        pthread_mutex_init(&run->ring.lock, NULL);
+        pthread_cond_init(&run->ring.not_full, NULL);
+        pthread_cond_init(&run->ring.not_empty, NULL);
+        run->ring.buf = storage;
+        run->ring.size = ring_size;
+        run->ring.head = 0;
+        run->ring.tail = 0;
+        run->ring.waits = 0;
+    }
+    else {
+        pv_spsc_init(&run->spsc, storage, ring_size);
+    }
+
+    start = now_s();
+    pthread_create(&cons, NULL, consumer, run);
+    pthread_create(&prod, NULL, producer, run);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    if (run->locked) {
+        run->waits = run->ring.waits;
+        pthread_cond_destroy(&run->ring.not_empty);
+        pthread_cond_destroy(&run->ring.not_full);
+        pthread_mutex_destroy(&run->ring.lock);
+    }
+    return now_s() - start;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-b MB] [-s RING_SIZE] [-p] [-n]\n"
+            "  -b MB         Data moved per run (default %u)\n"
+            "  -s RING_SIZE  Queue capacity, a power of two (default %u)\n"
+            "  -p            Pin producer and consumer to CPUs 0 and 1\n"
+            "  -n            Do not check the received bytes\n",
+            prog, DEFAULT_MB, DEFAULT_RING_SIZE);
+}
+
+int main(int argc, char **argv) {
+    uint64_t mb = DEFAULT_MB;
+    size_t ring_size = DEFAULT_RING_SIZE;
+    bool pin = false;
+    bool verify = true;
+    uint8_t *storage = NULL;
+    int opt;
+    int rc = 0;
+
+    while ((opt = getopt(argc, argv, "b:s:pnh")) != -1) {
+        switch (opt) {
+            case 'b': mb = strtoull(optarg, NULL, 0); break;
+            case 's': ring_size = strtoul(optarg, NULL, 0); break;
+            case 'p': pin = true; break;
+            case 'n': verify = false; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (mb == 0 || ring_size == 0 || (ring_size & (ring_size - 1)) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(s_pattern); i++) {
+        s_pattern[i] = (uint8_t)i;
+    }
+    storage = aligned_alloc(PV_SPSC_CACHE_LINE, ring_size);
+    if (storage == NULL) {
+        perror("aligned_alloc");
+        return 1;
+    }
+
+    printf("%llu MB per run, %zu byte queue%s%s\n\n", (unsigned long long)mb, ring_size,
+           pin ? ", pinned" : "", verify ? ", checked" : "");
+    printf("%8s  %12s  %10s  %12s  %10s  %8s\n", "chunk", "pv_spsc MB/s", "waits", "locked MB/s", "waits", "speedup");
+    for (size_t c = 0; c < sizeof(s_chunks) / sizeof(s_chunks[0]); c++) {
+        run_t spsc = { .locked = false, .chunk = s_chunks[c], .verify = verify, .pin = pin };
+        run_t locked = { .locked = true, .chunk = s_chunks[c], .verify = verify, .pin = pin };
+        double t_spsc, t_locked;
+
+        // The locked ring needs each chunk to fit as a whole, like xRingbufferSend
+        if (s_chunks[c] > ring_size) {
+            continue;
+        }
+        spsc.bytes = locked.bytes = mb * 1024U * 1024U / s_chunks[c] * s_chunks[c];
+        t_spsc = run_once(&spsc, storage, ring_size);
+        t_locked = run_once(&locked, storage, ring_size);
+
+        printf("%8zu  %12.1f  %10llu  %12.1f  %10llu  %7.2fx\n", s_chunks[c],
+               spsc.bytes / t_spsc / (1024.0 * 1024.0), (unsigned long long)spsc.waits,
+               locked.bytes / t_locked / (1024.0 * 1024.0), (unsigned long long)locked.waits, t_locked / t_spsc);
+        if (spsc.errors != 0 || locked.errors != 0) {
+            fprintf(stderr, "chunk %zu: %llu bad bytes through pv_spsc, %llu through the locked ring\n", s_chunks[c],
+                    (unsigned long long)spsc.errors, (unsigned long long)locked.errors);
+            rc = 1;
+        }
+    }
+
+    free(storage);
+    return rc;
+}